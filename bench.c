@@ -2,8 +2,43 @@
 // SPDX-License-Identifier: AGPL-3.0-only
 
 #include "libexif.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
+
+#ifndef SOURCE_DIR
+#define SOURCE_DIR "."
+#endif
+
+#define MAX_FILES 64
+
+static const char *write_tags[] = { "-Comment=libexif bench", "-Artist=bench" };
+static const exif_options_t write_opts = { .tags = write_tags, .ntags = 2 };
+
+typedef struct bench_file {
+    const char *path;
+    const char *name;  // basename, used as the buffer filename
+    char       *data;
+    size_t      len;
+} bench_file_t;
+
+typedef enum bench_api {
+    API_READ,
+    API_READ_BUF,
+    API_READ_FD,
+    API_WRITE,
+    API_WRITE_BUF,
+    API_COUNT,
+} bench_api_t;
+
+static const char *api_names[] = { "read", "read_buf", "read_fd", "write", "write_buf" };
 
 static double now_ms(void)
 {
@@ -12,40 +47,381 @@ static double now_ms(void)
     return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
 }
 
-int main(int argc, char *argv[])
+static char *read_file(const char *path, size_t *len)
 {
-    if (argc < 2) { fprintf(stderr, "Usage: %s <image>\n", argv[0]); return 1; }
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = size > 0 ? malloc((size_t)size) : NULL;
+    if (data && fread(data, 1, (size_t)size, f) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *len = data ? (size_t)size : 0;
+    return data;
+}
 
-    double t0 = now_ms();
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+static double percentile(const double *sorted, int n, double p)
+{
+    int rank = (int)(p / 100.0 * n + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    return sorted[rank - 1];
+}
+
+static long peak_rss_kib(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return -1;
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;  // bytes on macOS
+#else
+    return ru.ru_maxrss;
+#endif
+}
+
+static bool run_api(exif_t *exif, bench_api_t api, const bench_file_t *f,
+                    exif_stats_t *stats)
+{
+    exif_buf_t buf = { .data = f->data, .len = f->len, .filename = f->name };
+    char out_path[512];
+    exif_result_t r = {0};
+
+    switch (api) {
+    case API_READ:
+        r = exif_read(exif, f->path, NULL);
+        break;
+    case API_READ_BUF:
+        r = exif_read_buf(exif, buf, NULL);
+        break;
+    case API_READ_FD: {
+        int fd = open(f->path, O_RDONLY);
+        if (fd < 0) return false;
+        r = exif_read_fd(exif, fd, f->name, NULL);
+        close(fd);
+        break;
+    }
+    case API_WRITE:
+        // exiftool refuses to overwrite an existing -o target
+        snprintf(out_path, sizeof out_path, "/tmp/libexif_bench_%d_%s",
+                 (int)getpid(), f->name);
+        unlink(out_path);
+        r = exif_write(exif, f->path, out_path, &write_opts);
+        unlink(out_path);
+        break;
+    case API_WRITE_BUF:
+        r = exif_write_buf(exif, buf, &write_opts);
+        break;
+    default:
+        break;
+    }
+    bool ok = r.success;
+    if (!ok) fprintf(stderr, "  %s %s: %s\n", api_names[api], f->name,
+                     r.error ? r.error : "unknown error");
+    *stats = r.stats;
+    exif_result_free(exif, &r);
+    return ok;
+}
+
+static void print_json_str(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', out);
+        if ((unsigned char)*s < 0x20) fprintf(out, "\\u%04x", *s);
+        else fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static void print_stats(FILE *out, const exif_stats_t *sum, int n)
+{
+    double d = n > 0 ? n * 1e6 : 1;  // ns -> mean ms
+    fprintf(out, "{\"reset\": %.3f, \"marshal\": %.3f, \"run\": %.3f, \"flush\": %.3f, "
+                 "\"spill\": %.3f, \"readback\": %.3f}",
+            sum->reset_ns / d, sum->marshal_ns / d, sum->run_ns / d,
+            sum->flush_ns / d, sum->spill_ns / d, sum->readback_ns / d);
+}
+
+// Latency of one API on one file: warmup runs, then iters timed runs
+static void bench_latency(FILE *out, exif_t *exif, bench_api_t api,
+                          const bench_file_t *f, int iters, int warmup, bool first)
+{
+    exif_stats_t stats, sum = {0};
+    int errors = 0;
+    for (int i = 0; i < warmup; i++)
+        if (!run_api(exif, api, f, &stats)) errors++;
+
+    double *ms = malloc(iters * sizeof *ms);
+    int n = 0;
+    double total = 0;
+    for (int i = 0; ms && i < iters; i++) {
+        double t = now_ms();
+        bool ok = run_api(exif, api, f, &stats);
+        t = now_ms() - t;
+        if (!ok) { errors++; continue; }
+        ms[n++] = t;
+        total += t;
+        sum.reset_ns    += stats.reset_ns;
+        sum.marshal_ns  += stats.marshal_ns;
+        sum.run_ns      += stats.run_ns;
+        sum.flush_ns    += stats.flush_ns;
+        sum.spill_ns    += stats.spill_ns;
+        sum.readback_ns += stats.readback_ns;
+    }
+    if (ms) qsort(ms, n, sizeof *ms, cmp_double);
+
+    fprintf(out, "%s\n    {\"api\": \"%s\", \"file\": ", first ? "" : ",", api_names[api]);
+    print_json_str(out, f->name);
+    fprintf(out, ", \"bytes\": %zu, \"iterations\": %d, \"errors\": %d",
+            f->len, n, errors);
+    if (n) {
+        fprintf(out, ", \"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p95_ms\": %.3f, "
+                     "\"p99_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f, \"phases_ms\": ",
+                total / n, percentile(ms, n, 50), percentile(ms, n, 95),
+                percentile(ms, n, 99), ms[0], ms[n - 1]);
+        print_stats(out, &sum, n);
+    }
+    fprintf(out, "}");
+    free(ms);
+}
+
+// Start gate for the throughput threads (no pthread_barrier on macOS)
+typedef struct bench_gate {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             ready;
+    bool            go;
+} bench_gate_t;
+
+typedef struct bench_thread {
+    pthread_t           thread;
+    const bench_file_t *files;
+    int                 nfiles;
+    int                 ops;
+    int                 errors;
+    double              end_ms;
+    bench_gate_t       *gate;
+} bench_thread_t;
+
+// One context per thread, created before the clock starts
+static void *throughput_main(void *arg)
+{
+    bench_thread_t *t = arg;
     exif_t *exif = exif_create(NULL);
-    double t_create = now_ms() - t0;
-    if (!exif) { fprintf(stderr, "create failed\n"); return 1; }
 
-    printf("create: %.1f ms\n\n", t_create);
+    pthread_mutex_lock(&t->gate->lock);
+    t->gate->ready++;
+    pthread_cond_broadcast(&t->gate->cond);
+    while (!t->gate->go) pthread_cond_wait(&t->gate->cond, &t->gate->lock);
+    pthread_mutex_unlock(&t->gate->lock);
+
+    exif_stats_t stats;
+    for (int i = 0; i < t->ops; i++)
+        if (!exif || !run_api(exif, API_READ, &t->files[i % t->nfiles], &stats))
+            t->errors++;
+    t->end_ms = now_ms();
+    exif_destroy(exif);
+    return NULL;
+}
+
+static void bench_throughput(FILE *out, const bench_file_t *files, int nfiles,
+                             int nthreads, int ops, bool first)
+{
+    bench_thread_t *threads = calloc(nthreads, sizeof *threads);
+    if (!threads) return;
+    bench_gate_t gate = {
+        .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER,
+    };
+    int started = 0;
+    for (int i = 0; i < nthreads; i++) {
+        threads[i] = (bench_thread_t){
+            .files = files, .nfiles = nfiles, .ops = ops, .gate = &gate,
+        };
+        if (pthread_create(&threads[i].thread, NULL, throughput_main, &threads[i]) != 0)
+            break;
+        started++;
+    }
+
+    pthread_mutex_lock(&gate.lock);
+    while (gate.ready < started) pthread_cond_wait(&gate.cond, &gate.lock);
+    double t0 = now_ms();
+    gate.go = true;
+    pthread_cond_broadcast(&gate.cond);
+    pthread_mutex_unlock(&gate.lock);
 
-    double t1 = now_ms();
-    exif_result_t read_result = exif_read(exif, argv[1], NULL);
-    printf("read:  %.1f ms\n", now_ms() - t1);
-    if (read_result.success) printf("%.*s\n", (int)read_result.data_len, read_result.data);
-    else printf("ERROR: %s\n", read_result.error);
-    exif_result_free(exif, &read_result);
+    double end = t0;
+    int errors = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+        errors += threads[i].errors;
+        if (threads[i].end_ms > end) end = threads[i].end_ms;
+    }
+    double elapsed = end - t0;
+    nthreads = started;
+    free(threads);
 
-    printf("\n");
-    const char *write_tags[] = { "-Comment=libexif test", "-Artist=bench" };
-    exif_options_t write_opts = { .tags = write_tags, .ntags = 2 };
+    int total = nthreads * ops;
+    fprintf(out, "%s\n    {\"threads\": %d, \"ops\": %d, \"errors\": %d, "
+                 "\"elapsed_ms\": %.3f, \"ops_per_sec\": %.2f}",
+            first ? "" : ",", nthreads, total, errors, elapsed,
+            elapsed > 0 ? (total - errors) * 1000.0 / elapsed : 0);
+}
 
-    double t2 = now_ms();
-    exif_result_t write_result = exif_write(exif, argv[1], "/tmp/libexif_bench_out.png", &write_opts);
-    printf("write:  %.1f ms\n", now_ms() - t2);
-    if (!write_result.success) printf("ERROR: %s\n", write_result.error);
-    exif_result_free(exif, &write_result);
+// exif_pool_run over read jobs, after one warm-up job per worker
+static void bench_pool(FILE *out, const bench_file_t *files, int nfiles,
+                       int nworkers, int ops, bool first)
+{
+    int njobs = ops > nworkers ? ops : nworkers;
+    exif_pool_t *pool = exif_pool_create(NULL, nworkers);
+    exif_job_t *jobs = calloc(njobs, sizeof *jobs);
+    if (!pool || !jobs) { exif_pool_destroy(pool); free(jobs); return; }
+    for (int i = 0; i < njobs; i++)
+        jobs[i] = (exif_job_t){ .kind = EXIF_JOB_READ, .path = files[i % nfiles].path };
 
-    double t3 = now_ms();
-    exif_result_t readback_result = exif_read(exif, "/tmp/libexif_bench_out.png", NULL);
-    printf("\nread-back:  %.1f ms\n", now_ms() - t3);
-    if (readback_result.success) printf("%.*s\n", (int)readback_result.data_len, readback_result.data);
-    else printf("ERROR: %s\n", readback_result.error);
-    exif_result_free(exif, &readback_result);
+    exif_pool_run(pool, jobs, nworkers);
+    for (int i = 0; i < nworkers; i++) exif_pool_result_free(pool, &jobs[i].result);
+
+    double t0 = now_ms();
+    exif_pool_run(pool, jobs, ops);
+    double elapsed = now_ms() - t0;
 
+    int errors = 0;
+    for (int i = 0; i < ops; i++) {
+        errors += !jobs[i].result.success;
+        exif_pool_result_free(pool, &jobs[i].result);
+    }
+    free(jobs);
+    exif_pool_destroy(pool);
+
+    fprintf(out, "%s\n    {\"workers\": %d, \"ops\": %d, \"errors\": %d, "
+                 "\"elapsed_ms\": %.3f, \"ops_per_sec\": %.2f}",
+            first ? "" : ",", nworkers, ops, errors, elapsed,
+            elapsed > 0 ? (ops - errors) * 1000.0 / elapsed : 0);
+}
+
+static int load_data_dir(const char *dir, bench_file_t *files, char **paths)
+{
+    DIR *d = opendir(dir);
+    if (!d) return 0;
+    int n = 0;
+    struct dirent *e;
+    while (n < MAX_FILES && (e = readdir(d))) {
+        if (e->d_name[0] == '.') continue;
+        size_t len = strlen(dir) + strlen(e->d_name) + 2;
+        char *path = malloc(len);
+        if (!path) break;
+        snprintf(path, len, "%s/%s", dir, e->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) { free(path); continue; }
+        paths[n] = path;
+        files[n++].path = path;
+    }
+    closedir(d);
+    return n;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n iterations] [-w warmup] [-t max_threads] [-o out.json] [file...]\n"
+            "  Benchmarks every read and write API on each file (default: the\n"
+            "  samples in data/) and read throughput on 1..max_threads threads\n"
+            "  with one context each. Results are written as JSON.\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int iters = 20, warmup = 3, max_threads = 4;
+    const char *out_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:t:o:h")) != -1) {
+        switch (opt) {
+        case 'n': iters = atoi(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        case 't': max_threads = atoi(optarg); break;
+        case 'o': out_path = optarg; break;
+        default:  usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (iters < 1 || warmup < 0 || max_threads < 1) { usage(argv[0]); return 1; }
+
+    bench_file_t files[MAX_FILES] = {0};
+    char *owned[MAX_FILES] = {0};
+    int nfiles = 0;
+    if (optind < argc) {
+        for (int i = optind; i < argc && nfiles < MAX_FILES; i++)
+            files[nfiles++].path = argv[i];
+    } else {
+        nfiles = load_data_dir(SOURCE_DIR "/data", files, owned);
+    }
+    int loaded = 0;
+    for (int i = 0; i < nfiles; i++) {
+        const char *slash = strrchr(files[i].path, '/');
+        files[i].name = slash ? slash + 1 : files[i].path;
+        files[i].data = read_file(files[i].path, &files[i].len);
+        if (!files[i].data) fprintf(stderr, "skipping %s: unreadable\n", files[i].path);
+        else files[loaded++] = files[i];
+    }
+    nfiles = loaded;
+    if (!nfiles) { fprintf(stderr, "no input files\n"); return 1; }
+
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) { perror(out_path); return 1; }
+
+    double t0 = now_ms();
+    exif_config_t cfg = { .stats = true };
+    exif_t *exif = exif_create(&cfg);
+    double t_create = now_ms() - t0;
+    if (!exif) { fprintf(stderr, "create failed\n"); return 1; }
+
+    fprintf(out, "{\n  \"iterations\": %d,\n  \"warmup\": %d,\n  \"create_ms\": %.3f,\n"
+                 "  \"latency\": [",
+            iters, warmup, t_create);
+    bool first = true;
+    for (int i = 0; i < nfiles; i++) {
+        for (int api = 0; api < API_COUNT; api++) {
+            fprintf(stderr, "%s %s\n", api_names[api], files[i].name);
+            bench_latency(out, exif, api, &files[i], iters, warmup, first);
+            first = false;
+        }
+    }
+
+    exif_counters_t c;
+    exif_counters(exif, &c);
+    fprintf(out, "\n  ],\n  \"counters\": {\"calls\": %llu, \"bytes_in\": %llu, "
+                 "\"bytes_out\": %llu, \"heap_high_water\": %llu, \"traps\": %llu, "
+                 "\"resets\": %llu},\n  \"throughput\": [",
+            (unsigned long long)c.calls, (unsigned long long)c.bytes_in,
+            (unsigned long long)c.bytes_out, (unsigned long long)c.heap_high_water,
+            (unsigned long long)c.traps, (unsigned long long)c.resets);
+
+    for (int n = 1; n <= max_threads; n++) {
+        fprintf(stderr, "throughput %d thread%s\n", n, n == 1 ? "" : "s");
+        bench_throughput(out, files, nfiles, n, iters * nfiles, n == 1);
+    }
+    fprintf(out, "\n  ],\n  \"pool\": [");
+    for (int n = 1; n <= max_threads; n++) {
+        fprintf(stderr, "pool %d worker%s\n", n, n == 1 ? "" : "s");
+        bench_pool(out, files, nfiles, n, iters * nfiles * max_threads, n == 1);
+    }
+    // Destroyed last so the shared runtime stays loaded for the threads
     exif_destroy(exif);
+    fprintf(out, "\n  ],\n  \"peak_rss_kib\": %ld\n}\n", peak_rss_kib());
+
+    if (out != stdout) fclose(out);
+    for (int i = 0; i < nfiles; i++) free(files[i].data);
+    for (int i = 0; i < MAX_FILES; i++) free(owned[i]);
+    return 0;
 }
@@ -1,14 +1,37 @@
 // Copyright (c) 6OVER3 Institute. All rights reserved.
 // SPDX-License-Identifier: AGPL-3.0-only
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  // memfd_create
+#endif
+
 #include "libexif.h"
 #include "wasm_export.h"
 
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
 
 static const unsigned char zeroperl_aot[] = {
 #embed "resources/zeroperl.aot"
@@ -18,6 +41,10 @@ static const unsigned char exiftool_script[] = {
 #embed "resources/exiftool"
 };
 
+static const unsigned char exifbin_script[] = {
+#embed "resources/exifbin.pl"
+};
+
 #define DEFAULT_STACK  (8u << 20)
 #define DEFAULT_HEAP   (32u << 20)
 
@@ -37,6 +64,126 @@ static exif_allocator_t exif__default_allocator = {
     exif__default_alloc, exif__default_free, NULL
 };
 
+// Growable byte buffer backed by a context allocator.
+typedef struct exif__buf {
+    char   *data;
+    size_t  len;
+    size_t  cap;
+} exif__buf_t;
+
+// Guest stdout/stderr captured in host memory by the fd_write override.
+// The lock is shared with the resident thread, which writes while the
+// caller waits on cond for its markers.
+typedef struct exif__capture {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;      // broadcast on every write
+    exif__buf_t     out;
+    exif__buf_t     err;
+    bool            overflow;  // the allocator failed; output is incomplete
+} exif__capture_t;
+
+// Destination of stdout while a read with exif_options_t.sink runs. The
+// fd_write override passes each write on through exif__sink_drain; only
+// bytes that may belong to a marker wait in the capture buffer. Under
+// capture.lock, like the buffers.
+typedef struct exif__sink {
+    exif_sink_fn   fn;          // NULL when stdout is captured as usual
+    void          *ctx;
+    size_t         file;        // index the bytes are reported under
+    size_t         hold;        // trailing bytes kept for the {readyN} marker
+    const size_t  *ids;         // file index of each {fileN} command, or NULL
+    size_t         nids;
+    size_t        *lens;        // bytes streamed per {fileN} command
+    size_t         next;        // commands ended so far
+    uint64_t       bytes;       // streamed since the sink was set
+    uint64_t       file_bytes;  // of the current command
+    bool           bol;         // the last byte streamed ended a line
+} exif__sink_t;
+
+// Virtual files live under this guest directory, reached through the "/"
+// preopen. Their guest fds start far above anything WAMR hands out.
+#define EXIF__VFS_ROOT      "/libexif/"
+#define EXIF__VFS_PATH_MAX  1024
+#define EXIF__VFD_BASE      0x40000000u
+
+// Byte range of a sparse file that is backed by data. See exif__prefilter.
+typedef struct exif__span {
+    size_t off;
+    size_t len;
+} exif__span_t;
+
+#define EXIF__STREAM_BLOCK   (64u << 10)
+#define EXIF__STREAM_BLOCKS  8
+
+typedef struct exif__vblock {
+    char     *data;   // EXIF__STREAM_BLOCK bytes once allocated
+    uint64_t  index;  // block number in the source
+    size_t    len;    // short only for the last block
+    uint64_t  used;   // LRU tick; 0 while the slot is empty
+} exif__vblock_t;
+
+// Contents served from an exif_reader_t. Seekable readers go through a
+// small block cache; read()-only ones are spooled as far as the guest reads.
+typedef struct exif__vstream {
+    exif_reader_t   reader;
+    exif__buf_t     spool;
+    bool            eof;
+    exif__vblock_t  blocks[EXIF__STREAM_BLOCKS];
+    uint64_t        tick;
+} exif__vstream_t;
+
+// A virtual file. Contents are borrowed (caller buffer, embedded script)
+// or pulled from a reader until the guest writes to them, then owned by the
+// context. A file with spans is sparse: bytes outside them read as zeros.
+typedef struct exif__vfile {
+    char            *path;    // absolute guest path; NULL once unlinked
+    const char      *data;    // borrowed contents, or own.data
+    size_t           len;
+    exif__span_t    *spans;   // sorted, owned; NULL when every byte is backed
+    size_t           nspans;
+    exif__vstream_t *stream;  // owned; contents come from here when set
+    exif__buf_t      own;
+    uint32_t     nopen;  // guest fds referring to this file
+    uint64_t     ino;
+    uint64_t     mtime;  // ns since the epoch
+} exif__vfile_t;
+
+typedef struct exif__vfd {
+    exif__vfile_t *file;  // NULL when the slot is free
+    uint64_t       pos;
+    uint64_t       rights;
+    bool           append;
+} exif__vfd_t;
+
+// Only touched by the thread running the guest, or by the host while the
+// guest is idle between commands.
+typedef struct exif__vfs {
+    exif__vfile_t **files;
+    size_t          nfiles;
+    size_t          files_cap;
+    exif__vfd_t    *fds;  // slot i is guest fd EXIF__VFD_BASE + i
+    size_t          nfds;
+    size_t          fds_cap;
+    uint32_t        seq;  // names per-call directories
+    uint64_t        next_ino;
+} exif__vfs_t;
+
+// Resident interpreter running `exiftool -stay_open True -@ -` on its own
+// thread. Commands go in through the stdin pipe; each one is answered with
+// a {readyN} line on stdout and a {doneN status} line on stderr.
+typedef struct exif__resident {
+    pthread_t  thread;
+    bool       running;
+    bool       exited;      // under capture.lock once the interpreter loop returns
+    int        in_fd;       // host end of the interpreter's stdin
+    int        exit_fd[2];  // readable once the interpreter loop returns
+    uint64_t   wasm_ptrs[7];
+    uint64_t   argv_off;
+    int        argc;
+    uint32_t   seq;
+    int32_t    exit_code;
+} exif__resident_t;
+
 struct exif {
     exif_allocator_t     alloc;
     wasm_module_t        module;
@@ -47,10 +194,37 @@ struct exif {
     wasm_function_inst_t fn_flush;
     wasm_function_inst_t fn_last_error;
     wasm_function_inst_t fn_free_interp;
-    uint8_t             *wasm_buf;
+    int                  stdin_fd;
     int                  stdout_fd;
     int                  stderr_fd;
+    uint32_t             wasm_stack;
+    uint32_t             wasm_heap;
+    uint32_t             exec_stack;
+    bool                 stay_open;
+    bool                 snapshot;
+    bool                 poisoned;   // a trap hit the instance; replace it
+    exif__capture_t      capture;
+    exif__sink_t         sink;
+    exif__vfs_t          vfs;
+    exif__resident_t     resident;
     char                *script_path;
+    char                *bin_script_path;  // EXIF_FORMAT_BINARY emitter
+    char                *warmup_path;      // config requiring warm-up modules
+    exif__buf_t          warmup_script;
+    exif_cache_t        *cache;            // shared, not owned
+    uint32_t             generation;       // bumped per instance
+    uint64_t             memory_limit;     // of the next instance; 0: module's
+    uint64_t             memory_limit_base;
+    uint64_t             memory_limit_max;
+    uint64_t             recycle_size;
+    bool                 timed;            // config stats or trace
+    exif_trace_fn        trace;
+    void                *trace_ctx;
+    int                  call_depth;       // nesting of public calls
+    uint64_t             call_start;
+    uint64_t             call_bytes_in;
+    exif_stats_t         call_stats;       // of the outermost call
+    exif_counters_t      counters;
     char                 errbuf[512];
 };
 
@@ -97,6 +271,10 @@ static NativeSymbol exif__native_syms[] = {
 };
 
 
+static bool exif__recover(exif_t *ctx);
+static void exif__instance_free(exif_t *ctx);
+static bool exif__instance_init(exif_t *ctx);
+
 static exif_result_t exif__err_result(exif_allocator_t *alloc, const char *msg, int32_t code)
 {
     size_t len = strlen(msg) + 1;
@@ -112,6 +290,90 @@ static exif_result_t exif__ok_result(char *data, size_t len, int32_t code)
     };
 }
 
+// --- instrumentation ---
+
+typedef enum exif__phase {
+    EXIF__PHASE_RESET,
+    EXIF__PHASE_MARSHAL,
+    EXIF__PHASE_RUN,
+    EXIF__PHASE_FLUSH,
+    EXIF__PHASE_SPILL,
+    EXIF__PHASE_READBACK,
+} exif__phase_t;
+
+static const struct {
+    const char *name;
+    size_t      off;  // into exif_stats_t
+} exif__phases[] = {
+    [EXIF__PHASE_RESET]    = { "reset",    offsetof(exif_stats_t, reset_ns) },
+    [EXIF__PHASE_MARSHAL]  = { "marshal",  offsetof(exif_stats_t, marshal_ns) },
+    [EXIF__PHASE_RUN]      = { "run",      offsetof(exif_stats_t, run_ns) },
+    [EXIF__PHASE_FLUSH]    = { "flush",    offsetof(exif_stats_t, flush_ns) },
+    [EXIF__PHASE_SPILL]    = { "spill",    offsetof(exif_stats_t, spill_ns) },
+    [EXIF__PHASE_READBACK] = { "readback", offsetof(exif_stats_t, readback_ns) },
+};
+
+static uint64_t exif__mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Start of a phase, or 0 when ctx doesn't time calls.
+static uint64_t exif__timer(const exif_t *ctx)
+{
+    return ctx->timed ? exif__mono_ns() : 0;
+}
+
+static void exif__phase_end(exif_t *ctx, exif__phase_t phase, uint64_t start)
+{
+    if (!start) return;
+    uint64_t dur = exif__mono_ns() - start;
+    *(uint64_t *)((char *)&ctx->call_stats + exif__phases[phase].off) += dur;
+    if (ctx->trace) ctx->trace(exif__phases[phase].name, start, dur, ctx->trace_ctx);
+}
+
+// Public calls nest, e.g. exif_read_fd reads through exif_read_stream. Only
+// the outermost one starts the stats and hands them to its results; the
+// input size comes from the innermost call that knows it.
+static void exif__call_begin(exif_t *ctx)
+{
+    if (ctx->call_depth++) return;
+    ctx->call_stats = (exif_stats_t){0};
+    ctx->call_bytes_in = 0;
+    ctx->call_start = exif__timer(ctx);
+}
+
+static void exif__call_end(exif_t *ctx, exif_result_t *results, size_t n,
+                           uint64_t bytes_in)
+{
+    if (!ctx->call_bytes_in) ctx->call_bytes_in = bytes_in;
+    if (--ctx->call_depth) return;
+
+    exif_counters_t *c = &ctx->counters;
+    c->calls++;
+    c->bytes_in += ctx->call_bytes_in;
+    if (ctx->call_start) {
+        uint64_t dur = exif__mono_ns() - ctx->call_start;
+        ctx->call_stats.total_ns = dur;
+        if (ctx->trace) ctx->trace("call", ctx->call_start, dur, ctx->trace_ctx);
+    }
+    for (size_t i = 0; i < n; i++) {
+        c->bytes_out += results[i].data_len;
+        results[i].stats = ctx->call_stats;
+    }
+}
+
+// Linear memory only grows, so its current size is the high-water mark.
+static void exif__sample_heap(exif_t *ctx)
+{
+    wasm_memory_inst_t mem = ctx->inst ? wasm_runtime_get_default_memory(ctx->inst) : NULL;
+    if (!mem) return;
+    uint64_t size = wasm_memory_get_cur_page_count(mem) * wasm_memory_get_bytes_per_page(mem);
+    if (size > ctx->counters.heap_high_water) ctx->counters.heap_high_water = size;
+}
+
 static char *exif__read_fd(exif_t *ctx, int fd, size_t *out_len)
 {
     exif_allocator_t *a = &ctx->alloc;
@@ -174,401 +436,7157 @@ static char *exif__read_file(exif_allocator_t *alloc, const char *path, size_t *
     return buf;
 }
 
-static exif_result_t exif__run(exif_t *ctx, const char **tail, int ntail,
-                               const exif_options_t *opts)
+static bool exif__buf_reserve(exif_allocator_t *alloc, exif__buf_t *b, size_t extra)
 {
-    exif_allocator_t *alloc = &ctx->alloc;
-    exif_result_t result = {0};
-    uint64_t argv_off = 0, script_off = 0;
-    int nargs = 0;
+    if (b->len + extra + 1 <= b->cap) return true;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + extra + 1) cap *= 2;
+    char *data = alloc->alloc(cap, alloc->ctx);
+    if (!data) return false;
+    if (b->len) memcpy(data, b->data, b->len);
+    if (b->data) alloc->free(b->data, b->cap, alloc->ctx);
+    b->data = data;
+    b->cap = cap;
+    return true;
+}
 
-    int nopt_args    = opts ? opts->argc : 0;
-    int nconfig_args = (opts && opts->config_path) ? 2 : 0;
-    int ntag_args    = opts ? opts->ntags : 0;
-    int total        = nopt_args + nconfig_args + ntag_args + ntail;
+static bool exif__buf_append(exif_allocator_t *alloc, exif__buf_t *b,
+                             const void *data, size_t len)
+{
+    if (!exif__buf_reserve(alloc, b, len)) return false;
+    if (len) memcpy(b->data + b->len, data, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+    return true;
+}
 
-    uint64_t wasm_ptrs[total];
-    memset(wasm_ptrs, 0, sizeof wasm_ptrs);
+static void exif__buf_free(exif_allocator_t *alloc, exif__buf_t *b)
+{
+    if (b->data) alloc->free(b->data, b->cap, alloc->ctx);
+    *b = (exif__buf_t){0};
+}
 
-    bool thread_env_owned = false;
-    if (!wasm_runtime_thread_env_inited()) {
-        if (!wasm_runtime_init_thread_env())
-            return exif__err_result(alloc, "failed to init WAMR thread env", -1);
-        thread_env_owned = true;
-    }
+// --- WASI overrides: in-memory stdio and the virtual filesystem ---
+//
+// Natives registered for "wasi_snapshot_preview1" take precedence over
+// WAMR's built-in WASI table. Each override handles guest stdout/stderr or
+// virtual files itself and forwards everything else to WAMR's original,
+// whose address is stored through the symbol's attachment.
 
-    int32_t rc;
-    if (!exif__call_wasm(ctx, ctx->fn_reset, &rc) || rc != 0) {
-        result = exif__err_result(alloc, "zeroperl_reset failed", rc);
-        goto cleanup;
-    }
+#define EXIF__WASI_EBADF     8
+#define EXIF__WASI_EEXIST   20
+#define EXIF__WASI_EFAULT   21
+#define EXIF__WASI_EINVAL   28
+#define EXIF__WASI_EIO      29
+#define EXIF__WASI_EISDIR   31
+#define EXIF__WASI_ENOENT   44
+#define EXIF__WASI_ENOMEM   48
+#define EXIF__WASI_ENOTDIR  54
+#define EXIF__WASI_ENOTSUP  58
+#define EXIF__WASI_EXDEV    75
 
-    for (int i = 0; i < nopt_args; i++) {
-        wasm_ptrs[nargs] = exif__wasm_alloc_string(ctx, opts->args[i]);
-        if (!wasm_ptrs[nargs]) goto oom;
-        nargs++;
-    }
+#define EXIF__WASI_FILETYPE_DIRECTORY  3
+#define EXIF__WASI_FILETYPE_REGULAR    4
 
-    if (nconfig_args) {
-        wasm_ptrs[nargs] = exif__wasm_alloc_string(ctx, "-config");
-        if (!wasm_ptrs[nargs]) goto oom;
-        nargs++;
-        wasm_ptrs[nargs] = exif__wasm_alloc_string(ctx, opts->config_path);
-        if (!wasm_ptrs[nargs]) goto oom;
-        nargs++;
-    }
+#define EXIF__WASI_O_CREAT      1
+#define EXIF__WASI_O_DIRECTORY  2
+#define EXIF__WASI_O_EXCL       4
+#define EXIF__WASI_O_TRUNC      8
 
-    for (int i = 0; i < ntag_args; i++) {
-        wasm_ptrs[nargs] = exif__wasm_alloc_string(ctx, opts->tags[i]);
-        if (!wasm_ptrs[nargs]) goto oom;
-        nargs++;
-    }
+#define EXIF__WASI_FDFLAG_APPEND  1
 
-    for (int i = 0; i < ntail; i++) {
-        wasm_ptrs[nargs] = exif__wasm_alloc_string(ctx, tail[i]);
-        if (!wasm_ptrs[nargs]) goto oom;
-        nargs++;
-    }
+// Guest fd of the "/" preopen, the first entry of the WASI dir list
+#define EXIF__WASI_ROOT_FD  3
 
-    void *argv_native = NULL;
-    argv_off = wasm_runtime_module_malloc(ctx->inst,
-                                          nargs * sizeof(int32_t),
-                                          &argv_native);
-    if (!argv_off) goto oom;
-    for (int i = 0; i < nargs; i++)
-        ((int32_t *)argv_native)[i] = (int32_t)wasm_ptrs[i];
+// WAMR's own WASI table, used to find the functions we override. It is not
+// in WAMR's public headers; CMakeLists.txt checks the vendored release still
+// defines it with this signature. Should a symbol go missing from the table,
+// exif__wasi_hook registers nothing and every context works through temp
+// files instead.
+extern uint32_t get_libc_wasi_export_apis(NativeSymbol **p_libc_wasi_apis);
 
-    script_off = exif__wasm_alloc_string(ctx, ctx->script_path);
-    if (!script_off) goto oom;
+typedef struct exif__wasi_iovec {
+    uint32_t buf;      // app offset
+    uint32_t buf_len;
+} exif__wasi_iovec_t;
 
-    ftruncate(ctx->stdout_fd, 0);
-    lseek(ctx->stdout_fd, 0, SEEK_SET);
-    ftruncate(ctx->stderr_fd, 0);
-    lseek(ctx->stderr_fd, 0, SEEK_SET);
+// True once every override is registered. Otherwise stdout/stderr go to the
+// backing fds and buffers and the script go through temp files.
+static bool exif__wasi_hooked;
 
-    wasm_val_t call_args[3] = {
-        { .kind = WASM_I32, .of.i32 = (int32_t)script_off },
-        { .kind = WASM_I32, .of.i32 = nargs },
-        { .kind = WASM_I32, .of.i32 = (int32_t)argv_off },
-    };
-    wasm_val_t call_ret = { .kind = WASM_I32 };
-    int32_t exit_code = -1;
-    const char *wasm_error = NULL;
+static uint16_t (*exif__orig_fd_read)(wasm_exec_env_t, uint32_t, const exif__wasi_iovec_t *, uint32_t, uint32_t *);
+static uint16_t (*exif__orig_fd_write)(wasm_exec_env_t, uint32_t, const exif__wasi_iovec_t *, uint32_t, uint32_t *);
+static uint16_t (*exif__orig_fd_pread)(wasm_exec_env_t, uint32_t, const exif__wasi_iovec_t *, uint32_t, uint64_t, uint32_t *);
+static uint16_t (*exif__orig_fd_pwrite)(wasm_exec_env_t, uint32_t, const exif__wasi_iovec_t *, uint32_t, uint64_t, uint32_t *);
+static uint16_t (*exif__orig_fd_seek)(wasm_exec_env_t, uint32_t, int64_t, uint32_t, uint64_t *);
+static uint16_t (*exif__orig_fd_tell)(wasm_exec_env_t, uint32_t, uint64_t *);
+static uint16_t (*exif__orig_fd_close)(wasm_exec_env_t, uint32_t);
+static uint16_t (*exif__orig_fd_sync)(wasm_exec_env_t, uint32_t);
+static uint16_t (*exif__orig_fd_datasync)(wasm_exec_env_t, uint32_t);
+static uint16_t (*exif__orig_fd_fdstat_get)(wasm_exec_env_t, uint32_t, uint8_t *);
+static uint16_t (*exif__orig_fd_fdstat_set_flags)(wasm_exec_env_t, uint32_t, uint32_t);
+static uint16_t (*exif__orig_fd_filestat_get)(wasm_exec_env_t, uint32_t, uint8_t *);
+static uint16_t (*exif__orig_fd_filestat_set_size)(wasm_exec_env_t, uint32_t, uint64_t);
+static uint16_t (*exif__orig_fd_filestat_set_times)(wasm_exec_env_t, uint32_t, uint64_t, uint64_t, uint32_t);
+static uint16_t (*exif__orig_fd_advise)(wasm_exec_env_t, uint32_t, uint64_t, uint64_t, uint32_t);
+static uint16_t (*exif__orig_fd_allocate)(wasm_exec_env_t, uint32_t, uint64_t, uint64_t);
+static uint16_t (*exif__orig_path_open)(wasm_exec_env_t, uint32_t, uint32_t, const char *, uint32_t, uint32_t, uint64_t, uint64_t, uint32_t, uint32_t *);
+static uint16_t (*exif__orig_path_filestat_get)(wasm_exec_env_t, uint32_t, uint32_t, const char *, uint32_t, uint8_t *);
+static uint16_t (*exif__orig_path_filestat_set_times)(wasm_exec_env_t, uint32_t, uint32_t, const char *, uint32_t, uint64_t, uint64_t, uint32_t);
+static uint16_t (*exif__orig_path_unlink_file)(wasm_exec_env_t, uint32_t, const char *, uint32_t);
+static uint16_t (*exif__orig_path_create_directory)(wasm_exec_env_t, uint32_t, const char *, uint32_t);
+static uint16_t (*exif__orig_path_rename)(wasm_exec_env_t, uint32_t, const char *, uint32_t, uint32_t, const char *, uint32_t);
 
-    if (wasm_runtime_call_wasm_a(ctx->env, ctx->fn_run_file,
-                                  1, &call_ret, 3, call_args)) {
-        exit_code = call_ret.of.i32;
-    } else {
-        const char *exc = wasm_runtime_get_exception(ctx->inst);
-        if (exc && strstr(exc, "wasi proc exit")) {
-            exit_code = (int32_t)wasm_runtime_get_wasi_exit_code(ctx->inst);
-        } else {
-            snprintf(ctx->errbuf, sizeof ctx->errbuf, "%s",
-                     exc ? exc : "unknown");
-            wasm_error = ctx->errbuf;
-        }
-        wasm_runtime_clear_exception(ctx->inst);
-    }
+static exif_t *exif__wasi_ctx(wasm_exec_env_t env)
+{
+    return wasm_runtime_get_custom_data(wasm_runtime_get_module_inst(env));
+}
 
-    exif__call_wasm(ctx, ctx->fn_flush, NULL);
+static uint64_t exif__now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
 
-    if (!wasm_error) {
-        int32_t error_ptr = 0;
-        exif__call_wasm(ctx, ctx->fn_last_error, &error_ptr);
-        const char *perl_error = exif__wasm_read_cstring(ctx, error_ptr);
-        if (perl_error && *perl_error)
-            wasm_error = perl_error;
+static void *exif__grow(exif_allocator_t *alloc, void *items, size_t n,
+                        size_t *cap, size_t size)
+{
+    if (n < *cap) return items;
+    size_t ncap = *cap ? *cap * 2 : 8;
+    void *p = alloc->alloc(ncap * size, alloc->ctx);
+    if (!p) return NULL;
+    if (items) {
+        memcpy(p, items, *cap * size);
+        alloc->free(items, *cap * size, alloc->ctx);
     }
+    *cap = ncap;
+    return p;
+}
 
-    if (wasm_error) {
-        result = exif__err_result(alloc, wasm_error, exit_code);
-    } else if (exit_code != 0) {
-        size_t err_len;
-        char *err_data = exif__read_fd(ctx, ctx->stderr_fd, &err_len);
-        snprintf(ctx->errbuf, sizeof ctx->errbuf, "%.*s",
-                 (int)(err_len < sizeof ctx->errbuf - 1
-                       ? err_len : sizeof ctx->errbuf - 1),
-                 err_data ? err_data : "exiftool exited with error");
-        if (err_data) alloc->free(err_data, 0, alloc->ctx);
-        result = exif__err_result(alloc, ctx->errbuf, exit_code);
-    } else {
-        size_t out_len;
-        char *data = exif__read_fd(ctx, ctx->stdout_fd, &out_len);
-        result = exif__ok_result(data, out_len, exit_code);
+static exif__vfile_t *exif__vfs_find(exif__vfs_t *vfs, const char *path, size_t len)
+{
+    for (size_t i = 0; i < vfs->nfiles; i++) {
+        exif__vfile_t *f = vfs->files[i];
+        if (f->path && strlen(f->path) == len && memcmp(f->path, path, len) == 0)
+            return f;
     }
-    goto cleanup;
-
- oom:
-    result = exif__err_result(alloc, "WASM memory allocation failed", -1);
-
-cleanup:
-    for (int i = 0; i < nargs; i++)
-        if (wasm_ptrs[i]) wasm_runtime_module_free(ctx->inst, wasm_ptrs[i]);
-    if (argv_off)   wasm_runtime_module_free(ctx->inst, argv_off);
-    if (script_off) wasm_runtime_module_free(ctx->inst, script_off);
-    if (thread_env_owned)
-        wasm_runtime_destroy_thread_env();
-    return result;
+    return NULL;
 }
 
-exif_t *exif_create(const exif_config_t *cfg)
+// Directories are implicit: the root and every parent of a virtual file.
+static bool exif__vfs_is_dir(exif__vfs_t *vfs, const char *path, size_t len)
 {
-    exif_allocator_t alloc = exif__default_allocator;
-    if (cfg && cfg->allocator) alloc = *cfg->allocator;
-
-    uint32_t wasm_stack = DEFAULT_STACK;
-    uint32_t wasm_heap  = DEFAULT_HEAP;
-    uint32_t exec_stack = DEFAULT_STACK;
-    if (cfg) {
-        if (cfg->wasm_stack_size) wasm_stack = cfg->wasm_stack_size;
-        if (cfg->wasm_heap_size)  wasm_heap  = cfg->wasm_heap_size;
-        if (cfg->exec_stack_size) exec_stack = cfg->exec_stack_size;
+    if (len == sizeof EXIF__VFS_ROOT - 2 && memcmp(path, EXIF__VFS_ROOT, len) == 0)
+        return true;
+    for (size_t i = 0; i < vfs->nfiles; i++) {
+        const char *p = vfs->files[i]->path;
+        if (p && strlen(p) > len && memcmp(p, path, len) == 0 && p[len] == '/')
+            return true;
     }
+    return false;
+}
 
-    if (!wasm_runtime_init()) return NULL;
-
-    if (!wasm_runtime_register_natives("env", exif__native_syms,
-                                       sizeof exif__native_syms / sizeof exif__native_syms[0]))
-        goto fail_runtime;
-
-    char wamr_errbuf[256];
-    // WAMR mutates the buffer during load
-    uint8_t *wasm_buf = alloc.alloc(sizeof zeroperl_aot, alloc.ctx);
-    if (!wasm_buf) goto fail_runtime;
-    memcpy(wasm_buf, zeroperl_aot, sizeof zeroperl_aot);
-
-    wasm_module_t module = wasm_runtime_load(wasm_buf, sizeof zeroperl_aot,
-                                             wamr_errbuf, sizeof wamr_errbuf);
-    if (!module) goto fail_buf;
+static exif__vfile_t *exif__vfs_add(exif_t *ctx, const char *path, size_t len,
+                                    const void *data, size_t data_len)
+{
+    exif_allocator_t *alloc = &ctx->alloc;
+    exif__vfs_t *vfs = &ctx->vfs;
 
-    exif_t *ctx = alloc.alloc(sizeof *ctx, alloc.ctx);
-    if (!ctx) goto fail_module;
-    memset(ctx, 0, sizeof *ctx);
-    ctx->alloc = alloc;
-    ctx->module = module;
-    ctx->wasm_buf = wasm_buf;
+    exif__vfile_t **files = exif__grow(alloc, vfs->files, vfs->nfiles,
+                                       &vfs->files_cap, sizeof *files);
+    if (!files) return NULL;
+    vfs->files = files;
 
-    ctx->script_path = exif__write_tmpfile(&alloc, exiftool_script,
-                                     sizeof exiftool_script, NULL);
-    if (!ctx->script_path) goto fail_ctx;
+    exif__vfile_t *f = alloc->alloc(sizeof *f, alloc->ctx);
+    if (!f) return NULL;
+    char *copy = alloc->alloc(len + 1, alloc->ctx);
+    if (!copy) { alloc->free(f, sizeof *f, alloc->ctx); return NULL; }
+    memcpy(copy, path, len);
+    copy[len] = '\0';
 
-    char stdout_tmpl[] = "/tmp/libexif_stdout_XXXXXX";
-    ctx->stdout_fd = mkstemp(stdout_tmpl);
-    if (ctx->stdout_fd < 0) goto fail_ctx;
-    unlink(stdout_tmpl);
+    *f = (exif__vfile_t){
+        .path = copy, .data = data, .len = data_len,
+        .ino = ++vfs->next_ino, .mtime = exif__now_ns(),
+    };
+    vfs->files[vfs->nfiles++] = f;
+    return f;
+}
 
-    char stderr_tmpl[] = "/tmp/libexif_stderr_XXXXXX";
-    ctx->stderr_fd = mkstemp(stderr_tmpl);
-    if (ctx->stderr_fd < 0) goto fail_ctx;
-    unlink(stderr_tmpl);
+static void exif__vstream_free(exif_allocator_t *alloc, exif__vstream_t *s)
+{
+    if (!s) return;
+    for (int i = 0; i < EXIF__STREAM_BLOCKS; i++)
+        if (s->blocks[i].data) alloc->free(s->blocks[i].data, EXIF__STREAM_BLOCK, alloc->ctx);
+    exif__buf_free(alloc, &s->spool);
+    alloc->free(s, sizeof *s, alloc->ctx);
+}
 
-    const char *dirs[] = { "/", "/tmp", "/dev" };
-    char *wasi_argv[] = { "zeroperl" };
-    wasm_runtime_set_wasi_args_ex(module, dirs, 3, NULL, 0, NULL, 0,
-                                  wasi_argv, 1, -1, ctx->stdout_fd,
-                                  ctx->stderr_fd);
+static exif__vblock_t *exif__vstream_block(exif_allocator_t *alloc,
+                                           exif__vstream_t *s, uint64_t index)
+{
+    exif__vblock_t *victim = &s->blocks[0];
+    for (int i = 0; i < EXIF__STREAM_BLOCKS; i++) {
+        exif__vblock_t *b = &s->blocks[i];
+        if (b->used && b->index == index) {
+            b->used = ++s->tick;
+            return b;
+        }
+        if (b->used < victim->used) victim = b;
+    }
 
-    ctx->inst = wasm_runtime_instantiate(module, wasm_stack, wasm_heap,
-                                         wamr_errbuf, sizeof wamr_errbuf);
-    if (!ctx->inst) goto fail_ctx;
+    if (!victim->data) {
+        victim->data = alloc->alloc(EXIF__STREAM_BLOCK, alloc->ctx);
+        if (!victim->data) return NULL;
+    }
+    victim->used = 0;
+    size_t len = 0;
+    while (len < EXIF__STREAM_BLOCK) {
+        int64_t got = s->reader.pread(s->reader.ctx, victim->data + len,
+                                      EXIF__STREAM_BLOCK - len,
+                                      index * EXIF__STREAM_BLOCK + len);
+        if (got < 0) return NULL;
+        if (got == 0) break;
+        len += (size_t)got;
+    }
+    victim->index = index;
+    victim->len = len;
+    victim->used = ++s->tick;
+    return victim;
+}
 
-    ctx->env = wasm_runtime_create_exec_env(ctx->inst, exec_stack);
-    if (!ctx->env) goto fail_ctx;
+// Copy up to n bytes at pos out of a reader-backed file. Returns the number
+// of bytes copied, short only at the end of the source, or -1 on error.
+static int64_t exif__vstream_copy(exif_allocator_t *alloc, exif__vstream_t *s,
+                                  char *dst, uint64_t pos, size_t n)
+{
+    const exif_reader_t *r = &s->reader;
+    if (!r->pread) {
+        while (!s->eof && s->spool.len < pos + n) {
+            if (!exif__buf_reserve(alloc, &s->spool, EXIF__STREAM_BLOCK)) return -1;
+            int64_t got = r->read(r->ctx, s->spool.data + s->spool.len, EXIF__STREAM_BLOCK);
+            if (got < 0) return -1;
+            if (got == 0) s->eof = true;
+            s->spool.len += (size_t)got;
+        }
+        if (pos >= s->spool.len) return 0;
+        if (n > s->spool.len - pos) n = s->spool.len - pos;
+        memcpy(dst, s->spool.data + pos, n);
+        return (int64_t)n;
+    }
 
-    ctx->fn_reset       = wasm_runtime_lookup_function(ctx->inst, "zeroperl_reset");
-    ctx->fn_run_file    = wasm_runtime_lookup_function(ctx->inst, "zeroperl_run_file");
-    ctx->fn_flush       = wasm_runtime_lookup_function(ctx->inst, "zeroperl_flush");
-    ctx->fn_last_error  = wasm_runtime_lookup_function(ctx->inst, "zeroperl_last_error");
-    ctx->fn_free_interp = wasm_runtime_lookup_function(ctx->inst, "zeroperl_free_interpreter");
+    size_t done = 0;
+    while (done < n) {
+        uint64_t at = pos + done;
+        exif__vblock_t *b = exif__vstream_block(alloc, s, at / EXIF__STREAM_BLOCK);
+        if (!b) return -1;
+        size_t in = (size_t)(at % EXIF__STREAM_BLOCK);
+        if (in >= b->len) break;
+        size_t take = b->len - in < n - done ? b->len - in : n - done;
+        memcpy(dst + done, b->data + in, take);
+        done += take;
+    }
+    return (int64_t)done;
+}
 
-    wasm_function_inst_t fn_init = wasm_runtime_lookup_function(ctx->inst, "zeroperl_init");
-    if (!fn_init || !ctx->fn_reset || !ctx->fn_run_file || !ctx->fn_flush)
-        goto fail_ctx;
+// Unlink f; its storage goes once the last guest fd on it is closed.
+static void exif__vfs_drop(exif_t *ctx, exif__vfile_t *f)
+{
+    exif_allocator_t *alloc = &ctx->alloc;
+    exif__vfs_t *vfs = &ctx->vfs;
 
-    int32_t rc;
-    if (!exif__call_wasm(ctx, fn_init, &rc) || rc != 0) goto fail_ctx;
+    if (f->path) {
+        alloc->free(f->path, 0, alloc->ctx);
+        f->path = NULL;
+    }
+    if (f->nopen) return;
 
-    return ctx;
+    for (size_t i = 0; i < vfs->nfiles; i++) {
+        if (vfs->files[i] != f) continue;
+        vfs->files[i] = vfs->files[--vfs->nfiles];
+        break;
+    }
+    if (f->spans) alloc->free(f->spans, f->nspans * sizeof *f->spans, alloc->ctx);
+    exif__vstream_free(alloc, f->stream);
+    exif__buf_free(alloc, &f->own);
+    alloc->free(f, sizeof *f, alloc->ctx);
+}
 
-fail_ctx:
-    exif_destroy(ctx);
-    return NULL;
-fail_module:
-    wasm_runtime_unload(module);
-fail_buf:
-    alloc.free(wasm_buf, sizeof zeroperl_aot, alloc.ctx);
-fail_runtime:
-    wasm_runtime_destroy();
-    return NULL;
+// Copy n bytes at pos out of f, zero-filling between the spans of a sparse
+// file so unbacked pages of the source are never touched.
+static void exif__vfile_copy(const exif__vfile_t *f, char *dst, size_t pos, size_t n)
+{
+    if (!f->spans) {
+        memcpy(dst, f->data + pos, n);
+        return;
+    }
+    size_t lo = 0, hi = f->nspans;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (f->spans[mid].off + f->spans[mid].len <= pos) lo = mid + 1;
+        else hi = mid;
+    }
+    size_t at = pos, end = pos + n;
+    for (size_t i = lo; i < f->nspans && f->spans[i].off < end; i++) {
+        size_t a = f->spans[i].off > at ? f->spans[i].off : at;
+        size_t b = f->spans[i].off + f->spans[i].len;
+        if (b > end) b = end;
+        memset(dst + (at - pos), 0, a - at);
+        memcpy(dst + (a - pos), f->data + a, b - a);
+        at = b;
+    }
+    memset(dst + (at - pos), 0, end - at);
 }
 
-void exif_destroy(exif_t *ctx)
+// Copy borrowed contents into f->own and grow them to at least size bytes.
+static bool exif__vfile_own(exif_t *ctx, exif__vfile_t *f, size_t size)
 {
-    if (!ctx) return;
-    exif_allocator_t alloc = ctx->alloc;
+    exif__buf_t *b = &f->own;
+    if (f->len && (f->stream || f->data != b->data)) {
+        b->len = 0;
+        if (!exif__buf_reserve(&ctx->alloc, b, f->len > size ? f->len : size))
+            return false;
+        if (f->stream) {
+            if (exif__vstream_copy(&ctx->alloc, f->stream, b->data, 0, f->len)
+                != (int64_t)f->len)
+                return false;
+            exif__vstream_free(&ctx->alloc, f->stream);
+            f->stream = NULL;
+        } else {
+            exif__vfile_copy(f, b->data, 0, f->len);
+        }
+        b->len = f->len;
+    }
+    if (f->spans) {
+        ctx->alloc.free(f->spans, f->nspans * sizeof *f->spans, ctx->alloc.ctx);
+        f->spans = NULL;
+        f->nspans = 0;
+    }
+    if (size > b->len) {
+        if (!exif__buf_reserve(&ctx->alloc, b, size - b->len)) return false;
+        memset(b->data + b->len, 0, size - b->len);
+        b->len = size;
+    }
+    f->data = b->data;
+    f->len = b->len;
+    return true;
+}
 
-    if (ctx->fn_free_interp && ctx->env)
-        exif__call_wasm(ctx, ctx->fn_free_interp, NULL);
+static bool exif__vfile_resize(exif_t *ctx, exif__vfile_t *f, size_t size)
+{
+    if (size > f->len) return exif__vfile_own(ctx, f, size);
+    // Shrinking borrowed contents needs no copy
+    f->len = size;
+    if (f->data == f->own.data && f->own.data) {
+        f->own.len = size;
+        f->own.data[size] = '\0';
+    }
+    return true;
+}
 
-    if (ctx->env)    wasm_runtime_destroy_exec_env(ctx->env);
-    if (ctx->inst)   wasm_runtime_deinstantiate(ctx->inst);
-    if (ctx->module) wasm_runtime_unload(ctx->module);
-    if (ctx->wasm_buf) alloc.free(ctx->wasm_buf, sizeof zeroperl_aot, alloc.ctx);
-    wasm_runtime_destroy();
+// Rebuild the absolute guest path for (dirfd, path). Only paths under
+// EXIF__VFS_ROOT, reached through the "/" preopen, are virtual.
+static bool exif__vfs_path(uint32_t dirfd, const char *path, uint32_t len,
+                           char *out, size_t *out_len)
+{
+    if (dirfd != EXIF__WASI_ROOT_FD || len + 2 > EXIF__VFS_PATH_MAX) return false;
+    while (len >= 2 && path[0] == '.' && path[1] == '/') { path += 2; len -= 2; }
+    while (len && path[len - 1] == '/') len--;
 
-    if (ctx->stdout_fd > 0) close(ctx->stdout_fd);
-    if (ctx->stderr_fd > 0) close(ctx->stderr_fd);
+    out[0] = '/';
+    memcpy(out + 1, path, len);
+    out[len + 1] = '\0';
+    *out_len = len + 1;
 
-    if (ctx->script_path) {
-        unlink(ctx->script_path);
-        alloc.free(ctx->script_path, 0, alloc.ctx);
-    }
+    size_t root = sizeof EXIF__VFS_ROOT - 2;  // without the trailing '/'
+    return *out_len >= root && memcmp(out, EXIF__VFS_ROOT, root) == 0
+        && (*out_len == root || out[root] == '/');
+}
 
-    alloc.free(ctx, sizeof *ctx, alloc.ctx);
+static exif__vfd_t *exif__vfs_fd(exif_t *ctx, uint32_t fd)
+{
+    size_t i = fd - EXIF__VFD_BASE;
+    return i < ctx->vfs.nfds && ctx->vfs.fds[i].file ? &ctx->vfs.fds[i] : NULL;
 }
 
-static const char *exif__read_defaults[] = { "-json", "-a", "-s", "-n", "-ee3", "-U", "-G3:1", "-api", "requestall=3", "-api", "largefilesupport" };
-#define EXIF__N_READ_DEFAULTS (int)(sizeof exif__read_defaults / sizeof exif__read_defaults[0])
+static bool exif__is_vfd(exif_t *ctx, uint32_t fd)
+{
+    return ctx && fd >= EXIF__VFD_BASE;
+}
 
-static void exif__apply_transform(exif_allocator_t *alloc, exif_result_t *result,
-                            const exif_options_t *opts)
+static void exif__vfs_filestat(uint8_t *buf, uint64_t ino, uint8_t filetype,
+                               uint64_t size, uint64_t mtime)
 {
-    if (!result->success || !opts || !opts->transform)
-        return;
-    char *transformed = opts->transform(result->data, result->data_len,
-                                        opts->transform_ctx);
-    alloc->free(result->data, 0, alloc->ctx);
-    result->data = transformed;
-    result->data_len = transformed ? strlen(transformed) : 0;
+    uint64_t nlink = 1;
+    memset(buf, 0, 64);
+    memcpy(buf + 8, &ino, 8);
+    buf[16] = filetype;
+    memcpy(buf + 24, &nlink, 8);
+    memcpy(buf + 32, &size, 8);
+    memcpy(buf + 40, &mtime, 8);
+    memcpy(buf + 48, &mtime, 8);
+    memcpy(buf + 56, &mtime, 8);
 }
 
-exif_result_t exif_read(exif_t *ctx, const char *path,
-                        const exif_options_t *opts)
+static uint32_t exif__vfs_readv(exif_t *ctx, wasm_module_inst_t inst,
+                                exif__vfile_t *f, const exif__wasi_iovec_t *iov,
+                                uint32_t iovcnt, uint64_t pos, uint32_t *nread)
 {
-    const char *tail[EXIF__N_READ_DEFAULTS + 1];
-    for (int i = 0; i < EXIF__N_READ_DEFAULTS; i++)
-        tail[i] = exif__read_defaults[i];
-    tail[EXIF__N_READ_DEFAULTS] = path;
+    if (!wasm_runtime_validate_native_addr(inst, (void *)iov, (uint64_t)iovcnt * sizeof *iov)
+        || !wasm_runtime_validate_native_addr(inst, nread, sizeof *nread))
+        return EXIF__WASI_EFAULT;
 
-    exif_result_t result = exif__run(ctx, tail, EXIF__N_READ_DEFAULTS + 1, opts);
-    exif__apply_transform(&ctx->alloc, &result, opts);
-    return result;
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < iovcnt && pos < f->len; i++) {
+        if (!wasm_runtime_validate_app_addr(inst, iov[i].buf, iov[i].buf_len))
+            return EXIF__WASI_EFAULT;
+        size_t n = f->len - pos < iov[i].buf_len ? f->len - pos : iov[i].buf_len;
+        char *dst = wasm_runtime_addr_app_to_native(inst, iov[i].buf);
+        if (f->stream) {
+            int64_t got = exif__vstream_copy(&ctx->alloc, f->stream, dst, pos, n);
+            if (got < 0) return EXIF__WASI_EIO;
+            pos += (uint64_t)got;
+            total += (uint32_t)got;
+            if ((size_t)got < n) break;
+            continue;
+        }
+        exif__vfile_copy(f, dst, pos, n);
+        pos += n;
+        total += (uint32_t)n;
+    }
+    *nread = total;
+    return 0;
 }
 
-exif_result_t exif_read_buf(exif_t *ctx, exif_buf_t input,
-                            const exif_options_t *opts)
+static uint32_t exif__vfs_writev(exif_t *ctx, wasm_module_inst_t inst,
+                                 exif__vfile_t *f, const exif__wasi_iovec_t *iov,
+                                 uint32_t iovcnt, uint64_t pos, uint32_t *nwritten)
+{
+    if (!wasm_runtime_validate_native_addr(inst, (void *)iov, (uint64_t)iovcnt * sizeof *iov)
+        || !wasm_runtime_validate_native_addr(inst, nwritten, sizeof *nwritten))
+        return EXIF__WASI_EFAULT;
+
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < iovcnt; i++) {
+        if (!wasm_runtime_validate_app_addr(inst, iov[i].buf, iov[i].buf_len))
+            return EXIF__WASI_EFAULT;
+        if (!exif__vfile_own(ctx, f, pos + iov[i].buf_len))
+            return EXIF__WASI_ENOMEM;
+        memcpy(f->own.data + pos, wasm_runtime_addr_app_to_native(inst, iov[i].buf),
+               iov[i].buf_len);
+        pos += iov[i].buf_len;
+        total += iov[i].buf_len;
+    }
+    f->mtime = exif__now_ns();
+    *nwritten = total;
+    return 0;
+}
+
+// Index k of a "{fileN}" line, the -echo3 marker that ends command k
+static bool exif__sink_marker(const char *line, size_t len, size_t *k)
+{
+    if (len < 7 || memcmp(line, "{file", 5) != 0 || line[len - 1] != '}') return false;
+    size_t v = 0;
+    for (size_t i = 5; i < len - 1; i++) {
+        if (line[i] < '0' || line[i] > '9') return false;
+        v = v * 10 + (size_t)(line[i] - '0');
+    }
+    *k = v;
+    return true;
+}
+
+static void exif__sink_emit(exif__sink_t *s, const char *data, size_t len)
+{
+    if (!len) return;
+    s->fn(s->file, data, len, s->ctx);
+    s->bytes += len;
+    s->file_bytes += len;
+    s->bol = data[len - 1] == '\n';
+}
+
+static void exif__sink_end_file(exif__sink_t *s, size_t k)
+{
+    s->fn(s->ids[k], NULL, 0, s->ctx);
+    s->lens[k] = (size_t)s->file_bytes;
+    s->file_bytes = 0;
+    s->next = k + 1;
+    s->file = s->ids[k + 1 < s->nids ? k + 1 : k];
+    s->bol = true;
+}
+
+// Pass the settled part of b to the sink and drop it from b. Kept back are
+// the last hold bytes and, in a {fileN} run, an unfinished line starting
+// with '{'. A {fileN} line itself is dropped and ends command N. The final
+// drain, at the end of a run, keeps nothing back.
+static void exif__sink_drain(exif__sink_t *s, exif__buf_t *b, bool final)
+{
+    size_t pos = 0, end = b->len;
+    if (!final) end = end > s->hold ? end - s->hold : 0;
+    while (pos < end) {
+        size_t stop = end, resume = end, k = 0;
+        bool marker = false;
+        for (size_t line = pos; s->ids && line < end; ) {
+            const char *eol = memchr(b->data + line, '\n', end - line);
+            size_t line_end = eol ? (size_t)(eol - b->data) : end;
+            if ((line > pos || s->bol) && b->data[line] == '{') {
+                if (!eol && !final) {
+                    stop = resume = line;
+                    break;
+                }
+                if (exif__sink_marker(b->data + line, line_end - line, &k) && k < s->nids) {
+                    stop = line;
+                    resume = eol ? line_end + 1 : end;
+                    marker = true;
+                    break;
+                }
+            }
+            line = line_end + 1;
+        }
+        exif__sink_emit(s, b->data + pos, stop - pos);
+        pos = resume;
+        if (!marker) break;
+        exif__sink_end_file(s, k);
+    }
+    if (!pos) return;
+    b->len -= pos;
+    memmove(b->data, b->data + pos, b->len);
+    b->data[b->len] = '\0';
+}
+
+// Pass what r still holds to fn as the rest of file, then end the file.
+// Output that never went through the fd_write override arrives here in one
+// piece: native reads, runs without the override, the fork server.
+// data_len becomes what the file streamed in all.
+static void exif__sink_deliver(exif_allocator_t *alloc, exif_sink_fn fn, void *fctx,
+                               exif_result_t *r, size_t file, uint64_t streamed)
+{
+    if (r->success && r->data_len) fn(file, r->data, r->data_len, fctx);
+    r->data_len = r->success ? r->data_len + (size_t)streamed : 0;
+    if (r->data) alloc->free(r->data, 0, alloc->ctx);
+    r->data = NULL;
+    fn(file, NULL, 0, fctx);
+}
+
+// Send stdout of the runs in this call to opts->sink, as file. False when
+// there is no sink or an outer call has already set it.
+static bool exif__sink_begin(exif_t *ctx, const exif_options_t *opts, size_t file)
+{
+    if (!opts || !opts->sink || ctx->sink.fn) return false;
+    pthread_mutex_lock(&ctx->capture.lock);
+    ctx->sink = (exif__sink_t){
+        .fn = opts->sink, .ctx = opts->sink_ctx, .file = file, .bol = true,
+    };
+    pthread_mutex_unlock(&ctx->capture.lock);
+    return true;
+}
+
+static void exif__sink_end(exif_t *ctx, exif_result_t *r)
+{
+    pthread_mutex_lock(&ctx->capture.lock);
+    exif__sink_t s = ctx->sink;
+    ctx->sink = (exif__sink_t){0};
+    pthread_mutex_unlock(&ctx->capture.lock);
+    exif__sink_deliver(&ctx->alloc, s.fn, s.ctx, r, s.file, s.bytes);
+}
+
+// Guest stdout/stderr append straight into the context's capture buffers.
+static uint32_t exif__capture_writev(exif_t *ctx, wasm_module_inst_t inst,
+                                     uint32_t fd, const exif__wasi_iovec_t *iov,
+                                     uint32_t iovcnt, uint32_t *nwritten)
+{
+    if (!wasm_runtime_validate_native_addr(inst, (void *)iov,
+                                           (uint64_t)iovcnt * sizeof *iov)
+        || !wasm_runtime_validate_native_addr(inst, nwritten, sizeof *nwritten))
+        return EXIF__WASI_EFAULT;
+
+    exif__capture_t *cap = &ctx->capture;
+    exif__buf_t *b = fd == 1 ? &cap->out : &cap->err;
+    uint32_t total = 0, rc = 0;
+
+    pthread_mutex_lock(&cap->lock);
+    for (uint32_t i = 0; i < iovcnt; i++) {
+        if (!wasm_runtime_validate_app_addr(inst, iov[i].buf, iov[i].buf_len)) {
+            rc = EXIF__WASI_EFAULT;
+            break;
+        }
+        const void *src = wasm_runtime_addr_app_to_native(inst, iov[i].buf);
+        if (!exif__buf_append(&ctx->alloc, b, src, iov[i].buf_len)) {
+            cap->overflow = true;
+            rc = EXIF__WASI_ENOMEM;
+            break;
+        }
+        total += iov[i].buf_len;
+    }
+    if (fd == 1 && ctx->sink.fn) exif__sink_drain(&ctx->sink, b, false);
+    pthread_cond_broadcast(&cap->cond);
+    pthread_mutex_unlock(&cap->lock);
+
+    *nwritten = total;
+    return rc;
+}
+
+static uint32_t exif__wasi_fd_write(wasm_exec_env_t env, uint32_t fd,
+                                    const exif__wasi_iovec_t *iov,
+                                    uint32_t iovcnt, uint32_t *nwritten)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    wasm_module_inst_t inst = wasm_runtime_get_module_inst(env);
+    if (ctx && (fd == 1 || fd == 2))
+        return exif__capture_writev(ctx, inst, fd, iov, iovcnt, nwritten);
+    if (!exif__is_vfd(ctx, fd))
+        return exif__orig_fd_write(env, fd, iov, iovcnt, nwritten);
+
+    exif__vfd_t *vfd = exif__vfs_fd(ctx, fd);
+    if (!vfd) return EXIF__WASI_EBADF;
+    if (vfd->append) vfd->pos = vfd->file->len;
+    uint32_t rc = exif__vfs_writev(ctx, inst, vfd->file, iov, iovcnt, vfd->pos, nwritten);
+    if (!rc) vfd->pos += *nwritten;
+    return rc;
+}
+
+static uint32_t exif__wasi_fd_pwrite(wasm_exec_env_t env, uint32_t fd,
+                                     const exif__wasi_iovec_t *iov, uint32_t iovcnt,
+                                     uint64_t offset, uint32_t *nwritten)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    if (!exif__is_vfd(ctx, fd))
+        return exif__orig_fd_pwrite(env, fd, iov, iovcnt, offset, nwritten);
+    exif__vfd_t *vfd = exif__vfs_fd(ctx, fd);
+    if (!vfd) return EXIF__WASI_EBADF;
+    return exif__vfs_writev(ctx, wasm_runtime_get_module_inst(env), vfd->file,
+                            iov, iovcnt, offset, nwritten);
+}
+
+static uint32_t exif__wasi_fd_read(wasm_exec_env_t env, uint32_t fd,
+                                   const exif__wasi_iovec_t *iov,
+                                   uint32_t iovcnt, uint32_t *nread)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    if (!exif__is_vfd(ctx, fd))
+        return exif__orig_fd_read(env, fd, iov, iovcnt, nread);
+    exif__vfd_t *vfd = exif__vfs_fd(ctx, fd);
+    if (!vfd) return EXIF__WASI_EBADF;
+    uint32_t rc = exif__vfs_readv(ctx, wasm_runtime_get_module_inst(env), vfd->file,
+                                  iov, iovcnt, vfd->pos, nread);
+    if (!rc) vfd->pos += *nread;
+    return rc;
+}
+
+static uint32_t exif__wasi_fd_pread(wasm_exec_env_t env, uint32_t fd,
+                                    const exif__wasi_iovec_t *iov, uint32_t iovcnt,
+                                    uint64_t offset, uint32_t *nread)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    if (!exif__is_vfd(ctx, fd))
+        return exif__orig_fd_pread(env, fd, iov, iovcnt, offset, nread);
+    exif__vfd_t *vfd = exif__vfs_fd(ctx, fd);
+    if (!vfd) return EXIF__WASI_EBADF;
+    return exif__vfs_readv(ctx, wasm_runtime_get_module_inst(env), vfd->file,
+                           iov, iovcnt, offset, nread);
+}
+
+static uint32_t exif__wasi_fd_seek(wasm_exec_env_t env, uint32_t fd,
+                                   int64_t offset, uint32_t whence,
+                                   uint64_t *newoffset)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    if (!exif__is_vfd(ctx, fd))
+        return exif__orig_fd_seek(env, fd, offset, whence, newoffset);
+    exif__vfd_t *vfd = exif__vfs_fd(ctx, fd);
+    if (!vfd) return EXIF__WASI_EBADF;
+    if (!wasm_runtime_validate_native_addr(wasm_runtime_get_module_inst(env),
+                                           newoffset, sizeof *newoffset))
+        return EXIF__WASI_EFAULT;
+
+    int64_t base = whence == 0 ? 0
+                 : whence == 1 ? (int64_t)vfd->pos
+                 : whence == 2 ? (int64_t)vfd->file->len : -1;
+    if (base < 0 || base + offset < 0) return EXIF__WASI_EINVAL;
+    vfd->pos = (uint64_t)(base + offset);
+    *newoffset = vfd->pos;
+    return 0;
+}
+
+static uint32_t exif__wasi_fd_tell(wasm_exec_env_t env, uint32_t fd,
+                                   uint64_t *offset)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    if (!exif__is_vfd(ctx, fd)) return exif__orig_fd_tell(env, fd, offset);
+    exif__vfd_t *vfd = exif__vfs_fd(ctx, fd);
+    if (!vfd) return EXIF__WASI_EBADF;
+    if (!wasm_runtime_validate_native_addr(wasm_runtime_get_module_inst(env),
+                                           offset, sizeof *offset))
+        return EXIF__WASI_EFAULT;
+    *offset = vfd->pos;
+    return 0;
+}
+
+static uint32_t exif__wasi_fd_close(wasm_exec_env_t env, uint32_t fd)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    if (!exif__is_vfd(ctx, fd)) return exif__orig_fd_close(env, fd);
+    exif__vfd_t *vfd = exif__vfs_fd(ctx, fd);
+    if (!vfd) return EXIF__WASI_EBADF;
+    exif__vfile_t *f = vfd->file;
+    *vfd = (exif__vfd_t){0};
+    if (--f->nopen == 0 && !f->path) exif__vfs_drop(ctx, f);
+    return 0;
+}
+
+static uint32_t exif__wasi_fd_sync(wasm_exec_env_t env, uint32_t fd)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    if (!exif__is_vfd(ctx, fd)) return exif__orig_fd_sync(env, fd);
+    return exif__vfs_fd(ctx, fd) ? 0 : EXIF__WASI_EBADF;
+}
+
+static uint32_t exif__wasi_fd_datasync(wasm_exec_env_t env, uint32_t fd)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    if (!exif__is_vfd(ctx, fd)) return exif__orig_fd_datasync(env, fd);
+    return exif__vfs_fd(ctx, fd) ? 0 : EXIF__WASI_EBADF;
+}
+
+static uint32_t exif__wasi_fd_fdstat_get(wasm_exec_env_t env, uint32_t fd,
+                                         uint8_t *buf)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    if (!exif__is_vfd(ctx, fd)) return exif__orig_fd_fdstat_get(env, fd, buf);
+    exif__vfd_t *vfd = exif__vfs_fd(ctx, fd);
+    if (!vfd) return EXIF__WASI_EBADF;
+    if (!wasm_runtime_validate_native_addr(wasm_runtime_get_module_inst(env), buf, 24))
+        return EXIF__WASI_EFAULT;
+
+    uint16_t flags = vfd->append ? EXIF__WASI_FDFLAG_APPEND : 0;
+    memset(buf, 0, 24);
+    buf[0] = EXIF__WASI_FILETYPE_REGULAR;
+    memcpy(buf + 2, &flags, 2);
+    memcpy(buf + 8, &vfd->rights, 8);
+    return 0;
+}
+
+static uint32_t exif__wasi_fd_fdstat_set_flags(wasm_exec_env_t env, uint32_t fd,
+                                               uint32_t flags)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    if (!exif__is_vfd(ctx, fd)) return exif__orig_fd_fdstat_set_flags(env, fd, flags);
+    exif__vfd_t *vfd = exif__vfs_fd(ctx, fd);
+    if (!vfd) return EXIF__WASI_EBADF;
+    vfd->append = flags & EXIF__WASI_FDFLAG_APPEND;
+    return 0;
+}
+
+static uint32_t exif__wasi_fd_filestat_get(wasm_exec_env_t env, uint32_t fd,
+                                           uint8_t *buf)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    if (!exif__is_vfd(ctx, fd)) return exif__orig_fd_filestat_get(env, fd, buf);
+    exif__vfd_t *vfd = exif__vfs_fd(ctx, fd);
+    if (!vfd) return EXIF__WASI_EBADF;
+    if (!wasm_runtime_validate_native_addr(wasm_runtime_get_module_inst(env), buf, 64))
+        return EXIF__WASI_EFAULT;
+    exif__vfs_filestat(buf, vfd->file->ino, EXIF__WASI_FILETYPE_REGULAR,
+                       vfd->file->len, vfd->file->mtime);
+    return 0;
+}
+
+static uint32_t exif__wasi_fd_filestat_set_size(wasm_exec_env_t env, uint32_t fd,
+                                                uint64_t size)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    if (!exif__is_vfd(ctx, fd)) return exif__orig_fd_filestat_set_size(env, fd, size);
+    exif__vfd_t *vfd = exif__vfs_fd(ctx, fd);
+    if (!vfd) return EXIF__WASI_EBADF;
+    return exif__vfile_resize(ctx, vfd->file, size) ? 0 : EXIF__WASI_ENOMEM;
+}
+
+static uint32_t exif__wasi_fd_filestat_set_times(wasm_exec_env_t env, uint32_t fd,
+                                                 uint64_t atim, uint64_t mtim,
+                                                 uint32_t flags)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    if (!exif__is_vfd(ctx, fd))
+        return exif__orig_fd_filestat_set_times(env, fd, atim, mtim, flags);
+    return exif__vfs_fd(ctx, fd) ? 0 : EXIF__WASI_EBADF;
+}
+
+static uint32_t exif__wasi_fd_advise(wasm_exec_env_t env, uint32_t fd,
+                                     uint64_t offset, uint64_t len, uint32_t advice)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    if (!exif__is_vfd(ctx, fd)) return exif__orig_fd_advise(env, fd, offset, len, advice);
+    return exif__vfs_fd(ctx, fd) ? 0 : EXIF__WASI_EBADF;
+}
+
+static uint32_t exif__wasi_fd_allocate(wasm_exec_env_t env, uint32_t fd,
+                                       uint64_t offset, uint64_t len)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    if (!exif__is_vfd(ctx, fd)) return exif__orig_fd_allocate(env, fd, offset, len);
+    exif__vfd_t *vfd = exif__vfs_fd(ctx, fd);
+    if (!vfd) return EXIF__WASI_EBADF;
+    if (offset + len <= vfd->file->len) return 0;
+    return exif__vfile_own(ctx, vfd->file, offset + len) ? 0 : EXIF__WASI_ENOMEM;
+}
+
+static uint32_t exif__wasi_path_open(wasm_exec_env_t env, uint32_t dirfd,
+                                     uint32_t dirflags, const char *path,
+                                     uint32_t path_len, uint32_t oflags,
+                                     uint64_t rights_base, uint64_t rights_inheriting,
+                                     uint32_t fdflags, uint32_t *fd_out)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    char abs[EXIF__VFS_PATH_MAX];
+    size_t abs_len;
+    if (!ctx || !exif__vfs_path(dirfd, path, path_len, abs, &abs_len))
+        return exif__orig_path_open(env, dirfd, dirflags, path, path_len, oflags,
+                                    rights_base, rights_inheriting, fdflags, fd_out);
+    if (!wasm_runtime_validate_native_addr(wasm_runtime_get_module_inst(env),
+                                           fd_out, sizeof *fd_out))
+        return EXIF__WASI_EFAULT;
+
+    exif__vfs_t *vfs = &ctx->vfs;
+    exif__vfile_t *f = exif__vfs_find(vfs, abs, abs_len);
+    if (!f) {
+        if (exif__vfs_is_dir(vfs, abs, abs_len))
+            return oflags & EXIF__WASI_O_DIRECTORY ? EXIF__WASI_ENOTSUP : EXIF__WASI_EISDIR;
+        if (!(oflags & EXIF__WASI_O_CREAT)) return EXIF__WASI_ENOENT;
+        f = exif__vfs_add(ctx, abs, abs_len, NULL, 0);
+        if (!f) return EXIF__WASI_ENOMEM;
+    } else if ((oflags & EXIF__WASI_O_CREAT) && (oflags & EXIF__WASI_O_EXCL)) {
+        return EXIF__WASI_EEXIST;
+    } else if (oflags & EXIF__WASI_O_DIRECTORY) {
+        return EXIF__WASI_ENOTDIR;
+    }
+    if ((oflags & EXIF__WASI_O_TRUNC) && !exif__vfile_resize(ctx, f, 0))
+        return EXIF__WASI_ENOMEM;
+
+    size_t slot = 0;
+    while (slot < vfs->nfds && vfs->fds[slot].file) slot++;
+    if (slot == vfs->nfds) {
+        exif__vfd_t *fds = exif__grow(&ctx->alloc, vfs->fds, vfs->nfds,
+                                      &vfs->fds_cap, sizeof *fds);
+        if (!fds) return EXIF__WASI_ENOMEM;
+        vfs->fds = fds;
+        vfs->nfds++;
+    }
+    vfs->fds[slot] = (exif__vfd_t){
+        .file = f, .rights = rights_base,
+        .append = fdflags & EXIF__WASI_FDFLAG_APPEND,
+    };
+    f->nopen++;
+    *fd_out = EXIF__VFD_BASE + (uint32_t)slot;
+    return 0;
+}
+
+static uint32_t exif__wasi_path_filestat_get(wasm_exec_env_t env, uint32_t dirfd,
+                                             uint32_t flags, const char *path,
+                                             uint32_t path_len, uint8_t *buf)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    char abs[EXIF__VFS_PATH_MAX];
+    size_t abs_len;
+    if (!ctx || !exif__vfs_path(dirfd, path, path_len, abs, &abs_len))
+        return exif__orig_path_filestat_get(env, dirfd, flags, path, path_len, buf);
+    if (!wasm_runtime_validate_native_addr(wasm_runtime_get_module_inst(env), buf, 64))
+        return EXIF__WASI_EFAULT;
+
+    exif__vfile_t *f = exif__vfs_find(&ctx->vfs, abs, abs_len);
+    if (f)
+        exif__vfs_filestat(buf, f->ino, EXIF__WASI_FILETYPE_REGULAR, f->len, f->mtime);
+    else if (exif__vfs_is_dir(&ctx->vfs, abs, abs_len))
+        exif__vfs_filestat(buf, 0, EXIF__WASI_FILETYPE_DIRECTORY, 0, 0);
+    else
+        return EXIF__WASI_ENOENT;
+    return 0;
+}
+
+static uint32_t exif__wasi_path_filestat_set_times(wasm_exec_env_t env, uint32_t dirfd,
+                                                   uint32_t flags, const char *path,
+                                                   uint32_t path_len, uint64_t atim,
+                                                   uint64_t mtim, uint32_t fstflags)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    char abs[EXIF__VFS_PATH_MAX];
+    size_t abs_len;
+    if (!ctx || !exif__vfs_path(dirfd, path, path_len, abs, &abs_len))
+        return exif__orig_path_filestat_set_times(env, dirfd, flags, path, path_len,
+                                                  atim, mtim, fstflags);
+    return exif__vfs_find(&ctx->vfs, abs, abs_len)
+        || exif__vfs_is_dir(&ctx->vfs, abs, abs_len) ? 0 : EXIF__WASI_ENOENT;
+}
+
+static uint32_t exif__wasi_path_unlink_file(wasm_exec_env_t env, uint32_t dirfd,
+                                            const char *path, uint32_t path_len)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    char abs[EXIF__VFS_PATH_MAX];
+    size_t abs_len;
+    if (!ctx || !exif__vfs_path(dirfd, path, path_len, abs, &abs_len))
+        return exif__orig_path_unlink_file(env, dirfd, path, path_len);
+    exif__vfile_t *f = exif__vfs_find(&ctx->vfs, abs, abs_len);
+    if (!f)
+        return exif__vfs_is_dir(&ctx->vfs, abs, abs_len) ? EXIF__WASI_EISDIR
+                                                          : EXIF__WASI_ENOENT;
+    exif__vfs_drop(ctx, f);
+    return 0;
+}
+
+static uint32_t exif__wasi_path_create_directory(wasm_exec_env_t env, uint32_t dirfd,
+                                                 const char *path, uint32_t path_len)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    char abs[EXIF__VFS_PATH_MAX];
+    size_t abs_len;
+    if (!ctx || !exif__vfs_path(dirfd, path, path_len, abs, &abs_len))
+        return exif__orig_path_create_directory(env, dirfd, path, path_len);
+    // Directories only exist through the files in them
+    return exif__vfs_find(&ctx->vfs, abs, abs_len)
+        || exif__vfs_is_dir(&ctx->vfs, abs, abs_len) ? EXIF__WASI_EEXIST : 0;
+}
+
+static uint32_t exif__wasi_path_rename(wasm_exec_env_t env, uint32_t old_fd,
+                                       const char *old_path, uint32_t old_len,
+                                       uint32_t new_fd, const char *new_path,
+                                       uint32_t new_len)
+{
+    exif_t *ctx = exif__wasi_ctx(env);
+    char from[EXIF__VFS_PATH_MAX], to[EXIF__VFS_PATH_MAX];
+    size_t from_len, to_len;
+    bool from_virtual = ctx && exif__vfs_path(old_fd, old_path, old_len, from, &from_len);
+    bool to_virtual = ctx && exif__vfs_path(new_fd, new_path, new_len, to, &to_len);
+    if (!from_virtual && !to_virtual)
+        return exif__orig_path_rename(env, old_fd, old_path, old_len,
+                                      new_fd, new_path, new_len);
+    if (from_virtual != to_virtual) return EXIF__WASI_EXDEV;
+
+    exif__vfile_t *f = exif__vfs_find(&ctx->vfs, from, from_len);
+    if (!f) return EXIF__WASI_ENOENT;
+    char *dst = ctx->alloc.alloc(to_len + 1, ctx->alloc.ctx);
+    if (!dst) return EXIF__WASI_ENOMEM;
+    memcpy(dst, to, to_len + 1);
+
+    exif__vfile_t *existing = exif__vfs_find(&ctx->vfs, to, to_len);
+    if (existing && existing != f) exif__vfs_drop(ctx, existing);
+    ctx->alloc.free(f->path, 0, ctx->alloc.ctx);
+    f->path = dst;
+    return 0;
+}
+
+#define EXIF__WASI_HOOK(name, sig) \
+    { #name, (void *)exif__wasi_##name, sig, &exif__orig_##name }
+
+static NativeSymbol exif__wasi_syms[] = {
+    EXIF__WASI_HOOK(fd_read,                 "(i*i*)i"),
+    EXIF__WASI_HOOK(fd_write,                "(i*i*)i"),
+    EXIF__WASI_HOOK(fd_pread,                "(i*iI*)i"),
+    EXIF__WASI_HOOK(fd_pwrite,               "(i*iI*)i"),
+    EXIF__WASI_HOOK(fd_seek,                 "(iIi*)i"),
+    EXIF__WASI_HOOK(fd_tell,                 "(i*)i"),
+    EXIF__WASI_HOOK(fd_close,                "(i)i"),
+    EXIF__WASI_HOOK(fd_sync,                 "(i)i"),
+    EXIF__WASI_HOOK(fd_datasync,             "(i)i"),
+    EXIF__WASI_HOOK(fd_fdstat_get,           "(i*)i"),
+    EXIF__WASI_HOOK(fd_fdstat_set_flags,     "(ii)i"),
+    EXIF__WASI_HOOK(fd_filestat_get,         "(i*)i"),
+    EXIF__WASI_HOOK(fd_filestat_set_size,    "(iI)i"),
+    EXIF__WASI_HOOK(fd_filestat_set_times,   "(iIIi)i"),
+    EXIF__WASI_HOOK(fd_advise,               "(iIIi)i"),
+    EXIF__WASI_HOOK(fd_allocate,             "(iII)i"),
+    EXIF__WASI_HOOK(path_open,               "(ii*~iIIi*)i"),
+    EXIF__WASI_HOOK(path_filestat_get,       "(ii*~*)i"),
+    EXIF__WASI_HOOK(path_filestat_set_times, "(ii*~IIi)i"),
+    EXIF__WASI_HOOK(path_unlink_file,        "(i*~)i"),
+    EXIF__WASI_HOOK(path_create_directory,   "(i*~)i"),
+    EXIF__WASI_HOOK(path_rename,             "(i*~i*~)i"),
+};
+
+#define EXIF__N_WASI_SYMS (sizeof exif__wasi_syms / sizeof exif__wasi_syms[0])
+
+// Point every override at WAMR's original and register the table. All or
+// nothing: a partial set would split one file between two filesystems.
+// Called with the runtime lock held, right after wasm_runtime_init.
+static void exif__wasi_hook(void)
+{
+    NativeSymbol *apis;
+    uint32_t napis = get_libc_wasi_export_apis(&apis);
+    void *orig[EXIF__N_WASI_SYMS];
+
+    for (size_t i = 0; i < EXIF__N_WASI_SYMS; i++) {
+        orig[i] = NULL;
+        for (uint32_t j = 0; j < napis && !orig[i]; j++)
+            if (strcmp(apis[j].symbol, exif__wasi_syms[i].symbol) == 0)
+                orig[i] = apis[j].func_ptr;
+        if (!orig[i]) return;
+    }
+    for (size_t i = 0; i < EXIF__N_WASI_SYMS; i++)
+        memcpy(exif__wasi_syms[i].attachment, &orig[i], sizeof orig[i]);
+
+    exif__wasi_hooked = wasm_runtime_register_natives("wasi_snapshot_preview1",
+                                                      exif__wasi_syms,
+                                                      EXIF__N_WASI_SYMS);
+}
+
+// Guest path for a mount of a file called name. Every call takes a fresh
+// directory, so names from different calls never collide.
+static void exif__vfs_name(exif_t *ctx, char out[EXIF__VFS_PATH_MAX], const char *name)
+{
+    snprintf(out, EXIF__VFS_PATH_MAX, EXIF__VFS_ROOT "%u/%s", ++ctx->vfs.seq, name);
+}
+
+// Expose data at the absolute guest path without copying it. data must stay
+// valid until the file is unmounted.
+static exif__vfile_t *exif__vfs_mount(exif_t *ctx, const char *path,
+                                      const void *data, size_t len)
+{
+    exif__vfile_t *f = exif__vfs_find(&ctx->vfs, path, strlen(path));
+    if (f) exif__vfs_drop(ctx, f);
+    return exif__vfs_add(ctx, path, strlen(path), data, len);
+}
+
+static void exif__vfs_unmount(exif_t *ctx, const char *path)
+{
+    exif__vfile_t *f = exif__vfs_find(&ctx->vfs, path, strlen(path));
+    if (f) exif__vfs_drop(ctx, f);
+}
+
+// Take the contents of a file written by the guest. NULL if it doesn't exist.
+static char *exif__vfs_take(exif_t *ctx, const char *path, size_t *out_len)
+{
+    exif__vfile_t *f = exif__vfs_find(&ctx->vfs, path, strlen(path));
+    if (!f || !exif__vfile_own(ctx, f, 0) || !exif__buf_reserve(&ctx->alloc, &f->own, 0))
+        return NULL;
+    char *data = f->own.data;
+    *out_len = f->own.len;
+    if (data) data[*out_len] = '\0';
+    f->own = (exif__buf_t){0};
+    f->data = NULL;
+    f->len = 0;
+    exif__vfs_drop(ctx, f);
+    return data;
+}
+
+static void exif__vfs_free(exif_t *ctx)
+{
+    exif_allocator_t *alloc = &ctx->alloc;
+    exif__vfs_t *vfs = &ctx->vfs;
+    for (size_t i = 0; i < vfs->nfiles; i++) {
+        exif__vfile_t *f = vfs->files[i];
+        if (f->path) alloc->free(f->path, 0, alloc->ctx);
+        if (f->spans) alloc->free(f->spans, f->nspans * sizeof *f->spans, alloc->ctx);
+        exif__vstream_free(alloc, f->stream);
+        exif__buf_free(alloc, &f->own);
+        alloc->free(f, sizeof *f, alloc->ctx);
+    }
+    if (vfs->files) alloc->free(vfs->files, vfs->files_cap * sizeof *vfs->files, alloc->ctx);
+    if (vfs->fds)   alloc->free(vfs->fds, vfs->fds_cap * sizeof *vfs->fds, alloc->ctx);
+    *vfs = (exif__vfs_t){0};
+}
+
+static bool exif__thread_env_enter(bool *owned)
+{
+    *owned = false;
+    if (wasm_runtime_thread_env_inited()) return true;
+    if (!wasm_runtime_init_thread_env()) return false;
+    *owned = true;
+    return true;
+}
+
+static void exif__thread_env_leave(bool owned)
+{
+    if (owned) wasm_runtime_destroy_thread_env();
+}
+
+// Replace whatever `target` refers to with `fd`, keeping the descriptor number
+// WASI was instantiated with. Consumes fd.
+static bool exif__rebind_fd(int target, int fd)
+{
+    if (fd < 0) return false;
+    int rc = dup2(fd, target);
+    close(fd);
+    return rc >= 0;
+}
+
+// Host fd behind guest stdout/stderr. With the fd_write override it only
+// has to look like a regular file, so Perl fully buffers its output.
+static int exif__open_capture_fd(const char *name)
+{
+#ifdef __linux__
+    char label[32];
+    snprintf(label, sizeof label, "libexif_%s", name);
+    int mfd = memfd_create(label, MFD_CLOEXEC);
+    if (mfd >= 0) return mfd;
+#endif
+    char tmpl[64];
+    snprintf(tmpl, sizeof tmpl, "/tmp/libexif_%s_XXXXXX", name);
+    int fd = mkstemp(tmpl);
+    if (fd >= 0) unlink(tmpl);
+    return fd;
+}
+
+static void exif__capture_reset(exif_t *ctx)
+{
+    if (!exif__wasi_hooked) {
+        ftruncate(ctx->stdout_fd, 0);
+        lseek(ctx->stdout_fd, 0, SEEK_SET);
+        ftruncate(ctx->stderr_fd, 0);
+        lseek(ctx->stderr_fd, 0, SEEK_SET);
+        return;
+    }
+    pthread_mutex_lock(&ctx->capture.lock);
+    ctx->capture.out.len = 0;
+    ctx->capture.err.len = 0;
+    ctx->capture.overflow = false;
+    pthread_mutex_unlock(&ctx->capture.lock);
+}
+
+// Hand over what the guest wrote to fd 1 or 2 since the last reset.
+// Returns NULL when nothing was written.
+static char *exif__capture_take(exif_t *ctx, int fd, size_t *out_len)
+{
+    if (!exif__wasi_hooked)
+        return exif__read_fd(ctx, fd == 1 ? ctx->stdout_fd : ctx->stderr_fd,
+                             out_len);
+
+    exif__buf_t *b = fd == 1 ? &ctx->capture.out : &ctx->capture.err;
+    pthread_mutex_lock(&ctx->capture.lock);
+    exif__buf_t taken = *b;
+    *b = (exif__buf_t){0};
+    pthread_mutex_unlock(&ctx->capture.lock);
+
+    *out_len = taken.len;
+    if (taken.len) return taken.data;
+    exif__buf_free(&ctx->alloc, &taken);
+    return NULL;
+}
+
+// Encode one argument as an argfile line. Plain lines are trimmed and
+// reformatted by exiftool, so anything that would not survive that goes
+// through the #[CSTR] escape form instead. Returns false when neither form
+// can carry the argument unchanged.
+static bool exif__resident_put_arg(exif_allocator_t *alloc, exif__buf_t *cmd,
+                                   const char *arg)
+{
+    bool plain = *arg && *arg != '#' && *arg != ' ' && *arg != '\t'
+              && !strpbrk(arg, "\r\n");
+    if (plain && *arg == '-') {
+        const char *eq = strchr(arg, '=');
+        if (eq && (eq[1] == ' ' || eq[-1] == ' ' || eq[-1] == '\t'))
+            plain = false;
+    }
+    if (plain)
+        return exif__buf_append(alloc, cmd, arg, strlen(arg))
+            && exif__buf_append(alloc, cmd, "\n", 1);
+
+    // #[CSTR] leaves a backslash in front of $ and @
+    if (strpbrk(arg, "$@")) return false;
+
+    if (!exif__buf_append(alloc, cmd, "#[CSTR]", 7)) return false;
+    for (const char *p = arg; *p; p++) {
+        const char *esc = NULL;
+        switch (*p) {
+        case '\\': esc = "\\\\"; break;
+        case '"':  esc = "\\\""; break;
+        case '\n': esc = "\\n";  break;
+        case '\r': esc = "\\r";  break;
+        case '\t': esc = "\\t";  break;
+        }
+        bool ok = esc ? exif__buf_append(alloc, cmd, esc, 2)
+                      : exif__buf_append(alloc, cmd, p, 1);
+        if (!ok) return false;
+    }
+    return exif__buf_append(alloc, cmd, "\n", 1);
+}
+
+static void *exif__resident_main(void *arg)
+{
+    exif_t *ctx = arg;
+    exif__resident_t *res = &ctx->resident;
+    bool thread_env_owned;
+
+    res->exit_code = -1;
+    if (!exif__thread_env_enter(&thread_env_owned)) {
+        snprintf(ctx->errbuf, sizeof ctx->errbuf, "failed to init WAMR thread env");
+        goto done;
+    }
+
+    wasm_val_t call_args[3] = {
+        { .kind = WASM_I32, .of.i32 = (int32_t)res->wasm_ptrs[0] },
+        { .kind = WASM_I32, .of.i32 = res->argc },
+        { .kind = WASM_I32, .of.i32 = (int32_t)res->argv_off },
+    };
+    wasm_val_t call_ret = { .kind = WASM_I32 };
+    if (wasm_runtime_call_wasm_a(ctx->env, ctx->fn_run_file,
+                                 1, &call_ret, 3, call_args)) {
+        res->exit_code = call_ret.of.i32;
+        snprintf(ctx->errbuf, sizeof ctx->errbuf, "exiftool interpreter exited");
+    } else {
+        const char *exc = wasm_runtime_get_exception(ctx->inst);
+        if (exc && strstr(exc, "wasi proc exit"))
+            res->exit_code = (int32_t)wasm_runtime_get_wasi_exit_code(ctx->inst);
+        else
+            ctx->poisoned = true;
+        snprintf(ctx->errbuf, sizeof ctx->errbuf, "%s",
+                 exc ? exc : "exiftool interpreter exited");
+        wasm_runtime_clear_exception(ctx->inst);
+    }
+    exif__call_wasm(ctx, ctx->fn_flush, NULL);
+    exif__thread_env_leave(thread_env_owned);
+
+done:
+    pthread_mutex_lock(&ctx->capture.lock);
+    res->exited = true;
+    pthread_cond_broadcast(&ctx->capture.cond);
+    pthread_mutex_unlock(&ctx->capture.lock);
+    while (write(res->exit_fd[1], "x", 1) < 0 && errno == EINTR) {}
+    return NULL;
+}
+
+static void exif__resident_release(exif_t *ctx)
+{
+    exif__resident_t *res = &ctx->resident;
+
+    for (size_t i = 0; i < sizeof res->wasm_ptrs / sizeof res->wasm_ptrs[0]; i++)
+        if (res->wasm_ptrs[i]) wasm_runtime_module_free(ctx->inst, res->wasm_ptrs[i]);
+    if (res->argv_off) wasm_runtime_module_free(ctx->inst, res->argv_off);
+
+    int fds[] = { res->in_fd, res->exit_fd[0], res->exit_fd[1] };
+    for (size_t i = 0; i < sizeof fds / sizeof fds[0]; i++)
+        if (fds[i] >= 0) close(fds[i]);
+
+    // Point the interpreter's stdin back at /dev/null
+    exif__rebind_fd(ctx->stdin_fd, open("/dev/null", O_RDONLY));
+
+    *res = (exif__resident_t){ .in_fd = -1, .exit_fd = { -1, -1 } };
+}
+
+// Ask the interpreter loop to finish and wait for it. Returns its exit code.
+static int32_t exif__resident_stop(exif_t *ctx)
+{
+    exif__resident_t *res = &ctx->resident;
+    if (!res->running) return 0;
+
+    static const char quit[] = "-stay_open\nFalse\n";
+    struct pollfd pfd[2] = {
+        { .fd = res->in_fd,      .events = POLLOUT },
+        { .fd = res->exit_fd[0], .events = POLLIN },
+    };
+    if (poll(pfd, 2, -1) > 0 && !(pfd[1].revents & POLLIN))
+        (void)!write(res->in_fd, quit, sizeof quit - 1);
+    pthread_join(res->thread, NULL);
+    int32_t exit_code = res->exit_code;
+    exif__resident_release(ctx);
+    return exit_code;
+}
+
+static bool exif__resident_start(exif_t *ctx)
+{
+    exif__resident_t *res = &ctx->resident;
+    if (res->running) return true;
+
+    *res = (exif__resident_t){ .in_fd = -1, .exit_fd = { -1, -1 } };
+
+    // The WASI fd numbers are fixed at instantiation; swap what stdin points
+    // to. Output arrives in the capture buffers.
+    int in[2], done[2];
+    if (pipe(in)) goto fail;
+    res->in_fd = in[1];
+    if (!exif__rebind_fd(ctx->stdin_fd, in[0])) goto fail;
+    if (pipe(done)) goto fail;
+    res->exit_fd[0] = done[0];
+    res->exit_fd[1] = done[1];
+
+    int32_t rc;
+    if (!exif__call_wasm(ctx, ctx->fn_reset, &rc) || rc != 0) goto fail;
+    exif__capture_reset(ctx);
+
+    // Warm-up modules load with the config file, once per interpreter
+    const char *argv[] = { "-config", ctx->warmup_path, "-stay_open", "True", "-@", "-" };
+    const char **args = ctx->warmup_path ? argv : argv + 2;
+    res->argc = ctx->warmup_path ? 6 : 4;
+    res->wasm_ptrs[0] = exif__wasm_alloc_string(ctx, ctx->script_path);
+    if (!res->wasm_ptrs[0]) goto fail;
+    for (int i = 0; i < res->argc; i++) {
+        res->wasm_ptrs[i + 1] = exif__wasm_alloc_string(ctx, args[i]);
+        if (!res->wasm_ptrs[i + 1]) goto fail;
+    }
+    void *argv_native = NULL;
+    res->argv_off = wasm_runtime_module_malloc(ctx->inst, res->argc * sizeof(int32_t),
+                                               &argv_native);
+    if (!res->argv_off) goto fail;
+    for (int i = 0; i < res->argc; i++)
+        ((int32_t *)argv_native)[i] = (int32_t)res->wasm_ptrs[i + 1];
+
+    // AOT code runs on the native stack of whichever thread calls into it
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, ctx->exec_stack);
+    int created = pthread_create(&res->thread, &attr, exif__resident_main, ctx);
+    pthread_attr_destroy(&attr);
+    if (created != 0) goto fail;
+
+    res->running = true;
+    return true;
+
+fail:
+    exif__resident_release(ctx);
+    return false;
+}
+
+// Wait for one command's output: stdout up to {readyN}, stderr up to {doneN}.
+// Both buffers are handed over with the markers stripped.
+static bool exif__resident_collect(exif_t *ctx, exif__buf_t *out,
+                                   exif__buf_t *err, int32_t *exit_code)
+{
+    exif__resident_t *res = &ctx->resident;
+    exif__capture_t *cap = &ctx->capture;
+    char ready[32], done[32];
+    size_t ready_len = (size_t)snprintf(ready, sizeof ready, "{ready%u}\n", res->seq);
+    size_t done_len = (size_t)snprintf(done, sizeof done, "{done%u ", res->seq);
+    bool ok = false;
+
+    pthread_mutex_lock(&cap->lock);
+    for (;;) {
+        bool out_done = cap->out.len >= ready_len
+            && memcmp(cap->out.data + cap->out.len - ready_len, ready, ready_len) == 0;
+        char *mark = cap->err.len ? strstr(cap->err.data, done) : NULL;
+        if (out_done && mark && strchr(mark, '}')) {
+            *exit_code = (int32_t)strtol(mark + done_len, NULL, 10);
+            cap->out.len -= ready_len;
+            cap->out.data[cap->out.len] = '\0';
+            cap->err.len = (size_t)(mark - cap->err.data);
+            cap->err.data[cap->err.len] = '\0';
+            ok = true;
+            break;
+        }
+        // A dropped write may have taken a marker with it
+        if (res->exited || cap->overflow) break;
+        pthread_cond_wait(&cap->cond, &cap->lock);
+    }
+    *out = cap->out;
+    *err = cap->err;
+    cap->out = (exif__buf_t){0};
+    cap->err = (exif__buf_t){0};
+    ctx->sink.hold = 0;
+    pthread_mutex_unlock(&cap->lock);
+    return ok;
+}
+
+// Run one command through the resident interpreter. Sets *handled to false
+// without touching the interpreter when the arguments cannot be expressed as
+// an argfile, so the caller can fall back to a one-shot run.
+static exif_result_t exif__run_resident(exif_t *ctx, const char **tail, int ntail,
+                                        const exif_options_t *opts, bool partial,
+                                        bool *handled)
 {
     exif_allocator_t *alloc = &ctx->alloc;
+    exif__resident_t *res = &ctx->resident;
+    exif__buf_t cmd = {0}, out = {0}, err = {0};
+    exif_result_t result;
+
+    *handled = false;
+    bool ok = true;
+    for (int i = 0; ok && opts && i < opts->argc; i++)
+        ok = exif__resident_put_arg(alloc, &cmd, opts->args[i]);
+    for (int i = 0; ok && opts && i < opts->ntags; i++)
+        ok = exif__resident_put_arg(alloc, &cmd, opts->tags[i]);
+    for (int i = 0; ok && i < ntail; i++)
+        ok = exif__resident_put_arg(alloc, &cmd, tail[i]);
+    if (!ok) {
+        exif__buf_free(alloc, &cmd);
+        return (exif_result_t){0};
+    }
+    *handled = true;
+
+    if (!exif__resident_start(ctx)) {
+        exif__buf_free(alloc, &cmd);
+        return exif__err_result(alloc, "failed to start resident exiftool", -1);
+    }
+
+    char trailer[96];
+    uint32_t seq = ++res->seq;
+    int trailer_len = snprintf(trailer, sizeof trailer,
+                               "-echo4\n{done%u ${status}}\n-execute%u\n",
+                               seq, seq);
+    // A sink must not see the {readyN} line that ends the output
+    pthread_mutex_lock(&ctx->capture.lock);
+    ctx->sink.hold = (size_t)snprintf(NULL, 0, "{ready%u}\n", seq);
+    pthread_mutex_unlock(&ctx->capture.lock);
+    if (!exif__buf_append(alloc, &cmd, trailer, trailer_len)) {
+        exif__buf_free(alloc, &cmd);
+        return exif__err_result(alloc, "out of memory", -1);
+    }
+
+    size_t sent = 0;
+    while (sent < cmd.len) {
+        struct pollfd pfd[2] = {
+            { .fd = res->in_fd,      .events = POLLOUT },
+            { .fd = res->exit_fd[0], .events = POLLIN },
+        };
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR) break;
+        if (pfd[1].revents & POLLIN) break;
+        if (!(pfd[0].revents & POLLOUT)) continue;
+        ssize_t w = write(res->in_fd, cmd.data + sent, cmd.len - sent);
+        if (w < 0 && errno != EINTR) break;
+        if (w > 0) sent += w;
+    }
+    bool delivered = sent == cmd.len;
+    exif__buf_free(alloc, &cmd);
+
+    int32_t exit_code = -1;
+    if (!delivered || !exif__resident_collect(ctx, &out, &err, &exit_code)) {
+        // The interpreter is gone or wedged; report and start over next time
+        bool overflow = ctx->capture.overflow;
+        int32_t code = exif__resident_stop(ctx);
+        result = exif__err_result(alloc, overflow
+                                  ? "out of memory capturing exiftool output"
+                                  : err.len ? err.data
+                                  : "resident exiftool exited unexpectedly",
+                                  code ? code : -1);
+    } else if (partial) {
+        result = exif__ok_result(out.data, out.len, exit_code);
+        result.error = err.len ? err.data : NULL;
+        if (err.len) err = (exif__buf_t){0};
+        out = (exif__buf_t){0};
+    } else if (exit_code != 0) {
+        snprintf(ctx->errbuf, sizeof ctx->errbuf, "%s",
+                 err.len ? err.data : "exiftool exited with error");
+        result = exif__err_result(alloc, ctx->errbuf, exit_code);
+    } else if (out.len) {
+        result = exif__ok_result(out.data, out.len, exit_code);
+        out = (exif__buf_t){0};
+    } else {
+        result = exif__ok_result(NULL, 0, exit_code);
+    }
+
+    exif__buf_free(alloc, &out);
+    exif__buf_free(alloc, &err);
+    return result;
+}
+
+// --- prepared options ---
+
+// exif_prepare copies a set of options and keeps every constant argument
+// string staged in the instance heap, with an argv array to reuse. A run
+// with those options only copies in its paths. Staged offsets belong to
+// one instance; a rebuilt instance (see exif__recover) is restaged on the
+// next run.
+
+typedef struct exif__staged {
+    const char *str;
+    uint64_t    off;
+} exif__staged_t;
+
+struct exif_prepared {
+    exif_t          *ctx;
+    exif_options_t   opts;      // points into the copies below
+    char            *strings;   // every string of opts, packed
+    size_t           strings_len;
+    const char     **lists;     // args, tags, then profile_args
+    size_t           nlists;
+    const char     **consts;    // strings to stage: opts, read tail, scripts
+    size_t           nconsts;
+    size_t           consts_cap;
+    exif__staged_t  *staged;
+    size_t           nstaged;
+    uint64_t         argv_off;
+    int              argv_cap;
+    uint32_t         generation;  // ctx->generation the offsets belong to
+};
+
+// opts with the fields of opts->prepared filled in. A transform or sink
+// given with the call replaces the prepared one.
+static const exif_options_t *exif__with_prepared(const exif_options_t *opts,
+                                                 exif_options_t *merged)
+{
+    if (!opts || !opts->prepared) return opts;
+    *merged = opts->prepared->opts;
+    merged->prepared = opts->prepared;
+    if (opts->transform) {
+        merged->transform = opts->transform;
+        merged->transform_ctx = opts->transform_ctx;
+    }
+    if (opts->sink) {
+        merged->sink = opts->sink;
+        merged->sink_ctx = opts->sink_ctx;
+    }
+    return merged;
+}
+
+// Drop staged strings. With release unset their instance is already gone
+// and the offsets are just forgotten.
+static void exif__prepared_unstage(exif_prepared_t *p, bool release)
+{
+    exif_t *ctx = p->ctx;
+    for (size_t i = 0; release && i < p->nstaged; i++)
+        wasm_runtime_module_free(ctx->inst, p->staged[i].off);
+    if (release && p->argv_off) wasm_runtime_module_free(ctx->inst, p->argv_off);
+    if (p->staged)
+        ctx->alloc.free(p->staged, p->nconsts * sizeof *p->staged, ctx->alloc.ctx);
+    p->staged = NULL;
+    p->nstaged = 0;
+    p->argv_off = 0;
+}
+
+static bool exif__prepared_stage(exif_prepared_t *p)
+{
+    exif_t *ctx = p->ctx;
+    exif__prepared_unstage(p, p->generation == ctx->generation);
+    p->generation = ctx->generation;
+    p->staged = ctx->alloc.alloc(p->nconsts * sizeof *p->staged, ctx->alloc.ctx);
+    if (!p->staged) return false;
+    for (size_t i = 0; i < p->nconsts; i++) {
+        uint64_t off = exif__wasm_alloc_string(ctx, p->consts[i]);
+        if (!off) return false;
+        p->staged[p->nstaged++] = (exif__staged_t){ p->consts[i], off };
+    }
+    void *native = NULL;
+    p->argv_off = wasm_runtime_module_malloc(ctx->inst, p->argv_cap * sizeof(int32_t),
+                                             &native);
+    return p->argv_off != 0;
+}
+
+// Staged copy of s, or 0. Tails hold the very pointers that were staged, so
+// the pointer compare nearly always decides; literals fall back to strcmp.
+static uint64_t exif__prepared_find(const exif_prepared_t *p, const char *s)
+{
+    if (!p || !s) return 0;
+    for (size_t i = 0; i < p->nstaged; i++)
+        if (p->staged[i].str == s) return p->staged[i].off;
+    for (size_t i = 0; i < p->nstaged; i++)
+        if (strcmp(p->staged[i].str, s) == 0) return p->staged[i].off;
+    return 0;
+}
+
+// The prepared options usable for a run on ctx right now, restaging them
+// into a rebuilt instance first. NULL when opts has none for ctx.
+static exif_prepared_t *exif__prepared_for(exif_t *ctx, const exif_options_t *opts)
+{
+    exif_prepared_t *p = opts ? opts->prepared : NULL;
+    if (!p || p->ctx != ctx) return NULL;
+    if (p->generation == ctx->generation && p->argv_off) return p;
+    return exif__prepared_stage(p) ? p : NULL;
+}
+
+// Offset of s for an argv: the staged copy when there is one, else a fresh
+// allocation that *owned marks for freeing after the run.
+static uint64_t exif__arg_string(exif_t *ctx, const exif_prepared_t *p,
+                                 const char *s, bool *owned)
+{
+    uint64_t off = exif__prepared_find(p, s);
+    *owned = !off;
+    return off ? off : exif__wasm_alloc_string(ctx, s);
+}
+
+// With partial set, a non-zero exit still returns stdout as a successful
+// result and hands back stderr in result.error, for callers that split
+// per-file outcomes out of one run themselves. script replaces exiftool
+// for this run when non-NULL.
+static exif_result_t exif__run_once(exif_t *ctx, const char **tail, int ntail,
+                                    const exif_options_t *opts, bool partial,
+                                    const char *script)
+{
+    exif_allocator_t *alloc = &ctx->alloc;
+    exif_result_t result = {0};
+    uint64_t argv_off = 0, script_off = 0;
+    bool argv_owned = true, script_owned = true;
+    exif_prepared_t *prep = NULL;
+    int nargs = 0;
+
+    int nopt_args    = opts ? opts->argc : 0;
+    int nconfig_args = (opts && opts->config_path) ? 2 : 0;
+    int ntag_args    = opts ? opts->ntags : 0;
+    int total        = nopt_args + nconfig_args + ntag_args + ntail;
+
+    uint64_t wasm_ptrs[total];
+    bool owned[total];
+    memset(wasm_ptrs, 0, sizeof wasm_ptrs);
+
+    bool thread_env_owned;
+    if (!exif__thread_env_enter(&thread_env_owned))
+        return exif__err_result(alloc, "failed to init WAMR thread env", -1);
+
+    // The stay-open interpreter can also trap between calls. Replace its
+    // instance now rather than fail this call on a dead loop.
+    if (ctx->resident.running) {
+        pthread_mutex_lock(&ctx->capture.lock);
+        bool exited = ctx->resident.exited;
+        pthread_mutex_unlock(&ctx->capture.lock);
+        if (exited) {
+            exif__resident_stop(ctx);
+            if (ctx->poisoned) ctx->counters.traps++;
+        }
+    }
+
+    // An earlier trap left ctx without a working instance
+    if ((!ctx->inst || ctx->poisoned) && !exif__recover(ctx)) {
+        exif__instance_free(ctx);
+        result = exif__err_result(alloc, "failed to recreate WASM instance", -1);
+        goto cleanup;
+    }
+
+    // -config is only honoured as the first argument of a fresh command line,
+    // and the resident loop only runs exiftool. The loop is driven through
+    // the capture buffers, so it needs the fd_write override.
+    if (ctx->stay_open && exif__wasi_hooked) {
+        bool handled = false;
+        if (!(opts && opts->config_path) && !script) {
+            uint64_t t = exif__timer(ctx);
+            result = exif__run_resident(ctx, tail, ntail, opts, partial,
+                                        &handled);
+            exif__phase_end(ctx, EXIF__PHASE_RUN, t);
+        }
+        if (handled) goto cleanup;
+        exif__resident_stop(ctx);
+    }
+
+    int32_t rc = -1;
+    uint64_t t = exif__timer(ctx);
+    if (!exif__call_wasm(ctx, ctx->fn_reset, &rc)) ctx->poisoned = true;
+    exif__phase_end(ctx, EXIF__PHASE_RESET, t);
+    if (rc != 0) {
+        result = exif__err_result(alloc, "zeroperl_reset failed", rc);
+        goto cleanup;
+    }
+
+    // Prepared options already hold their constant strings in the heap;
+    // only what they don't cover, such as paths, is copied in below.
+    t = exif__timer(ctx);
+    prep = exif__prepared_for(ctx, opts);
+
+    for (int i = 0; i < nopt_args; i++) {
+        wasm_ptrs[nargs] = exif__arg_string(ctx, prep, opts->args[i], &owned[nargs]);
+        if (!wasm_ptrs[nargs]) goto oom;
+        nargs++;
+    }
+
+    if (nconfig_args) {
+        wasm_ptrs[nargs] = exif__arg_string(ctx, prep, "-config", &owned[nargs]);
+        if (!wasm_ptrs[nargs]) goto oom;
+        nargs++;
+        wasm_ptrs[nargs] = exif__arg_string(ctx, prep, opts->config_path, &owned[nargs]);
+        if (!wasm_ptrs[nargs]) goto oom;
+        nargs++;
+    }
+
+    for (int i = 0; i < ntag_args; i++) {
+        wasm_ptrs[nargs] = exif__arg_string(ctx, prep, opts->tags[i], &owned[nargs]);
+        if (!wasm_ptrs[nargs]) goto oom;
+        nargs++;
+    }
+
+    for (int i = 0; i < ntail; i++) {
+        wasm_ptrs[nargs] = exif__arg_string(ctx, prep, tail[i], &owned[nargs]);
+        if (!wasm_ptrs[nargs]) goto oom;
+        nargs++;
+    }
+
+    void *argv_native = NULL;
+    if (prep && nargs <= prep->argv_cap) {
+        argv_off = prep->argv_off;
+        argv_owned = false;
+        argv_native = wasm_runtime_addr_app_to_native(ctx->inst, argv_off);
+    } else {
+        argv_off = wasm_runtime_module_malloc(ctx->inst,
+                                              nargs * sizeof(int32_t),
+                                              &argv_native);
+        if (!argv_off) goto oom;
+    }
+    for (int i = 0; i < nargs; i++)
+        ((int32_t *)argv_native)[i] = (int32_t)wasm_ptrs[i];
+
+    script_off = exif__arg_string(ctx, prep, script ? script : ctx->script_path,
+                                  &script_owned);
+    if (!script_off) goto oom;
+    exif__phase_end(ctx, EXIF__PHASE_MARSHAL, t);
+
+    exif__capture_reset(ctx);
+
+    wasm_val_t call_args[3] = {
+        { .kind = WASM_I32, .of.i32 = (int32_t)script_off },
+        { .kind = WASM_I32, .of.i32 = nargs },
+        { .kind = WASM_I32, .of.i32 = (int32_t)argv_off },
+    };
+    wasm_val_t call_ret = { .kind = WASM_I32 };
+    int32_t exit_code = -1;
+    const char *wasm_error = NULL;
+
+    t = exif__timer(ctx);
+    bool called = wasm_runtime_call_wasm_a(ctx->env, ctx->fn_run_file,
+                                           1, &call_ret, 3, call_args);
+    exif__phase_end(ctx, EXIF__PHASE_RUN, t);
+    if (called) {
+        exit_code = call_ret.of.i32;
+    } else {
+        const char *exc = wasm_runtime_get_exception(ctx->inst);
+        if (exc && strstr(exc, "wasi proc exit")) {
+            exit_code = (int32_t)wasm_runtime_get_wasi_exit_code(ctx->inst);
+        } else {
+            snprintf(ctx->errbuf, sizeof ctx->errbuf, "%s",
+                     exc ? exc : "unknown");
+            wasm_error = ctx->errbuf;
+            ctx->poisoned = true;
+        }
+        wasm_runtime_clear_exception(ctx->inst);
+    }
+
+    t = exif__timer(ctx);
+    if (!ctx->poisoned) exif__call_wasm(ctx, ctx->fn_flush, NULL);
+    exif__phase_end(ctx, EXIF__PHASE_FLUSH, t);
+
+    t = exif__timer(ctx);
+    if (!wasm_error) {
+        int32_t error_ptr = 0;
+        exif__call_wasm(ctx, ctx->fn_last_error, &error_ptr);
+        const char *perl_error = exif__wasm_read_cstring(ctx, error_ptr);
+        if (perl_error && *perl_error)
+            wasm_error = perl_error;
+    }
+
+    if (wasm_error) {
+        result = exif__err_result(alloc, wasm_error, exit_code);
+    } else if (ctx->capture.overflow) {
+        result = exif__err_result(alloc, "out of memory capturing exiftool output", -1);
+    } else if (partial) {
+        size_t out_len, err_len;
+        char *data = exif__capture_take(ctx, 1, &out_len);
+        result = exif__ok_result(data, out_len, exit_code);
+        result.error = exif__capture_take(ctx, 2, &err_len);
+    } else if (exit_code != 0) {
+        size_t err_len;
+        char *err_data = exif__capture_take(ctx, 2, &err_len);
+        snprintf(ctx->errbuf, sizeof ctx->errbuf, "%.*s",
+                 (int)(err_len < sizeof ctx->errbuf - 1
+                       ? err_len : sizeof ctx->errbuf - 1),
+                 err_data ? err_data : "exiftool exited with error");
+        if (err_data) alloc->free(err_data, 0, alloc->ctx);
+        result = exif__err_result(alloc, ctx->errbuf, exit_code);
+    } else {
+        size_t out_len;
+        char *data = exif__capture_take(ctx, 1, &out_len);
+        result = exif__ok_result(data, out_len, exit_code);
+    }
+    exif__phase_end(ctx, EXIF__PHASE_READBACK, t);
+    goto cleanup;
+
+ oom:
+    result = exif__err_result(alloc, "WASM memory allocation failed", -1);
+
+cleanup:
+    exif__sample_heap(ctx);
+    if (ctx->poisoned) {
+        // The instance is discarded along with everything allocated in it.
+        // If recovery fails, the next call retries it.
+        ctx->counters.traps++;
+        if (!exif__recover(ctx)) exif__instance_free(ctx);
+    } else {
+        for (int i = 0; i < nargs; i++)
+            if (wasm_ptrs[i] && owned[i])
+                wasm_runtime_module_free(ctx->inst, wasm_ptrs[i]);
+        if (argv_off && argv_owned)     wasm_runtime_module_free(ctx->inst, argv_off);
+        if (script_off && script_owned) wasm_runtime_module_free(ctx->inst, script_off);
+    }
+    exif__thread_env_leave(thread_env_owned);
+    return result;
+}
+
+// --- memory governor ---
+
+// Linear memory never shrinks while an instance lives. A context with a
+// recycle size replaces an instance that grew past it, which returns every
+// page at once; the guest allocator keeps its free lists inside the memory,
+// so no part of a live instance can be dropped with madvise. With a snapshot
+// the replacement is a copy-on-write mapping, not a zeroperl_init.
+
+static uint64_t exif__memory_size(exif_t *ctx)
+{
+    wasm_memory_inst_t mem = ctx->inst ? wasm_runtime_get_default_memory(ctx->inst) : NULL;
+    if (!mem) return 0;
+    return wasm_memory_get_cur_page_count(mem) * wasm_memory_get_bytes_per_page(mem);
+}
+
+// Perl reports a failed allocation as "Out of memory!"; argument staging
+// fails in exif__run_once.
+static bool exif__out_of_memory(const exif_result_t *r)
+{
+    return r->error && (strstr(r->error, "Out of memory")
+                        || strstr(r->error, "WASM memory allocation failed"));
+}
+
+static bool exif__replace_instance(exif_t *ctx)
+{
+    bool thread_env_owned;
+    if (!exif__thread_env_enter(&thread_env_owned)) return false;
+    exif__resident_stop(ctx);
+    exif__instance_free(ctx);
+    ctx->poisoned = false;
+    bool ok = exif__instance_init(ctx);
+    // The next run retries a failed init
+    if (!ok) exif__instance_free(ctx);
+    exif__thread_env_leave(thread_env_owned);
+    return ok;
+}
+
+static exif_result_t exif__run_ex(exif_t *ctx, const char **tail, int ntail,
+                                  const exif_options_t *opts, bool partial,
+                                  const char *script)
+{
+    exif_result_t result = exif__run_once(ctx, tail, ntail, opts, partial, script);
+    if (!ctx->memory_limit_max && !ctx->recycle_size) return result;
+
+    // Repeat a run that hit the limit on larger instances, then go back
+    uint64_t limit = ctx->memory_limit;
+    bool raised = false;
+    // Output already streamed to a sink can't be taken back for a retry
+    while (exif__out_of_memory(&result) && limit && limit < ctx->memory_limit_max
+           && !ctx->sink.bytes) {
+        limit = limit * 2 < ctx->memory_limit_max ? limit * 2 : ctx->memory_limit_max;
+        ctx->memory_limit = limit;
+        raised = true;
+        if (!exif__replace_instance(ctx)) break;
+        ctx->counters.memory_retries++;
+        exif_result_free(ctx, &result);
+        result = exif__run_once(ctx, tail, ntail, opts, partial, script);
+    }
+    if (raised) ctx->memory_limit = ctx->memory_limit_base;
+
+    if (raised || (ctx->recycle_size && exif__memory_size(ctx) > ctx->recycle_size)) {
+        exif__replace_instance(ctx);
+        ctx->counters.recycles++;
+    }
+
+    if (!result.success && exif__out_of_memory(&result) && limit) {
+        snprintf(ctx->errbuf, sizeof ctx->errbuf, "%s (WASM memory limit %llu MiB)",
+                 result.error, (unsigned long long)(limit >> 20));
+        exif_result_t err = exif__err_result(&ctx->alloc, ctx->errbuf, result.exit_code);
+        exif_result_free(ctx, &result);
+        result = err;
+    }
+    return result;
+}
+
+static exif_result_t exif__run(exif_t *ctx, const char **tail, int ntail,
+                               const exif_options_t *opts)
+{
+    return exif__run_ex(ctx, tail, ntail, opts, false, NULL);
+}
+
+// Process-wide WAMR runtime and loaded AOT module, shared by every context.
+// Each context only instantiates the module and owns its exec env.
+// Linear memory as zeroperl_init leaves it, for the stack/heap sizes it was
+// taken with. After a top-level call returns the stack pointer global is
+// back at its initial value, so memory is the only state to carry over.
+// Globals and tables are not captured: WAMR only reaches exported globals,
+// and the stack pointer isn't one. A restore therefore always goes into a
+// newly instantiated module, including after a trap. It saves
+// zeroperl_init, not instantiation.
+typedef struct exif__snapshot {
+    bool      ready;
+    uint32_t  wasm_stack;
+    uint32_t  wasm_heap;
+    uint64_t  pages;
+    size_t    size;
+    int       fd;     // memfd holding the image, mapped copy-on-write
+    void     *image;  // heap copy when there is no memfd
+} exif__snapshot_t;
+
+static struct {
+    pthread_mutex_t  lock;
+    int              refs;
+    wasm_module_t    module;
+    uint8_t         *wasm_buf;
+    exif__snapshot_t snapshot;
+} exif__runtime = { .lock = PTHREAD_MUTEX_INITIALIZER, .snapshot = { .fd = -1 } };
+
+static wasm_module_t exif__runtime_acquire(void)
+{
+    pthread_mutex_lock(&exif__runtime.lock);
+    if (exif__runtime.refs == 0) {
+        char wamr_errbuf[256];
+        if (!wasm_runtime_init()) goto fail;
+
+        if (!wasm_runtime_register_natives("env", exif__native_syms,
+                                           sizeof exif__native_syms / sizeof exif__native_syms[0]))
+            goto fail_runtime;
+
+        exif__wasi_hook();
+
+        // WAMR mutates the buffer during load and keeps it until unload.
+        // It outlives any one context, so it isn't charged to their allocators.
+        exif__runtime.wasm_buf = malloc(sizeof zeroperl_aot);
+        if (!exif__runtime.wasm_buf) goto fail_runtime;
+        memcpy(exif__runtime.wasm_buf, zeroperl_aot, sizeof zeroperl_aot);
+
+        exif__runtime.module = wasm_runtime_load(exif__runtime.wasm_buf,
+                                                 sizeof zeroperl_aot,
+                                                 wamr_errbuf, sizeof wamr_errbuf);
+        if (!exif__runtime.module) goto fail_buf;
+    }
+    exif__runtime.refs++;
+    pthread_mutex_unlock(&exif__runtime.lock);
+    return exif__runtime.module;
+
+fail_buf:
+    free(exif__runtime.wasm_buf);
+    exif__runtime.wasm_buf = NULL;
+fail_runtime:
+    wasm_runtime_destroy();
+fail:
+    pthread_mutex_unlock(&exif__runtime.lock);
+    return NULL;
+}
+
+static void exif__runtime_release(void)
+{
+    pthread_mutex_lock(&exif__runtime.lock);
+    if (--exif__runtime.refs == 0) {
+        exif__snapshot_t *s = &exif__runtime.snapshot;
+        if (s->fd >= 0) close(s->fd);
+        free(s->image);
+        *s = (exif__snapshot_t){ .fd = -1 };
+        wasm_runtime_unload(exif__runtime.module);
+        free(exif__runtime.wasm_buf);
+        exif__runtime.module = NULL;
+        exif__runtime.wasm_buf = NULL;
+        wasm_runtime_destroy();
+    }
+    pthread_mutex_unlock(&exif__runtime.lock);
+}
+
+// WASI args live on the shared module until the next instantiation, so
+// setting them and instantiating happen under the runtime lock.
+static wasm_module_inst_t exif__instantiate(exif_t *ctx, uint32_t wasm_stack,
+                                            uint32_t wasm_heap)
+{
+    char wamr_errbuf[256];
+    const char *dirs[] = { "/", "/tmp", "/dev" };
+    char *wasi_argv[] = { "zeroperl" };
+
+    pthread_mutex_lock(&exif__runtime.lock);
+    wasm_runtime_set_wasi_args_ex(ctx->module, dirs, 3, NULL, 0, NULL, 0,
+                                  wasi_argv, 1, ctx->stdin_fd, ctx->stdout_fd,
+                                  ctx->stderr_fd);
+    InstantiationArgs args = {
+        .default_stack_size     = wasm_stack,
+        .host_managed_heap_size = wasm_heap,
+        .max_memory_pages       = ctx->memory_limit
+            ? (uint32_t)(ctx->memory_limit < (1ull << 32)
+                         ? (ctx->memory_limit + 65535) / 65536 : 65536)
+            : 0,
+    };
+    wasm_module_inst_t inst = wasm_runtime_instantiate_ex(ctx->module, &args, wamr_errbuf,
+                                                          sizeof wamr_errbuf);
+    pthread_mutex_unlock(&exif__runtime.lock);
+    // Lets the fd_write override find the capture buffers
+    if (inst) wasm_runtime_set_custom_data(inst, ctx);
+    return inst;
+}
+
+// WAMR reserves linear memory with mmap on 64-bit Linux (hardware bounds
+// checks), so a snapshot can be mapped over it copy-on-write. Elsewhere it
+// is copied in.
+#if defined(__linux__) && UINTPTR_MAX > 0xFFFFFFFFu
+#define EXIF__SNAPSHOT_COW 1
+#else
+#define EXIF__SNAPSHOT_COW 0
+#endif
+
+// Only modules that export malloc/free keep every allocation inside linear
+// memory; WAMR's own app heap has host-side state a snapshot would miss.
+static bool exif__snapshot_usable(exif_t *ctx)
+{
+    return ctx->snapshot
+        && wasm_runtime_lookup_function(ctx->inst, "malloc")
+        && wasm_runtime_lookup_function(ctx->inst, "free");
+}
+
+static void exif__snapshot_capture(exif_t *ctx)
+{
+    exif__snapshot_t *s = &exif__runtime.snapshot;
+    wasm_memory_inst_t mem = wasm_runtime_get_default_memory(ctx->inst);
+    if (!mem) return;
+
+    exif__snapshot_t snap = {
+        .wasm_stack = ctx->wasm_stack,
+        .wasm_heap  = ctx->wasm_heap,
+        .pages      = wasm_memory_get_cur_page_count(mem),
+        .fd         = -1,
+    };
+    snap.size = (size_t)(snap.pages * wasm_memory_get_bytes_per_page(mem));
+    const char *base = wasm_memory_get_base_address(mem);
+
+    pthread_mutex_lock(&exif__runtime.lock);
+    if (s->ready) goto done;
+#if EXIF__SNAPSHOT_COW
+    snap.fd = memfd_create("libexif_snapshot", MFD_CLOEXEC);
+    for (size_t off = 0; snap.fd >= 0 && off < snap.size; ) {
+        ssize_t w = write(snap.fd, base + off, snap.size - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) { close(snap.fd); snap.fd = -1; break; }
+        off += (size_t)w;
+    }
+#endif
+    if (snap.fd < 0) {
+        snap.image = malloc(snap.size);
+        if (!snap.image) goto done;
+        memcpy(snap.image, base, snap.size);
+    }
+    snap.ready = true;
+    *s = snap;
+done:
+    pthread_mutex_unlock(&exif__runtime.lock);
+}
+
+// Load the snapshot into ctx's fresh instance. False when none matches, or
+// when the copy failed; *touched then says whether memory was written to.
+static bool exif__snapshot_restore(exif_t *ctx, bool *touched)
+{
+    exif__snapshot_t *s = &exif__runtime.snapshot;
+    bool restored = false;
+    *touched = false;
+
+    pthread_mutex_lock(&exif__runtime.lock);
+    if (!s->ready || s->wasm_stack != ctx->wasm_stack || s->wasm_heap != ctx->wasm_heap)
+        goto done;
+
+    wasm_memory_inst_t mem = wasm_runtime_get_default_memory(ctx->inst);
+    uint64_t pages = mem ? wasm_memory_get_cur_page_count(mem) : 0;
+    if (!mem || pages > s->pages) goto done;
+    if (pages < s->pages && !wasm_runtime_enlarge_memory(ctx->inst, s->pages - pages))
+        goto done;
+    char *base = wasm_memory_get_base_address(mem);
+    *touched = true;
+
+#if EXIF__SNAPSHOT_COW
+    if (s->fd >= 0) {
+        long page = sysconf(_SC_PAGESIZE);
+        if (page > 0 && (uintptr_t)base % (uintptr_t)page == 0
+            && mmap(base, s->size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED, s->fd, 0) != MAP_FAILED) {
+            restored = true;
+            goto done;
+        }
+        // Not page aligned: copy the image in instead
+        for (size_t off = 0; off < s->size; ) {
+            ssize_t r = pread(s->fd, base + off, s->size - off, (off_t)off);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) goto done;
+            off += (size_t)r;
+        }
+        restored = true;
+        goto done;
+    }
+#endif
+    memcpy(base, s->image, s->size);
+    restored = true;
+
+done:
+    pthread_mutex_unlock(&exif__runtime.lock);
+    return restored;
+}
+
+static void exif__instance_free(exif_t *ctx)
+{
+    if (ctx->env)  wasm_runtime_destroy_exec_env(ctx->env);
+    if (ctx->inst) wasm_runtime_deinstantiate(ctx->inst);
+    ctx->env = NULL;
+    ctx->inst = NULL;
+}
+
+static bool exif__instance_create(exif_t *ctx)
+{
+    ctx->generation++;
+    ctx->inst = exif__instantiate(ctx, ctx->wasm_stack, ctx->wasm_heap);
+    if (!ctx->inst) return false;
+
+    ctx->env = wasm_runtime_create_exec_env(ctx->inst, ctx->exec_stack);
+    if (!ctx->env) return false;
+
+    ctx->fn_reset       = wasm_runtime_lookup_function(ctx->inst, "zeroperl_reset");
+    ctx->fn_run_file    = wasm_runtime_lookup_function(ctx->inst, "zeroperl_run_file");
+    ctx->fn_flush       = wasm_runtime_lookup_function(ctx->inst, "zeroperl_flush");
+    ctx->fn_last_error  = wasm_runtime_lookup_function(ctx->inst, "zeroperl_last_error");
+    ctx->fn_free_interp = wasm_runtime_lookup_function(ctx->inst, "zeroperl_free_interpreter");
+
+    return ctx->fn_reset && ctx->fn_run_file && ctx->fn_flush
+        && wasm_runtime_lookup_function(ctx->inst, "zeroperl_init");
+}
+
+// Instantiate the shared module for ctx and bring the interpreter up: from
+// the snapshot when one matches, otherwise by running zeroperl_init.
+static bool exif__instance_init(exif_t *ctx)
+{
+    if (!exif__instance_create(ctx)) return false;
+
+    bool snapshot = exif__snapshot_usable(ctx), touched;
+    if (snapshot && exif__snapshot_restore(ctx, &touched)) return true;
+    // A copy that failed part way leaves memory neither fresh nor restored
+    if (snapshot && touched) {
+        exif__instance_free(ctx);
+        if (!exif__instance_create(ctx)) return false;
+    }
+
+    wasm_function_inst_t fn_init = wasm_runtime_lookup_function(ctx->inst, "zeroperl_init");
+    int32_t rc;
+    if (!exif__call_wasm(ctx, fn_init, &rc) || rc != 0) return false;
+    if (snapshot) exif__snapshot_capture(ctx);
+    return true;
+}
+
+// A trap can leave linear memory in any state, so swap in a fresh instance.
+// With a snapshot this costs about as much as creating a context.
+static bool exif__recover(exif_t *ctx)
+{
+    ctx->counters.resets++;
+    exif__resident_stop(ctx);
+    exif__instance_free(ctx);
+    ctx->poisoned = false;
+    return exif__instance_init(ctx);
+}
+
+// --- warm-up ---
+
+// exiftool compiles its per-format modules on first use. A stay-open
+// context given warm-up names loads them from a generated config file, once
+// for the life of its interpreter. zeroperl_reset starts every one-shot run
+// on a clean interpreter, which would drop them again, so other contexts
+// ignore the names rather than pay for a run that leaves nothing behind.
+
+static const struct {
+    const char *format;
+    const char *modules;  // under Image::ExifTool::, space separated
+} exif__warmup_formats[] = {
+    { "JPEG", "JPEG Exif XMP Photoshop IPTC ICC_Profile" },
+    { "TIFF", "Exif XMP Photoshop IPTC ICC_Profile" },
+    { "DNG",  "Exif XMP DNG ICC_Profile" },
+    { "PNG",  "PNG Exif XMP ICC_Profile" },
+    { "HEIC", "QuickTime Exif XMP ICC_Profile" },
+    { "AVIF", "QuickTime Exif XMP ICC_Profile" },
+    { "MOV",  "QuickTime XMP" },
+    { "MP4",  "QuickTime XMP" },
+    { "CR2",  "Exif Canon XMP" },
+    { "CR3",  "QuickTime Canon Exif XMP" },
+    { "NEF",  "Exif Nikon XMP" },
+    { "ARW",  "Exif Sony XMP" },
+    { "ORF",  "Exif Olympus XMP" },
+    { "RAF",  "FujiFilm Exif XMP" },
+    { "RW2",  "PanasonicRaw Panasonic Exif XMP" },
+    { "EXR",  "OpenEXR" },
+    { "GIF",  "GIF XMP" },
+    { "WEBP", "RIFF Exif XMP" },
+    { "PDF",  "PDF XMP" },
+};
+
+static bool exif__warmup_require(exif_allocator_t *alloc, exif__buf_t *out,
+                                 const char *module, size_t len)
+{
+    if (!len) return true;
+    bool prefixed = true;
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)module[i]) && module[i] != '_' && module[i] != ':')
+            return true;  // not a module name; skipped
+        if (module[i] == ':') prefixed = false;
+    }
+    char line[256];
+    int n = snprintf(line, sizeof line, "eval { require %s%.*s };\n",
+                     prefixed ? "Image::ExifTool::" : "", (int)len, module);
+    return n > 0 && (size_t)n < sizeof line && exif__buf_append(alloc, out, line, (size_t)n);
+}
+
+// Config file text requiring the modules behind names, which are formats
+// from the table above or module names, with or without Image::ExifTool::.
+static bool exif__warmup_script(exif_allocator_t *alloc, const char *const *names,
+                                int n, exif__buf_t *out)
+{
+    *out = (exif__buf_t){0};
+    bool ok = exif__buf_append(alloc, out, "require Image::ExifTool;\n", 25);
+    for (int i = 0; ok && i < n; i++) {
+        if (!names[i]) continue;
+        const char *modules = NULL;
+        for (size_t f = 0; f < sizeof exif__warmup_formats / sizeof *exif__warmup_formats; f++)
+            if (strcasecmp(names[i], exif__warmup_formats[f].format) == 0)
+                modules = exif__warmup_formats[f].modules;
+        if (!modules) {
+            ok = exif__warmup_require(alloc, out, names[i], strlen(names[i]));
+            continue;
+        }
+        for (const char *m = modules; ok && *m; ) {
+            size_t len = strcspn(m, " ");
+            ok = exif__warmup_require(alloc, out, m, len);
+            m += len + (m[len] == ' ');
+        }
+    }
+    ok = ok && exif__buf_append(alloc, out, "1;\n", 3);
+    if (!ok) exif__buf_free(alloc, out);
+    return ok;
+}
+
+// Bring the modules in before the first request. The stay-open loop loads
+// them as it starts; -ver waits for that.
+static void exif__warmup_run(exif_t *ctx)
+{
+    const char *tail[] = { "-ver" };
+    exif_result_t r = exif__run(ctx, tail, 1, NULL);
+    exif_result_free(ctx, &r);
+}
+
+exif_t *exif_create(const exif_config_t *cfg)
+{
+    exif_allocator_t alloc = exif__default_allocator;
+    if (cfg && cfg->allocator) alloc = *cfg->allocator;
+    // Retries double memory_limit, so there has to be one below the maximum
+    if (cfg && cfg->memory_limit_max
+        && (!cfg->memory_limit || cfg->memory_limit >= cfg->memory_limit_max))
+        return NULL;
+
+    uint32_t wasm_stack = DEFAULT_STACK;
+    uint32_t wasm_heap  = DEFAULT_HEAP;
+    uint32_t exec_stack = DEFAULT_STACK;
+    if (cfg) {
+        if (cfg->wasm_stack_size) wasm_stack = cfg->wasm_stack_size;
+        if (cfg->wasm_heap_size)  wasm_heap  = cfg->wasm_heap_size;
+        if (cfg->exec_stack_size) exec_stack = cfg->exec_stack_size;
+    }
+
+    exif_t *ctx = alloc.alloc(sizeof *ctx, alloc.ctx);
+    if (!ctx) return NULL;
+    memset(ctx, 0, sizeof *ctx);
+    ctx->alloc = alloc;
+    ctx->wasm_stack = wasm_stack;
+    ctx->wasm_heap = wasm_heap;
+    ctx->exec_stack = exec_stack;
+    ctx->stay_open = cfg && cfg->stay_open;
+    ctx->snapshot = cfg && cfg->snapshot;
+    ctx->cache = cfg ? cfg->cache : NULL;
+    ctx->trace = cfg ? cfg->trace : NULL;
+    ctx->trace_ctx = cfg ? cfg->trace_ctx : NULL;
+    ctx->timed = cfg && (cfg->stats || cfg->trace);
+    if (cfg) {
+        ctx->memory_limit = ctx->memory_limit_base = cfg->memory_limit;
+        ctx->memory_limit_max = cfg->memory_limit_max;
+        ctx->recycle_size = cfg->recycle_size;
+    }
+    ctx->stdin_fd = -1;
+    pthread_mutex_init(&ctx->capture.lock, NULL);
+    pthread_cond_init(&ctx->capture.cond, NULL);
+    ctx->resident = (exif__resident_t){
+        .in_fd = -1, .exit_fd = { -1, -1 }
+    };
+
+    ctx->module = exif__runtime_acquire();
+    if (!ctx->module) goto fail_ctx;
+
+    // Serve the script straight from the embedded array when the VFS is up
+    if (exif__wasi_hooked) {
+        static const char script[] = EXIF__VFS_ROOT "exiftool";
+        ctx->script_path = alloc.alloc(sizeof script, alloc.ctx);
+        if (!ctx->script_path) goto fail_ctx;
+        memcpy(ctx->script_path, script, sizeof script);
+        if (!exif__vfs_mount(ctx, script, exiftool_script, sizeof exiftool_script))
+            goto fail_ctx;
+    } else {
+        ctx->script_path = exif__write_tmpfile(&alloc, exiftool_script,
+                                         sizeof exiftool_script, NULL);
+        if (!ctx->script_path) goto fail_ctx;
+    }
+
+    if (exif__wasi_hooked) {
+        static const char script[] = EXIF__VFS_ROOT "exifbin.pl";
+        ctx->bin_script_path = alloc.alloc(sizeof script, alloc.ctx);
+        if (!ctx->bin_script_path) goto fail_ctx;
+        memcpy(ctx->bin_script_path, script, sizeof script);
+        if (!exif__vfs_mount(ctx, script, exifbin_script, sizeof exifbin_script))
+            goto fail_ctx;
+    } else {
+        ctx->bin_script_path = exif__write_tmpfile(&alloc, exifbin_script,
+                                             sizeof exifbin_script, NULL);
+        if (!ctx->bin_script_path) goto fail_ctx;
+    }
+
+    ctx->stdout_fd = exif__open_capture_fd("stdout");
+    if (ctx->stdout_fd < 0) goto fail_ctx;
+
+    ctx->stderr_fd = exif__open_capture_fd("stderr");
+    if (ctx->stderr_fd < 0) goto fail_ctx;
+
+    // The resident interpreter reads its commands from stdin
+    if (ctx->stay_open) {
+        ctx->stdin_fd = open("/dev/null", O_RDONLY);
+        if (ctx->stdin_fd < 0) goto fail_ctx;
+    }
+
+    // Only the resident loop keeps what the warm-up loads
+    if (cfg && cfg->warmup && cfg->nwarmup > 0 && ctx->stay_open && exif__wasi_hooked) {
+        static const char script[] = EXIF__VFS_ROOT "warmup.pl";
+        if (!exif__warmup_script(&alloc, cfg->warmup, cfg->nwarmup, &ctx->warmup_script))
+            goto fail_ctx;
+        ctx->warmup_path = alloc.alloc(sizeof script, alloc.ctx);
+        if (!ctx->warmup_path) goto fail_ctx;
+        memcpy(ctx->warmup_path, script, sizeof script);
+        if (!exif__vfs_mount(ctx, script, ctx->warmup_script.data, ctx->warmup_script.len))
+            goto fail_ctx;
+    }
+
+    if (!exif__instance_init(ctx)) goto fail_ctx;
+    if (ctx->warmup_path) exif__warmup_run(ctx);
+
+    return ctx;
+
+fail_ctx:
+    exif_destroy(ctx);
+    return NULL;
+}
+
+void exif_destroy(exif_t *ctx)
+{
+    if (!ctx) return;
+    exif_allocator_t alloc = ctx->alloc;
+
+    bool thread_env_owned = false;
+    if (ctx->env) exif__thread_env_enter(&thread_env_owned);
+    exif__resident_stop(ctx);
+    if (ctx->fn_free_interp && ctx->env && !ctx->poisoned)
+        exif__call_wasm(ctx, ctx->fn_free_interp, NULL);
+    exif__thread_env_leave(thread_env_owned);
+
+    exif__instance_free(ctx);
+    // Other contexts may still be running on the shared runtime
+    if (ctx->module) exif__runtime_release();
+
+    if (ctx->stdin_fd > 0)  close(ctx->stdin_fd);
+    if (ctx->stdout_fd > 0) close(ctx->stdout_fd);
+    if (ctx->stderr_fd > 0) close(ctx->stderr_fd);
+
+    if (ctx->script_path) {
+        if (!exif__wasi_hooked) unlink(ctx->script_path);
+        alloc.free(ctx->script_path, 0, alloc.ctx);
+    }
+    if (ctx->bin_script_path) {
+        if (!exif__wasi_hooked) unlink(ctx->bin_script_path);
+        alloc.free(ctx->bin_script_path, 0, alloc.ctx);
+    }
+    if (ctx->warmup_path) alloc.free(ctx->warmup_path, 0, alloc.ctx);
+
+    exif__vfs_free(ctx);
+    exif__buf_free(&alloc, &ctx->warmup_script);
+
+    exif__buf_free(&alloc, &ctx->capture.out);
+    exif__buf_free(&alloc, &ctx->capture.err);
+    pthread_cond_destroy(&ctx->capture.cond);
+    pthread_mutex_destroy(&ctx->capture.lock);
+
+    alloc.free(ctx, sizeof *ctx, alloc.ctx);
+}
+
+static const char *exif__read_defaults[] = { "-json", "-a", "-s", "-n", "-ee3", "-U", "-G3:1", "-api", "requestall=3", "-api", "largefilesupport" };
+static const char *exif__read_standard[] = { "-json", "-a", "-s", "-n", "-G3:1", "-api", "largefilesupport" };
+static const char *exif__read_fast[] = { "-json", "-s", "-n", "-G3:1", "-fast2", "-api", "largefilesupport" };
+static const char *exif__read_common[] = {
+    "-json", "-a", "-s", "-n", "-G3:1", "-fast2", "-api", "largefilesupport",
+    "-File:ImageWidth", "-File:ImageHeight", "-PNG:ImageWidth", "-PNG:ImageHeight",
+    "-IFD0:ImageWidth", "-IFD0:ImageHeight", "-IFD0:Make", "-IFD0:Model", "-IFD0:Orientation",
+    "-ExifIFD:DateTimeOriginal", "-ExifIFD:OffsetTimeOriginal", "-ExifIFD:ExposureTime",
+    "-ExifIFD:FNumber", "-ExifIFD:ISO", "-ExifIFD:FocalLength", "-ExifIFD:LensMake",
+    "-ExifIFD:LensModel", "-GPS:GPSLatitudeRef", "-GPS:GPSLatitude", "-GPS:GPSLongitudeRef",
+    "-GPS:GPSLongitude", "-GPS:GPSAltitudeRef", "-GPS:GPSAltitude",
+};
+#define EXIF__N_ARGS(a) (int)(sizeof a / sizeof a[0])
+
+// argv tail for a read of paths: the profile's arguments, or -json and the
+// caller's list for EXIF_PROFILE_CUSTOM, then the paths. Free with
+// ntail * sizeof(char *).
+static const char **exif__read_tail(exif_t *ctx, const exif_options_t *opts,
+                                    const char *const *paths, size_t npaths,
+                                    int *ntail)
+{
+    static const char *json[] = { "-json" };
+    const char **args = exif__read_defaults, **extra = NULL;
+    int nargs = EXIF__N_ARGS(exif__read_defaults), nextra = 0;
+    switch (opts ? opts->profile : EXIF_PROFILE_FULL) {
+    case EXIF_PROFILE_STANDARD:
+        args = exif__read_standard;
+        nargs = EXIF__N_ARGS(exif__read_standard);
+        break;
+    case EXIF_PROFILE_FAST:
+        args = exif__read_fast;
+        nargs = EXIF__N_ARGS(exif__read_fast);
+        break;
+    case EXIF_PROFILE_COMMON:
+        args = exif__read_common;
+        nargs = EXIF__N_ARGS(exif__read_common);
+        break;
+    case EXIF_PROFILE_CUSTOM:
+        args = json;
+        nargs = 1;
+        extra = opts->profile_args;
+        nextra = opts->profile_argc > 0 && extra ? opts->profile_argc : 0;
+        break;
+    default:
+        break;
+    }
+
+    exif_allocator_t *alloc = &ctx->alloc;
+    *ntail = nargs + nextra + (int)npaths;
+    const char **tail = alloc->alloc(*ntail * sizeof *tail, alloc->ctx);
+    if (!tail) return NULL;
+    memcpy(tail, args, nargs * sizeof *tail);
+    if (nextra) memcpy(tail + nargs, extra, nextra * sizeof *tail);
+    if (npaths) memcpy(tail + nargs + nextra, paths, npaths * sizeof *tail);
+    return tail;
+}
+
+// Whether an argument of opts, custom profile arguments included, matches.
+// EXIF_PROFILE_FULL (-ee3, requestall=3) and no options match everything.
+static bool exif__read_args_any(const exif_options_t *opts, bool (*match)(const char *))
+{
+    if (!opts || opts->profile == EXIF_PROFILE_FULL) return true;
+    for (int pass = 0; pass < 2; pass++) {
+        const char **list = pass ? opts->args : opts->profile_args;
+        int n = pass ? opts->argc : opts->profile_argc;
+        if (pass == 0 && opts->profile != EXIF_PROFILE_CUSTOM) continue;
+        for (int i = 0; list && i < n; i++)
+            if (list[i] && match(list[i])) return true;
+    }
+    return false;
+}
+
+// Embedded stream extraction (-ee*) reaches into media payload the
+// prefilter would otherwise leave out.
+static bool exif__arg_embedded(const char *arg)
+{
+    return strncmp(arg, "-ee", 3) == 0 || strncmp(arg, "--ee", 4) == 0
+        || strncasecmp(arg, "-extractembedded", 16) == 0;
+}
+
+// ImageDataHash covers the image data itself. exiftool computes it when it
+// is asked for by name, group prefix or not, or under RequestAll=3 and up.
+static bool exif__arg_hashes(const char *arg)
+{
+    if (strncasecmp(arg, "requestall=", 11) == 0) return atoi(arg + 11) > 2;
+    if (*arg != '-') return false;
+    const char *name = strrchr(arg, ':');
+    name = name ? name + 1 : arg + 1;
+    return strncasecmp(name, "imagedatahash", 13) == 0
+        && (!name[13] || name[13] == '#');
+}
+
+static bool exif__read_embedded(const exif_options_t *opts)
+{
+    return exif__read_args_any(opts, exif__arg_embedded);
+}
+
+// Option words of the exiftool command line, lowercased with any digits
+// at the end dropped. An argument naming one of these is an option, not a
+// tag, even when it looks like one.
+static const char *const exif__exiftool_options[] = {
+    "@", "a", "api", "arg", "argformat", "args", "b", "binary", "c", "charset",
+    "common_args", "composite", "config", "coordformat", "csv", "csvdelim", "d",
+    "dateformat", "decimal", "delete_original", "diff", "duplicates", "e", "ec",
+    "echo", "ee", "efile", "escapec", "escapehtml", "escapexml", "ex", "exclude",
+    "execute", "ext", "extension", "extractembedded", "f", "fast", "file",
+    "fileorder", "forceprint", "g", "geotag", "globaltimeshift", "groupheadings",
+    "groupnames", "h", "hex", "htmldump", "htmlformat", "i", "if", "ignore",
+    "ignoreminorerrors", "j", "json", "k", "l", "lang", "latin", "list", "list_dir",
+    "listd", "listf", "listg", "listgeo", "listitem", "listr", "listw", "listwf",
+    "listx", "long", "m", "n", "nop", "o", "out", "overwrite_original",
+    "overwrite_original_in_place", "p", "password", "pause", "php", "plot",
+    "preserve", "printconv", "progress", "q", "quiet", "r", "recurse", "require",
+    "restore_original", "s", "scanforxmp", "sep", "separator", "short", "sort",
+    "srcfile", "stay_open", "struct", "t", "tab", "table", "tagout", "tagoutext",
+    "tagsfromfile", "textout", "u", "unknown", "use", "userparam", "v", "ver",
+    "verbose", "veryshort", "w", "wext", "wm", "writemode", "x", "xmlformat", "z",
+    "zip",
+};
+
+static bool exif__is_exiftool_option(const char *s, size_t n)
+{
+    while (n && isdigit((unsigned char)s[n - 1])) n--;
+    for (size_t i = 0; i < sizeof exif__exiftool_options / sizeof *exif__exiftool_options; i++) {
+        const char *o = exif__exiftool_options[i];
+        if (strlen(o) == n && strncasecmp(s, o, n) == 0) return true;
+    }
+    return false;
+}
+
+// True when resources/exifbin.pl parses every argument the way exiftool
+// does: the options it implements, their values, tag names and paths.
+static bool exif__bin_args_ok(const char *const *args, int n)
+{
+    static const char *const flags[] = {
+        "-json", "-j", "-s", "-S", "-short", "-a", "-U", "-u", "-n", "-b", "-struct",
+    };
+    static const char *const valued[] = { "-config", "-d", "-c", "-lang", "-x", "-api" };
+    for (int i = 0; args && i < n; i++) {
+        const char *a = args[i];
+        if (!a) continue;
+        if (a[0] != '-' || !a[1]) continue;  // a path
+        bool known = false;
+        for (size_t k = 0; !known && k < sizeof flags / sizeof *flags; k++)
+            known = strcmp(a, flags[k]) == 0;
+        for (size_t k = 0; !known && k < sizeof valued / sizeof *valued; k++)
+            if ((known = strcmp(a, valued[k]) == 0)) i++;
+        if (known) continue;
+        // -ee[N], -fast[N], -G[families]
+        const char *d = NULL, *digits = "0123456789";
+        if (strncmp(a, "-ee", 3) == 0) d = a + 3;
+        else if (strncmp(a, "-fast", 5) == 0) d = a + 5;
+        else if (strncmp(a, "-G", 2) == 0) {
+            d = a + 2;
+            digits = "0123456789:";
+        }
+        if (d && !d[strspn(d, digits)] && (a[1] == 'G' || strlen(d) <= 1)) continue;
+
+        // -TAG, --TAG, -GROUP:TAG, with an optional # for -n; the first
+        // word must not be an exiftool option
+        const char *rest = a[1] == '-' ? a + 2 : a + 1;
+        size_t len = strlen(rest);
+        if (len && rest[len - 1] == '#') len--;
+        if (!len || strspn(rest, "-_:*?abcdefghijklmnopqrstuvwxyz"
+                                 "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789") < len)
+            return false;
+        const char *colon = memchr(rest, ':', len);
+        if (exif__is_exiftool_option(rest, colon ? (size_t)(colon - rest) : len))
+            return false;
+    }
+    return true;
+}
+
+// The binary emitter runs in place of exiftool for EXIF_FORMAT_BINARY reads
+// whose arguments it understands. The others, and those a resident exiftool
+// can serve, run as JSON and are converted to the same documents.
+static const char *exif__read_script(exif_t *ctx, const exif_options_t *opts)
+{
+    if (!opts || opts->format != EXIF_FORMAT_BINARY) return NULL;
+    if (ctx->stay_open && exif__wasi_hooked && !opts->config_path) return NULL;
+    if (!exif__bin_args_ok(opts->args, opts->argc)) return NULL;
+    if (opts->profile == EXIF_PROFILE_CUSTOM
+        && !exif__bin_args_ok(opts->profile_args, opts->profile_argc))
+        return NULL;
+    return ctx->bin_script_path;
+}
+
+static void exif__bin_from_json(exif_allocator_t *alloc, exif_result_t *r);
+
+// A binary read that ran exiftool instead of the emitter
+static void exif__read_convert(exif_t *ctx, const exif_options_t *opts,
+                               const char *script, exif_result_t *r)
+{
+    if (opts && opts->format == EXIF_FORMAT_BINARY && !script)
+        exif__bin_from_json(&ctx->alloc, r);
+}
+
+static void exif__apply_transform(exif_allocator_t *alloc, exif_result_t *result,
+                            const exif_options_t *opts)
+{
+    if (!result->success || !opts || !opts->transform || opts->sink
+        || opts->format == EXIF_FORMAT_BINARY)
+        return;
+    char *transformed = opts->transform(result->data, result->data_len,
+                                        opts->transform_ctx);
+    alloc->free(result->data, 0, alloc->ctx);
+    result->data = transformed;
+    result->data_len = transformed ? strlen(transformed) : 0;
+}
+
+// --- result cache ---
+
+// Reads are keyed by what decides their output: the file identity from
+// stat (or a hash of a buffer's bytes), the reported name and every option
+// that reaches the command line. Entries hold the untransformed result.
+// An entry is inserted pending before its read starts; identical requests
+// on other contexts wait on it instead of running exiftool again.
+
+#define EXIF__CACHE_DEFAULT_BYTES (64u << 20)
+
+typedef struct exif__centry exif__centry_t;
+struct exif__centry {
+    exif__centry_t *chain;        // next in the hash bucket
+    exif__centry_t *prev, *next;  // LRU list, most recent first; ready only
+    uint64_t        hash;
+    char           *key;
+    size_t          key_len;
+    exif_result_t   result;       // owned by the cache allocator
+    size_t          bytes;
+    int             refs;         // callers waiting on or copying the entry
+    bool            ready;
+    bool            linked;       // reachable from the table
+};
+
+struct exif_cache {
+    exif_allocator_t  alloc;
+    pthread_mutex_t   lock;
+    pthread_cond_t    ready_cv;
+    exif__centry_t  **buckets;
+    size_t            nbuckets;   // power of two
+    size_t            count;
+    exif__centry_t   *head, *tail;
+    size_t            bytes;
+    size_t            max_bytes;
+};
+
+#define EXIF__P1 0x9E3779B185EBCA87ull
+#define EXIF__P2 0xC2B2AE3D27D4EB4Full
+#define EXIF__P3 0x165667B19E3779F9ull
+#define EXIF__P4 0x85EBCA77C2B2AE63ull
+
+static uint64_t exif__rotl64(uint64_t x, int r)
+{
+    return x << r | x >> (64 - r);
+}
+
+static uint64_t exif__mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    return h ^ h >> 33;
+}
+
+// Non-cryptographic 128-bit hash. Four lanes take alternate words of each
+// 32-byte stripe, so their multiplies overlap.
+static void exif__hash128(const void *data, size_t len, uint64_t out[2])
+{
+    const uint8_t *p = data;
+    uint64_t lane[4] = { EXIF__P1 + EXIF__P2, EXIF__P2, EXIF__P3, EXIF__P4 };
+    for (size_t i = 0; i < len / 32; i++, p += 32) {
+        for (int j = 0; j < 4; j++) {
+            uint64_t k;
+            memcpy(&k, p + 8 * j, sizeof k);
+            lane[j] = exif__rotl64(lane[j] + k * EXIF__P2, 31) * EXIF__P1;
+        }
+    }
+    uint64_t rest[4] = {0};
+    memcpy(rest, p, len % 32);
+    for (int j = 0; j < 4; j++)
+        lane[j] = exif__rotl64(lane[j] + rest[j] * EXIF__P2, 31) * EXIF__P1;
+
+    out[0] = exif__mix64(lane[0] ^ exif__rotl64(lane[1], 17) ^ exif__rotl64(lane[2], 29)
+                         ^ exif__rotl64(lane[3], 43) ^ len);
+    out[1] = exif__mix64(lane[3] ^ exif__rotl64(lane[2], 13) ^ exif__rotl64(lane[1], 23)
+                         ^ exif__rotl64(lane[0], 37) ^ out[0]);
+}
+
+exif_cache_t *exif_cache_create(const exif_allocator_t *alloc, size_t max_bytes)
+{
+    exif_allocator_t a = alloc ? *alloc : exif__default_allocator;
+    exif_cache_t *c = a.alloc(sizeof *c, a.ctx);
+    if (!c) return NULL;
+    *c = (exif_cache_t){
+        .alloc = a, .nbuckets = 64,
+        .max_bytes = max_bytes ? max_bytes : EXIF__CACHE_DEFAULT_BYTES,
+    };
+    c->buckets = a.alloc(c->nbuckets * sizeof *c->buckets, a.ctx);
+    if (!c->buckets) {
+        a.free(c, sizeof *c, a.ctx);
+        return NULL;
+    }
+    memset(c->buckets, 0, c->nbuckets * sizeof *c->buckets);
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->ready_cv, NULL);
+    return c;
+}
+
+static void exif__cache_free_entry(exif_cache_t *c, exif__centry_t *e)
+{
+    exif_allocator_t *a = &c->alloc;
+    if (e->result.data)  a->free(e->result.data, e->result.data_len + 1, a->ctx);
+    if (e->result.error) a->free(e->result.error, strlen(e->result.error) + 1, a->ctx);
+    a->free(e->key, e->key_len, a->ctx);
+    a->free(e, sizeof *e, a->ctx);
+}
+
+static void exif__cache_lru_remove(exif_cache_t *c, exif__centry_t *e)
+{
+    if (e->prev) e->prev->next = e->next; else c->head = e->next;
+    if (e->next) e->next->prev = e->prev; else c->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void exif__cache_lru_push(exif_cache_t *c, exif__centry_t *e)
+{
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head) c->head->prev = e; else c->tail = e;
+    c->head = e;
+}
+
+// Take e out of the table. It is freed now or by the last caller holding it.
+static void exif__cache_unlink(exif_cache_t *c, exif__centry_t *e)
+{
+    exif__centry_t **pp = &c->buckets[e->hash & (c->nbuckets - 1)];
+    while (*pp != e) pp = &(*pp)->chain;
+    *pp = e->chain;
+    c->count--;
+    if (e->ready) {
+        exif__cache_lru_remove(c, e);
+        c->bytes -= e->bytes;
+    }
+    e->linked = false;
+    if (!e->refs) exif__cache_free_entry(c, e);
+}
+
+static exif__centry_t *exif__cache_find(exif_cache_t *c, uint64_t hash,
+                                        const exif__buf_t *key)
+{
+    for (exif__centry_t *e = c->buckets[hash & (c->nbuckets - 1)]; e; e = e->chain)
+        if (e->hash == hash && e->key_len == key->len
+            && memcmp(e->key, key->data, key->len) == 0)
+            return e;
+    return NULL;
+}
+
+// Insert a pending entry for key; NULL when out of memory.
+static exif__centry_t *exif__cache_insert(exif_cache_t *c, uint64_t hash,
+                                          const exif__buf_t *key)
+{
+    exif_allocator_t *a = &c->alloc;
+    if (c->count >= c->nbuckets) {
+        size_t n = c->nbuckets * 2;
+        exif__centry_t **b = a->alloc(n * sizeof *b, a->ctx);
+        if (b) {
+            memset(b, 0, n * sizeof *b);
+            for (size_t i = 0; i < c->nbuckets; i++) {
+                for (exif__centry_t *e = c->buckets[i], *next; e; e = next) {
+                    next = e->chain;
+                    e->chain = b[e->hash & (n - 1)];
+                    b[e->hash & (n - 1)] = e;
+                }
+            }
+            a->free(c->buckets, c->nbuckets * sizeof *c->buckets, a->ctx);
+            c->buckets = b;
+            c->nbuckets = n;
+        }
+    }
+
+    exif__centry_t *e = a->alloc(sizeof *e, a->ctx);
+    if (!e) return NULL;
+    *e = (exif__centry_t){ .hash = hash, .key_len = key->len, .linked = true };
+    e->key = a->alloc(key->len, a->ctx);
+    if (!e->key) {
+        a->free(e, sizeof *e, a->ctx);
+        return NULL;
+    }
+    memcpy(e->key, key->data, key->len);
+    e->chain = c->buckets[hash & (c->nbuckets - 1)];
+    c->buckets[hash & (c->nbuckets - 1)] = e;
+    c->count++;
+    return e;
+}
+
+// Store r in the pending entry e and wake its waiters. Failures are handed
+// to the waiters but not kept.
+static void exif__cache_complete(exif_cache_t *c, exif__centry_t *e,
+                                 const exif_result_t *r)
+{
+    exif_allocator_t *a = &c->alloc;
+    e->result = (exif_result_t){ .success = r->success, .exit_code = r->exit_code };
+    if (r->data && (e->result.data = a->alloc(r->data_len + 1, a->ctx))) {
+        memcpy(e->result.data, r->data, r->data_len);
+        e->result.data[r->data_len] = '\0';
+        e->result.data_len = r->data_len;
+    }
+    if (r->error && (e->result.error = a->alloc(strlen(r->error) + 1, a->ctx)))
+        memcpy(e->result.error, r->error, strlen(r->error) + 1);
+    if (r->success && !e->result.data) e->result.success = false;
+    e->bytes = sizeof *e + e->key_len + e->result.data_len;
+    e->ready = true;
+
+    if (!e->linked) return;
+    exif__cache_lru_push(c, e);
+    c->bytes += e->bytes;
+    if (!e->result.success || e->bytes > c->max_bytes) {
+        exif__cache_unlink(c, e);
+        return;
+    }
+    while (c->bytes > c->max_bytes && c->tail)
+        exif__cache_unlink(c, c->tail);
+}
+
+// Copy a ready entry out with the context's allocator.
+static exif_result_t exif__cache_copy(exif_allocator_t *alloc, const exif__centry_t *e)
+{
+    const exif_result_t *r = &e->result;
+    if (!r->success && !r->error)
+        return exif__err_result(alloc, "out of memory", -1);
+    if (!r->success)
+        return exif__err_result(alloc, r->error, r->exit_code);
+    char *data = alloc->alloc(r->data_len + 1, alloc->ctx);
+    if (!data) return exif__err_result(alloc, "out of memory", -1);
+    memcpy(data, r->data, r->data_len + 1);
+    return exif__ok_result(data, r->data_len, r->exit_code);
+}
+
+typedef exif_result_t (*exif__read_fn)(exif_t *ctx, const void *arg,
+                                       const exif_options_t *opts);
+
+// Serve key from the cache, wait for an identical read in flight, or run
+// read and publish its result.
+static exif_result_t exif__cache_run(exif_t *ctx, const exif__buf_t *key,
+                                     exif__read_fn read, const void *arg,
+                                     const exif_options_t *opts)
+{
+    exif_cache_t *c = ctx->cache;
+    uint64_t hash[2];
+    exif__hash128(key->data, key->len, hash);
+
+    pthread_mutex_lock(&c->lock);
+    exif__centry_t *e = exif__cache_find(c, hash[0], key);
+    if (e) {
+        e->refs++;
+        while (!e->ready) pthread_cond_wait(&c->ready_cv, &c->lock);
+        if (e->linked) {
+            exif__cache_lru_remove(c, e);
+            exif__cache_lru_push(c, e);
+        }
+        exif_result_t result = exif__cache_copy(&ctx->alloc, e);
+        if (!--e->refs && !e->linked) exif__cache_free_entry(c, e);
+        pthread_mutex_unlock(&c->lock);
+        return result;
+    }
+    e = exif__cache_insert(c, hash[0], key);
+    if (e) e->refs++;
+    pthread_mutex_unlock(&c->lock);
+
+    exif_result_t result = read(ctx, arg, opts);
+    if (!e) return result;
+
+    pthread_mutex_lock(&c->lock);
+    exif__cache_complete(c, e, &result);
+    if (!--e->refs && !e->linked) exif__cache_free_entry(c, e);
+    pthread_cond_broadcast(&c->ready_cv);
+    pthread_mutex_unlock(&c->lock);
+    return result;
+}
+
+// A finished entry for key, without waiting on reads in flight.
+static bool exif__cache_get(exif_t *ctx, const exif__buf_t *key, exif_result_t *out)
+{
+    exif_cache_t *c = ctx->cache;
+    uint64_t hash[2];
+    exif__hash128(key->data, key->len, hash);
+    pthread_mutex_lock(&c->lock);
+    exif__centry_t *e = exif__cache_find(c, hash[0], key);
+    bool hit = e && e->ready && e->result.success;
+    if (hit) {
+        exif__cache_lru_remove(c, e);
+        exif__cache_lru_push(c, e);
+        *out = exif__cache_copy(&ctx->alloc, e);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return hit;
+}
+
+static void exif__cache_put(exif_t *ctx, const exif__buf_t *key, const exif_result_t *r)
+{
+    exif_cache_t *c = ctx->cache;
+    uint64_t hash[2];
+    exif__hash128(key->data, key->len, hash);
+    pthread_mutex_lock(&c->lock);
+    exif__centry_t *e = exif__cache_find(c, hash[0], key) ? NULL
+                      : exif__cache_insert(c, hash[0], key);
+    if (e) exif__cache_complete(c, e, r);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void exif_cache_clear(exif_cache_t *c)
+{
+    if (!c) return;
+    pthread_mutex_lock(&c->lock);
+    for (size_t i = 0; i < c->nbuckets; i++) {
+        for (exif__centry_t *e = c->buckets[i], *next; e; e = next) {
+            next = e->chain;
+            if (e->ready) exif__cache_unlink(c, e);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void exif_cache_destroy(exif_cache_t *c)
+{
+    if (!c) return;
+    exif_cache_clear(c);
+    exif_allocator_t a = c->alloc;
+    pthread_cond_destroy(&c->ready_cv);
+    pthread_mutex_destroy(&c->lock);
+    a.free(c->buckets, c->nbuckets * sizeof *c->buckets, a.ctx);
+    a.free(c, sizeof *c, a.ctx);
+}
+
+static bool exif__key_bytes(exif_allocator_t *alloc, exif__buf_t *k,
+                            const void *data, size_t len)
+{
+    uint64_t n = len;
+    return exif__buf_append(alloc, k, &n, sizeof n) && exif__buf_append(alloc, k, data, len);
+}
+
+static bool exif__key_str(exif_allocator_t *alloc, exif__buf_t *k, const char *s)
+{
+    return exif__key_bytes(alloc, k, s ? s : "", s ? strlen(s) + 1 : 0);
+}
+
+static bool exif__key_strs(exif_allocator_t *alloc, exif__buf_t *k,
+                           const char *const *list, int n)
+{
+    if (!list || n < 0) n = 0;
+    uint64_t count = (uint64_t)n;
+    bool ok = exif__buf_append(alloc, k, &count, sizeof count);
+    for (int i = 0; ok && i < n; i++) ok = exif__key_str(alloc, k, list[i]);
+    return ok;
+}
+
+// Identity of the file at path; false unless it is a regular file.
+static bool exif__key_stat(exif_allocator_t *alloc, exif__buf_t *k, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+#ifdef __APPLE__
+    int64_t nsec = st.st_mtimespec.tv_nsec;
+#else
+    int64_t nsec = st.st_mtim.tv_nsec;
+#endif
+    int64_t id[5] = { (int64_t)st.st_dev, (int64_t)st.st_ino, (int64_t)st.st_size,
+                      (int64_t)st.st_mtime, nsec };
+    return exif__buf_append(alloc, k, id, sizeof id);
+}
+
+// Key for a read of path or of buf (exactly one is set). False when the
+// context has no cache or the input cannot be identified.
+static bool exif__cache_key(exif_t *ctx, exif__buf_t *k, const char *path,
+                            const exif_buf_t *buf, const exif_options_t *opts)
+{
+    exif_allocator_t *alloc = &ctx->alloc;
+    exif_options_t none = {0};
+    if (!ctx->cache) return false;
+    if (!opts) opts = &none;
+    if (opts->sink) return false;  // nothing is left to cache
+
+    uint32_t scalars[3] = { (uint32_t)opts->profile, (uint32_t)opts->format,
+                            opts->prefilter };
+    bool ok;
+    if (path) {
+        ok = exif__buf_append(alloc, k, "p", 1) && exif__key_str(alloc, k, path)
+          && exif__key_stat(alloc, k, path);
+    } else {
+        uint64_t hash[2];
+        exif__hash128(buf->data, buf->len, hash);
+        ok = exif__buf_append(alloc, k, "b", 1) && exif__key_str(alloc, k, buf->filename)
+          && exif__key_bytes(alloc, k, hash, sizeof hash);
+    }
+    ok = ok && exif__buf_append(alloc, k, scalars, sizeof scalars)
+       && exif__key_strs(alloc, k, opts->args, opts->argc)
+       && exif__key_strs(alloc, k, opts->tags, opts->ntags)
+       && exif__key_strs(alloc, k, opts->profile_args,
+                         opts->profile == EXIF_PROFILE_CUSTOM ? opts->profile_argc : 0)
+       && exif__key_str(alloc, k, opts->config_path)
+       && (!opts->config_path || exif__key_stat(alloc, k, opts->config_path));
+    if (!ok) exif__buf_free(alloc, k);
+    return ok;
+}
+
+static bool exif__read_native_path(exif_t *ctx, const char *path,
+                                   const exif_options_t *opts, exif_result_t *result);
+
+static exif_result_t exif__read_path(exif_t *ctx, const void *arg,
+                                     const exif_options_t *opts)
+{
+    const char *path = arg;
+    exif_result_t result;
+    if (exif__read_native_path(ctx, path, opts, &result)) return result;
+
+    int ntail;
+    const char **tail = exif__read_tail(ctx, opts, &path, 1, &ntail);
+    if (!tail) return exif__err_result(&ctx->alloc, "out of memory", -1);
+
+    const char *script = exif__read_script(ctx, opts);
+    result = exif__run_ex(ctx, tail, ntail, opts, false, script);
+    ctx->alloc.free(tail, ntail * sizeof *tail, ctx->alloc.ctx);
+    exif__read_convert(ctx, opts, script, &result);
+    return result;
+}
+
+exif_prepared_t *exif_prepare(exif_t *ctx, const exif_options_t *opts)
+{
+    exif_allocator_t *alloc = &ctx->alloc;
+    exif_options_t merged;
+    opts = exif__with_prepared(opts, &merged);
+
+    exif_prepared_t *p = alloc->alloc(sizeof *p, alloc->ctx);
+    if (!p) return NULL;
+    *p = (exif_prepared_t){ .ctx = ctx };
+    if (opts) p->opts = *opts;
+    p->opts.prepared = NULL;
+
+    exif_options_t *o = &p->opts;
+    int nargs = o->args ? o->argc : 0;
+    int ntags = o->tags ? o->ntags : 0;
+    int nprof = o->profile_args && o->profile_argc > 0 ? o->profile_argc : 0;
+    const char *const *src[] = { o->args, o->tags, o->profile_args };
+    int nsrc[] = { nargs, ntags, nprof };
+
+    // One block for the strings, one for the lists pointing into it
+    p->nlists = (size_t)nargs + ntags + nprof;
+    p->strings_len = o->config_path ? strlen(o->config_path) + 1 : 0;
+    for (int l = 0; l < 3; l++)
+        for (int i = 0; i < nsrc[l]; i++)
+            if (src[l][i]) p->strings_len += strlen(src[l][i]) + 1;
+    if (p->nlists) {
+        p->lists = alloc->alloc(p->nlists * sizeof *p->lists, alloc->ctx);
+        if (!p->lists) goto fail;
+    }
+    if (p->strings_len) {
+        p->strings = alloc->alloc(p->strings_len, alloc->ctx);
+        if (!p->strings) goto fail;
+    }
+
+    char *s = p->strings;
+    const char **list = p->lists;
+    for (int l = 0; l < 3; l++) {
+        for (int i = 0; i < nsrc[l]; i++) {
+            list[i] = NULL;
+            if (!src[l][i]) continue;
+            size_t len = strlen(src[l][i]) + 1;
+            list[i] = memcpy(s, src[l][i], len);
+            s += len;
+        }
+        if (l == 0) o->args = nargs ? list : NULL;
+        if (l == 1) o->tags = ntags ? list : NULL;
+        if (l == 2) o->profile_args = nprof ? list : NULL;
+        if (list) list += nsrc[l];
+    }
+    if (o->config_path) o->config_path = memcpy(s, o->config_path, strlen(o->config_path) + 1);
+
+    // What gets staged: the options' own strings, the constant part of a
+    // read with them, the write flags and the scripts
+    int ntail;
+    const char **tail = exif__read_tail(ctx, o, NULL, 0, &ntail);
+    if (!tail) goto fail;
+    p->consts_cap = p->nlists + ntail + 6;
+    p->consts = alloc->alloc(p->consts_cap * sizeof *p->consts, alloc->ctx);
+    if (!p->consts) {
+        alloc->free(tail, ntail * sizeof *tail, alloc->ctx);
+        goto fail;
+    }
+    for (size_t i = 0; i < p->nlists; i++)
+        if (p->lists[i]) p->consts[p->nconsts++] = p->lists[i];
+    if (o->config_path) {
+        p->consts[p->nconsts++] = "-config";
+        p->consts[p->nconsts++] = o->config_path;
+    }
+    for (int i = 0; i < ntail; i++) p->consts[p->nconsts++] = tail[i];
+    alloc->free(tail, ntail * sizeof *tail, alloc->ctx);
+    p->consts[p->nconsts++] = "-o";
+    p->consts[p->nconsts++] = "-overwrite_original";
+    if (ctx->script_path)     p->consts[p->nconsts++] = ctx->script_path;
+    if (ctx->bin_script_path) p->consts[p->nconsts++] = ctx->bin_script_path;
+
+    // Room for a single-file read or write on top of the fixed arguments
+    p->argv_cap = nargs + ntags + (o->config_path ? 2 : 0) + ntail + 3;
+    return p;
+
+ fail:
+    exif_prepared_free(ctx, p);
+    return NULL;
+}
+
+void exif_prepared_free(exif_t *ctx, exif_prepared_t *p)
+{
+    if (!p) return;
+    exif_allocator_t *alloc = &ctx->alloc;
+    bool thread_env_owned = false;
+    bool live = p->staged && p->generation == ctx->generation && ctx->inst;
+    if (live) {
+        // The resident loop runs in the same instance; it restarts on the
+        // next call
+        exif__resident_stop(ctx);
+        live = exif__thread_env_enter(&thread_env_owned);
+    }
+    exif__prepared_unstage(p, live);
+    if (live) exif__thread_env_leave(thread_env_owned);
+    if (p->consts)  alloc->free(p->consts, p->consts_cap * sizeof *p->consts, alloc->ctx);
+    if (p->lists)   alloc->free(p->lists, p->nlists * sizeof *p->lists, alloc->ctx);
+    if (p->strings) alloc->free(p->strings, p->strings_len, alloc->ctx);
+    alloc->free(p, sizeof *p, alloc->ctx);
+}
+
+exif_result_t exif_read(exif_t *ctx, const char *path,
+                        const exif_options_t *opts)
+{
+    exif_options_t merged;
+    opts = exif__with_prepared(opts, &merged);
+    exif__call_begin(ctx);
+    bool sink = exif__sink_begin(ctx, opts, 0);
+    exif__buf_t key = {0};
+    exif_result_t result = exif__cache_key(ctx, &key, path, NULL, opts)
+        ? exif__cache_run(ctx, &key, exif__read_path, path, opts)
+        : exif__read_path(ctx, path, opts);
+    exif__buf_free(&ctx->alloc, &key);
+    exif__apply_transform(&ctx->alloc, &result, opts);
+    if (sink) exif__sink_end(ctx, &result);
+    exif__call_end(ctx, &result, 1, 0);
+    return result;
+}
+
+// --- prefilter ---
+
+// Native scan of a read_buf input for the bulk image/media payload that
+// exiftool only seeks past. Those ranges become holes in a sparse file:
+// offsets are unchanged, so every pointer in the file still resolves, and
+// the caller's pages behind a hole are never touched.
+
+#define EXIF__PREFILTER_MIN_HOLE  4096u
+#define EXIF__PREFILTER_MAX_IFDS  64
+
+typedef struct exif__spans {
+    exif__span_t *items;
+    size_t        n;
+    size_t        cap;
+} exif__spans_t;
+
+static bool exif__spans_add(exif_allocator_t *alloc, exif__spans_t *s,
+                            size_t off, size_t len, size_t limit)
+{
+    if (off >= limit || !len) return true;
+    if (len > limit - off) len = limit - off;
+    exif__span_t *items = exif__grow(alloc, s->items, s->n, &s->cap, sizeof *items);
+    if (!items) return false;
+    s->items = items;
+    s->items[s->n++] = (exif__span_t){ off, len };
+    return true;
+}
+
+static int exif__span_cmp(const void *a, const void *b)
+{
+    const exif__span_t *x = a, *y = b;
+    return x->off < y->off ? -1 : x->off > y->off;
+}
+
+// Sort and coalesce overlapping or touching spans in place.
+static void exif__spans_merge(exif__spans_t *s)
+{
+    if (s->n < 2) return;
+    qsort(s->items, s->n, sizeof *s->items, exif__span_cmp);
+    size_t out = 0;
+    for (size_t i = 1; i < s->n; i++) {
+        exif__span_t *last = &s->items[out];
+        size_t end = last->off + last->len;
+        if (s->items[i].off <= end) {
+            size_t e = s->items[i].off + s->items[i].len;
+            if (e > end) last->len = e - last->off;
+        } else {
+            s->items[++out] = s->items[i];
+        }
+    }
+    s->n = out + 1;
+}
+
+static uint16_t exif__rd16(const uint8_t *p, bool le)
+{
+    return le ? (uint16_t)(p[0] | p[1] << 8) : (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t exif__rd32(const uint8_t *p, bool le)
+{
+    return le ? (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24
+              : (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+// JPEG: entropy-coded data after each SOS, up to the next real marker.
+// Everything from EOI on (trailers, MPF images) is kept.
+static bool exif__prefilter_jpeg(exif_allocator_t *alloc, const uint8_t *d,
+                                 size_t len, exif__spans_t *holes)
+{
+    size_t p = 2;
+    while (p + 4 <= len) {
+        if (d[p] != 0xFF) return true;  // lost sync; keep the rest
+        uint8_t m = d[p + 1];
+        if (m == 0xFF) { p++; continue; }
+        if (m == 0xD9) return true;
+        if (m == 0x01 || (m >= 0xD0 && m <= 0xD7)) { p += 2; continue; }
+        size_t seglen = exif__rd16(d + p + 2, false);
+        if (seglen < 2) return true;
+        p += 2 + seglen;
+        if (m != 0xDA) continue;
+
+        size_t start = p;
+        while (p + 1 < len) {
+            const uint8_t *ff = memchr(d + p, 0xFF, len - 1 - p);
+            if (!ff) { p = len; break; }
+            p = (size_t)(ff - d);
+            uint8_t n = d[p + 1];
+            if (n == 0xFF) { p++; continue; }
+            if (n == 0x00 || (n >= 0xD0 && n <= 0xD7)) { p += 2; continue; }
+            break;
+        }
+        if (p + 1 >= len) return true;  // unterminated scan; keep it
+        if (!exif__spans_add(alloc, holes, start, p - start, len)) return false;
+    }
+    return true;
+}
+
+// PNG: IDAT payloads, and fdAT payloads after their sequence number.
+static bool exif__prefilter_png(exif_allocator_t *alloc, const uint8_t *d,
+                                size_t len, exif__spans_t *holes)
+{
+    size_t p = 8;
+    while (p + 12 <= len) {
+        size_t clen = exif__rd32(d + p, false);
+        if (clen > len - p - 12) break;
+        const uint8_t *type = d + p + 4;
+        bool ok = true;
+        if (memcmp(type, "IDAT", 4) == 0)
+            ok = exif__spans_add(alloc, holes, p + 8, clen, len);
+        else if (memcmp(type, "fdAT", 4) == 0 && clen > 4)
+            ok = exif__spans_add(alloc, holes, p + 12, clen - 4, len);
+        if (!ok) return false;
+        if (memcmp(type, "IEND", 4) == 0) break;
+        p += 12 + clen;
+    }
+    return true;
+}
+
+// TIFF/DNG: strip and tile data of every IFD reachable from IFD0, SubIFDs
+// and the Exif IFD, minus anything an IFD entry points at. JPEG-compressed
+// previews are kept since exiftool parses their embedded metadata; raw CFA
+// and LinearRaw data is dropped whatever its compression.
+static bool exif__prefilter_tiff(exif_allocator_t *alloc, const uint8_t *d,
+                                 size_t len, exif__spans_t *holes,
+                                 exif__spans_t *keep)
+{
+    static const uint8_t type_size[] = { 0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8, 4 };
+    bool le = d[0] == 'I';
+
+    uint32_t queue[EXIF__PREFILTER_MAX_IFDS];
+    size_t nqueue = 0, visited = 0;
+    queue[nqueue++] = exif__rd32(d + 4, le);
+
+    while (nqueue && visited++ < EXIF__PREFILTER_MAX_IFDS) {
+        size_t ifd = queue[--nqueue];
+        if (!ifd || ifd + 2 > len) continue;
+        size_t n = exif__rd16(d + ifd, le);
+        if (ifd + 2 + n * 12 + 4 > len) continue;
+        if (!exif__spans_add(alloc, keep, ifd, 2 + n * 12 + 4, len)) return false;
+
+        const uint8_t *offsets = NULL, *counts = NULL;
+        uint16_t offsets_type = 0, counts_type = 0;
+        uint32_t noffsets = 0, ncounts = 0, compression = 1, photometric = 0;
+
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t *e = d + ifd + 2 + i * 12;
+            uint16_t tag = exif__rd16(e, le), type = exif__rd16(e + 2, le);
+            uint32_t count = exif__rd32(e + 4, le);
+            uint64_t size = type < sizeof type_size ? (uint64_t)type_size[type] * count : 0;
+            const uint8_t *val = e + 8;
+            if (size > 4) {
+                size_t off = exif__rd32(e + 8, le);
+                if (off > len || size > len - off) continue;
+                if (!exif__spans_add(alloc, keep, off, size, len)) return false;
+                val = d + off;
+            }
+            bool wide = type == 4 || type == 13;
+            if (type != 3 && !wide) continue;
+
+            switch (tag) {
+            case 0x103: compression = wide ? exif__rd32(val, le) : exif__rd16(val, le); break;
+            case 0x106: photometric = wide ? exif__rd32(val, le) : exif__rd16(val, le); break;
+            case 0x111: case 0x144:
+                offsets = val; offsets_type = type; noffsets = count;
+                break;
+            case 0x117: case 0x145:
+                counts = val; counts_type = type; ncounts = count;
+                break;
+            case 0x14A: case 0x8769:
+                for (uint32_t k = 0; k < count && nqueue < EXIF__PREFILTER_MAX_IFDS; k++)
+                    queue[nqueue++] = wide ? exif__rd32(val + 4 * k, le)
+                                           : exif__rd16(val + 2 * k, le);
+                break;
+            }
+        }
+        if (nqueue < EXIF__PREFILTER_MAX_IFDS)
+            queue[nqueue++] = exif__rd32(d + ifd + 2 + n * 12, le);
+
+        bool raw = photometric == 32803 || photometric == 34892;
+        bool jpeg = compression == 6 || compression == 7 || compression == 34892;
+        if (!offsets || !counts || (jpeg && !raw)) continue;
+        uint32_t nstrips = noffsets < ncounts ? noffsets : ncounts;
+        for (uint32_t k = 0; k < nstrips; k++) {
+            size_t off = offsets_type == 3 ? exif__rd16(offsets + 2 * k, le)
+                                           : exif__rd32(offsets + 4 * k, le);
+            size_t cnt = counts_type == 3 ? exif__rd16(counts + 2 * k, le)
+                                          : exif__rd32(counts + 4 * k, le);
+            if (!exif__spans_add(alloc, holes, off, cnt, len)) return false;
+        }
+    }
+    return true;
+}
+
+// ISO-BMFF/QuickTime: top-level mdat payloads. Only without embedded
+// extraction (-ee reads timed metadata out of mdat), and never for HEIF
+// style files with a top-level meta box, whose Exif/XMP items live in mdat.
+static bool exif__prefilter_bmff(exif_allocator_t *alloc, const uint8_t *d,
+                                 size_t len, bool embedded, exif__spans_t *holes)
+{
+    if (embedded) return true;
+    size_t p = 0, first = holes->n;
+    while (p + 8 <= len) {
+        uint64_t size = exif__rd32(d + p, false);
+        size_t hdr = 8;
+        if (size == 1) {
+            if (p + 16 > len) break;
+            size = (uint64_t)exif__rd32(d + p + 8, false) << 32
+                 | exif__rd32(d + p + 12, false);
+            hdr = 16;
+        } else if (size == 0) {
+            size = len - p;
+        }
+        if (size < hdr || size > len - p) break;
+        if (memcmp(d + p + 4, "meta", 4) == 0) {
+            holes->n = first;
+            return true;
+        }
+        if (memcmp(d + p + 4, "mdat", 4) == 0
+            && !exif__spans_add(alloc, holes, p + hdr, size - hdr, len))
+            return false;
+        p += size;
+    }
+    return true;
+}
+
+// Work out the spans of data that exiftool needs. Returns false when the
+// format is not recognized or there is nothing worth leaving out, in which
+// case the input is served as is.
+static bool exif__prefilter(exif_allocator_t *alloc, const void *data, size_t len,
+                            bool embedded, exif__span_t **out, size_t *nout)
+{
+    const uint8_t *d = data;
+    exif__spans_t holes = {0}, keep = {0}, spans = {0};
+    bool ok = false;
+
+    if (len >= 4 && d[0] == 0xFF && d[1] == 0xD8)
+        ok = exif__prefilter_jpeg(alloc, d, len, &holes);
+    else if (len >= 8 && memcmp(d, "\x89PNG\r\n\x1a\n", 8) == 0)
+        ok = exif__prefilter_png(alloc, d, len, &holes);
+    else if (len >= 8 && (memcmp(d, "II*\0", 4) == 0 || memcmp(d, "MM\0*", 4) == 0))
+        ok = exif__prefilter_tiff(alloc, d, len, &holes, &keep);
+    else if (len >= 8 && (memcmp(d + 4, "ftyp", 4) == 0 || memcmp(d + 4, "moov", 4) == 0
+                          || memcmp(d + 4, "mdat", 4) == 0 || memcmp(d + 4, "wide", 4) == 0))
+        ok = exif__prefilter_bmff(alloc, d, len, embedded, &holes);
+    if (!ok || !holes.n) goto done;
+
+    exif__spans_merge(&holes);
+    exif__spans_merge(&keep);
+
+    // spans = [0, len) minus (holes minus keep), skipping holes too small
+    // to be worth a gap
+    size_t at = 0, k = 0;
+    for (size_t i = 0; i < holes.n; i++) {
+        size_t h = holes.items[i].off, hend = h + holes.items[i].len;
+        while (h < hend) {
+            while (k < keep.n && keep.items[k].off + keep.items[k].len <= h) k++;
+            size_t cut = hend;
+            if (k < keep.n && keep.items[k].off < hend)
+                cut = keep.items[k].off > h ? keep.items[k].off : h;
+            if (cut - h >= EXIF__PREFILTER_MIN_HOLE) {
+                if (!exif__spans_add(alloc, &spans, at, h - at, len)) { ok = false; goto done; }
+                at = cut;
+            }
+            if (cut >= hend) break;
+            h = keep.items[k].off + keep.items[k].len;
+        }
+    }
+    if (!spans.n && at == 0) { ok = false; goto done; }
+    if (!exif__spans_add(alloc, &spans, at, len - at, len)) { ok = false; goto done; }
+
+    *out = alloc->alloc(spans.n * sizeof **out, alloc->ctx);
+    if (!*out) { ok = false; goto done; }
+    memcpy(*out, spans.items, spans.n * sizeof **out);
+    *nout = spans.n;
+
+done:
+    if (holes.items) alloc->free(holes.items, holes.cap * sizeof *holes.items, alloc->ctx);
+    if (keep.items)  alloc->free(keep.items, keep.cap * sizeof *keep.items, alloc->ctx);
+    if (spans.items) alloc->free(spans.items, spans.cap * sizeof *spans.items, alloc->ctx);
+    return ok;
+}
+
+// Write data to fd, leaving the gaps between spans as filesystem holes.
+static bool exif__write_spans(int fd, const void *data, size_t len,
+                              const exif__span_t *spans, size_t nspans)
+{
+    exif__span_t whole = { 0, len };
+    if (!spans) {
+        spans = &whole;
+        nspans = 1;
+    } else if (ftruncate(fd, (off_t)len) != 0) {
+        return false;
+    }
+    for (size_t i = 0; i < nspans; i++) {
+        const unsigned char *src = (const unsigned char *)data + spans[i].off;
+        size_t remaining = spans[i].len;
+        off_t at = (off_t)spans[i].off;
+        while (remaining > 0) {
+            ssize_t w = pwrite(fd, src, remaining, at);
+            if (w < 0) return false;
+            src += w;
+            at += w;
+            remaining -= w;
+        }
+    }
+    return true;
+}
+
+// --- native reader ---
+
+// EXIF_PROFILE_COMMON reads a fixed set of tags. For JPEG, TIFF, DNG and PNG
+// they are parsed here and printed the way exiftool prints them for the
+// same arguments: the keys of exif__read_common in that order, -n values,
+// and numbers left unquoted under the rule of its EscapeJSON. Anything the
+// parser is unsure of (bounds, unusual formats, control characters, raw
+// profiles in PNG text) goes to exiftool instead.
+
+#define EXIF__COMMON_VALUE_MAX 256
+
+enum { EXIF__IFD_NONE, EXIF__IFD_0, EXIF__IFD_EXIF, EXIF__IFD_GPS };
+
+// Same order as the tag arguments of exif__read_common
+static const struct {
+    const char *key;
+    uint8_t     ifd;
+    uint16_t    tag;
+} exif__common_tags[] = {
+    { "Main:File:ImageWidth",           EXIF__IFD_NONE, 0 },
+    { "Main:File:ImageHeight",          EXIF__IFD_NONE, 1 },
+    { "Main:PNG:ImageWidth",            EXIF__IFD_NONE, 2 },
+    { "Main:PNG:ImageHeight",           EXIF__IFD_NONE, 3 },
+    { "Main:IFD0:ImageWidth",           EXIF__IFD_0,    0x0100 },
+    { "Main:IFD0:ImageHeight",          EXIF__IFD_0,    0x0101 },
+    { "Main:IFD0:Make",                 EXIF__IFD_0,    0x010F },
+    { "Main:IFD0:Model",                EXIF__IFD_0,    0x0110 },
+    { "Main:IFD0:Orientation",          EXIF__IFD_0,    0x0112 },
+    { "Main:ExifIFD:DateTimeOriginal",  EXIF__IFD_EXIF, 0x9003 },
+    { "Main:ExifIFD:OffsetTimeOriginal",EXIF__IFD_EXIF, 0x9011 },
+    { "Main:ExifIFD:ExposureTime",      EXIF__IFD_EXIF, 0x829A },
+    { "Main:ExifIFD:FNumber",           EXIF__IFD_EXIF, 0x829D },
+    { "Main:ExifIFD:ISO",               EXIF__IFD_EXIF, 0x8827 },
+    { "Main:ExifIFD:FocalLength",       EXIF__IFD_EXIF, 0x920A },
+    { "Main:ExifIFD:LensMake",          EXIF__IFD_EXIF, 0xA433 },
+    { "Main:ExifIFD:LensModel",         EXIF__IFD_EXIF, 0xA434 },
+    { "Main:GPS:GPSLatitudeRef",        EXIF__IFD_GPS,  0x0001 },
+    { "Main:GPS:GPSLatitude",           EXIF__IFD_GPS,  0x0002 },
+    { "Main:GPS:GPSLongitudeRef",       EXIF__IFD_GPS,  0x0003 },
+    { "Main:GPS:GPSLongitude",          EXIF__IFD_GPS,  0x0004 },
+    { "Main:GPS:GPSAltitudeRef",        EXIF__IFD_GPS,  0x0005 },
+    { "Main:GPS:GPSAltitude",           EXIF__IFD_GPS,  0x0006 },
+};
+
+#define EXIF__N_COMMON (sizeof exif__common_tags / sizeof *exif__common_tags)
+
+typedef struct exif__common {
+    char value[EXIF__N_COMMON][EXIF__COMMON_VALUE_MAX];
+    bool found[EXIF__N_COMMON];
+} exif__common_t;
+
+static bool exif__common_set(exif__common_t *c, size_t i, const char *fmt, ...)
+{
+    if (c->found[i]) return true;  // the first occurrence is the one printed
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(c->value[i], sizeof c->value[i], fmt, ap);
+    va_end(ap);
+    c->found[i] = n > 0 && (size_t)n < sizeof c->value[i];
+    return c->found[i];
+}
+
+// A value as exiftool's -n output has it: strings cut at the first NUL,
+// rationals to 10 significant digits, lists joined by spaces, and GPS
+// coordinates through its ToDegrees (d + (m + s/60) / 60 at %.15g).
+static bool exif__common_entry(exif__common_t *c, size_t slot, const uint8_t *t,
+                               size_t tlen, const uint8_t *e, bool le)
+{
+    static const uint8_t type_size[] = { 0, 1, 1, 2, 4, 8, 1, 0, 2, 4, 8 };
+    uint16_t type = exif__rd16(e + 2, le);
+    uint32_t count = exif__rd32(e + 4, le);
+    if (!type || type >= sizeof type_size || !type_size[type] || !count) return false;
+    uint64_t size = (uint64_t)type_size[type] * count;
+    const uint8_t *v = e + 8;
+    if (size > 4) {
+        uint32_t off = exif__rd32(e + 8, le);
+        if (off > tlen || size > tlen - off) return false;
+        v = t + off;
+    }
+
+    if (type == 2) {
+        size_t n = strnlen((const char *)v, count);
+        bool trim = exif__common_tags[slot].tag == 0x010F || exif__common_tags[slot].tag == 0x0110;
+        while (trim && n && isspace(v[n - 1])) n--;
+        if (!n || isspace(v[n - 1])) return false;
+        for (size_t i = 0; i < n; i++)
+            if (v[i] < 0x20 || v[i] >= 0x7F) return false;
+        return exif__common_set(c, slot, "%.*s", (int)n, (const char *)v);
+    }
+
+    bool degrees = exif__common_tags[slot].ifd == EXIF__IFD_GPS
+                   && (exif__common_tags[slot].tag == 2 || exif__common_tags[slot].tag == 4);
+    if (degrees && (type != 5 || count != 3)) return false;
+    if (count > 16) return false;
+    char out[EXIF__COMMON_VALUE_MAX];
+    size_t at = 0;
+    double dms[3] = {0};
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t *p = v + (size_t)i * type_size[type];
+        char item[32];
+        switch (type) {
+        case 1:  snprintf(item, sizeof item, "%u", p[0]); break;
+        case 3:  snprintf(item, sizeof item, "%u", exif__rd16(p, le)); break;
+        case 4:  snprintf(item, sizeof item, "%u", exif__rd32(p, le)); break;
+        case 6:  snprintf(item, sizeof item, "%d", (int8_t)p[0]); break;
+        case 8:  snprintf(item, sizeof item, "%d", (int16_t)exif__rd16(p, le)); break;
+        case 9:  snprintf(item, sizeof item, "%d", (int32_t)exif__rd32(p, le)); break;
+        case 5:
+        case 10: {
+            uint32_t num = exif__rd32(p, le), den = exif__rd32(p + 4, le);
+            if (!den) return false;  // exiftool prints inf/undef
+            double q = type == 5 ? (double)num / den : (double)(int32_t)num / (int32_t)den;
+            snprintf(item, sizeof item, "%.10g", q);
+            if (degrees) dms[i] = strtod(item, NULL);
+            break;
+        }
+        default:
+            return false;
+        }
+        int n = snprintf(out + at, sizeof out - at, "%s%s", i ? " " : "", item);
+        if (n < 0 || (size_t)n >= sizeof out - at) return false;
+        at += (size_t)n;
+    }
+    if (degrees) return exif__common_set(c, slot, "%.15g", dms[0] + (dms[1] + dms[2] / 60) / 60);
+    return exif__common_set(c, slot, "%s", out);
+}
+
+// Walk IFD0, the Exif IFD and the GPS IFD of a TIFF block.
+static bool exif__common_tiff(exif__common_t *c, const uint8_t *t, size_t tlen)
+{
+    if (tlen < 8 || !(memcmp(t, "II*\0", 4) == 0 || memcmp(t, "MM\0*", 4) == 0))
+        return false;
+    bool le = t[0] == 'I';
+    uint32_t offs[4] = { 0, exif__rd32(t + 4, le), 0, 0 };
+    for (int ifd = EXIF__IFD_0; ifd <= EXIF__IFD_GPS; ifd++) {
+        uint32_t off = offs[ifd];
+        if (!off) continue;
+        if (off > tlen - 2) return false;
+        uint16_t n = exif__rd16(t + off, le);
+        if ((size_t)n * 12 > tlen - off - 2) return false;
+        for (uint16_t i = 0; i < n; i++) {
+            const uint8_t *e = t + off + 2 + (size_t)i * 12;
+            uint16_t tag = exif__rd16(e, le);
+            if (ifd == EXIF__IFD_0 && (tag == 0x8769 || tag == 0x8825)) {
+                uint16_t type = exif__rd16(e + 2, le);
+                if ((type != 4 && type != 13) || exif__rd32(e + 4, le) != 1) return false;
+                offs[tag == 0x8769 ? EXIF__IFD_EXIF : EXIF__IFD_GPS] = exif__rd32(e + 8, le);
+                continue;
+            }
+            for (size_t k = 0; k < EXIF__N_COMMON; k++)
+                if (exif__common_tags[k].ifd == ifd && exif__common_tags[k].tag == tag
+                    && !exif__common_entry(c, k, t, tlen, e, le))
+                    return false;
+        }
+    }
+    return true;
+}
+
+static bool exif__common_jpeg(exif__common_t *c, const uint8_t *d, size_t len)
+{
+    bool exif = false;
+    size_t p = 2;
+    while (p + 4 <= len) {
+        if (d[p] != 0xFF) return false;
+        uint8_t m = d[p + 1];
+        if (m == 0xFF) { p++; continue; }
+        if (m == 0xDA || m == 0xD9) return true;
+        if (m == 0x01 || (m >= 0xD0 && m <= 0xD7)) { p += 2; continue; }
+        size_t seglen = exif__rd16(d + p + 2, false);
+        if (seglen < 2 || seglen > len - p - 2) return false;
+        const uint8_t *body = d + p + 4;
+        size_t blen = seglen - 2;
+        if (m == 0xE1 && blen >= 6 && memcmp(body, "Exif\0\0", 6) == 0) {
+            if (exif) return false;  // exiftool reads every copy
+            exif = true;
+            if (!exif__common_tiff(c, body + 6, blen - 6)) return false;
+        } else if (m >= 0xC0 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC
+                   && blen >= 5) {
+            exif__common_set(c, 0, "%u", exif__rd16(body + 3, false));
+            exif__common_set(c, 1, "%u", exif__rd16(body + 1, false));
+        }
+        p += 2 + seglen;
+    }
+    return false;
+}
+
+// EXIF raw profiles in text chunks are also decoded by exiftool; leave
+// those files to it.
+static bool exif__common_png(exif__common_t *c, const uint8_t *d, size_t len)
+{
+    bool exif = false;
+    size_t p = 8;
+    while (p + 12 <= len) {
+        size_t clen = exif__rd32(d + p, false);
+        if (clen > len - p - 12) return false;
+        const uint8_t *type = d + p + 4, *body = d + p + 8;
+        if (memcmp(type, "IHDR", 4) == 0 && clen >= 8) {
+            exif__common_set(c, 2, "%u", exif__rd32(body, false));
+            exif__common_set(c, 3, "%u", exif__rd32(body + 4, false));
+        } else if (memcmp(type, "eXIf", 4) == 0 || memcmp(type, "exIf", 4) == 0) {
+            if (exif) return false;
+            exif = true;
+            if (!exif__common_tiff(c, body, clen)) return false;
+        } else if ((memcmp(type, "tEXt", 4) == 0 || memcmp(type, "zTXt", 4) == 0
+                    || memcmp(type, "iTXt", 4) == 0)
+                   && clen >= 12 && memcmp(body, "Raw profile", 11) == 0) {
+            return false;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            return true;
+        }
+        p += 12 + clen;
+    }
+    return false;
+}
+
+static bool exif__json_number(const char *s)
+{
+    // ^-?(\d|[1-9]\d{1,14})(\.\d{1,16})?(e[-+]?\d{1,3})?$
+    size_t n;
+    if (*s == '-') s++;
+    for (n = 0; isdigit((unsigned char)s[n]); n++) {}
+    if (!n || n > 15 || (n > 1 && *s == '0')) return false;
+    s += n;
+    if (*s == '.') {
+        for (n = 0; isdigit((unsigned char)s[1 + n]); n++) {}
+        if (!n || n > 16) return false;
+        s += 1 + n;
+    }
+    if (*s == 'e' || *s == 'E') {
+        s++;
+        if (*s == '-' || *s == '+') s++;
+        for (n = 0; isdigit((unsigned char)s[n]); n++) {}
+        if (!n || n > 3) return false;
+        s += n;
+    }
+    return !*s;
+}
+
+static bool exif__json_append_string(exif_allocator_t *alloc, exif__buf_t *b, const char *s)
+{
+    bool ok = exif__buf_append(alloc, b, "\"", 1);
+    for (; ok && *s; s++) {
+        if (*s == '"' || *s == '\\') ok = exif__buf_append(alloc, b, "\\", 1);
+        ok = ok && exif__buf_append(alloc, b, s, 1);
+    }
+    return ok && exif__buf_append(alloc, b, "\"", 1);
+}
+
+// The -json document exiftool prints for source with the common profile,
+// or false when the input has to go to exiftool.
+static bool exif__read_native(exif_allocator_t *alloc, const void *data, size_t len,
+                              const char *source, const exif_options_t *opts,
+                              exif_result_t *result)
+{
+    if (!opts || opts->profile != EXIF_PROFILE_COMMON || opts->format != EXIF_FORMAT_JSON
+        || opts->argc || opts->config_path) return false;
+    const char *suffix = exif__suffix_of(source);
+    if (!suffix) return false;
+    for (const char *s = source; *s; s++)
+        if ((unsigned char)*s < 0x20) return false;
+
+    const uint8_t *d = data;
+    exif__common_t c;
+    memset(c.found, 0, sizeof c.found);
+    bool ok;
+    if ((strcasecmp(suffix, "jpg") == 0 || strcasecmp(suffix, "jpeg") == 0)
+        && len >= 4 && d[0] == 0xFF && d[1] == 0xD8)
+        ok = exif__common_jpeg(&c, d, len);
+    else if (strcasecmp(suffix, "png") == 0 && len >= 8
+             && memcmp(d, "\x89PNG\r\n\x1a\n", 8) == 0)
+        ok = exif__common_png(&c, d, len);
+    else if (strcasecmp(suffix, "tif") == 0 || strcasecmp(suffix, "tiff") == 0
+             || strcasecmp(suffix, "dng") == 0)
+        ok = exif__common_tiff(&c, d, len);
+    else
+        ok = false;
+    if (!ok) return false;
+
+    exif__buf_t out = {0};
+    ok = exif__buf_append(alloc, &out, "[{\n  \"SourceFile\": ", 19)
+      && exif__json_append_string(alloc, &out, source);
+    for (size_t i = 0; ok && i < EXIF__N_COMMON; i++) {
+        if (!c.found[i]) continue;
+        const char *key = exif__common_tags[i].key;
+        ok = exif__buf_append(alloc, &out, ",\n  \"", 5)
+          && exif__buf_append(alloc, &out, key, strlen(key))
+          && exif__buf_append(alloc, &out, "\": ", 3)
+          && (exif__json_number(c.value[i])
+              ? exif__buf_append(alloc, &out, c.value[i], strlen(c.value[i]))
+              : exif__json_append_string(alloc, &out, c.value[i]));
+    }
+    ok = ok && exif__buf_append(alloc, &out, "\n}]\n", 4);
+    if (!ok) {
+        exif__buf_free(alloc, &out);
+        return false;
+    }
+    *result = exif__ok_result(out.data, out.len, 0);
+    return true;
+}
+
+// exif__read_native on a file, mapped rather than read
+static bool exif__read_native_path(exif_t *ctx, const char *path,
+                                   const exif_options_t *opts, exif_result_t *result)
+{
+    if (!opts || opts->profile != EXIF_PROFILE_COMMON) return false;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    bool ok = false;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            ok = exif__read_native(&ctx->alloc, map, (size_t)st.st_size, path, opts, result);
+            munmap(map, (size_t)st.st_size);
+        }
+    }
+    close(fd);
+    if (ok) ctx->counters.native_reads++;
+    return ok;
+}
+
+static exif_result_t exif__read_buf(exif_t *ctx, const void *arg,
+                                    const exif_options_t *opts)
+{
+    exif_allocator_t *alloc = &ctx->alloc;
+    exif_buf_t input = *(const exif_buf_t *)arg;
+
+    const char *name = input.filename;
+    if (!name || !*name) name = "input";
+
+    // The native reader reports the path the fallback mounts the buffer at
+    char vpath[EXIF__VFS_PATH_MAX];
+    if (exif__wasi_hooked) exif__vfs_name(ctx, vpath, name);
+    if (opts && opts->profile == EXIF_PROFILE_COMMON) {
+        exif_result_t result;
+        if (exif__read_native(alloc, input.data, input.len,
+                              exif__wasi_hooked ? vpath : name, opts, &result)) {
+            ctx->counters.native_reads++;
+            return result;
+        }
+    }
+
+    exif__span_t *spans = NULL;
+    size_t nspans = 0;
+    if (opts && opts->prefilter && !exif__read_args_any(opts, exif__arg_hashes))
+        exif__prefilter(alloc, input.data, input.len, exif__read_embedded(opts),
+                        &spans, &nspans);
+
+    // Mount the caller's buffer under its own name; nothing touches disk
+    if (exif__wasi_hooked) {
+        uint64_t t = exif__timer(ctx);
+        exif__vfile_t *f = exif__vfs_mount(ctx, vpath, input.data, input.len);
+        exif__phase_end(ctx, EXIF__PHASE_SPILL, t);
+        if (!f) {
+            if (spans) alloc->free(spans, nspans * sizeof *spans, alloc->ctx);
+            return exif__err_result(alloc, "out of memory", -1);
+        }
+        f->spans = spans;
+        f->nspans = nspans;
+        exif_result_t result = exif__read_path(ctx, vpath, opts);
+        exif__vfs_unmount(ctx, vpath);
+        return result;
+    }
+
+    // Write to temp dir with original filename so exiftool reports it correctly
+    char dir_buf[256];
+    snprintf(dir_buf, sizeof dir_buf, "/tmp/libexif_XXXXXX");
+    char path_buf[512];
+    int fd = -1;
+    exif_result_t result;
+    if (!mkdtemp(dir_buf)) {
+        result = exif__err_result(alloc, "failed to create temp dir", -1);
+        goto done;
+    }
+
+    snprintf(path_buf, sizeof path_buf, "%s/%s", dir_buf, name);
+
+    uint64_t t = exif__timer(ctx);
+    fd = open(path_buf, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        rmdir(dir_buf);
+        result = exif__err_result(alloc, "failed to create temp file", -1);
+        goto done;
+    }
+    bool written = exif__write_spans(fd, input.data, input.len, spans, nspans);
+    close(fd);
+    exif__phase_end(ctx, EXIF__PHASE_SPILL, t);
+    if (!written) {
+        unlink(path_buf);
+        rmdir(dir_buf);
+        result = exif__err_result(alloc, "write failed", -1);
+        goto done;
+    }
+
+    result = exif__read_path(ctx, path_buf, opts);
+
+    unlink(path_buf);
+    rmdir(dir_buf);
+
+done:
+    if (spans) alloc->free(spans, nspans * sizeof *spans, alloc->ctx);
+    return result;
+}
+
+exif_result_t exif_read_buf(exif_t *ctx, exif_buf_t input,
+                            const exif_options_t *opts)
+{
+    exif_options_t merged;
+    opts = exif__with_prepared(opts, &merged);
+    exif__call_begin(ctx);
+    bool sink = exif__sink_begin(ctx, opts, 0);
+    exif__buf_t key = {0};
+    exif_result_t result = exif__cache_key(ctx, &key, NULL, &input, opts)
+        ? exif__cache_run(ctx, &key, exif__read_buf, &input, opts)
+        : exif__read_buf(ctx, &input, opts);
+    exif__buf_free(&ctx->alloc, &key);
+    exif__apply_transform(&ctx->alloc, &result, opts);
+    if (sink) exif__sink_end(ctx, &result);
+    exif__call_end(ctx, &result, 1, input.len);
+    return result;
+}
+
+// Pull a whole source into memory, for readers without a known size.
+static bool exif__reader_slurp(exif_allocator_t *alloc, const exif_reader_t *r,
+                               exif__buf_t *out)
+{
+    *out = (exif__buf_t){0};
+    for (;;) {
+        if (!exif__buf_reserve(alloc, out, EXIF__STREAM_BLOCK)) break;
+        int64_t got = r->pread
+            ? r->pread(r->ctx, out->data + out->len, EXIF__STREAM_BLOCK, out->len)
+            : r->read(r->ctx, out->data + out->len, EXIF__STREAM_BLOCK);
+        if (got < 0) break;
+        if (got == 0) return true;
+        out->len += (size_t)got;
+    }
+    exif__buf_free(alloc, out);
+    return false;
+}
+
+static exif_result_t exif__read_stream(exif_t *ctx, const exif_reader_t *reader,
+                                       const char *filename, int64_t size,
+                                       const exif_options_t *opts)
+{
+    exif_allocator_t *alloc = &ctx->alloc;
+    if (!reader || (!reader->pread && !reader->read))
+        return exif__err_result(alloc, "reader needs pread or read", -1);
+
+    const char *name = filename;
+    if (!name || !*name) name = "input";
+
+    // exiftool stats the file up front, so a source of unknown size has to
+    // be read to the end anyway; do it once and serve it as a buffer
+    if (size < 0 || !exif__wasi_hooked) {
+        exif__buf_t all;
+        if (!exif__reader_slurp(alloc, reader, &all))
+            return exif__err_result(alloc, "failed to read from reader", -1);
+        exif_buf_t buf = { .data = all.data, .len = all.len, .filename = name };
+        exif_result_t result = exif_read_buf(ctx, buf, opts);
+        exif__buf_free(alloc, &all);
+        return result;
+    }
+
+    exif__vstream_t *stream = alloc->alloc(sizeof *stream, alloc->ctx);
+    if (!stream) return exif__err_result(alloc, "out of memory", -1);
+    *stream = (exif__vstream_t){ .reader = *reader };
+
+    char vpath[EXIF__VFS_PATH_MAX];
+    exif__vfs_name(ctx, vpath, name);
+    uint64_t t = exif__timer(ctx);
+    exif__vfile_t *f = exif__vfs_mount(ctx, vpath, NULL, (size_t)size);
+    exif__phase_end(ctx, EXIF__PHASE_SPILL, t);
+    if (!f) {
+        exif__vstream_free(alloc, stream);
+        return exif__err_result(alloc, "out of memory", -1);
+    }
+    f->stream = stream;
+
+    exif_result_t result = exif__read_path(ctx, vpath, opts);
+    exif__vfs_unmount(ctx, vpath);
+    exif__apply_transform(alloc, &result, opts);
+    return result;
+}
+
+exif_result_t exif_read_stream(exif_t *ctx, const exif_reader_t *reader,
+                               const char *filename, const exif_options_t *opts)
+{
+    exif_options_t merged;
+    opts = exif__with_prepared(opts, &merged);
+    exif__call_begin(ctx);
+    bool sink = exif__sink_begin(ctx, opts, 0);
+    int64_t size = reader && reader->size ? reader->size(reader->ctx) : -1;
+    exif_result_t result = exif__read_stream(ctx, reader, filename, size, opts);
+    if (sink) exif__sink_end(ctx, &result);
+    exif__call_end(ctx, &result, 1, size > 0 ? (uint64_t)size : 0);
+    return result;
+}
+
+static int64_t exif__fd_reader_size(void *ctx)
+{
+    struct stat st;
+    int fd = (int)(intptr_t)ctx;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    return st.st_size;
+}
+
+static int64_t exif__fd_reader_pread(void *ctx, void *buf, size_t len, uint64_t off)
+{
+    ssize_t n;
+    do n = pread((int)(intptr_t)ctx, buf, len, (off_t)off); while (n < 0 && errno == EINTR);
+    return n;
+}
+
+static int64_t exif__fd_reader_read(void *ctx, void *buf, size_t len)
+{
+    ssize_t n;
+    do n = read((int)(intptr_t)ctx, buf, len); while (n < 0 && errno == EINTR);
+    return n;
+}
+
+exif_result_t exif_read_fd(exif_t *ctx, int fd, const char *filename,
+                           const exif_options_t *opts)
+{
+    exif_options_t merged;
+    opts = exif__with_prepared(opts, &merged);
+    // With a name to report, serve the fd as a stream: regular files are
+    // read lazily at the offsets exiftool asks for, pipes are spooled
+    if (filename && *filename && exif__wasi_hooked) {
+        bool seekable = exif__fd_reader_size((void *)(intptr_t)fd) >= 0;
+        exif_reader_t reader = {
+            .size  = exif__fd_reader_size,
+            .pread = seekable ? exif__fd_reader_pread : NULL,
+            .read  = exif__fd_reader_read,
+            .ctx   = (void *)(intptr_t)fd,
+        };
+        return exif_read_stream(ctx, &reader, filename, opts);
+    }
+
+    char path[32];
+    snprintf(path, sizeof path, "/dev/fd/%d", fd);
+    return exif_read(ctx, path, opts);
+}
+
+// --- binary output ---
+
+// Documents written by resources/exifbin.pl for EXIF_FORMAT_BINARY reads, one
+// per file: "EXB1", a u32 body length and the body, all little-endian. Every
+// string in a document is length-prefixed and NUL-terminated, so decoding
+// only assigns pointers into it.
+
+#define EXIF__BIN_MAGIC "EXB1"
+
+typedef struct exif__bin_doc {
+    const uint8_t *strings;   // first string-table entry
+    uint32_t       nstrings;
+    const uint8_t *tags;      // first tag record
+    uint32_t       ntags;
+    const uint8_t *end;
+} exif__bin_doc_t;
+
+static bool exif__bin_next_doc(const char **pos, const char *end,
+                               const char **doc, size_t *doc_len)
+{
+    const char *p = *pos;
+    if (end - p < 8 || memcmp(p, EXIF__BIN_MAGIC, 4) != 0) return false;
+    uint32_t len = exif__rd32((const uint8_t *)p + 4, true);
+    if ((size_t)(end - p) - 8 < len) return false;
+    *doc = p;
+    *doc_len = 8 + (size_t)len;
+    *pos = p + 8 + len;
+    return true;
+}
+
+// The string at *p; advances *p past its NUL.
+static const char *exif__bin_str(const uint8_t **p, const uint8_t *end,
+                                 uint32_t *len)
+{
+    if (end - *p < 4) return NULL;
+    uint32_t n = exif__rd32(*p, true);
+    if ((size_t)(end - *p) - 4 <= n || (*p)[4 + n] != 0) return NULL;
+    const char *s = (const char *)*p + 4;
+    *p += 4 + (size_t)n + 1;
+    if (len) *len = n;
+    return s;
+}
+
+static bool exif__bin_open(const char *doc, size_t len, exif__bin_doc_t *d)
+{
+    const uint8_t *p = (const uint8_t *)doc + 8, *end = (const uint8_t *)doc + len;
+    if (end - p < 4) return false;
+    d->nstrings = exif__rd32(p, true);
+    d->strings = p += 4;
+    for (uint32_t i = 0; i < d->nstrings; i++)
+        if (!exif__bin_str(&p, end, NULL)) return false;
+    if (end - p < 4) return false;
+    d->ntags = exif__rd32(p, true);
+    d->tags = p + 4;
+    d->end = end;
+    // A record takes at least 9 bytes
+    return d->ntags <= (size_t)(end - d->tags) / 9;
+}
+
+// String i of the table, or NULL past its end.
+static const char *exif__bin_string(const exif__bin_doc_t *d, uint32_t i)
+{
+    const uint8_t *p = d->strings;
+    const char *s = NULL;
+    for (uint32_t k = 0; k <= i && k < d->nstrings; k++)
+        s = exif__bin_str(&p, d->end, NULL);
+    return i < d->nstrings ? s : NULL;
+}
+
+// Decode the value of the tag record at *p into tag, leaving the string
+// indices of its group and name in *group and *name; advances *p.
+static bool exif__bin_tag(const uint8_t **p, const uint8_t *end,
+                          exif_tag_t *tag, uint32_t *group, uint32_t *name)
+{
+    uint32_t len = 0;
+    if (end - *p < 9) return false;
+    *group = exif__rd32(*p, true);
+    *name = exif__rd32(*p + 4, true);
+    uint8_t type = (*p)[8];
+    *p += 9;
+
+    *tag = (exif_tag_t){ .type = (exif_value_type_t)type };
+    switch (type) {
+    case EXIF_VALUE_NULL:
+        tag->text = "null";
+        tag->text_len = 4;
+        return true;
+    case EXIF_VALUE_NUMBER: {
+        if (end - *p < 8) return false;
+        uint64_t bits = (uint64_t)exif__rd32(*p, true)
+                      | (uint64_t)exif__rd32(*p + 4, true) << 32;
+        memcpy(&tag->number, &bits, sizeof bits);
+        *p += 8;
+        break;
+    }
+    case EXIF_VALUE_STRING: case EXIF_VALUE_ARRAY:
+    case EXIF_VALUE_OBJECT: case EXIF_VALUE_BINARY:
+        break;
+    default:
+        return false;
+    }
+    tag->text = exif__bin_str(p, end, &len);
+    tag->text_len = len;
+    return tag->text != NULL;
+}
+
+// SourceFile, which the emitter writes as the first tag of each document.
+static const char *exif__bin_source(const char *doc, size_t len)
+{
+    exif__bin_doc_t d;
+    exif_tag_t tag;
+    uint32_t group, name;
+    const uint8_t *p;
+    if (!exif__bin_open(doc, len, &d) || !d.ntags) return NULL;
+    p = d.tags;
+    if (!exif__bin_tag(&p, d.end, &tag, &group, &name)) return NULL;
+    const char *g = exif__bin_string(&d, group), *n = exif__bin_string(&d, name);
+    return g && !*g && n && strcmp(n, "SourceFile") == 0 && tag.type == EXIF_VALUE_STRING
+           ? tag.text : NULL;
+}
+
+// Paths per exiftool run in exif_read_many; bounds argv and stdout size
+#define EXIF__READ_MANY_CHUNK 512
+
+// Skip the JSON string starting at p (on the opening quote). memchr does the
+// scanning, so long values are crossed a vector at a time; a quote is
+// escaped when an odd run of backslashes precedes it.
+static const char *exif__json_skip_string(const char *p, const char *end)
+{
+    for (p++; p < end; ) {
+        const char *q = memchr(p, '"', (size_t)(end - p));
+        if (!q) return end;
+        size_t bs = 0;
+        while (q - bs > p && q[-1 - (ptrdiff_t)bs] == '\\') bs++;
+        if (bs % 2 == 0) return q + 1;
+        p = q + 1;
+    }
+    return end;
+}
+
+// Find the next top-level object of a JSON array; advances *pos past it.
+static bool exif__json_next_object(const char **pos, const char *end,
+                                   const char **obj, size_t *obj_len)
+{
+    const char *p = *pos;
+    while (p < end && *p != '{') p++;
+    if (p >= end) return false;
+
+    const char *start = p;
+    int depth = 0;
+    while (p < end) {
+        if (*p == '"') { p = exif__json_skip_string(p, end); continue; }
+        if (*p == '{' || *p == '[') depth++;
+        else if ((*p == '}' || *p == ']') && --depth == 0) break;
+        p++;
+    }
+    if (p >= end) return false;
+    *obj = start;
+    *obj_len = (size_t)(p + 1 - start);
+    *pos = p + 1;
+    return true;
+}
+
+// Decode the JSON string [p, close) (opening quote to one past the closing
+// one) into out, which needs close - p bytes. Returns the decoded length.
+static size_t exif__json_decode_into(char *out, const char *p, const char *close)
+{
+    char *o = out;
+    for (p++; p < close - 1; p++) {
+        if (*p != '\\') { *o++ = *p; continue; }
+        switch (*++p) {
+        case 'b': *o++ = '\b'; break;
+        case 'f': *o++ = '\f'; break;
+        case 'n': *o++ = '\n'; break;
+        case 'r': *o++ = '\r'; break;
+        case 't': *o++ = '\t'; break;
+        case 'u': {
+            if (close - p < 5) break;
+            unsigned cp = (unsigned)strtoul((char[5]){ p[1], p[2], p[3], p[4], 0 }, NULL, 16);
+            p += 4;
+            if (cp >= 0xD800 && cp < 0xDC00 && close - p >= 7 && p[1] == '\\' && p[2] == 'u') {
+                unsigned lo = (unsigned)strtoul((char[5]){ p[3], p[4], p[5], p[6], 0 }, NULL, 16);
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                p += 6;
+            }
+            if (cp < 0x80) {
+                *o++ = (char)cp;
+            } else if (cp < 0x800) {
+                *o++ = (char)(0xC0 | cp >> 6);
+                *o++ = (char)(0x80 | (cp & 0x3F));
+            } else if (cp < 0x10000) {
+                *o++ = (char)(0xE0 | cp >> 12);
+                *o++ = (char)(0x80 | (cp >> 6 & 0x3F));
+                *o++ = (char)(0x80 | (cp & 0x3F));
+            } else {
+                *o++ = (char)(0xF0 | cp >> 18);
+                *o++ = (char)(0x80 | (cp >> 12 & 0x3F));
+                *o++ = (char)(0x80 | (cp >> 6 & 0x3F));
+                *o++ = (char)(0x80 | (cp & 0x3F));
+            }
+            break;
+        }
+        default: *o++ = *p; break;
+        }
+    }
+    *o = '\0';
+    return (size_t)(o - out);
+}
+
+// Decode the JSON string starting at p (on the opening quote).
+static char *exif__json_decode_string(exif_allocator_t *alloc, const char *p,
+                                      const char *end)
+{
+    const char *close = exif__json_skip_string(p, end);
+    char *out = alloc->alloc((size_t)(close - p) + 1, alloc->ctx);
+    if (!out) return NULL;
+    exif__json_decode_into(out, p, close);
+    return out;
+}
+
+// Locate the string value of a top-level key in obj. Matches "Key" and any
+// "Group:Key" form produced by -G.
+static const char *exif__json_find_value(const char *obj, size_t len,
+                                         const char *key)
+{
+    const char *p = obj + 1, *end = obj + len;
+    size_t klen = strlen(key);
+    int depth = 1;
+    while (p < end) {
+        if (*p == '"') {
+            const char *s = p;
+            p = exif__json_skip_string(p, end);
+            if (depth != 1) continue;
+            const char *q = p;
+            while (q < end && (*q == ' ' || *q == '\t' || *q == '\n' || *q == '\r')) q++;
+            if (q >= end || *q != ':') continue;
+            size_t slen = (size_t)(p - s) - 2;
+            bool match = slen >= klen && memcmp(p - 1 - klen, key, klen) == 0
+                         && (slen == klen || p[-2 - (int)klen] == ':');
+            if (!match) continue;
+            for (q++; q < end && (*q == ' ' || *q == '\t' || *q == '\n' || *q == '\r'); q++) {}
+            return q < end && *q == '"' ? q : NULL;
+        }
+        if (*p == '{' || *p == '[') depth++;
+        else if (*p == '}' || *p == ']') depth--;
+        p++;
+    }
+    return NULL;
+}
+
+// exiftool reports files it could not open on stderr as "Error: ... - <path>"
+static char *exif__stderr_error_for(exif_allocator_t *alloc, const char *err,
+                                    const char *path)
+{
+    size_t plen = strlen(path);
+    for (const char *line = err; line && *line; ) {
+        const char *eol = strchr(line, '\n');
+        size_t len = eol ? (size_t)(eol - line) : strlen(line);
+        if (len > plen + 3 && memcmp(line + len - plen - 3, " - ", 3) == 0
+            && memcmp(line + len - plen, path, plen) == 0) {
+            char *msg = alloc->alloc(len + 1, alloc->ctx);
+            if (msg) { memcpy(msg, line, len); msg[len] = '\0'; }
+            return msg;
+        }
+        line = eol ? eol + 1 : NULL;
+    }
+    return NULL;
+}
+
+// Copy [p, p + len) into a NUL-terminated string
+static char *exif__strndup(exif_allocator_t *alloc, const char *p, size_t len)
+{
+    char *s = alloc->alloc(len + 1, alloc->ctx);
+    if (!s) return NULL;
+    memcpy(s, p, len);
+    s[len] = '\0';
+    return s;
+}
+
+// Find the next line starting with the {<name>i} marker of command i. *pos
+// is where the command's own output starts; *seg_end gets the start of the
+// marker line, and *pos moves past it. Returns the text after the marker,
+// or NULL.
+static const char *exif__marker(const char **pos, const char *end,
+                                const char *name, size_t i, const char **seg_end)
+{
+    char marker[40];
+    int mlen = snprintf(marker, sizeof marker, "{%s%u", name, (unsigned)i);
+    for (const char *line = *pos; line < end; ) {
+        const char *eol = memchr(line, '\n', (size_t)(end - line));
+        if (!eol) eol = end;
+        if ((size_t)(eol - line) > (size_t)mlen && memcmp(line, marker, (size_t)mlen) == 0
+            && (line[mlen] == '}' || line[mlen] == ' ')) {
+            *seg_end = line;
+            *pos = eol < end ? eol + 1 : end;
+            return line + mlen;
+        }
+        line = eol + 1;
+    }
+    return NULL;
+}
+
+static void exif__read_many_run(exif_t *ctx, const char *const *paths,
+                                size_t n, const exif_options_t *opts,
+                                exif_result_t *results)
+{
+    exif_allocator_t *alloc = &ctx->alloc;
+    for (size_t i = 0; i < n; i++)
+        results[i] = (exif_result_t){0};
+
+    int ntail;
+    const char **tail = exif__read_tail(ctx, opts, paths, n, &ntail);
+    const char *script = exif__read_script(ctx, opts);
+    exif_result_t run = tail ? exif__run_ex(ctx, tail, ntail, opts, true, script)
+                             : exif__err_result(alloc, "out of memory", -1);
+    if (tail) alloc->free(tail, ntail * sizeof *tail, alloc->ctx);
+    if (!run.success) {
+        for (size_t i = 0; i < n; i++)
+            results[i] = exif__err_result(alloc, run.error ? run.error
+                                          : "exiftool failed", run.exit_code);
+        exif_result_free(ctx, &run);
+        return;
+    }
+
+    // exiftool emits objects in argument order, so the next unfilled slot
+    // is almost always the match; a scan covers duplicates and skipped files.
+    // Binary documents each stand alone and are handed out as they are.
+    bool binary = script != NULL;
+    const char *pos = run.data, *end = run.data + run.data_len;
+    const char *obj;
+    size_t obj_len, next = 0;
+    while (run.data && (binary ? exif__bin_next_doc(&pos, end, &obj, &obj_len)
+                               : exif__json_next_object(&pos, end, &obj, &obj_len))) {
+        char *decoded = NULL;
+        const char *source;
+        if (binary) {
+            source = exif__bin_source(obj, obj_len);
+        } else {
+            const char *sf = exif__json_find_value(obj, obj_len, "SourceFile");
+            source = decoded = sf ? exif__json_decode_string(alloc, sf, obj + obj_len)
+                                  : NULL;
+        }
+        if (!source) continue;
+
+        size_t slot = n;
+        for (size_t k = 0; k < n && slot == n; k++) {
+            size_t i = (next + k) % n;
+            if (!results[i].success && !results[i].error
+                && strcmp(paths[i], source) == 0)
+                slot = i;
+        }
+        if (decoded) alloc->free(decoded, 0, alloc->ctx);
+        if (slot == n) continue;
+        next = slot + 1;
+
+        if (binary) {
+            char *data = alloc->alloc(obj_len + 1, alloc->ctx);
+            if (data) {
+                memcpy(data, obj, obj_len);
+                data[obj_len] = '\0';
+            }
+            results[slot] = data ? exif__ok_result(data, obj_len, 0)
+                                 : exif__err_result(alloc, "out of memory", -1);
+            continue;
+        }
+
+        const char *ev = exif__json_find_value(obj, obj_len, "Error");
+        if (ev) {
+            char *msg = exif__json_decode_string(alloc, ev, obj + obj_len);
+            results[slot] = exif__err_result(alloc, msg ? msg : "exiftool error", 1);
+            if (msg) alloc->free(msg, 0, alloc->ctx);
+            continue;
+        }
+
+        // Same shape as a single-file exif_read: a one-element array
+        char *data = alloc->alloc(obj_len + 4, alloc->ctx);
+        if (!data) {
+            results[slot] = exif__err_result(alloc, "out of memory", -1);
+            continue;
+        }
+        data[0] = '[';
+        memcpy(data + 1, obj, obj_len);
+        memcpy(data + 1 + obj_len, "]\n", 3);
+        results[slot] = exif__ok_result(data, obj_len + 3, 0);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (results[i].success || results[i].error) continue;
+        int32_t code = run.exit_code ? run.exit_code : 1;
+        char *msg = run.error ? exif__stderr_error_for(alloc, run.error, paths[i]) : NULL;
+        if (msg)
+            results[i] = (exif_result_t){ .error = msg, .exit_code = code };
+        else
+            results[i] = exif__err_result(alloc, "exiftool produced no output for file", code);
+    }
+    exif_result_free(ctx, &run);
+    for (size_t i = 0; i < n; i++)
+        exif__read_convert(ctx, opts, script, &results[i]);
+}
+
+// Paths the native reader covers are filled in directly; exiftool reads
+// the rest in one run.
+static void exif__read_many_chunk(exif_t *ctx, const char *const *paths,
+                                  size_t n, const exif_options_t *opts,
+                                  exif_result_t *results)
+{
+    exif_allocator_t *alloc = &ctx->alloc;
+    if (!opts || opts->profile != EXIF_PROFILE_COMMON) {
+        exif__read_many_run(ctx, paths, n, opts, results);
+        return;
+    }
+    const char **rest = alloc->alloc(n * sizeof *rest, alloc->ctx);
+    size_t *slots = alloc->alloc(n * sizeof *slots, alloc->ctx);
+    exif_result_t *sub = alloc->alloc(n * sizeof *sub, alloc->ctx);
+    if (rest && slots && sub) {
+        size_t nrest = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (exif__read_native_path(ctx, paths[i], opts, &results[i])) continue;
+            rest[nrest] = paths[i];
+            slots[nrest++] = i;
+        }
+        if (nrest) exif__read_many_run(ctx, rest, nrest, opts, sub);
+        for (size_t k = 0; k < nrest; k++)
+            results[slots[k]] = sub[k];
+    } else {
+        exif__read_many_run(ctx, paths, n, opts, results);
+    }
+    if (rest)  alloc->free(rest, n * sizeof *rest, alloc->ctx);
+    if (slots) alloc->free(slots, n * sizeof *slots, alloc->ctx);
+    if (sub)   alloc->free(sub, n * sizeof *sub, alloc->ctx);
+}
+
+// exif_read_many with a sink, one exiftool run per chunk. As in
+// exif__write_many_chunk each file is its own command, with the read
+// arguments after -common_args. -echo3 ends a command's stdout with a
+// {fileN} line, which exif__sink_drain turns into the end of that file while
+// the output streams; -echo4 marks its stderr and status. ids maps each
+// command to the file index reported to the sink and used in results.
+static void exif__read_many_stream(exif_t *ctx, const char *const *paths,
+                                   const size_t *ids, size_t n,
+                                   const exif_options_t *opts,
+                                   exif_result_t *results)
+{
+    exif_allocator_t *alloc = &ctx->alloc;
+    int nconst = 0;
+    const char **consts = exif__read_tail(ctx, opts, NULL, 0, &nconst);
+    int max_tail = (int)n * 6 + 1 + opts->argc + opts->ntags + nconst;
+    const char **tail = alloc->alloc((size_t)max_tail * sizeof *tail, alloc->ctx);
+    char *markers = alloc->alloc(n * 64, alloc->ctx);
+    size_t *lens = alloc->alloc(n * sizeof *lens, alloc->ctx);
+    exif__sink_t s = {0};
+    exif_result_t run;
+    int ntail = 0;
+    if (!consts || !tail || !markers || !lens) {
+        run = exif__err_result(alloc, "out of memory", -1);
+        goto split;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        char *m3 = markers + i * 64, *m4 = m3 + 24;
+        snprintf(m3, 24, "{file%u}", (unsigned)i);
+        snprintf(m4, 40, "{file%u ${status}}", (unsigned)i);
+        tail[ntail++] = "-echo3";
+        tail[ntail++] = m3;
+        tail[ntail++] = "-echo4";
+        tail[ntail++] = m4;
+        tail[ntail++] = paths[i];
+        if (i + 1 < n) tail[ntail++] = "-execute";
+        lens[i] = 0;
+    }
+    tail[ntail++] = "-common_args";
+    for (int i = 0; i < opts->argc; i++)  tail[ntail++] = opts->args[i];
+    for (int i = 0; i < opts->ntags; i++) tail[ntail++] = opts->tags[i];
+    for (int i = 0; i < nconst; i++)      tail[ntail++] = consts[i];
+
+    exif_options_t common = *opts;
+    common.args = NULL;
+    common.argc = 0;
+    common.tags = NULL;
+    common.ntags = 0;
+    pthread_mutex_lock(&ctx->capture.lock);
+    ctx->sink = (exif__sink_t){
+        .fn = opts->sink, .ctx = opts->sink_ctx, .file = ids[0],
+        .ids = ids, .nids = n, .lens = lens, .bol = true,
+    };
+    pthread_mutex_unlock(&ctx->capture.lock);
+    run = exif__run_ex(ctx, tail, ntail, &common, true, NULL);
+    pthread_mutex_lock(&ctx->capture.lock);
+    s = ctx->sink;
+    ctx->sink = (exif__sink_t){0};
+    pthread_mutex_unlock(&ctx->capture.lock);
+
+    // Whatever is left belongs to the command that was running; files past
+    // it end now, with nothing or what they got before the run stopped
+    if (run.success && run.data_len && s.next < n) {
+        exif__buf_t rest = { .data = run.data, .len = run.data_len, .cap = run.data_len };
+        exif__sink_drain(&s, &rest, true);
+        run.data_len = rest.len;
+    }
+    while (s.next < n) exif__sink_end_file(&s, s.next);
+
+split:
+    if (consts)  alloc->free(consts, (size_t)nconst * sizeof *consts, alloc->ctx);
+    if (tail)    alloc->free(tail, (size_t)max_tail * sizeof *tail, alloc->ctx);
+    if (markers) alloc->free(markers, n * 64, alloc->ctx);
+    if (!run.success) {
+        for (size_t i = 0; i < n; i++) {
+            results[ids[i]] = exif__err_result(alloc, run.error ? run.error
+                                               : "exiftool failed", run.exit_code);
+            if (!s.fn) opts->sink(ids[i], NULL, 0, opts->sink_ctx);
+        }
+        if (lens) alloc->free(lens, n * sizeof *lens, alloc->ctx);
+        exif_result_free(ctx, &run);
+        return;
+    }
+
+    const char *err_pos = run.error ? run.error : "";
+    const char *err_end = err_pos + strlen(err_pos);
+    for (size_t i = 0; i < n; i++) {
+        const char *err_start = err_pos, *err_seg;
+        const char *status = exif__marker(&err_pos, err_end, "file", i, &err_seg);
+        if (!status) {
+            char *msg = run.error ? exif__stderr_error_for(alloc, run.error, paths[i]) : NULL;
+            results[ids[i]] = msg ? (exif_result_t){ .error = msg, .exit_code = 1 }
+                                  : exif__err_result(alloc, "exiftool produced no output for file", 1);
+            err_pos = err_start;
+            continue;
+        }
+        int32_t code = (int32_t)strtol(status, NULL, 10);
+        if (code == 0) {
+            results[ids[i]] = exif__ok_result(NULL, lens[i], 0);
+        } else {
+            size_t len = (size_t)(err_seg - err_start);
+            char *msg = len ? exif__strndup(alloc, err_start, len) : NULL;
+            results[ids[i]] = msg ? (exif_result_t){ .error = msg, .exit_code = code }
+                                  : exif__err_result(alloc, "exiftool exited with error", code);
+        }
+    }
+    alloc->free(lens, n * sizeof *lens, alloc->ctx);
+    exif_result_free(ctx, &run);
+}
+
+// exif_read_many with a sink. Returns false when the output can't stream,
+// leaving the usual run to the caller, with each result delivered whole.
+static bool exif__read_many_sink(exif_t *ctx, const char *const *paths, size_t n,
+                                 const exif_options_t *opts, exif_result_t *results)
+{
+    exif_allocator_t *alloc = &ctx->alloc;
+    if (!exif__wasi_hooked || opts->format == EXIF_FORMAT_BINARY) return false;
+
+    // A resident loop already runs each file as one command
+    if (ctx->stay_open && !opts->config_path) {
+        for (size_t i = 0; i < n; i++) {
+            exif__sink_begin(ctx, opts, i);
+            results[i] = exif__read_path(ctx, paths[i], opts);
+            exif__sink_end(ctx, &results[i]);
+        }
+        return true;
+    }
+
+    const char **rest = alloc->alloc(n * sizeof *rest, alloc->ctx);
+    size_t *ids = alloc->alloc(n * sizeof *ids, alloc->ctx);
+    bool ok = rest && ids;
+    size_t nrest = 0;
+    for (size_t i = 0; ok && i < n; i++) {
+        // Native reads are done before the run starts
+        if (exif__read_native_path(ctx, paths[i], opts, &results[i])) {
+            exif__sink_deliver(alloc, opts->sink, opts->sink_ctx, &results[i], i, 0);
+            continue;
+        }
+        rest[nrest] = paths[i];
+        ids[nrest++] = i;
+    }
+    for (size_t off = 0; ok && off < nrest; off += EXIF__READ_MANY_CHUNK) {
+        size_t count = nrest - off < EXIF__READ_MANY_CHUNK ? nrest - off : EXIF__READ_MANY_CHUNK;
+        exif__read_many_stream(ctx, rest + off, ids + off, count, opts, results);
+    }
+    if (rest) alloc->free(rest, n * sizeof *rest, alloc->ctx);
+    if (ids)  alloc->free(ids, n * sizeof *ids, alloc->ctx);
+    return ok;
+}
+
+size_t exif_read_many(exif_t *ctx, const char *const *paths, size_t n,
+                      const exif_options_t *opts, exif_result_t *results)
+{
+    exif_options_t merged;
+    opts = exif__with_prepared(opts, &merged);
+    exif__call_begin(ctx);
+    exif_allocator_t *alloc = &ctx->alloc;
+    const char **miss = NULL;
+    size_t *slots = NULL, nmiss = n, ok = 0;
+    exif__buf_t *keys = NULL;
+    exif_result_t *out = results;
+
+    if (opts && opts->sink && exif__read_many_sink(ctx, paths, n, opts, results)) {
+        for (size_t i = 0; i < n; i++)
+            if (results[i].success) ok++;
+        exif__call_end(ctx, results, n, 0);
+        return ok;
+    }
+
+    // Cache hits are filled in place; only the misses go to exiftool, and
+    // their results are cached as if each had been read alone
+    if (ctx->cache && n) {
+        miss  = alloc->alloc(n * sizeof *miss, alloc->ctx);
+        slots = alloc->alloc(n * sizeof *slots, alloc->ctx);
+        keys  = alloc->alloc(n * sizeof *keys, alloc->ctx);
+        out   = alloc->alloc(n * sizeof *out, alloc->ctx);
+        if (miss && slots && keys && out) {
+            nmiss = 0;
+            for (size_t i = 0; i < n; i++) {
+                exif__buf_t key = {0};
+                if (exif__cache_key(ctx, &key, paths[i], NULL, opts)
+                    && exif__cache_get(ctx, &key, &results[i])) {
+                    exif__buf_free(alloc, &key);
+                    continue;
+                }
+                miss[nmiss] = paths[i];
+                slots[nmiss] = i;
+                keys[nmiss++] = key;
+            }
+            paths = miss;
+        } else {
+            if (out && out != results) alloc->free(out, n * sizeof *out, alloc->ctx);
+            out = results;
+        }
+    }
+
+    for (size_t off = 0; off < nmiss; off += EXIF__READ_MANY_CHUNK) {
+        size_t count = nmiss - off < EXIF__READ_MANY_CHUNK ? nmiss - off : EXIF__READ_MANY_CHUNK;
+        exif__read_many_chunk(ctx, paths + off, count, opts, out + off);
+    }
+
+    if (out != results) {
+        for (size_t k = 0; k < nmiss; k++) {
+            if (keys[k].len && out[k].success) exif__cache_put(ctx, &keys[k], &out[k]);
+            exif__buf_free(alloc, &keys[k]);
+            results[slots[k]] = out[k];
+        }
+        alloc->free(out, n * sizeof *out, alloc->ctx);
+    }
+    if (miss)  alloc->free(miss, n * sizeof *miss, alloc->ctx);
+    if (slots) alloc->free(slots, n * sizeof *slots, alloc->ctx);
+    if (keys)  alloc->free(keys, n * sizeof *keys, alloc->ctx);
+
+    for (size_t i = 0; i < n; i++) {
+        exif__apply_transform(alloc, &results[i], opts);
+        if (opts && opts->sink)
+            exif__sink_deliver(alloc, opts->sink, opts->sink_ctx, &results[i], i, 0);
+        if (results[i].success) ok++;
+    }
+    exif__call_end(ctx, results, n, 0);
+    return ok;
+}
+
+// --- native patcher ---
+
+// Simple edits to a JPEG's EXIF IFD0 and XMP packet are made in C when the
+// options ask for it, with exiftool as the fallback for anything else. The
+// edit must only set ASCII IFD0 tags or existing simple XMP properties,
+// with no extra args or config. The result is a valid file with the same
+// tag values exiftool would write, but not its byte layout: IFD0 is patched
+// where it lies rather than rebuilt.
+
+#define EXIF__PATCH_MAX_EDITS 32
+
+static const struct {
+    const char *name;
+    uint16_t    tag;
+} exif__patch_tags[] = {
+    { "ImageDescription", 0x010E },
+    { "Make",             0x010F },
+    { "Model",            0x0110 },
+    { "Software",         0x0131 },
+    { "Artist",           0x013B },
+    { "HostComputer",     0x013C },
+    { "Copyright",        0x8298 },
+};
+
+// Simple string properties; typed ones go through exiftool's conversions
+static const struct {
+    const char *group;   // after XMP-
+    const char *qname;   // as written in the packet
+} exif__patch_xmp_props[] = {
+    { "photoshop", "photoshop:AuthorsPosition" },
+    { "photoshop", "photoshop:CaptionWriter" },
+    { "photoshop", "photoshop:City" },
+    { "photoshop", "photoshop:Country" },
+    { "photoshop", "photoshop:Credit" },
+    { "photoshop", "photoshop:Headline" },
+    { "photoshop", "photoshop:Instructions" },
+    { "photoshop", "photoshop:Source" },
+    { "photoshop", "photoshop:State" },
+    { "photoshop", "photoshop:TransmissionReference" },
+    { "tiff",      "tiff:Artist" },
+    { "tiff",      "tiff:Make" },
+    { "tiff",      "tiff:Model" },
+    { "tiff",      "tiff:Software" },
+    { "xmp",       "xmp:CreatorTool" },
+    { "xmp",       "xmp:Label" },
+    { "xmpRights", "xmpRights:WebStatement" },
+};
+
+typedef struct exif__patch_edit {
+    const char *name;      // tag name
+    size_t      name_len;
+    const char *qname;     // XMP property; NULL for EXIF
+    const char *value;
+    uint16_t    tag;       // EXIF tag ID
+    bool        exif_only; // written with an EXIF/IFD0 group
+} exif__patch_edit_t;
+
+static void exif__wr16(uint8_t *p, uint16_t v, bool le)
+{
+    if (le) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); }
+    else    { p[0] = (uint8_t)(v >> 8); p[1] = (uint8_t)v; }
+}
+
+static void exif__wr32(uint8_t *p, uint32_t v, bool le)
+{
+    for (int i = 0; i < 4; i++)
+        p[le ? i : 3 - i] = (uint8_t)(v >> 8 * i);
+}
+
+// Parse "-[Group:]Tag=Value" into an edit. False for anything exiftool has
+// to handle: deletions, +=, redirection, other groups, non-ASCII values.
+static bool exif__patch_parse(const char *arg, exif__patch_edit_t *e)
+{
+    *e = (exif__patch_edit_t){0};
+    if (!arg || arg[0] != '-') return false;
+    const char *eq = strchr(arg, '=');
+    if (!eq || !eq[1]) return false;
+    for (const char *v = eq + 1; *v; v++)
+        if ((unsigned char)*v < 0x20 || (unsigned char)*v >= 0x7F) return false;
+    e->value = eq + 1;
+
+    const char *name = arg + 1, *colon = memchr(name, ':', (size_t)(eq - name));
+    const char *xmp_group = NULL;
+    size_t xmp_group_len = 0;
+    if (colon) {
+        size_t glen = (size_t)(colon - name);
+        if (glen > 4 && strncasecmp(name, "XMP-", 4) == 0) {
+            xmp_group = name + 4;
+            xmp_group_len = glen - 4;
+        } else if ((glen == 4 && strncasecmp(name, "EXIF", 4) == 0)
+                   || (glen == 4 && strncasecmp(name, "IFD0", 4) == 0)) {
+            e->exif_only = true;
+        } else {
+            return false;
+        }
+        name = colon + 1;
+    }
+    e->name = name;
+    e->name_len = (size_t)(eq - name);
+    if (!e->name_len) return false;
+    for (size_t i = 0; i < e->name_len; i++)
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_') return false;
+    if (xmp_group) {
+        for (size_t i = 0; i < sizeof exif__patch_xmp_props / sizeof *exif__patch_xmp_props; i++) {
+            const char *group = exif__patch_xmp_props[i].group;
+            const char *prop = strchr(exif__patch_xmp_props[i].qname, ':') + 1;
+            if (strlen(group) == xmp_group_len && strncasecmp(group, xmp_group, xmp_group_len) == 0
+                && strlen(prop) == e->name_len && strncasecmp(prop, name, e->name_len) == 0) {
+                e->qname = exif__patch_xmp_props[i].qname;
+                return true;
+            }
+        }
+        return false;
+    }
+    for (size_t i = 0; i < sizeof exif__patch_tags / sizeof *exif__patch_tags; i++)
+        if (strlen(exif__patch_tags[i].name) == e->name_len
+            && strncasecmp(exif__patch_tags[i].name, name, e->name_len) == 0) {
+            e->tag = exif__patch_tags[i].tag;
+            return true;
+        }
+    return false;
+}
+
+typedef struct exif__jpeg_segs {
+    size_t exif, exif_len;  // APP1 Exif: marker offset, total bytes
+    size_t xmp, xmp_len;    // APP1 XMP
+    bool   xmp_extended;
+} exif__jpeg_segs_t;
+
+static bool exif__patch_scan(const uint8_t *d, size_t len, exif__jpeg_segs_t *s)
+{
+    static const char xmp_ns[] = "http://ns.adobe.com/xap/1.0/";
+    static const char ext_ns[] = "http://ns.adobe.com/xmp/extension/";
+    *s = (exif__jpeg_segs_t){0};
+    if (len < 4 || d[0] != 0xFF || d[1] != 0xD8) return false;
+    size_t p = 2;
+    while (p + 4 <= len) {
+        if (d[p] != 0xFF) return false;
+        uint8_t m = d[p + 1];
+        if (m == 0xFF) { p++; continue; }
+        if (m == 0xDA || m == 0xD9) return true;
+        if (m == 0x01 || (m >= 0xD0 && m <= 0xD7)) { p += 2; continue; }
+        size_t seglen = exif__rd16(d + p + 2, false);
+        if (seglen < 2 || seglen > len - p - 2) return false;
+        const uint8_t *body = d + p + 4;
+        size_t blen = seglen - 2;
+        if (m == 0xE1) {
+            if (blen >= 14 && memcmp(body, "Exif\0\0", 6) == 0 && !s->exif) {
+                s->exif = p;
+                s->exif_len = seglen + 2;
+            } else if (blen > sizeof xmp_ns && memcmp(body, xmp_ns, sizeof xmp_ns) == 0
+                       && !s->xmp) {
+                s->xmp = p;
+                s->xmp_len = seglen + 2;
+            } else if (blen > sizeof ext_ns && memcmp(body, ext_ns, sizeof ext_ns) == 0) {
+                s->xmp_extended = true;
+            }
+        }
+        p += 2 + seglen;
+    }
+    return false;
+}
+
+// Find name case-insensitively as a property (after a ':' and followed by
+// '=', '>', '/' or white space) anywhere in the packet.
+static bool exif__xmp_has_property(const char *x, size_t len, const char *name,
+                                   size_t nlen)
+{
+    for (size_t i = 1; i + nlen < len; i++) {
+        if (x[i - 1] != ':' || strncasecmp(x + i, name, nlen) != 0) continue;
+        char c = x[i + nlen];
+        if (c == '=' || c == '>' || c == '/' || c == ' ' || c == '\t'
+            || c == '\r' || c == '\n') return true;
+    }
+    return false;
+}
+
+// Escaped value, or NULL when out of memory
+static char *exif__xml_escape(exif_allocator_t *alloc, const char *v, size_t *out_len)
+{
+    exif__buf_t b = {0};
+    bool ok = exif__buf_reserve(alloc, &b, strlen(v));
+    for (; ok && *v; v++) {
+        const char *ent = *v == '&' ? "&amp;" : *v == '<' ? "&lt;" : *v == '>' ? "&gt;"
+                        : *v == '"' ? "&quot;" : *v == '\'' ? "&#39;" : NULL;
+        ok = ent ? exif__buf_append(alloc, &b, ent, strlen(ent))
+                 : exif__buf_append(alloc, &b, v, 1);
+    }
+    if (!ok) { exif__buf_free(alloc, &b); return NULL; }
+    *out_len = b.len;
+    return b.data;
+}
+
+// Replace the value of an existing simple XMP property inside the packet,
+// taking the size difference out of the padding before <?xpacket end so
+// the segment keeps its length. Returns false to fall back.
+static bool exif__patch_xmp(exif_allocator_t *alloc, char *x, size_t len,
+                            const exif__patch_edit_t *e)
+{
+    const char *qname = e->qname;
+    size_t qlen = strlen(qname);
+
+    // Attribute form prefix:Name="v", or element form <prefix:Name>v</...>
+    size_t vstart = 0, vend = 0;
+    for (size_t i = 1; i + qlen + 2 < len && !vend; i++) {
+        if (memcmp(x + i, qname, qlen) != 0) continue;
+        char before = x[i - 1], after = x[i + qlen];
+        if (after == '=' && (before == ' ' || before == '\t' || before == '\r' || before == '\n')
+            && (x[i + qlen + 1] == '"' || x[i + qlen + 1] == '\'')) {
+            const char *close = memchr(x + i + qlen + 2, x[i + qlen + 1], len - i - qlen - 2);
+            if (!close) return false;
+            vstart = i + qlen + 2;
+            vend = (size_t)(close - x);
+        } else if (after == '>' && before == '<') {
+            const char *close = memchr(x + i + qlen + 1, '<', len - i - qlen - 1);
+            if (!close || (size_t)(x + len - close) < qlen + 3
+                || close[1] != '/' || memcmp(close + 2, qname, qlen) != 0
+                || close[2 + qlen] != '>') return false;  // structured value
+            vstart = i + qlen + 1;
+            vend = (size_t)(close - x);
+        }
+    }
+    if (!vend) return false;
+
+    static const char trailer[] = "<?xpacket end=";
+    size_t pad_end = 0;
+    for (size_t i = len; i-- > vend; )
+        if (len - i >= sizeof trailer - 1 && memcmp(x + i, trailer, sizeof trailer - 1) == 0) {
+            pad_end = i;
+            break;
+        }
+    if (!pad_end) return false;
+    size_t pad_start = pad_end;
+    while (pad_start > vend && (x[pad_start - 1] == ' ' || x[pad_start - 1] == '\n'
+                                || x[pad_start - 1] == '\r' || x[pad_start - 1] == '\t'))
+        pad_start--;
+
+    size_t nlen;
+    char *val = exif__xml_escape(alloc, e->value, &nlen);
+    if (!val) return false;
+    size_t olen = vend - vstart;
+    bool ok = nlen <= olen || nlen - olen <= pad_end - pad_start;
+    if (ok) {
+        // Shift what lies between the value and the padding, then refill
+        // the padding with spaces up to the trailer
+        size_t tail = pad_start - vend;
+        memmove(x + vstart + nlen, x + vend, tail);
+        memcpy(x + vstart, val, nlen);
+        size_t new_pad_start = vstart + nlen + tail;
+        memset(x + new_pad_start, ' ', pad_end - new_pad_start);
+        if (pad_end - new_pad_start) x[pad_end - 1] = '\n';
+    }
+    alloc->free(val, 0, alloc->ctx);
+    return ok;
+}
+
+typedef struct exif__ifd_entry {
+    uint8_t raw[12];
+    uint16_t tag;
+} exif__ifd_entry_t;
+
+static int exif__ifd_entry_cmp(const void *a, const void *b)
+{
+    const exif__ifd_entry_t *x = a, *y = b;
+    return (int)x->tag - (int)y->tag;
+}
+
+// Append ASCII value v to the TIFF block, word aligned. Returns its offset.
+static bool exif__tiff_append(exif_allocator_t *alloc, exif__buf_t *t,
+                              const char *v, size_t vlen, uint32_t *off)
+{
+    if (t->len & 1 && !exif__buf_append(alloc, t, "", 1)) return false;
+    *off = (uint32_t)t->len;
+    return exif__buf_append(alloc, t, v, vlen);
+}
+
+// Apply EXIF edits to a copy of the TIFF block in t. Existing entries are
+// rewritten in place, in their old data when the new value fits and at the
+// end of the block otherwise; new tags move IFD0 to the end with its
+// entries in tag order. Nothing else moves, so every other offset holds.
+static bool exif__patch_tiff(exif_allocator_t *alloc, exif__buf_t *t,
+                             const exif__patch_edit_t *edits, size_t n)
+{
+    uint8_t *d = (uint8_t *)t->data;
+    if (t->len < 8 || !(memcmp(d, "II*\0", 4) == 0 || memcmp(d, "MM\0*", 4) == 0))
+        return false;
+    bool le = d[0] == 'I';
+    uint32_t ifd = exif__rd32(d + 4, le);
+    if (ifd < 8 || ifd > t->len - 2) return false;
+    uint16_t count = exif__rd16(d + ifd, le);
+    if ((size_t)count * 12 + 6 > t->len - ifd) return false;
+
+    exif__ifd_entry_t added[EXIF__PATCH_MAX_EDITS];
+    size_t nadded = 0;
+    for (size_t k = 0; k < n; k++) {
+        size_t vlen = strlen(edits[k].value) + 1;
+        d = (uint8_t *)t->data;
+        size_t at = SIZE_MAX;  // entry offset in t, or SIZE_MAX for an added one
+        uint8_t *entry = NULL;
+        for (uint16_t i = 0; i < count && !entry; i++)
+            if (exif__rd16(d + ifd + 2 + i * 12, le) == edits[k].tag) {
+                at = ifd + 2 + (size_t)i * 12;
+                entry = d + at;
+            }
+        for (size_t i = 0; i < nadded && !entry; i++)
+            if (added[i].tag == edits[k].tag) entry = added[i].raw;
+        if (!entry) {
+            if (nadded == EXIF__PATCH_MAX_EDITS) return false;
+            entry = added[nadded].raw;
+            memset(entry, 0, 12);
+            exif__wr16(entry, edits[k].tag, le);
+            exif__wr16(entry + 2, 2, le);
+            added[nadded++].tag = edits[k].tag;
+        } else {
+            if (exif__rd16(entry + 2, le) != 2) return false;
+            uint32_t old = exif__rd32(entry + 4, le);
+            uint32_t old_off = exif__rd32(entry + 8, le);
+            if (old > 4) {
+                if (old_off > t->len || old > t->len - old_off) return false;
+                if (vlen > 4 && vlen <= old) {
+                    memset(d + old_off, 0, old);
+                    memcpy(d + old_off, edits[k].value, vlen);
+                    exif__wr32(entry + 4, (uint32_t)vlen, le);
+                    continue;
+                }
+                memset(d + old_off, 0, old);  // don't leave the old value behind
+            }
+        }
+
+        uint8_t field[4] = {0};
+        if (vlen <= 4) {
+            memcpy(field, edits[k].value, vlen);
+        } else {
+            uint32_t off;
+            if (!exif__tiff_append(alloc, t, edits[k].value, vlen, &off)) return false;
+            exif__wr32(field, off, le);
+            if (at != SIZE_MAX) entry = (uint8_t *)t->data + at;  // t may have moved
+        }
+        exif__wr32(entry + 4, (uint32_t)vlen, le);
+        memcpy(entry + 8, field, 4);
+    }
+    if (!nadded) return true;
+
+    // Rebuild IFD0 at the end with the new entries merged in
+    size_t total = count + nadded;
+    exif__ifd_entry_t *all = alloc->alloc(total * sizeof *all, alloc->ctx);
+    if (!all) return false;
+    d = (uint8_t *)t->data;
+    for (uint16_t i = 0; i < count; i++) {
+        memcpy(all[i].raw, d + ifd + 2 + i * 12, 12);
+        all[i].tag = exif__rd16(all[i].raw, le);
+    }
+    memcpy(all + count, added, nadded * sizeof *added);
+    qsort(all, total, sizeof *all, exif__ifd_entry_cmp);
+    uint8_t next[4];
+    memcpy(next, d + ifd + 2 + count * 12, 4);
+    memset(d + ifd, 0, (size_t)count * 12 + 6);
+
+    uint8_t hdr[2];
+    exif__wr16(hdr, (uint16_t)total, le);
+    bool ok = total <= 0xFFFF && (!(t->len & 1) || exif__buf_append(alloc, t, "", 1));
+    uint32_t new_ifd = (uint32_t)t->len;
+    ok = ok && exif__buf_append(alloc, t, hdr, 2);
+    for (size_t i = 0; ok && i < total; i++)
+        ok = exif__buf_append(alloc, t, all[i].raw, 12);
+    ok = ok && exif__buf_append(alloc, t, next, 4);
+    alloc->free(all, total * sizeof *all, alloc->ctx);
+    if (ok) exif__wr32((uint8_t *)t->data + 4, new_ifd, le);
+    return ok;
+}
+
+// Patched copy of a JPEG in out, or false when exiftool has to do the edit.
+static bool exif__patch_jpeg(exif_allocator_t *alloc, const void *data, size_t len,
+                             const exif_options_t *opts, exif__buf_t *out)
+{
+    *out = (exif__buf_t){0};
+    if (!opts || !opts->patch || opts->argc || opts->config_path) return false;
+    if (opts->ntags <= 0 || opts->ntags > EXIF__PATCH_MAX_EDITS) return false;
+
+    exif__patch_edit_t edits[EXIF__PATCH_MAX_EDITS], exif_edits[EXIF__PATCH_MAX_EDITS];
+    size_t nedits = (size_t)opts->ntags, nexif = 0;
+    for (size_t i = 0; i < nedits; i++) {
+        if (!exif__patch_parse(opts->tags[i], &edits[i])) return false;
+        if (!edits[i].qname) exif_edits[nexif++] = edits[i];
+    }
+
+    const uint8_t *d = data;
+    exif__jpeg_segs_t segs;
+    if (!exif__patch_scan(d, len, &segs) || segs.xmp_extended) return false;
+    if (nexif && !segs.exif) return false;
+    if (nexif < nedits && !segs.xmp) return false;
+
+    // exiftool also writes a tag into XMP where the packet already has it
+    const char *xmp = segs.xmp ? (const char *)d + segs.xmp + 33 : NULL;
+    size_t xmp_len = segs.xmp ? segs.xmp_len - 33 : 0;
+    for (size_t i = 0; xmp && i < nexif; i++)
+        if (!exif_edits[i].exif_only
+            && exif__xmp_has_property(xmp, xmp_len, exif_edits[i].name, exif_edits[i].name_len))
+            return false;
+
+    if (!exif__buf_append(alloc, out, data, len)) return false;
+    for (size_t i = 0; i < nedits; i++)
+        if (edits[i].qname
+            && !exif__patch_xmp(alloc, out->data + segs.xmp + 33, xmp_len, &edits[i]))
+            goto fallback;
+    if (!nexif) return true;
+
+    exif__buf_t tiff = {0};
+    size_t tiff_off = segs.exif + 10;
+    if (!exif__buf_append(alloc, &tiff, out->data + tiff_off, segs.exif_len - 10)
+        || !exif__patch_tiff(alloc, &tiff, exif_edits, nexif)
+        || tiff.len + 8 > 0xFFFF) {
+        exif__buf_free(alloc, &tiff);
+        goto fallback;
+    }
+
+    // Splice the new segment in place of the old one
+    exif__buf_t spliced = {0};
+    uint8_t hdr[4] = { 0xFF, 0xE1 };
+    exif__wr16(hdr + 2, (uint16_t)(tiff.len + 8), false);
+    bool ok = exif__buf_reserve(alloc, &spliced, len + tiff.len + 10 - segs.exif_len)
+           && exif__buf_append(alloc, &spliced, out->data, segs.exif)
+           && exif__buf_append(alloc, &spliced, hdr, 4)
+           && exif__buf_append(alloc, &spliced, "Exif\0\0", 6)
+           && exif__buf_append(alloc, &spliced, tiff.data, tiff.len)
+           && exif__buf_append(alloc, &spliced, out->data + segs.exif + segs.exif_len,
+                               len - segs.exif - segs.exif_len);
+    exif__buf_free(alloc, &tiff);
+    exif__buf_free(alloc, out);
+    if (!ok) { exif__buf_free(alloc, &spliced); return false; }
+    *out = spliced;
+    return true;
+
+fallback:
+    exif__buf_free(alloc, out);
+    return false;
+}
+
+// exif_write through the patcher: the result exiftool would print, or false
+// to run exiftool. The output goes to a temp file renamed over the target,
+// and an existing out_path is left for exiftool to refuse.
+static bool exif__patch_file(exif_t *ctx, const char *in_path, const char *out_path,
+                             const exif_options_t *opts, exif_result_t *result)
+{
+    exif_allocator_t *alloc = &ctx->alloc;
+    struct stat st;
+    if (!opts || !opts->patch || stat(in_path, &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+    if (out_path && access(out_path, F_OK) == 0) return false;
+    const char *suffix = exif__suffix_of(in_path);
+    if (!suffix || (strcasecmp(suffix, "jpg") != 0 && strcasecmp(suffix, "jpeg") != 0))
+        return false;
+
+    size_t len;
+    char *data = exif__read_file(alloc, in_path, &len);
+    if (!data) return false;
+    exif__buf_t patched;
+    bool ok = exif__patch_jpeg(alloc, data, len, opts, &patched);
+    // Same bytes: exiftool leaves the file alone and only copies it for -o
+    bool same = ok && patched.len == len && memcmp(patched.data, data, len) == 0;
+    alloc->free(data, 0, alloc->ctx);
+    if (!ok) return false;
+
+    const char *msg_text = same ? (out_path ? "    1 image files copied\n"
+                                            : "    1 image files unchanged\n")
+                                : (out_path ? "    1 image files created\n"
+                                            : "    1 image files updated\n");
+    // Unchanged in place: nothing to write
+    if (!same || out_path) {
+        const char *target = out_path ? out_path : in_path;
+        char tmp[PATH_MAX];
+        ok = snprintf(tmp, sizeof tmp, "%s_exiftool_tmp", target) < (int)sizeof tmp;
+        int fd = ok ? open(tmp, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 0777) : -1;
+        for (size_t done = 0; fd >= 0 && done < patched.len; ) {
+            ssize_t w = write(fd, patched.data + done, patched.len - done);
+            if (w < 0) { ok = false; break; }
+            done += (size_t)w;
+        }
+        ok = fd >= 0 && ok;
+        if (fd >= 0 && close(fd) != 0) ok = false;
+        if (ok && rename(tmp, target) != 0) ok = false;
+        if (!ok && fd >= 0) unlink(tmp);
+    }
+    exif__buf_free(alloc, &patched);
+    if (!ok) return false;
+    ctx->counters.patched++;
+
+    size_t mlen = strlen(msg_text);
+    char *msg = alloc->alloc(mlen + 1, alloc->ctx);
+    if (!msg) return false;
+    memcpy(msg, msg_text, mlen + 1);
+    *result = exif__ok_result(msg, mlen, 0);
+    return true;
+}
+
+exif_result_t exif_write(exif_t *ctx, const char *in_path,
+                         const char *out_path, const exif_options_t *opts)
+{
+    exif_options_t merged;
+    opts = exif__with_prepared(opts, &merged);
+    exif__call_begin(ctx);
+    const char *out_tail[] = { "-o", out_path, in_path };
+    const char *in_tail[]  = { "-overwrite_original", in_path };
+    exif_result_t result;
+    if (!exif__patch_file(ctx, in_path, out_path, opts, &result))
+        result = out_path ? exif__run(ctx, out_tail, 3, opts)
+                          : exif__run(ctx, in_tail, 2, opts);
+    exif__call_end(ctx, &result, 1, 0);
+    return result;
+}
+
+// Files per exiftool run in exif_write_many
+#define EXIF__WRITE_MANY_CHUNK 256
+
+// One exiftool run for a chunk. Every file is its own command, separated by
+// -execute; the tags follow -common_args, so exiftool appends them to each
+// command without the interpreter or modules being set up again. -echo3 and
+// -echo4 mark the end of each command's stdout and stderr, with its status.
+static void exif__write_many_chunk(exif_t *ctx, const char *const *in_paths,
+                                   const char *const *out_paths, size_t n,
+                                   const exif_options_t *opts,
+                                   exif_result_t *results)
+{
+    exif_allocator_t *alloc = &ctx->alloc;
+    for (size_t i = 0; i < n; i++)
+        results[i] = (exif_result_t){0};
+
+    int nopt_args = opts ? opts->argc : 0;
+    int ntag_args = opts ? opts->ntags : 0;
+    int max_tail  = (int)n * 8 + 1 + nopt_args + ntag_args;
+    const char **tail = alloc->alloc((size_t)max_tail * sizeof *tail, alloc->ctx);
+    char *markers = alloc->alloc(n * 64, alloc->ctx);
+    exif_result_t run;
+    int ntail = 0;
+    if (!tail || !markers) {
+        run = exif__err_result(alloc, "out of memory", -1);
+        goto split;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        char *m3 = markers + i * 64, *m4 = m3 + 24;
+        snprintf(m3, 24, "{written%u}", (unsigned)i);
+        snprintf(m4, 40, "{written%u ${status}}", (unsigned)i);
+        tail[ntail++] = "-echo3";
+        tail[ntail++] = m3;
+        tail[ntail++] = "-echo4";
+        tail[ntail++] = m4;
+        const char *out = out_paths ? out_paths[i] : NULL;
+        if (out) {
+            tail[ntail++] = "-o";
+            tail[ntail++] = out;
+        } else {
+            tail[ntail++] = "-overwrite_original";
+        }
+        tail[ntail++] = in_paths[i];
+        if (i + 1 < n) tail[ntail++] = "-execute";
+    }
+    tail[ntail++] = "-common_args";
+    for (int i = 0; i < nopt_args; i++) tail[ntail++] = opts->args[i];
+    for (int i = 0; i < ntag_args; i++) tail[ntail++] = opts->tags[i];
+
+    // The arguments are all in the tail; config and prepared strings stay
+    exif_options_t common = opts ? *opts : (exif_options_t){0};
+    common.args = NULL;
+    common.argc = 0;
+    common.tags = NULL;
+    common.ntags = 0;
+    run = exif__run_ex(ctx, tail, ntail, &common, true, NULL);
+
+split:
+    if (tail) alloc->free(tail, (size_t)max_tail * sizeof *tail, alloc->ctx);
+    if (markers) alloc->free(markers, n * 64, alloc->ctx);
+    if (!run.success) {
+        for (size_t i = 0; i < n; i++)
+            results[i] = exif__err_result(alloc, run.error ? run.error
+                                          : "exiftool failed", run.exit_code);
+        exif_result_free(ctx, &run);
+        return;
+    }
+
+    const char *out_pos = run.data ? run.data : "";
+    const char *out_end = out_pos + (run.data ? run.data_len : 0);
+    const char *err_pos = run.error ? run.error : "";
+    const char *err_end = err_pos + strlen(err_pos);
+    for (size_t i = 0; i < n; i++) {
+        const char *out_start = out_pos, *err_start = err_pos, *out_seg, *err_seg;
+        const char *done = exif__marker(&out_pos, out_end, "written", i, &out_seg);
+        const char *status = exif__marker(&err_pos, err_end, "written", i, &err_seg);
+        if (!done || !status) {
+            // The run ended before this command; later ones never ran either
+            char *msg = run.error ? exif__stderr_error_for(alloc, run.error, in_paths[i]) : NULL;
+            results[i] = msg ? (exif_result_t){ .error = msg, .exit_code = 1 }
+                             : exif__err_result(alloc, "exiftool produced no output for file", 1);
+            out_pos = out_start;
+            err_pos = err_start;
+            continue;
+        }
+        int32_t code = (int32_t)strtol(status, NULL, 10);
+        if (code == 0) {
+            size_t len = (size_t)(out_seg - out_start);
+            char *data = exif__strndup(alloc, out_start, len);
+            results[i] = data ? exif__ok_result(data, len, 0)
+                              : exif__err_result(alloc, "out of memory", -1);
+        } else {
+            size_t len = (size_t)(err_seg - err_start);
+            char *msg = len ? exif__strndup(alloc, err_start, len) : NULL;
+            results[i] = msg ? (exif_result_t){ .error = msg, .exit_code = code }
+                             : exif__err_result(alloc, "exiftool exited with error", code);
+        }
+    }
+    exif_result_free(ctx, &run);
+}
+
+size_t exif_write_many(exif_t *ctx, const char *const *in_paths,
+                       const char *const *out_paths, size_t n,
+                       const exif_options_t *opts, exif_result_t *results)
+{
+    exif_options_t merged;
+    opts = exif__with_prepared(opts, &merged);
+    exif__call_begin(ctx);
+    exif_allocator_t *alloc = &ctx->alloc;
+    const char **rest_in = NULL, **rest_out = NULL;
+    size_t *slots = NULL, total = n, ok = 0;
+    exif_result_t *all = results;
+
+    // Files the patcher takes never reach exiftool
+    if (opts && opts->patch && n) {
+        rest_in  = alloc->alloc(n * sizeof *rest_in, alloc->ctx);
+        rest_out = alloc->alloc(n * sizeof *rest_out, alloc->ctx);
+        slots    = alloc->alloc(n * sizeof *slots, alloc->ctx);
+        results  = alloc->alloc(n * sizeof *results, alloc->ctx);
+        if (rest_in && rest_out && slots && results) {
+            size_t nrest = 0;
+            for (size_t i = 0; i < total; i++) {
+                const char *out = out_paths ? out_paths[i] : NULL;
+                if (exif__patch_file(ctx, in_paths[i], out, opts, &all[i])) continue;
+                rest_in[nrest] = in_paths[i];
+                rest_out[nrest] = out;
+                slots[nrest++] = i;
+            }
+            in_paths = rest_in;
+            out_paths = rest_out;
+            n = nrest;
+        } else {
+            if (results) alloc->free(results, total * sizeof *results, alloc->ctx);
+            results = all;
+        }
+    }
+
+    // A resident loop already runs each file as one command; a chain of
+    // them in a single command line is only worth it one-shot
+    if (ctx->stay_open && exif__wasi_hooked && !(opts && opts->config_path)) {
+        for (size_t i = 0; i < n; i++) {
+            const char *out = out_paths ? out_paths[i] : NULL;
+            const char *out_tail[] = { "-o", out, in_paths[i] };
+            const char *in_tail[]  = { "-overwrite_original", in_paths[i] };
+            results[i] = out ? exif__run(ctx, out_tail, 3, opts)
+                             : exif__run(ctx, in_tail, 2, opts);
+        }
+    } else {
+        for (size_t off = 0; off < n; off += EXIF__WRITE_MANY_CHUNK) {
+            size_t count = n - off < EXIF__WRITE_MANY_CHUNK ? n - off : EXIF__WRITE_MANY_CHUNK;
+            exif__write_many_chunk(ctx, in_paths + off, out_paths ? out_paths + off : NULL,
+                                   count, opts, results + off);
+        }
+    }
+
+    if (results != all) {
+        for (size_t k = 0; k < n; k++)
+            all[slots[k]] = results[k];
+        alloc->free(results, total * sizeof *results, alloc->ctx);
+    }
+    if (rest_in)  alloc->free(rest_in, total * sizeof *rest_in, alloc->ctx);
+    if (rest_out) alloc->free(rest_out, total * sizeof *rest_out, alloc->ctx);
+    if (slots)    alloc->free(slots, total * sizeof *slots, alloc->ctx);
+
+    for (size_t i = 0; i < total; i++)
+        if (all[i].success) ok++;
+    exif__call_end(ctx, all, total, 0);
+    return ok;
+}
+
+static exif_result_t exif__write_buf(exif_t *ctx, exif_buf_t input,
+                                     const exif_options_t *opts)
+{
+    exif_allocator_t *alloc = &ctx->alloc;
+    exif_result_t result;
+    const char *suffix = exif__suffix_of(input.filename);
+
+    exif__buf_t patched;
+    if (suffix && (strcasecmp(suffix, "jpg") == 0 || strcasecmp(suffix, "jpeg") == 0)
+        && exif__patch_jpeg(alloc, input.data, input.len, opts, &patched)) {
+        ctx->counters.patched++;
+        return exif__ok_result(patched.data, patched.len, 0);
+    }
+
+    // Input and output both live in the VFS; the result takes the output
+    // buffer as is
+    if (exif__wasi_hooked) {
+        char vin[EXIF__VFS_PATH_MAX], vout[EXIF__VFS_PATH_MAX];
+        uint32_t seq = ++ctx->vfs.seq;
+        snprintf(vin, sizeof vin, EXIF__VFS_ROOT "%u/in%s%s", seq,
+                 suffix ? "." : "", suffix ? suffix : "");
+        snprintf(vout, sizeof vout, EXIF__VFS_ROOT "%u/out%s%s", seq,
+                 suffix ? "." : "", suffix ? suffix : "");
+        uint64_t t = exif__timer(ctx);
+        bool mounted = exif__vfs_mount(ctx, vin, input.data, input.len);
+        exif__phase_end(ctx, EXIF__PHASE_SPILL, t);
+        if (!mounted) return exif__err_result(alloc, "out of memory", -1);
+
+        const char *tail[] = { "-o", vout, vin };
+        result = exif__run(ctx, tail, 3, opts);
+        if (result.success) {
+            alloc->free(result.data, 0, alloc->ctx);
+            t = exif__timer(ctx);
+            result.data = exif__vfs_take(ctx, vout, &result.data_len);
+            exif__phase_end(ctx, EXIF__PHASE_READBACK, t);
+            if (!result.data)
+                result = exif__err_result(alloc, "output file not produced", -1);
+        }
+        exif__vfs_unmount(ctx, vout);
+        exif__vfs_unmount(ctx, vin);
+        return result;
+    }
+
+    uint64_t t = exif__timer(ctx);
+    char *in_path = exif__write_tmpfile(alloc, input.data, input.len, suffix);
+    exif__phase_end(ctx, EXIF__PHASE_SPILL, t);
+    if (!in_path)
+        return exif__err_result(alloc, "failed to write input temp file", -1);
+
+    char out_path[256];
+    snprintf(out_path, sizeof out_path, "/tmp/libexif_out_XXXXXX%s%s",
+             suffix ? "." : "", suffix ? suffix : "");
+    int out_fd = mkstemps(out_path, suffix ? (int)strlen(suffix) + 1 : 0);
+    if (out_fd < 0) {
+        result = exif__err_result(alloc, "failed to create output temp", -1);
+        goto cleanup;
+    }
+    close(out_fd);
+    unlink(out_path);
+
+    const char *tail[] = { "-o", out_path, in_path };
+    result = exif__run(ctx, tail, 3, opts);
+
+    if (result.success) {
+        alloc->free(result.data, 0, alloc->ctx);
+        t = exif__timer(ctx);
+        result.data = exif__read_file(alloc, out_path, &result.data_len);
+        exif__phase_end(ctx, EXIF__PHASE_READBACK, t);
+        if (!result.data)
+            result = exif__err_result(alloc, "output file not produced", -1);
+    }
+
+    unlink(out_path);
+
+cleanup:
+    unlink(in_path);
+    alloc->free(in_path, 0, alloc->ctx);
+    return result;
+}
+
+exif_result_t exif_write_buf(exif_t *ctx, exif_buf_t input,
+                             const exif_options_t *opts)
+{
+    exif_options_t merged;
+    opts = exif__with_prepared(opts, &merged);
+    exif__call_begin(ctx);
+    exif_result_t result = exif__write_buf(ctx, input, opts);
+    exif__call_end(ctx, &result, 1, input.len);
+    return result;
+}
+
+void exif_result_free(exif_t *ctx, exif_result_t *result)
+{
+    if (!result) return;
+    exif_allocator_t *alloc = ctx ? &ctx->alloc : &exif__default_allocator;
+    if (result->data)  alloc->free(result->data, 0, alloc->ctx);
+    if (result->error) alloc->free(result->error, 0, alloc->ctx);
+    result->data = NULL;
+    result->error = NULL;
+}
+
+void exif_counters(const exif_t *ctx, exif_counters_t *out)
+{
+    *out = ctx->counters;
+}
+
+// --- tag table ---
+
+struct exif_tags {
+    exif_allocator_t  alloc;
+    char             *arena;  // every string the entries point at
+    size_t            arena_used;
+    size_t            arena_cap;
+    exif_tag_t       *tags;
+    size_t            ntags;
+    size_t            tags_cap;
+    uint32_t         *index;  // open addressing on the tag name; entry + 1, 0 empty
+    size_t            index_cap;
+};
+
+static uint32_t exif__tag_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h;
+}
+
+static const char *exif__json_skip_ws(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' || *p == ','))
+        p++;
+    return p;
+}
+
+// End of the JSON value starting at p.
+static const char *exif__json_skip_value(const char *p, const char *end)
+{
+    if (*p == '"') return exif__json_skip_string(p, end);
+    if (*p != '{' && *p != '[') {
+        const char *start = p;
+        while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != '\n') p++;
+        while (p > start && (p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\r')) p--;
+        return p;
+    }
+    int depth = 0;
+    while (p < end) {
+        if (*p == '"') { p = exif__json_skip_string(p, end); continue; }
+        if (*p == '{' || *p == '[') depth++;
+        else if ((*p == '}' || *p == ']') && --depth == 0) return p + 1;
+        p++;
+    }
+    return end;
+}
+
+static const char *exif__tags_put(exif_tags_t *t, const char *src, size_t len)
+{
+    char *dst = t->arena + t->arena_used;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+    t->arena_used += len + 1;
+    return dst;
+}
+
+static bool exif__tags_index(exif_tags_t *t)
+{
+    size_t cap = 16;
+    while (cap < t->ntags * 2) cap *= 2;
+    t->index = t->alloc.alloc(cap * sizeof *t->index, t->alloc.ctx);
+    if (!t->index) return false;
+    memset(t->index, 0, cap * sizeof *t->index);
+    t->index_cap = cap;
+
+    for (size_t i = 0; i < t->ntags; i++) {
+        const char *name = t->tags[i].name;
+        size_t slot = exif__tag_hash(name, strlen(name)) & (cap - 1);
+        while (t->index[slot]) slot = (slot + 1) & (cap - 1);
+        t->index[slot] = (uint32_t)i + 1;
+    }
+    return true;
+}
+
+// A binary document is copied whole into the arena and the entries point
+// into the copy. Only the "Group:Name" keys are built, once, after the copy.
+static exif_tags_t *exif__tags_parse_bin(exif_allocator_t alloc, const char *data,
+                                         size_t len)
+{
+    const char *pos = data, *doc;
+    size_t doc_len;
+    exif__bin_doc_t d;
+    if (!exif__bin_next_doc(&pos, data + len, &doc, &doc_len)
+        || !exif__bin_open(doc, doc_len, &d))
+        return NULL;
+
+    exif_tags_t *t = alloc.alloc(sizeof *t, alloc.ctx);
+    if (!t) return NULL;
+    *t = (exif_tags_t){ .alloc = alloc };
+    size_t nstrs = (size_t)d.nstrings + 1;
+    const char **strs = alloc.alloc(nstrs * sizeof *strs, alloc.ctx);
+    t->tags = alloc.alloc(((size_t)d.ntags + 1) * sizeof *t->tags, alloc.ctx);
+    if (!strs || !t->tags) goto fail;
+    t->tags_cap = (size_t)d.ntags + 1;
+
+    // Decode against the caller's bytes to size the keys, then move every
+    // pointer to the same offset of the copy
+    const uint8_t *p = d.strings;
+    for (uint32_t i = 0; i < d.nstrings; i++)
+        strs[i] = exif__bin_str(&p, d.end, NULL);
+    size_t keys = 0;
+    p = d.tags;
+    for (uint32_t i = 0; i < d.ntags; i++) {
+        exif_tag_t *tag = &t->tags[t->ntags];
+        uint32_t group, name;
+        if (!exif__bin_tag(&p, d.end, tag, &group, &name)
+            || group >= d.nstrings || name >= d.nstrings)
+            goto fail;
+        tag->group = strs[group];
+        tag->name = strs[name];
+        if (*tag->group) keys += strlen(tag->group) + 1 + strlen(tag->name) + 1;
+        t->ntags++;
+    }
+
+    t->arena_cap = doc_len + keys;
+    t->arena = alloc.alloc(t->arena_cap, alloc.ctx);
+    if (!t->arena) goto fail;
+    memcpy(t->arena, doc, doc_len);
+    t->arena_used = doc_len;
+    for (size_t i = 0; i < t->ntags; i++) {
+        exif_tag_t *tag = &t->tags[i];
+        tag->group = t->arena + (tag->group - doc);
+        tag->name = t->arena + (tag->name - doc);
+        if (tag->type != EXIF_VALUE_NULL) tag->text = t->arena + (tag->text - doc);
+        if (!*tag->group) {
+            tag->key = tag->name;
+            continue;
+        }
+        size_t glen = strlen(tag->group), nlen = strlen(tag->name);
+        char *key = t->arena + t->arena_used;
+        memcpy(key, tag->group, glen);
+        key[glen] = ':';
+        memcpy(key + glen + 1, tag->name, nlen + 1);
+        tag->key = key;
+        t->arena_used += glen + 1 + nlen + 1;
+    }
+    alloc.free(strs, nstrs * sizeof *strs, alloc.ctx);
+    strs = NULL;
+
+    if (!exif__tags_index(t)) goto fail;
+    return t;
+
+fail:
+    if (strs) alloc.free(strs, nstrs * sizeof *strs, alloc.ctx);
+    exif_tags_free(t);
+    return NULL;
+}
+
+// The first object of a -json document
+static exif_tags_t *exif__tags_parse_json(exif_allocator_t alloc, const char *data,
+                                          size_t len)
+{
+    const char *pos = data, *obj;
+    size_t obj_len;
+    if (!exif__json_next_object(&pos, data + len, &obj, &obj_len))
+        return NULL;
+
+    exif_tags_t *t = alloc.alloc(sizeof *t, alloc.ctx);
+    if (!t) return NULL;
+    *t = (exif_tags_t){ .alloc = alloc };
+
+    // Decoded strings never outgrow their JSON text; one NUL per string
+    // at most doubles it
+    t->arena_cap = obj_len * 2 + 1;
+    t->arena = alloc.alloc(t->arena_cap, alloc.ctx);
+    if (!t->arena) goto fail;
+
+    const char *p = obj + 1, *end = obj + obj_len - 1;
+    for (;;) {
+        p = exif__json_skip_ws(p, end);
+        if (p >= end) break;
+        if (*p != '"') goto fail;
+
+        const char *kclose = exif__json_skip_string(p, end);
+        char *key = t->arena + t->arena_used;
+        size_t klen = exif__json_decode_into(key, p, kclose);
+        t->arena_used += klen + 1;
+
+        p = exif__json_skip_ws(kclose, end);
+        if (p >= end || *p != ':') goto fail;
+        p = exif__json_skip_ws(p + 1, end);
+        if (p >= end) goto fail;
+
+        exif_tag_t *tags = exif__grow(&t->alloc, t->tags, t->ntags, &t->tags_cap,
+                                      sizeof *tags);
+        if (!tags) goto fail;
+        t->tags = tags;
+        exif_tag_t *tag = &t->tags[t->ntags++];
+
+        const char *colon = strrchr(key, ':');
+        *tag = (exif_tag_t){ .key = key, .name = colon ? colon + 1 : key, .group = "" };
+        if (colon) tag->group = exif__tags_put(t, key, (size_t)(colon - key));
+
+        const char *vend = exif__json_skip_value(p, end);
+        if (*p == '"') {
+            char *text = t->arena + t->arena_used;
+            tag->type = EXIF_VALUE_STRING;
+            tag->text_len = exif__json_decode_into(text, p, vend);
+            tag->text = text;
+            t->arena_used += tag->text_len + 1;
+        } else {
+            tag->text = exif__tags_put(t, p, (size_t)(vend - p));
+            tag->text_len = (size_t)(vend - p);
+            if (*p == '{') tag->type = EXIF_VALUE_OBJECT;
+            else if (*p == '[') tag->type = EXIF_VALUE_ARRAY;
+            else if (*p == 'n') tag->type = EXIF_VALUE_NULL;
+            else if (*p == 't' || *p == 'f') {
+                tag->type = EXIF_VALUE_BOOL;
+                tag->number = *p == 't';
+            } else {
+                tag->type = EXIF_VALUE_NUMBER;
+                tag->number = strtod(tag->text, NULL);
+            }
+        }
+        p = vend;
+    }
+
+    if (!exif__tags_index(t)) goto fail;
+    return t;
+
+fail:
+    exif_tags_free(t);
+    return NULL;
+}
+
+
+static bool exif__bin_put32(exif_allocator_t *alloc, exif__buf_t *b, uint32_t v)
+{
+    uint8_t x[4];
+    exif__wr32(x, v, true);
+    return exif__buf_append(alloc, b, x, 4);
+}
+
+static bool exif__bin_put_str(exif_allocator_t *alloc, exif__buf_t *b,
+                              const char *s, size_t len)
+{
+    return exif__bin_put32(alloc, b, (uint32_t)len)
+        && exif__buf_append(alloc, b, s, len)
+        && exif__buf_append(alloc, b, "", 1);
+}
+
+// The bytes of a "base64:" value as a BINARY value; false, with nothing
+// appended, if s is not valid base64.
+static bool exif__bin_put_base64(exif_allocator_t *alloc, exif__buf_t *b,
+                                 const char *s, size_t len)
+{
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    while (len && s[len - 1] == '=') len--;
+    if (len % 4 == 1 || !exif__buf_reserve(alloc, b, 5 + len / 4 * 3 + 2))
+        return false;
+    uint8_t *out = (uint8_t *)b->data + b->len + 5;
+    size_t n = 0;
+    uint32_t acc = 0;
+    for (size_t i = 0; i < len; i++) {
+        const char *d = s[i] ? strchr(digits, s[i]) : NULL;
+        if (!d) return false;
+        acc = acc << 6 | (uint32_t)(d - digits);
+        if (i % 4 == 3) {
+            out[n++] = (uint8_t)(acc >> 16);
+            out[n++] = (uint8_t)(acc >> 8);
+            out[n++] = (uint8_t)acc;
+        }
+    }
+    if (len % 4 == 2) out[n++] = (uint8_t)(acc >> 4);
+    if (len % 4 == 3) {
+        out[n++] = (uint8_t)(acc >> 10);
+        out[n++] = (uint8_t)(acc >> 2);
+    }
+    out[n] = 0;
+    b->data[b->len] = EXIF_VALUE_BINARY;
+    exif__wr32((uint8_t *)b->data + b->len + 1, (uint32_t)n, true);
+    b->len += 5 + n + 1;
+    return true;
+}
+
+// Replace a JSON read result with the document resources/exifbin.pl would
+// have written for it. Groups are interned; names follow them in the
+// string table, one per tag. Values exiftool printed as base64 come back
+// as BINARY.
+static void exif__bin_from_json(exif_allocator_t *alloc, exif_result_t *r)
+{
+    if (!r->success) return;
+    exif_tags_t *t = exif__tags_parse_json(*alloc, r->data, r->data_len);
+    exif__buf_t b = {0};
+    uint32_t *groups = NULL;
+    size_t ngroups = 0;
+    bool ok = t && (groups = alloc->alloc((t->ntags + 1) * sizeof *groups, alloc->ctx));
+    for (size_t i = 0; ok && i < t->ntags; i++) {
+        size_t g = 0;
+        while (g < ngroups && strcmp(t->tags[groups[g]].group, t->tags[i].group) != 0) g++;
+        if (g == ngroups) groups[ngroups++] = (uint32_t)i;
+    }
+
+    ok = ok && exif__buf_append(alloc, &b, EXIF__BIN_MAGIC "\0\0\0\0", 8)
+            && exif__bin_put32(alloc, &b, (uint32_t)(ngroups + t->ntags));
+    for (size_t g = 0; ok && g < ngroups; g++) {
+        const char *s = t->tags[groups[g]].group;
+        ok = exif__bin_put_str(alloc, &b, s, strlen(s));
+    }
+    for (size_t i = 0; ok && i < t->ntags; i++)
+        ok = exif__bin_put_str(alloc, &b, t->tags[i].name, strlen(t->tags[i].name));
+    ok = ok && exif__bin_put32(alloc, &b, (uint32_t)t->ntags);
+    for (size_t i = 0; ok && i < t->ntags; i++) {
+        const exif_tag_t *tag = &t->tags[i];
+        size_t g = 0;
+        while (strcmp(t->tags[groups[g]].group, tag->group) != 0) g++;
+        ok = exif__bin_put32(alloc, &b, (uint32_t)g)
+          && exif__bin_put32(alloc, &b, (uint32_t)(ngroups + i));
+        if (!ok) break;
+        switch (tag->type) {
+        case EXIF_VALUE_NULL:
+            ok = exif__buf_append(alloc, &b, "\0", 1);
+            break;
+        case EXIF_VALUE_BOOL:
+        case EXIF_VALUE_NUMBER: {
+            uint8_t x[9] = { EXIF_VALUE_NUMBER };
+            uint64_t bits;
+            memcpy(&bits, &tag->number, sizeof bits);
+            exif__wr32(x + 1, (uint32_t)bits, true);
+            exif__wr32(x + 5, (uint32_t)(bits >> 32), true);
+            ok = exif__buf_append(alloc, &b, x, sizeof x)
+              && exif__bin_put_str(alloc, &b, tag->text, tag->text_len);
+            break;
+        }
+        case EXIF_VALUE_STRING:
+            if (tag->text_len > 7 && memcmp(tag->text, "base64:", 7) == 0
+                && exif__bin_put_base64(alloc, &b, tag->text + 7, tag->text_len - 7))
+                break;
+            /* fall through */
+        default: {
+            uint8_t type = (uint8_t)tag->type;
+            ok = exif__buf_append(alloc, &b, &type, 1)
+              && exif__bin_put_str(alloc, &b, tag->text, tag->text_len);
+            break;
+        }
+        }
+    }
+    if (groups) alloc->free(groups, (t->ntags + 1) * sizeof *groups, alloc->ctx);
+    exif_tags_free(t);
+
+    if (!ok) {
+        exif__buf_free(alloc, &b);
+        alloc->free(r->data, 0, alloc->ctx);
+        *r = exif__err_result(alloc, "failed to convert output to binary", -1);
+        return;
+    }
+    exif__wr32((uint8_t *)b.data + 4, (uint32_t)(b.len - 8), true);
+    alloc->free(r->data, 0, alloc->ctx);
+    r->data = b.data;
+    r->data_len = b.len;
+}
+
+exif_tags_t *exif_tags_parse(exif_t *ctx, const exif_result_t *r)
+{
+    exif_allocator_t alloc = ctx ? ctx->alloc : exif__default_allocator;
+    if (!r || !r->success || !r->data) return NULL;
+    if (r->data_len >= 4 && memcmp(r->data, EXIF__BIN_MAGIC, 4) == 0)
+        return exif__tags_parse_bin(alloc, r->data, r->data_len);
+
+    return exif__tags_parse_json(alloc, r->data, r->data_len);
+}
+
+const exif_tag_t *exif_tags_get(const exif_tags_t *t, const char *key)
+{
+    if (!t || !key) return NULL;
+    const char *colon = strrchr(key, ':');
+    const char *name = colon ? colon + 1 : key;
+    size_t klen = strlen(key), nlen = strlen(name);
+
+    size_t slot = exif__tag_hash(name, nlen) & (t->index_cap - 1);
+    for (; t->index[slot]; slot = (slot + 1) & (t->index_cap - 1)) {
+        const exif_tag_t *tag = &t->tags[t->index[slot] - 1];
+        if (strcmp(tag->name, name) != 0) continue;
+        if (!colon) return tag;
+        // "IFD0:Orientation" matches "Main:IFD0:Orientation"
+        size_t tlen = strlen(tag->key);
+        if (tlen >= klen && memcmp(tag->key + tlen - klen, key, klen) == 0
+            && (tlen == klen || tag->key[tlen - klen - 1] == ':'))
+            return tag;
+    }
+    return NULL;
+}
+
+size_t exif_tags_count(const exif_tags_t *t)
+{
+    return t ? t->ntags : 0;
+}
+
+const exif_tag_t *exif_tags_at(const exif_tags_t *t, size_t i)
+{
+    return t && i < t->ntags ? &t->tags[i] : NULL;
+}
+
+void exif_tags_free(exif_tags_t *t)
+{
+    if (!t) return;
+    exif_allocator_t alloc = t->alloc;
+    if (t->index) alloc.free(t->index, t->index_cap * sizeof *t->index, alloc.ctx);
+    if (t->tags)  alloc.free(t->tags, t->tags_cap * sizeof *t->tags, alloc.ctx);
+    if (t->arena) alloc.free(t->arena, t->arena_cap, alloc.ctx);
+    alloc.free(t, sizeof *t, alloc.ctx);
+}
+
+// --- embedded previews ---
+
+// JPEG previews and thumbnails are located without extracting them: TIFF
+// based files (DNG and most raw formats) are walked through IFD0, its
+// chain and SubIFDs; JPEG files through the EXIF thumbnail and MPF
+// images. Other formats, and files where the walk finds nothing (previews
+// in maker notes, say), ask exiftool for the offset/length tag pairs.
+
+#define EXIF__PREVIEW_MAX_IFDS 32
+
+typedef struct exif__previews {
+    exif_preview_t *out;
+    size_t          max;
+    size_t          n;
+} exif__previews_t;
+
+// Dimensions from the first SOF of the JPEG at d, 0 when not found
+static void exif__jpeg_dims(const uint8_t *d, size_t len, uint32_t *w, uint32_t *h)
+{
+    *w = *h = 0;
+    size_t p = 2;
+    while (p + 9 <= len) {
+        if (d[p] != 0xFF) return;
+        uint8_t m = d[p + 1];
+        if (m == 0xFF) { p++; continue; }
+        if (m == 0xDA || m == 0xD9) return;
+        if (m == 0x01 || (m >= 0xD0 && m <= 0xD7)) { p += 2; continue; }
+        if (m >= 0xC0 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC) {
+            *h = exif__rd16(d + p + 5, false);
+            *w = exif__rd16(d + p + 7, false);
+            return;
+        }
+        p += 2 + exif__rd16(d + p + 2, false);
+    }
+}
+
+// Record [off, off + len) of the file if it holds a JPEG
+static void exif__preview_add(exif__previews_t *pv, const uint8_t *d, size_t dlen,
+                              uint64_t off, uint64_t len, exif_preview_kind_t kind,
+                              const char *name)
+{
+    if (!len || off > dlen || len > dlen - off || len < 4) return;
+    if (d[off] != 0xFF || d[off + 1] != 0xD8) return;
+    for (size_t i = 0; i < pv->n && i < pv->max; i++)
+        if (pv->out[i].offset == off) return;  // reached through two IFDs
+    if (pv->n < pv->max) {
+        exif_preview_t *p = &pv->out[pv->n];
+        *p = (exif_preview_t){ .offset = off, .length = len, .kind = kind, .name = name };
+        exif__jpeg_dims(d + off, (size_t)len, &p->width, &p->height);
+    }
+    pv->n++;
+}
+
+// Walk the IFDs of the TIFF block at base. Offsets in it are relative to
+// base; the ranges recorded are relative to d.
+static bool exif__previews_tiff(exif__previews_t *pv, const uint8_t *d, size_t dlen,
+                                size_t base)
+{
+    const uint8_t *t = d + base;
+    size_t tlen = dlen - base;
+    if (tlen < 8 || !(memcmp(t, "II*\0", 4) == 0 || memcmp(t, "MM\0*", 4) == 0))
+        return false;
+    bool le = t[0] == 'I';
+
+    // Work list of (offset, index in IFD0 chain or -1 for a SubIFD)
+    uint32_t ifds[EXIF__PREVIEW_MAX_IFDS];
+    int chain[EXIF__PREVIEW_MAX_IFDS];
+    size_t nifds = 0;
+    ifds[nifds] = exif__rd32(t + 4, le);
+    chain[nifds++] = 0;
+    for (size_t k = 0; k < nifds; k++) {
+        uint32_t off = ifds[k];
+        if (!off || off > tlen - 2) continue;
+        uint16_t n = exif__rd16(t + off, le);
+        if ((size_t)n * 12 + 6 > tlen - off) continue;
+
+        uint32_t jpeg_off = 0, jpeg_len = 0, strip_off = 0, strip_len = 0, nstrips = 0;
+        uint32_t compression = 0, photometric = 0, subfile = 0;
+        for (uint16_t i = 0; i < n; i++) {
+            const uint8_t *e = t + off + 2 + (size_t)i * 12;
+            uint16_t tag = exif__rd16(e, le), type = exif__rd16(e + 2, le);
+            uint32_t count = exif__rd32(e + 4, le);
+            uint32_t v = type == 3 ? exif__rd16(e + 8, le) : exif__rd32(e + 8, le);
+            switch (tag) {
+            case 0x00FE: subfile = v; break;
+            case 0x0103: compression = v; break;
+            case 0x0106: photometric = v; break;
+            case 0x0111: strip_off = v; nstrips = count; break;
+            case 0x0117: strip_len = v; break;
+            case 0x0201: jpeg_off = v; break;
+            case 0x0202: jpeg_len = v; break;
+            case 0x014A: {
+                // SubIFDs: one offset inline, or a list elsewhere
+                uint32_t list = exif__rd32(e + 8, le);
+                for (uint32_t s = 0; s < count && nifds < EXIF__PREVIEW_MAX_IFDS; s++) {
+                    uint32_t sub = count == 1 ? list
+                                 : list <= tlen - 4 && s < (tlen - list) / 4
+                                   ? exif__rd32(t + list + s * 4, le) : 0;
+                    ifds[nifds] = sub;
+                    chain[nifds++] = -1;
+                }
+                break;
+            }
+            default: break;
+            }
+        }
+
+        // exiftool names JPEGInterchangeFormat by IFD: the thumbnail in IFD1,
+        // JpgFromRaw in a SubIFD, PreviewImage in IFD0 (ARW, SR2) and
+        // OtherImage further down the chain. Strip previews keep the
+        // coarser PreviewImage label.
+        bool thumb = chain[k] == 1;
+        exif_preview_kind_t kind = thumb ? EXIF_PREVIEW_THUMBNAIL : EXIF_PREVIEW_PREVIEW;
+        const char *name = thumb ? "ThumbnailImage" : chain[k] < 0 ? "JpgFromRaw"
+                         : chain[k] == 0 ? "PreviewImage" : "OtherImage";
+        if (jpeg_off && jpeg_len)
+            exif__preview_add(pv, d, dlen, base + (uint64_t)jpeg_off, jpeg_len, kind, name);
+        // A single JPEG strip, unless it is the raw data itself
+        else if (nstrips == 1 && strip_len && (compression == 6 || compression == 7)
+                 && photometric != 32803 && photometric != 34892
+                 && (subfile & 1 || compression == 6))
+            exif__preview_add(pv, d, dlen, base + (uint64_t)strip_off, strip_len, kind,
+                              thumb ? "ThumbnailImage" : "PreviewImage");
+
+        uint32_t next = exif__rd32(t + off + 2 + (size_t)n * 12, le);
+        if (chain[k] >= 0 && next && nifds < EXIF__PREVIEW_MAX_IFDS) {
+            ifds[nifds] = next;
+            chain[nifds++] = chain[k] + 1;
+        }
+    }
+    return true;
+}
+
+static bool exif__previews_jpeg(exif__previews_t *pv, const uint8_t *d, size_t len)
+{
+    size_t p = 2;
+    while (p + 4 <= len) {
+        if (d[p] != 0xFF) return true;
+        uint8_t m = d[p + 1];
+        if (m == 0xFF) { p++; continue; }
+        if (m == 0xDA || m == 0xD9) return true;
+        if (m == 0x01 || (m >= 0xD0 && m <= 0xD7)) { p += 2; continue; }
+        size_t seglen = exif__rd16(d + p + 2, false);
+        if (seglen < 2 || seglen > len - p - 2) return true;
+        const uint8_t *body = d + p + 4;
+        size_t blen = seglen - 2;
+        if (m == 0xE1 && blen >= 14 && memcmp(body, "Exif\0\0", 6) == 0) {
+            exif__previews_tiff(pv, d, len, p + 10);
+        } else if (m == 0xE2 && blen >= 12 && memcmp(body, "MPF\0", 4) == 0) {
+            // MP entries: attributes, size, offset from the MPF header
+            // (0 for the primary image), two dependent image numbers
+            const uint8_t *t = body + 4;
+            size_t tlen = blen - 4, base = p + 8;
+            if (memcmp(t, "II*\0", 4) != 0 && memcmp(t, "MM\0*", 4) != 0) goto next;
+            bool le = t[0] == 'I';
+            uint32_t ifd = exif__rd32(t + 4, le);
+            if (ifd > tlen - 2) goto next;
+            uint16_t n = exif__rd16(t + ifd, le);
+            for (uint16_t i = 0; i < n && (size_t)ifd + 2 + (size_t)(i + 1) * 12 <= tlen; i++) {
+                const uint8_t *e = t + ifd + 2 + (size_t)i * 12;
+                if (exif__rd16(e, le) != 0xB002) continue;
+                uint32_t count = exif__rd32(e + 4, le), at = exif__rd32(e + 8, le);
+                if (at > tlen || count > tlen - at) break;
+                for (uint32_t k = 1; k < count / 16; k++) {
+                    static const char *names[] = {
+                        "MPImage2", "MPImage3", "MPImage4", "MPImage5",
+                        "MPImage6", "MPImage7", "MPImage8", "MPImage9",
+                    };
+                    if (k > sizeof names / sizeof *names) break;
+                    const uint8_t *mp = t + at + k * 16;
+                    uint32_t size = exif__rd32(mp + 4, le), off = exif__rd32(mp + 8, le);
+                    if (off)
+                        exif__preview_add(pv, d, len, base + (uint64_t)off, size,
+                                          EXIF_PREVIEW_PREVIEW, names[k - 1]);
+                }
+            }
+        }
+    next:
+        p += 2 + seglen;
+    }
+    return true;
+}
+
+// exiftool's offset/length pairs for formats walked nowhere else
+static size_t exif__previews_exiftool(exif_t *ctx, const char *path, const exif_buf_t *buf,
+                                      exif_preview_t *out, size_t max)
+{
+    static const struct {
+        const char *start, *length, *name;
+        exif_preview_kind_t kind;
+    } pairs[] = {
+        { "ThumbnailOffset",   "ThumbnailLength",   "ThumbnailImage", EXIF_PREVIEW_THUMBNAIL },
+        { "PreviewImageStart", "PreviewImageLength", "PreviewImage",  EXIF_PREVIEW_PREVIEW },
+        { "JpgFromRawStart",   "JpgFromRawLength",  "JpgFromRaw",     EXIF_PREVIEW_PREVIEW },
+        { "OtherImageStart",   "OtherImageLength",  "OtherImage",     EXIF_PREVIEW_PREVIEW },
+    };
+    const char *args[] = {
+        "-a", "-s", "-n", "-G3:1", "-fast2",
+        "-ThumbnailOffset", "-ThumbnailLength", "-PreviewImageStart", "-PreviewImageLength",
+        "-JpgFromRawStart", "-JpgFromRawLength", "-OtherImageStart", "-OtherImageLength",
+    };
+    exif_options_t opts = { .profile = EXIF_PROFILE_CUSTOM, .profile_args = args,
+                            .profile_argc = (int)(sizeof args / sizeof *args) };
+    exif_result_t r = path ? exif_read(ctx, path, &opts) : exif_read_buf(ctx, *buf, &opts);
+    exif_tags_t *t = exif_tags_parse(ctx, &r);
+    exif_result_free(ctx, &r);
+    if (!t) return 0;
+
+    size_t n = 0;
+    for (size_t i = 0; i < exif_tags_count(t); i++) {
+        const exif_tag_t *start = exif_tags_at(t, i);
+        if (start->type != EXIF_VALUE_NUMBER || strncmp(start->key, "Main:", 5) != 0)
+            continue;
+        for (size_t k = 0; k < sizeof pairs / sizeof *pairs; k++) {
+            if (strcmp(start->name, pairs[k].start) != 0) continue;
+            // The length in the same group
+            char key[128];
+            snprintf(key, sizeof key, "%s:%s", start->group, pairs[k].length);
+            const exif_tag_t *length = exif_tags_get(t, key);
+            if (!length || length->type != EXIF_VALUE_NUMBER || length->number <= 0)
+                break;
+            if (n < max)
+                out[n] = (exif_preview_t){ .offset = (uint64_t)start->number,
+                                           .length = (uint64_t)length->number,
+                                           .kind = pairs[k].kind, .name = pairs[k].name };
+            n++;
+            break;
+        }
+    }
+    exif_tags_free(t);
+    return n;
+}
+
+// Ranges in data when its format is walked natively; false otherwise.
+static bool exif__previews_native(const void *data, size_t len, exif_preview_t *out,
+                                  size_t max, size_t *n)
+{
+    const uint8_t *d = data;
+    exif__previews_t pv = { .out = out, .max = max };
+    bool ok;
+    if (len >= 4 && d[0] == 0xFF && d[1] == 0xD8)
+        ok = exif__previews_jpeg(&pv, d, len);
+    else
+        ok = exif__previews_tiff(&pv, d, len, 0);
+    *n = pv.n;
+    return ok;
+}
+
+size_t exif_previews(exif_t *ctx, const char *path, exif_preview_t *out, size_t max)
+{
+    size_t n = 0;
+    bool native = false;
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            native = exif__previews_native(map, (size_t)st.st_size, out, max, &n);
+            munmap(map, (size_t)st.st_size);
+        }
+    }
+    if (fd >= 0) close(fd);
+    return native && n ? n : exif__previews_exiftool(ctx, path, NULL, out, max);
+}
+
+size_t exif_previews_buf(exif_t *ctx, exif_buf_t input, exif_preview_t *out, size_t max)
+{
+    size_t n;
+    if (exif__previews_native(input.data, input.len, out, max, &n) && n) return n;
+    return exif__previews_exiftool(ctx, NULL, &input, out, max);
+}
+
+// --- pool ---
+
+typedef struct exif__batch {
+    atomic_size_t remaining;
+} exif__batch_t;
+
+// A task belongs to an exif_pool_run batch, or was submitted on its own
+// and is finished through done or the completion ring.
+typedef struct exif__task {
+    exif_job_t    *job;
+    exif__batch_t *batch;
+    exif_done_fn   done;
+    void          *user;
+} exif__task_t;
+
+// Per-worker deque. The owner takes from the bottom, thieves from the top.
+typedef struct exif__deque {
+    pthread_mutex_t lock;
+    exif__task_t   *tasks;
+    size_t          cap;   // power of two
+    size_t          top;
+    size_t          bottom;
+} exif__deque_t;
+
+typedef struct exif__worker {
+    exif_pool_t   *pool;
+    exif_t        *ctx;
+    pthread_t      thread;
+    exif__deque_t  deque;
+    int            index;
+    bool           started;
+} exif__worker_t;
+
+struct exif_pool {
+    exif_allocator_t alloc;
+    exif__worker_t  *workers;
+    int              nworkers;
+    atomic_uint      next;     // round-robin submission cursor
+    atomic_size_t    queued;   // tasks sitting in any deque
+    pthread_mutex_t  lock;     // guards sleeping and batch completion
+    pthread_cond_t   work_cv;
+    pthread_cond_t   done_cv;
+    bool             stopping;
+
+    // Completions of exif_submit jobs without a callback, in order. A slot
+    // is reserved at submit, so workers never allocate here.
+    pthread_mutex_t    ring_lock;
+    pthread_cond_t     ring_cv;
+    exif_completion_t *ring;
+    size_t             ring_cap;   // power of two
+    size_t             ring_head;
+    size_t             ring_len;
+    size_t             reserved;   // submitted and not yet reaped
+    int                event_fd[2];  // readable while ring_len > 0
+};
+
+static bool exif__deque_push(exif_allocator_t *alloc, exif__deque_t *d,
+                             exif__task_t task)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom - d->top == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 64;
+        exif__task_t *tasks = alloc->alloc(cap * sizeof *tasks, alloc->ctx);
+        if (!tasks) { pthread_mutex_unlock(&d->lock); return false; }
+        for (size_t i = d->top; i < d->bottom; i++)
+            tasks[i & (cap - 1)] = d->tasks[i & (d->cap - 1)];
+        if (d->tasks) alloc->free(d->tasks, d->cap * sizeof *d->tasks, alloc->ctx);
+        d->tasks = tasks;
+        d->cap = cap;
+    }
+    d->tasks[d->bottom++ & (d->cap - 1)] = task;
+    pthread_mutex_unlock(&d->lock);
+    return true;
+}
+
+static bool exif__deque_pop(exif__deque_t *d, exif__task_t *out)
+{
+    pthread_mutex_lock(&d->lock);
+    bool ok = d->bottom != d->top;
+    if (ok) *out = d->tasks[--d->bottom & (d->cap - 1)];
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+static bool exif__deque_steal(exif__deque_t *d, exif__task_t *out)
+{
+    pthread_mutex_lock(&d->lock);
+    bool ok = d->bottom != d->top;
+    if (ok) *out = d->tasks[d->top++ & (d->cap - 1)];
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+static bool exif__pool_take(exif__worker_t *w, exif__task_t *out)
+{
+    exif_pool_t *pool = w->pool;
+    if (exif__deque_pop(&w->deque, out)) goto taken;
+    for (int i = 1; i < pool->nworkers; i++) {
+        exif__worker_t *victim = &pool->workers[(w->index + i) % pool->nworkers];
+        if (exif__deque_steal(&victim->deque, out)) goto taken;
+    }
+    return false;
+
+taken:
+    atomic_fetch_sub(&pool->queued, 1);
+    return true;
+}
+
+static void exif__pool_execute(exif_t *ctx, exif_job_t *job)
+{
+    switch (job->kind) {
+    case EXIF_JOB_READ:
+        job->result = exif_read(ctx, job->path, job->opts);
+        break;
+    case EXIF_JOB_READ_BUF:
+        job->result = exif_read_buf(ctx, job->buf, job->opts);
+        break;
+    case EXIF_JOB_WRITE:
+        job->result = exif_write(ctx, job->path, job->out_path, job->opts);
+        break;
+    case EXIF_JOB_WRITE_BUF:
+        job->result = exif_write_buf(ctx, job->buf, job->opts);
+        break;
+    default:
+        job->result = exif__err_result(&ctx->alloc, "unknown job kind", -1);
+        break;
+    }
+}
+
+static void exif__pool_complete(exif_pool_t *pool, exif_job_t *job, void *user)
+{
+    pthread_mutex_lock(&pool->ring_lock);
+    size_t tail = (pool->ring_head + pool->ring_len) & (pool->ring_cap - 1);
+    pool->ring[tail] = (exif_completion_t){ .job = job, .user = user };
+    if (pool->ring_len++ == 0 && pool->event_fd[1] >= 0) {
+        char b = 1;
+        while (write(pool->event_fd[1], &b, 1) < 0 && errno == EINTR) {}
+    }
+    pthread_cond_broadcast(&pool->ring_cv);
+    pthread_mutex_unlock(&pool->ring_lock);
+}
+
+static void *exif__pool_main(void *arg)
+{
+    exif__worker_t *w = arg;
+    exif_pool_t *pool = w->pool;
+
+    // Held for the worker's lifetime so calls don't set it up each time
+    bool thread_env_owned;
+    exif__thread_env_enter(&thread_env_owned);
+
+    for (;;) {
+        exif__task_t task;
+        if (!exif__pool_take(w, &task)) {
+            pthread_mutex_lock(&pool->lock);
+            while (!pool->stopping && atomic_load(&pool->queued) == 0)
+                pthread_cond_wait(&pool->work_cv, &pool->lock);
+            bool stopping = pool->stopping && atomic_load(&pool->queued) == 0;
+            pthread_mutex_unlock(&pool->lock);
+            if (stopping) break;
+            continue;
+        }
+
+        exif__pool_execute(w->ctx, task.job);
+
+        if (!task.batch) {
+            if (task.done) task.done(task.job, task.user);
+            else exif__pool_complete(pool, task.job, task.user);
+        } else if (atomic_fetch_sub(&task.batch->remaining, 1) == 1) {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_broadcast(&pool->done_cv);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+
+    exif__thread_env_leave(thread_env_owned);
+    return NULL;
+}
+
+exif_pool_t *exif_pool_create(const exif_config_t *cfg, int nworkers)
+{
+    exif_allocator_t alloc = exif__default_allocator;
+    if (cfg && cfg->allocator) alloc = *cfg->allocator;
+
+    if (nworkers <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = ncpu > 0 ? (int)ncpu : 1;
+    }
+    uint32_t exec_stack = (cfg && cfg->exec_stack_size) ? cfg->exec_stack_size
+                                                         : DEFAULT_STACK;
+
+    exif_pool_t *pool = alloc.alloc(sizeof *pool, alloc.ctx);
+    if (!pool) return NULL;
+    memset(pool, 0, sizeof *pool);
+    pool->alloc = alloc;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cv, NULL);
+    pthread_cond_init(&pool->done_cv, NULL);
+    pthread_mutex_init(&pool->ring_lock, NULL);
+    pthread_cond_init(&pool->ring_cv, NULL);
+    pool->event_fd[0] = pool->event_fd[1] = -1;
+    if (pipe(pool->event_fd) == 0) {
+        for (int i = 0; i < 2; i++) {
+            fcntl(pool->event_fd[i], F_SETFL, fcntl(pool->event_fd[i], F_GETFL) | O_NONBLOCK);
+            fcntl(pool->event_fd[i], F_SETFD, FD_CLOEXEC);
+        }
+    } else {
+        pool->event_fd[0] = pool->event_fd[1] = -1;
+    }
+
+    pool->workers = alloc.alloc(nworkers * sizeof *pool->workers, alloc.ctx);
+    if (!pool->workers) goto fail;
+    memset(pool->workers, 0, nworkers * sizeof *pool->workers);
+
+    // Contexts are created up front, one pinned to each worker
+    for (int i = 0; i < nworkers; i++) {
+        exif__worker_t *w = &pool->workers[i];
+        w->pool = pool;
+        w->index = i;
+        pthread_mutex_init(&w->deque.lock, NULL);
+        pool->nworkers = i + 1;
+        w->ctx = exif_create(cfg);
+        if (!w->ctx) goto fail;
+    }
 
-    // Write to temp dir with original filename so exiftool reports it correctly
-    char dir_buf[256];
-    snprintf(dir_buf, sizeof dir_buf, "/tmp/libexif_XXXXXX");
-    if (!mkdtemp(dir_buf))
-        return exif__err_result(alloc, "failed to create temp dir", -1);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, exec_stack);
+    for (int i = 0; i < nworkers; i++) {
+        exif__worker_t *w = &pool->workers[i];
+        w->started = pthread_create(&w->thread, &attr, exif__pool_main, w) == 0;
+        if (!w->started) break;
+    }
+    pthread_attr_destroy(&attr);
+    if (!pool->workers[nworkers - 1].started) goto fail;
 
-    const char *name = input.filename;
-    if (!name || !*name) name = "input";
+    return pool;
 
-    char path_buf[512];
-    snprintf(path_buf, sizeof path_buf, "%s/%s", dir_buf, name);
+fail:
+    exif_pool_destroy(pool);
+    return NULL;
+}
+
+void exif_pool_destroy(exif_pool_t *pool)
+{
+    if (!pool) return;
+    exif_allocator_t alloc = pool->alloc;
 
-    int fd = open(path_buf, O_WRONLY | O_CREAT | O_TRUNC, 0600);
-    if (fd < 0) { rmdir(dir_buf); return exif__err_result(alloc, "failed to create temp file", -1); }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
 
-    const unsigned char *src = input.data;
-    size_t remaining = input.len;
-    while (remaining > 0) {
-        ssize_t w = write(fd, src, remaining);
-        if (w < 0) { close(fd); unlink(path_buf); rmdir(dir_buf); return exif__err_result(alloc, "write failed", -1); }
-        src += w;
-        remaining -= w;
+    for (int i = 0; i < pool->nworkers; i++) {
+        exif__worker_t *w = &pool->workers[i];
+        if (w->started) pthread_join(w->thread, NULL);
+        exif_destroy(w->ctx);
+        if (w->deque.tasks)
+            alloc.free(w->deque.tasks, w->deque.cap * sizeof *w->deque.tasks, alloc.ctx);
+        pthread_mutex_destroy(&w->deque.lock);
     }
-    close(fd);
+    if (pool->workers)
+        alloc.free(pool->workers, pool->nworkers * sizeof *pool->workers, alloc.ctx);
 
-    const char *tail[EXIF__N_READ_DEFAULTS + 1];
-    for (int i = 0; i < EXIF__N_READ_DEFAULTS; i++)
-        tail[i] = exif__read_defaults[i];
-    tail[EXIF__N_READ_DEFAULTS] = path_buf;
+    if (pool->ring)
+        alloc.free(pool->ring, pool->ring_cap * sizeof *pool->ring, alloc.ctx);
+    for (int i = 0; i < 2; i++)
+        if (pool->event_fd[i] >= 0) close(pool->event_fd[i]);
 
-    exif_result_t result = exif__run(ctx, tail, EXIF__N_READ_DEFAULTS + 1, opts);
-    exif__apply_transform(alloc, &result, opts);
+    pthread_cond_destroy(&pool->ring_cv);
+    pthread_mutex_destroy(&pool->ring_lock);
+    pthread_cond_destroy(&pool->done_cv);
+    pthread_cond_destroy(&pool->work_cv);
+    pthread_mutex_destroy(&pool->lock);
+    alloc.free(pool, sizeof *pool, alloc.ctx);
+}
 
-    unlink(path_buf);
-    rmdir(dir_buf);
-    return result;
+int exif_pool_size(const exif_pool_t *pool)
+{
+    return pool ? pool->nworkers : 0;
 }
 
-exif_result_t exif_read_fd(exif_t *ctx, int fd, const char *filename,
-                           const exif_options_t *opts)
+void exif_pool_run(exif_pool_t *pool, exif_job_t *jobs, size_t njobs)
 {
-    char path[32];
-    snprintf(path, sizeof path, "/dev/fd/%d", fd);
+    exif__batch_t batch;
+    atomic_init(&batch.remaining, njobs);
 
-    const char *tail[EXIF__N_READ_DEFAULTS + 1];
-    for (int i = 0; i < EXIF__N_READ_DEFAULTS; i++)
-        tail[i] = exif__read_defaults[i];
-    tail[EXIF__N_READ_DEFAULTS] = path;
+    size_t pushed = 0;
+    for (; pushed < njobs; pushed++) {
+        unsigned slot = atomic_fetch_add(&pool->next, 1) % (unsigned)pool->nworkers;
+        exif__task_t task = { .job = &jobs[pushed], .batch = &batch };
+        atomic_fetch_add(&pool->queued, 1);
+        if (!exif__deque_push(&pool->alloc, &pool->workers[slot].deque, task)) {
+            atomic_fetch_sub(&pool->queued, 1);
+            break;
+        }
+    }
+    for (size_t i = pushed; i < njobs; i++) {
+        jobs[i].result = exif__err_result(&pool->alloc, "pool queue allocation failed", -1);
+        atomic_fetch_sub(&batch.remaining, 1);
+    }
 
-    exif_result_t result = exif__run(ctx, tail, EXIF__N_READ_DEFAULTS + 1, opts);
-    exif__apply_transform(&ctx->alloc, &result, opts);
-    return result;
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->work_cv);
+    while (atomic_load(&batch.remaining) > 0)
+        pthread_cond_wait(&pool->done_cv, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
 }
 
-exif_result_t exif_write(exif_t *ctx, const char *in_path,
-                         const char *out_path, const exif_options_t *opts)
+// Make room in the ring for one more job's completion.
+static bool exif__pool_reserve(exif_pool_t *pool)
 {
-    if (out_path) {
-        const char *tail[] = { "-o", out_path, in_path };
-        return exif__run(ctx, tail, 3, opts);
+    exif_allocator_t *alloc = &pool->alloc;
+    pthread_mutex_lock(&pool->ring_lock);
+    bool ok = true;
+    if (pool->reserved == pool->ring_cap) {
+        size_t cap = pool->ring_cap ? pool->ring_cap * 2 : 64;
+        exif_completion_t *ring = alloc->alloc(cap * sizeof *ring, alloc->ctx);
+        if (ring) {
+            for (size_t i = 0; i < pool->ring_len; i++)
+                ring[i] = pool->ring[(pool->ring_head + i) & (pool->ring_cap - 1)];
+            if (pool->ring)
+                alloc->free(pool->ring, pool->ring_cap * sizeof *pool->ring, alloc->ctx);
+            pool->ring = ring;
+            pool->ring_cap = cap;
+            pool->ring_head = 0;
+        }
+        ok = ring != NULL;
     }
-    const char *tail[] = { "-overwrite_original", in_path };
-    return exif__run(ctx, tail, 2, opts);
+    if (ok) pool->reserved++;
+    pthread_mutex_unlock(&pool->ring_lock);
+    return ok;
 }
 
-exif_result_t exif_write_buf(exif_t *ctx, exif_buf_t input,
-                             const exif_options_t *opts)
+bool exif_submit(exif_pool_t *pool, exif_job_t *job, exif_done_fn done, void *user)
+{
+    if (!pool || !job) return false;
+    if (!done && !exif__pool_reserve(pool)) return false;
+
+    unsigned slot = atomic_fetch_add(&pool->next, 1) % (unsigned)pool->nworkers;
+    exif__task_t task = { .job = job, .done = done, .user = user };
+    atomic_fetch_add(&pool->queued, 1);
+    if (!exif__deque_push(&pool->alloc, &pool->workers[slot].deque, task)) {
+        atomic_fetch_sub(&pool->queued, 1);
+        if (!done) {
+            pthread_mutex_lock(&pool->ring_lock);
+            pool->reserved--;
+            pthread_mutex_unlock(&pool->ring_lock);
+        }
+        return false;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+// Move up to max completions to out; ring_lock held.
+static size_t exif__pool_reap(exif_pool_t *pool, exif_completion_t *out, size_t max)
+{
+    size_t n = 0;
+    for (; n < max && pool->ring_len; n++, pool->ring_len--) {
+        out[n] = pool->ring[pool->ring_head];
+        pool->ring_head = (pool->ring_head + 1) & (pool->ring_cap - 1);
+    }
+    pool->reserved -= n;
+    if (n && !pool->ring_len && pool->event_fd[0] >= 0) {
+        char drain[64];
+        while (read(pool->event_fd[0], drain, sizeof drain) > 0) {}
+    }
+    return n;
+}
+
+size_t exif_poll(exif_pool_t *pool, exif_completion_t *out, size_t max)
+{
+    if (!pool || !out || !max) return 0;
+    pthread_mutex_lock(&pool->ring_lock);
+    size_t n = exif__pool_reap(pool, out, max);
+    pthread_mutex_unlock(&pool->ring_lock);
+    return n;
+}
+
+size_t exif_wait(exif_pool_t *pool, exif_completion_t *out, size_t max,
+                 int timeout_ms)
+{
+    if (!pool || !out || !max) return 0;
+    struct timespec deadline;
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&pool->ring_lock);
+    // Nothing outstanding means nothing will ever arrive
+    while (!pool->ring_len && pool->reserved && timeout_ms != 0) {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&pool->ring_cv, &pool->ring_lock);
+        else if (pthread_cond_timedwait(&pool->ring_cv, &pool->ring_lock,
+                                        &deadline) == ETIMEDOUT)
+            break;
+    }
+    size_t n = exif__pool_reap(pool, out, max);
+    pthread_mutex_unlock(&pool->ring_lock);
+    return n;
+}
+
+int exif_pool_event_fd(const exif_pool_t *pool)
+{
+    return pool ? pool->event_fd[0] : -1;
+}
+
+void exif_pool_result_free(exif_pool_t *pool, exif_result_t *result)
+{
+    if (!result) return;
+    exif_allocator_t *alloc = pool ? &pool->alloc : &exif__default_allocator;
+    if (result->data)  alloc->free(result->data, 0, alloc->ctx);
+    if (result->error) alloc->free(result->error, 0, alloc->ctx);
+    result->data = NULL;
+    result->error = NULL;
+}
+
+// --- fork server ---
+
+// Messages between the parent and a worker process are a u64 body length
+// followed by the body. Strings are a u32 length (NUL included, 0 for NULL)
+// and the bytes; byte blobs are a u64 length and the bytes.
+
+typedef struct exif__wire {
+    const char *p;
+    const char *end;
+} exif__wire_t;
+
+static bool exif__wire_u32(exif_allocator_t *alloc, exif__buf_t *b, uint32_t v)
+{
+    return exif__buf_append(alloc, b, &v, sizeof v);
+}
+
+static bool exif__wire_str(exif_allocator_t *alloc, exif__buf_t *b, const char *s)
+{
+    uint32_t n = s ? (uint32_t)strlen(s) + 1 : 0;
+    return exif__wire_u32(alloc, b, n) && exif__buf_append(alloc, b, s, n);
+}
+
+static bool exif__wire_blob(exif_allocator_t *alloc, exif__buf_t *b,
+                            const void *data, uint64_t len)
+{
+    return exif__buf_append(alloc, b, &len, sizeof len)
+        && exif__buf_append(alloc, b, data, len);
+}
+
+static bool exif__wire_strs(exif_allocator_t *alloc, exif__buf_t *b,
+                            const char **strs, int n)
+{
+    if (!exif__wire_u32(alloc, b, n > 0 ? (uint32_t)n : 0)) return false;
+    for (int i = 0; i < n; i++)
+        if (!exif__wire_str(alloc, b, strs[i])) return false;
+    return true;
+}
+
+static bool exif__wire_get(exif__wire_t *w, void *out, size_t n)
+{
+    if ((size_t)(w->end - w->p) < n) return false;
+    memcpy(out, w->p, n);
+    w->p += n;
+    return true;
+}
+
+// Strings point into the message; they are NUL-terminated on the wire.
+static bool exif__wire_get_str(exif__wire_t *w, const char **out)
+{
+    uint32_t n;
+    if (!exif__wire_get(w, &n, sizeof n)) return false;
+    *out = NULL;
+    if (!n) return true;
+    if ((size_t)(w->end - w->p) < n || w->p[n - 1] != '\0') return false;
+    *out = w->p;
+    w->p += n;
+    return true;
+}
+
+static bool exif__wire_get_blob(exif__wire_t *w, const void **out, uint64_t *len)
+{
+    if (!exif__wire_get(w, len, sizeof *len)) return false;
+    if ((uint64_t)(w->end - w->p) < *len) return false;
+    *out = w->p;
+    w->p += *len;
+    return true;
+}
+
+static bool exif__wire_get_strs(exif_allocator_t *alloc, exif__wire_t *w,
+                                const char ***out, int *n)
+{
+    uint32_t count;
+    *out = NULL;
+    *n = 0;
+    if (!exif__wire_get(w, &count, sizeof count)) return false;
+    if (!count) return true;
+    if (count > (size_t)(w->end - w->p) / sizeof(uint32_t)) return false;
+    const char **strs = alloc->alloc(count * sizeof *strs, alloc->ctx);
+    if (!strs) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!exif__wire_get_str(w, &strs[i]) || !strs[i]) {
+            alloc->free(strs, count * sizeof *strs, alloc->ctx);
+            return false;
+        }
+    }
+    *out = strs;
+    *n = (int)count;
+    return true;
+}
+
+// On a non-blocking fd, waits for room until deadline (ns, 0 for none)
+static bool exif__io_write(int fd, const void *data, size_t len, uint64_t deadline)
+{
+    const char *p = data;
+    while (len) {
+#ifdef MSG_NOSIGNAL
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+#else
+        ssize_t n = send(fd, p, len, 0);
+#endif
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            uint64_t now = exif__now_ns();
+            if (deadline && now >= deadline) return false;
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if (poll(&pfd, 1, deadline ? (int)((deadline - now) / 1000000u + 1) : -1) < 0
+                && errno != EINTR)
+                return false;
+            continue;
+        }
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool exif__io_read(int fd, void *data, size_t len)
+{
+    char *p = data;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool exif__wire_send(int fd, const exif__buf_t *msg, uint64_t deadline)
+{
+    uint64_t len = msg->len;
+    return exif__io_write(fd, &len, sizeof len, deadline)
+        && exif__io_write(fd, msg->data, msg->len, deadline);
+}
+
+static bool exif__wire_recv(exif_allocator_t *alloc, int fd, exif__buf_t *msg)
+{
+    uint64_t len;
+    *msg = (exif__buf_t){0};
+    if (!exif__io_read(fd, &len, sizeof len)) return false;
+    if (len > SIZE_MAX - 1 || !exif__buf_reserve(alloc, msg, (size_t)len))
+        return false;
+    if (!exif__io_read(fd, msg->data, (size_t)len)) {
+        exif__buf_free(alloc, msg);
+        return false;
+    }
+    msg->len = (size_t)len;
+    msg->data[len] = '\0';
+    return true;
+}
+
+static void exif__nosigpipe(int fd)
+{
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof one);
+#else
+    (void)fd;
+#endif
+}
+
+// Worker process: decode a job, run it on the inherited context, send back
+// the raw result. Transforms run in the parent, where their state lives.
+static void exif__forkserver_serve(exif_t *ctx, int fd)
 {
     exif_allocator_t *alloc = &ctx->alloc;
-    exif_result_t result;
-    const char *suffix = exif__suffix_of(input.filename);
 
-    char *in_path = exif__write_tmpfile(alloc, input.data, input.len, suffix);
-    if (!in_path)
-        return exif__err_result(alloc, "failed to write input temp file", -1);
+    // The capture fds are shared with the zygote and every sibling; only the
+    // in-memory capture leaves them untouched, so give this process its own.
+    if (!exif__wasi_hooked) {
+        exif__rebind_fd(ctx->stdout_fd, exif__open_capture_fd("stdout"));
+        exif__rebind_fd(ctx->stderr_fd, exif__open_capture_fd("stderr"));
+    }
 
-    char out_path[256];
-    snprintf(out_path, sizeof out_path, "/tmp/libexif_out_XXXXXX%s%s",
-             suffix ? "." : "", suffix ? suffix : "");
-    int out_fd = mkstemps(out_path, suffix ? (int)strlen(suffix) + 1 : 0);
-    if (out_fd < 0) {
-        result = exif__err_result(alloc, "failed to create output temp", -1);
-        goto cleanup;
+    for (;;) {
+        exif__buf_t msg;
+        if (!exif__wire_recv(alloc, fd, &msg)) return;
+
+        exif__wire_t w = { msg.data, msg.data + msg.len };
+        exif_job_t job = {0};
+        exif_options_t opts = {0};
+        uint32_t kind, flags, profile = 0;
+        const void *data = NULL;
+        uint64_t len = 0;
+        bool ok = exif__wire_get(&w, &kind, sizeof kind)
+               && exif__wire_get(&w, &flags, sizeof flags)
+               && exif__wire_get_str(&w, &job.path)
+               && exif__wire_get_str(&w, &job.out_path)
+               && exif__wire_get_str(&w, &job.buf.filename)
+               && exif__wire_get_blob(&w, &data, &len)
+               && exif__wire_get_str(&w, &opts.config_path)
+               && exif__wire_get_strs(alloc, &w, &opts.args, &opts.argc)
+               && exif__wire_get_strs(alloc, &w, &opts.tags, &opts.ntags)
+               && exif__wire_get(&w, &profile, sizeof profile)
+               && exif__wire_get_strs(alloc, &w, &opts.profile_args, &opts.profile_argc);
+
+        if (ok) {
+            job.kind = (exif_job_kind_t)kind;
+            job.buf.data = data;
+            job.buf.len = (size_t)len;
+            opts.prefilter = flags & 1;
+            opts.format = flags & 2 ? EXIF_FORMAT_BINARY : EXIF_FORMAT_JSON;
+            opts.patch = flags & 4;
+            opts.profile = (exif_profile_t)profile;
+            job.opts = &opts;
+            exif__pool_execute(ctx, &job);
+        } else {
+            job.result = exif__err_result(alloc, "malformed fork server request", -1);
+        }
+        if (opts.args)
+            alloc->free(opts.args, opts.argc * sizeof *opts.args, alloc->ctx);
+        if (opts.tags)
+            alloc->free(opts.tags, opts.ntags * sizeof *opts.tags, alloc->ctx);
+        if (opts.profile_args)
+            alloc->free(opts.profile_args, opts.profile_argc * sizeof *opts.profile_args,
+                        alloc->ctx);
+        exif__buf_free(alloc, &msg);
+
+        exif_result_t *r = &job.result;
+        uint8_t success = r->success;
+        bool sent = exif__buf_append(alloc, &msg, &success, sizeof success)
+                 && exif__wire_u32(alloc, &msg, (uint32_t)r->exit_code)
+                 && exif__wire_blob(alloc, &msg, r->data, r->data ? r->data_len : 0)
+                 && exif__wire_str(alloc, &msg, r->error)
+                 && exif__wire_send(fd, &msg, 0);
+        exif__buf_free(alloc, &msg);
+        exif_result_free(ctx, r);
+        if (!sent) return;
     }
-    close(out_fd);
-    unlink(out_path);
+}
 
-    const char *tail[] = { "-o", out_path, in_path };
-    result = exif__run(ctx, tail, 3, opts);
+// Zygote process: owns one initialized context and forks a worker per 'F'
+// request on ctl, handing the parent the worker's socket and pid. It stays
+// single-threaded so every fork starts from a consistent image.
+static void exif__forkserver_zygote(const exif_config_t *cfg, int ctl)
+{
+    // Workers are reaped automatically; the parent only ever kills them
+    signal(SIGCHLD, SIG_IGN);
 
-    if (result.success) {
-        alloc->free(result.data, 0, alloc->ctx);
-        result.data = exif__read_file(alloc, out_path, &result.data_len);
-        if (!result.data)
-            result = exif__err_result(alloc, "output file not produced", -1);
+    // Nothing runs here, so a stay_open interpreter is only started inside
+    // each worker, on its own thread, by the worker's first job. Warm-up
+    // starts one at create; it goes before the first fork.
+    exif_t *ctx = exif_create(cfg);
+    if (ctx) exif__resident_stop(ctx);
+    uint8_t ready = ctx != NULL;
+    if (!exif__io_write(ctl, &ready, 1, 0) || !ctx) _exit(1);
+
+    for (;;) {
+        uint8_t cmd;
+        if (!exif__io_read(ctl, &cmd, 1)) break;
+
+        int sv[2] = { -1, -1 };
+        pid_t pid = -1;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) {
+            pid = fork();
+            if (pid == 0) {
+                close(ctl);
+                close(sv[0]);
+                signal(SIGCHLD, SIG_DFL);
+                exif__nosigpipe(sv[1]);
+                exif__forkserver_serve(ctx, sv[1]);
+                _exit(0);
+            }
+            close(sv[1]);
+        }
+
+        // The reply always carries the pid; the fd only when the fork worked
+        char cbuf[CMSG_SPACE(sizeof(int))];
+        memset(cbuf, 0, sizeof cbuf);
+        struct iovec iov = { &pid, sizeof pid };
+        struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+        if (pid > 0) {
+            mh.msg_control = cbuf;
+            mh.msg_controllen = sizeof cbuf;
+            struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+            cm->cmsg_level = SOL_SOCKET;
+            cm->cmsg_type = SCM_RIGHTS;
+            cm->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cm), &sv[0], sizeof(int));
+        }
+        ssize_t n;
+        do n = sendmsg(ctl, &mh, 0); while (n < 0 && errno == EINTR);
+        if (sv[0] >= 0) close(sv[0]);
+        if (n != sizeof pid) break;
     }
 
-    unlink(out_path);
+    exif_destroy(ctx);
+    _exit(0);
+}
 
-cleanup:
-    unlink(in_path);
-    alloc->free(in_path, 0, alloc->ctx);
-    return result;
+typedef struct exif__fork_worker {
+    pid_t       pid;
+    int         fd;        // -1 when the slot needs a fresh fork; non-blocking
+    size_t      job;       // index into the running batch
+    bool        busy;
+    uint64_t    deadline;  // ns, 0 for none
+    exif__buf_t rx;        // the reply so far, length prefix included
+} exif__fork_worker_t;
+
+struct exif_forkserver {
+    exif_allocator_t     alloc;
+    pthread_mutex_t      lock;     // one batch at a time
+    pid_t                zygote;
+    int                  ctl;
+    exif__fork_worker_t *workers;
+    int                  nworkers;
+    uint32_t             timeout_ms;
+};
+
+static bool exif__forkserver_spawn(exif_forkserver_t *fs, exif__fork_worker_t *w)
+{
+    uint8_t cmd = 'F';
+    if (!exif__io_write(fs->ctl, &cmd, 1, 0)) return false;
+
+    pid_t pid = -1;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &pid, sizeof pid };
+    struct msghdr mh = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf, .msg_controllen = sizeof cbuf,
+    };
+    ssize_t n;
+    do n = recvmsg(fs->ctl, &mh, 0); while (n < 0 && errno == EINTR);
+    if (n != sizeof pid || pid <= 0) return false;
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    if (!cm || cm->cmsg_type != SCM_RIGHTS) return false;
+    int fd;
+    memcpy(&fd, CMSG_DATA(cm), sizeof fd);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    // Replies are read as they arrive, so a worker that stalls part way
+    // through one still runs into its deadline
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    exif__nosigpipe(fd);
+
+    w->pid = pid;
+    w->fd = fd;
+    w->busy = false;
+    return true;
 }
 
-void exif_result_free(exif_t *ctx, exif_result_t *result)
+// Sockets are shut down rather than just closed: later zygotes inherit
+// copies of them, which would otherwise keep the far end from seeing EOF.
+static void exif__forkserver_retire(exif_forkserver_t *fs, exif__fork_worker_t *w)
+{
+    exif__buf_free(&fs->alloc, &w->rx);
+    if (w->fd >= 0) {
+        shutdown(w->fd, SHUT_RDWR);
+        close(w->fd);
+    }
+    if (w->pid > 0) kill(w->pid, SIGKILL);
+    w->fd = -1;
+    w->pid = 0;
+    w->busy = false;
+}
+
+static bool exif__forkserver_send(exif_forkserver_t *fs, exif__fork_worker_t *w,
+                                  const exif_job_t *job)
+{
+    exif_allocator_t *alloc = &fs->alloc;
+    exif_options_t merged;
+    const exif_options_t *o = exif__with_prepared(job->opts, &merged);
+    bool with_buf = job->kind == EXIF_JOB_READ_BUF || job->kind == EXIF_JOB_WRITE_BUF;
+    uint32_t kind = job->kind;
+
+    exif__buf_t msg = {0};
+    uint32_t flags = (o && o->prefilter)
+                   | (o && o->format == EXIF_FORMAT_BINARY) << 1
+                   | (o && o->patch) << 2;
+    bool ok = exif__wire_u32(alloc, &msg, kind)
+           && exif__wire_u32(alloc, &msg, flags)
+           && exif__wire_str(alloc, &msg, job->path)
+           && exif__wire_str(alloc, &msg, job->out_path)
+           && exif__wire_str(alloc, &msg, with_buf ? job->buf.filename : NULL)
+           && exif__wire_blob(alloc, &msg, with_buf ? job->buf.data : NULL,
+                              with_buf ? job->buf.len : 0)
+           && exif__wire_str(alloc, &msg, o ? o->config_path : NULL)
+           && exif__wire_strs(alloc, &msg, o ? o->args : NULL, o ? o->argc : 0)
+           && exif__wire_strs(alloc, &msg, o ? o->tags : NULL, o ? o->ntags : 0)
+           && exif__wire_u32(alloc, &msg, o ? (uint32_t)o->profile : 0)
+           && exif__wire_strs(alloc, &msg, o ? o->profile_args : NULL,
+                              o ? o->profile_argc : 0)
+           && exif__wire_send(w->fd, &msg, w->deadline);
+    exif__buf_free(alloc, &msg);
+    return ok;
+}
+
+// Read what has arrived of w's reply without blocking: 1 once all of it is
+// in w->rx, 0 while more is due, -1 when the worker is gone.
+static int exif__forkserver_pump(exif_forkserver_t *fs, exif__fork_worker_t *w)
+{
+    uint64_t len = 0;
+    for (;;) {
+        size_t want = sizeof len;
+        if (w->rx.len >= sizeof len) {
+            memcpy(&len, w->rx.data, sizeof len);
+            if (len > SIZE_MAX - 1 - sizeof len) return -1;
+            want += (size_t)len;
+            if (w->rx.len == want) return 1;
+        }
+        if (!exif__buf_reserve(&fs->alloc, &w->rx, want - w->rx.len)) return -1;
+        ssize_t n = read(w->fd, w->rx.data + w->rx.len, want - w->rx.len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) return -1;
+        w->rx.len += (size_t)n;
+    }
+}
+
+// Turn the reply in w->rx into the job's result
+static bool exif__forkserver_recv(exif_forkserver_t *fs, exif__fork_worker_t *w,
+                                  exif_job_t *job)
+{
+    exif_allocator_t *alloc = &fs->alloc;
+    exif__buf_t msg = w->rx;
+    w->rx = (exif__buf_t){0};
+    msg.data[msg.len] = '\0';
+
+    exif__wire_t in = { msg.data + sizeof(uint64_t), msg.data + msg.len };
+    uint8_t success;
+    uint32_t code;
+    const void *data;
+    uint64_t len;
+    const char *error;
+    bool ok = exif__wire_get(&in, &success, sizeof success)
+           && exif__wire_get(&in, &code, sizeof code)
+           && exif__wire_get_blob(&in, &data, &len)
+           && exif__wire_get_str(&in, &error);
+    if (!ok) {
+        exif__buf_free(alloc, &msg);
+        return false;
+    }
+
+    exif_result_t r = { .success = success, .exit_code = (int32_t)code };
+    if (success) {
+        r.data = alloc->alloc(len + 1, alloc->ctx);
+        if (r.data) {
+            memcpy(r.data, data, len);
+            r.data[len] = '\0';
+            r.data_len = len;
+        } else {
+            r = exif__err_result(alloc, "out of memory", -1);
+        }
+    } else {
+        r = exif__err_result(alloc, error ? error : "unknown error", r.exit_code);
+    }
+    exif__buf_free(alloc, &msg);
+
+    // The sink runs here, not in the worker that read the file
+    exif_options_t merged;
+    const exif_options_t *o = exif__with_prepared(job->opts, &merged);
+    if (job->kind == EXIF_JOB_READ || job->kind == EXIF_JOB_READ_BUF) {
+        exif__apply_transform(alloc, &r, o);
+        if (o && o->sink) exif__sink_deliver(alloc, o->sink, o->sink_ctx, &r, 0, 0);
+    }
+    job->result = r;
+    return true;
+}
+
+// Threads of this process, or 0 where that can't be told.
+static int exif__thread_count(void)
+{
+    int n = 0;
+#if defined(__linux__)
+    DIR *d = opendir("/proc/self/task");
+    if (!d) return 0;
+    for (struct dirent *e; (e = readdir(d)); )
+        if (e->d_name[0] != '.') n++;
+    closedir(d);
+#elif defined(__APPLE__)
+    thread_act_array_t threads;
+    mach_msg_type_number_t count;
+    if (task_threads(mach_task_self(), &threads, &count) != KERN_SUCCESS) return 0;
+    for (mach_msg_type_number_t i = 0; i < count; i++)
+        mach_port_deallocate(mach_task_self(), threads[i]);
+    vm_deallocate(mach_task_self(), (vm_address_t)threads, count * sizeof *threads);
+    n = (int)count;
+#endif
+    return n;
+}
+
+exif_forkserver_t *exif_forkserver_create(const exif_config_t *cfg, int nworkers,
+                                          uint32_t timeout_ms)
+{
+    exif_allocator_t alloc = exif__default_allocator;
+    if (cfg && cfg->allocator) alloc = *cfg->allocator;
+
+    // The zygote runs exif_create after fork(). A lock held by another
+    // thread at that moment would never be released in the child.
+    if (exif__thread_count() > 1) return NULL;
+
+    if (nworkers <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = ncpu > 0 ? (int)ncpu : 1;
+    }
+
+    exif_forkserver_t *fs = alloc.alloc(sizeof *fs, alloc.ctx);
+    if (!fs) return NULL;
+    memset(fs, 0, sizeof *fs);
+    fs->alloc = alloc;
+    fs->ctl = -1;
+    fs->timeout_ms = timeout_ms;
+    pthread_mutex_init(&fs->lock, NULL);
+
+    fs->workers = alloc.alloc(nworkers * sizeof *fs->workers, alloc.ctx);
+    if (!fs->workers) goto fail;
+    for (int i = 0; i < nworkers; i++)
+        fs->workers[i] = (exif__fork_worker_t){ .fd = -1 };
+    fs->nworkers = nworkers;
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) goto fail;
+    fs->zygote = fork();
+    if (fs->zygote == 0) {
+        close(sv[0]);
+        exif__forkserver_zygote(cfg, sv[1]);
+    }
+    close(sv[1]);
+    fs->ctl = sv[0];
+    if (fs->zygote < 0) goto fail;
+    fcntl(fs->ctl, F_SETFD, FD_CLOEXEC);
+    exif__nosigpipe(fs->ctl);
+
+    uint8_t ready = 0;
+    if (!exif__io_read(fs->ctl, &ready, 1) || !ready) goto fail;
+
+    // Fork every worker now so the first batch doesn't pay for it
+    for (int i = 0; i < nworkers; i++)
+        if (!exif__forkserver_spawn(fs, &fs->workers[i])) goto fail;
+
+    return fs;
+
+fail:
+    exif_forkserver_destroy(fs);
+    return NULL;
+}
+
+void exif_forkserver_destroy(exif_forkserver_t *fs)
+{
+    if (!fs) return;
+    exif_allocator_t alloc = fs->alloc;
+
+    for (int i = 0; i < fs->nworkers; i++)
+        exif__forkserver_retire(fs, &fs->workers[i]);
+    if (fs->workers)
+        alloc.free(fs->workers, fs->nworkers * sizeof *fs->workers, alloc.ctx);
+
+    // The zygote exits once its control socket closes
+    if (fs->ctl >= 0) {
+        shutdown(fs->ctl, SHUT_RDWR);
+        close(fs->ctl);
+    }
+    if (fs->zygote > 0) {
+        while (waitpid(fs->zygote, NULL, 0) < 0 && errno == EINTR) {}
+    }
+
+    pthread_mutex_destroy(&fs->lock);
+    alloc.free(fs, sizeof *fs, alloc.ctx);
+}
+
+int exif_forkserver_size(const exif_forkserver_t *fs)
+{
+    return fs ? fs->nworkers : 0;
+}
+
+void exif_forkserver_run(exif_forkserver_t *fs, exif_job_t *jobs, size_t njobs)
+{
+    exif_allocator_t *alloc = &fs->alloc;
+    pthread_mutex_lock(&fs->lock);
+
+    size_t next = 0, done = 0;
+    struct pollfd *pfds = alloc->alloc(fs->nworkers * sizeof *pfds, alloc->ctx);
+    if (!pfds) {
+        for (; next < njobs; next++)
+            jobs[next].result = exif__err_result(alloc, "out of memory", -1);
+        pthread_mutex_unlock(&fs->lock);
+        return;
+    }
+
+    while (done < njobs) {
+        int busy = 0;
+        for (int i = 0; i < fs->nworkers; i++) {
+            exif__fork_worker_t *w = &fs->workers[i];
+            if (!w->busy && next < njobs) {
+                // A slot whose worker died gets a fresh fork from the zygote
+                if (w->fd < 0 && !exif__forkserver_spawn(fs, w)) continue;
+                w->deadline = fs->timeout_ms
+                    ? exif__now_ns() + (uint64_t)fs->timeout_ms * 1000000u : 0;
+                if (exif__forkserver_send(fs, w, &jobs[next])) {
+                    w->busy = true;
+                    w->job = next;
+                } else {
+                    bool late = w->deadline && exif__now_ns() >= w->deadline;
+                    exif__forkserver_retire(fs, w);
+                    jobs[next].result = exif__err_result(alloc, late
+                                                         ? "worker process timed out"
+                                                         : "worker process exited", -1);
+                    done++;
+                }
+                next++;
+            }
+            busy += w->busy;
+        }
+
+        if (!busy) {
+            // Nothing in flight and the zygote can't fork: fail the rest
+            for (; next < njobs; next++, done++)
+                jobs[next].result = exif__err_result(alloc, "no worker process available", -1);
+            continue;
+        }
+
+        int timeout = -1;
+        uint64_t now = exif__now_ns();
+        int nfds = 0;
+        for (int i = 0; i < fs->nworkers; i++) {
+            exif__fork_worker_t *w = &fs->workers[i];
+            if (!w->busy) continue;
+            pfds[nfds++] = (struct pollfd){ .fd = w->fd, .events = POLLIN };
+            if (w->deadline) {
+                uint64_t left = w->deadline > now ? (w->deadline - now) / 1000000u + 1 : 0;
+                if (timeout < 0 || left < (uint64_t)timeout) timeout = (int)left;
+            }
+        }
+        if (poll(pfds, nfds, timeout) < 0 && errno != EINTR) {
+            for (int i = 0; i < nfds; i++) pfds[i].revents = POLLERR;
+        }
+
+        now = exif__now_ns();
+        int k = 0;
+        for (int i = 0; i < fs->nworkers; i++) {
+            exif__fork_worker_t *w = &fs->workers[i];
+            if (!w->busy) continue;
+            short rev = pfds[k++].revents;
+            exif_job_t *job = &jobs[w->job];
+            int got = rev ? exif__forkserver_pump(fs, w) : 0;
+            if (got > 0 && exif__forkserver_recv(fs, w, job)) {
+                w->busy = false;
+                done++;
+            } else if (got != 0) {
+                exif__forkserver_retire(fs, w);
+                job->result = exif__err_result(alloc, "worker process crashed", -1);
+                done++;
+            } else if (w->deadline && now >= w->deadline) {
+                // Also when part of the reply has arrived
+                exif__forkserver_retire(fs, w);
+                job->result = exif__err_result(alloc, "worker process timed out", -1);
+                done++;
+            }
+        }
+    }
+
+    alloc->free(pfds, fs->nworkers * sizeof *pfds, alloc->ctx);
+    pthread_mutex_unlock(&fs->lock);
+}
+
+void exif_forkserver_result_free(exif_forkserver_t *fs, exif_result_t *result)
 {
     if (!result) return;
-    exif_allocator_t *alloc = ctx ? &ctx->alloc : &exif__default_allocator;
+    exif_allocator_t *alloc = fs ? &fs->alloc : &exif__default_allocator;
     if (result->data)  alloc->free(result->data, 0, alloc->ctx);
     if (result->error) alloc->free(result->error, 0, alloc->ctx);
     result->data = NULL;
@@ -40,20 +40,100 @@ typedef struct exif_allocator {
     void   *ctx;  // forwarded as last arg to alloc and free
 } exif_allocator_t;
 
+typedef struct exif_cache exif_cache_t;
+
+//! Receives one span per timed phase of a call, then one named "call" for
+//! the whole call. Runs on the calling thread (a worker thread in a pool).
+//! @param phase        "reset", "marshal", "run", "flush", "spill",
+//!                     "readback" or "call". Static string.
+//! @param start_ns     CLOCK_MONOTONIC start time.
+//! @param duration_ns  Phase duration.
+typedef void (*exif_trace_fn)(const char *phase, uint64_t start_ns,
+                              uint64_t duration_ns, void *ctx);
+
 //! Runtime configuration. Zero-init for defaults.
 //! @param allocator  NULL uses malloc/free.
+//! @param stay_open  Keep one exiftool interpreter resident across calls
+//!                   (-stay_open) on a context-owned thread. Calls with
+//!                   config_path fall back to a one-shot run.
+//! @param snapshot   Start from a snapshot of linear memory taken after the
+//!                   first such context's zeroperl_init, mapped copy-on-write
+//!                   where supported. Contexts with the same stack and heap
+//!                   sizes then skip interpreter init. Only memory is
+//!                   captured, so each of them still instantiates the module
+//!                   for fresh globals and tables. A context whose instance
+//!                   traps gets a new instance restored from the snapshot.
+//! @param cache      Read cache from exif_cache_create, shared by every
+//!                   context given it. NULL disables caching.
+//! @param memory_limit      Cap on an instance's linear memory, in bytes.
+//!                          0 keeps the module's own maximum.
+//! @param memory_limit_max  A call that runs out of memory under
+//!                          memory_limit is retried on a fresh instance with
+//!                          double the limit, up to this. The context returns
+//!                          to memory_limit afterwards. 0 disables retries.
+//!                          Needs a memory_limit below it; exif_create
+//!                          returns NULL otherwise.
+//! @param recycle_size      Replace the instance after a call that leaves its
+//!                          linear memory larger than this many bytes, giving
+//!                          the pages back. 0 never recycles.
+//! @param warmup     Formats ("JPEG", "HEIC", "MOV", ...) or ExifTool modules
+//!                   ("XMP", "Image::ExifTool::QuickTime") to load during
+//!                   exif_create, so the first read of them runs at steady
+//!                   state. The stay-open interpreter keeps them loaded for
+//!                   its lifetime. Ignored without stay_open: every call
+//!                   then starts on a reset interpreter, which would drop
+//!                   them, so no warm-up run is made.
+//! @param stats      Time the phases of every call into exif_result_t.stats.
+//! @param trace      Called for each phase as it ends; implies timing.
 typedef struct exif_config {
     exif_allocator_t *allocator;
     uint32_t          wasm_stack_size;   // default: 8 MiB
     uint32_t          wasm_heap_size;    // default: 32 MiB
     uint32_t          exec_stack_size;   // default: 8 MiB
+    bool              stay_open;         // default: false
+    bool              snapshot;          // default: false
+    exif_cache_t     *cache;             // default: none
+    uint64_t          memory_limit;      // default: module maximum
+    uint64_t          memory_limit_max;  // default: no retry
+    uint64_t          recycle_size;      // default: never
+    const char      **warmup;            // default: none
+    int               nwarmup;
+    bool              stats;             // default: false
+    exif_trace_fn     trace;             // default: none
+    void             *trace_ctx;         // forwarded to trace
 } exif_config_t;
 
 //! Transform raw exiftool stdout before returning it in a result.
 //! Return a caller-owned string; the library frees the original data.
 typedef char *(*exif_transform_fn)(const char *data, size_t len, void *ctx);
 
+//! Receive read output as exiftool writes it, instead of in result.data.
+//! file is 0 for single-file reads and the path index for exif_read_many.
+//! Each file's bytes arrive in order and end with a call with data NULL and
+//! len 0. Called while the read runs, on its thread or the stay-open
+//! interpreter's; must not call into ctx.
+typedef void (*exif_sink_fn)(size_t file, const char *data, size_t len, void *ctx);
+
+//! Default argument set for reads.
+typedef enum exif_profile {
+    EXIF_PROFILE_FULL,      // -json -a -s -n -ee3 -U -G3:1 -api requestall=3 -api largefilesupport
+    EXIF_PROFILE_STANDARD,  // -json -a -s -n -G3:1 -api largefilesupport
+    EXIF_PROFILE_FAST,      // -json -s -n -G3:1 -fast2 -api largefilesupport
+    EXIF_PROFILE_CUSTOM,    // -json followed by profile_args
+    EXIF_PROFILE_COMMON,    // dimensions, camera, exposure, GPS; native for JPEG/TIFF/DNG/PNG
+} exif_profile_t;
+
+//! Output format of reads.
+typedef enum exif_format {
+    EXIF_FORMAT_JSON,    // exiftool -json text
+    EXIF_FORMAT_BINARY,  // length-prefixed records, see resources/exifbin.pl
+} exif_format_t;
+
+typedef struct exif_prepared exif_prepared_t;
+
 //! Per-operation options. Zero-init for defaults. All fields optional.
+//! With prepared set, every other field comes from the prepared options,
+//! except that a transform or sink given here replaces the prepared one.
 typedef struct exif_options {
     const char       **args;            // extra exiftool CLI args
     int                argc;
@@ -62,6 +142,15 @@ typedef struct exif_options {
     int                ntags;
     exif_transform_fn  transform;       // post-process stdout before return
     void              *transform_ctx;
+    bool               prefilter;       // read_buf: skip image/media payload
+    exif_profile_t     profile;         // reads only; default FULL
+    const char       **profile_args;    // EXIF_PROFILE_CUSTOM arguments
+    int                profile_argc;
+    exif_format_t      format;          // reads only; default JSON
+    exif_prepared_t   *prepared;        // from exif_prepare
+    bool               patch;           // writes: simple JPEG edits in C
+    exif_sink_fn       sink;            // reads: stream stdout; no transform or cache
+    void              *sink_ctx;
 } exif_options_t;
 
 //! Named in-memory buffer. Filename extension determines format handling.
@@ -71,18 +160,59 @@ typedef struct exif_buf {
     const char *filename;
 } exif_buf_t;
 
+//! Pull-based input for exif_read_stream. Callbacks are only invoked while
+//! the exif_read_stream call runs, on its thread or, with stay_open, the
+//! stay-open interpreter's; they must not call into ctx. read and pread
+//! return the number of bytes read, 0 at the end, or -1 on error.
+typedef struct exif_reader {
+    int64_t (*size)(void *ctx);  // total bytes, or -1 if unknown; may be NULL
+    int64_t (*pread)(void *ctx, void *buf, size_t len, uint64_t off);  // NULL if not seekable
+    int64_t (*read)(void *ctx, void *buf, size_t len);  // used when pread is NULL
+    void     *ctx;  // forwarded as first arg to every callback
+} exif_reader_t;
+
+//! Nanoseconds spent in each phase of one call, summed over every exiftool
+//! run the call made. All zero unless the context times calls.
+typedef struct exif_stats {
+    uint64_t reset_ns;     // zeroperl_reset
+    uint64_t marshal_ns;   // copying arguments into the instance
+    uint64_t run_ns;       // zeroperl_run_file, or the stay-open command
+    uint64_t flush_ns;     // zeroperl_flush
+    uint64_t spill_ns;     // placing buffer input in the VFS or a temp file
+    uint64_t readback_ns;  // collecting output and written files
+    uint64_t total_ns;     // the whole call, including cache lookups
+} exif_stats_t;
+
+//! Cumulative counters of a context.
+typedef struct exif_counters {
+    uint64_t calls;            // public read and write calls
+    uint64_t bytes_in;         // buffer and stream input
+    uint64_t bytes_out;        // result data
+    uint64_t heap_high_water;  // largest linear memory size seen, in bytes
+    uint64_t traps;            // runs that trapped the instance
+    uint64_t resets;           // instances rebuilt after a trap
+    uint64_t recycles;         // instances replaced to give memory back
+    uint64_t memory_retries;   // runs repeated under a larger memory limit
+    uint64_t patched;          // writes done by the native JPEG patcher
+    uint64_t native_reads;     // EXIF_PROFILE_COMMON reads done without exiftool
+} exif_counters_t;
+
 //! Operation result. Owned by the context's allocator; free with exif_result_free.
 //! On success: data/data_len hold output, error is NULL.
 //! On failure: error holds a message, data is NULL.
+//! Reads with a sink succeed with data NULL and data_len the bytes streamed.
 typedef struct exif_result {
     bool     success;
     char    *data;
     size_t   data_len;
     char    *error;
     int32_t  exit_code;
+    exif_stats_t stats;  // timings, with exif_config_t.stats or .trace
 } exif_result_t;
 
-//! Load the AOT module and initialize the WASM runtime.
+//! Create a context with its own exiftool instance.
+//! The WASM runtime and AOT module are loaded by the first context and
+//! shared by all later ones; the last exif_destroy unloads them.
 //! @param cfg  Runtime configuration. NULL for defaults.
 //! @return     Opaque context, or NULL on failure.
 EXIF_API exif_t *exif_create(const exif_config_t *cfg);
@@ -91,31 +221,112 @@ EXIF_API exif_t *exif_create(const exif_config_t *cfg);
 //! @param ctx  Context to destroy. NULL is a no-op.
 EXIF_API void exif_destroy(exif_t *ctx);
 
+//! Create a cache of read results. Files are keyed by path and by device,
+//! inode, size and mtime; buffers by a hash of their bytes and filename.
+//! The options are part of every key. An identical read already running on
+//! another context is waited on, not repeated. Transforms run per call on
+//! a copy of the cached result.
+//! @param alloc      Allocator for entries. NULL uses malloc/free.
+//! @param max_bytes  Budget; least recently used entries are evicted past
+//!                   it. 0 for 64 MiB.
+//! @return           Cache, or NULL on allocation failure.
+EXIF_API exif_cache_t *exif_cache_create(const exif_allocator_t *alloc,
+                                         size_t max_bytes);
+
+//! Drop every finished entry.
+EXIF_API void exif_cache_clear(exif_cache_t *c);
+
+//! Destroy a cache once no context uses it any more. NULL is a no-op.
+EXIF_API void exif_cache_destroy(exif_cache_t *c);
+
+//! Prepare options for repeated use. The options are copied, and on first
+//! use their constant argument strings are copied into ctx's instance once
+//! and kept there, so each call only copies in its paths. Pass the handle as
+//! exif_options_t.prepared to any call. With another context, such as a pool
+//! worker, the options still apply but nothing is kept staged. Stay-open
+//! reads don't build argument vectors and gain nothing.
+//! @param ctx   Context whose instance holds the staged strings.
+//! @param opts  Options to copy. NULL for defaults.
+//! @return      Handle, or NULL on allocation failure.
+EXIF_API exif_prepared_t *exif_prepare(exif_t *ctx, const exif_options_t *opts);
+
+//! Release prepared options. Call before exif_destroy(ctx). NULL is a no-op.
+EXIF_API void exif_prepared_free(exif_t *ctx, exif_prepared_t *p);
+
 //! Read metadata from a file path.
-//! Always returns structured JSON (-json -a -s -n -ee3 -U -G3:1 -api requestall=3 -api largefilesupport).
+//! Always returns structured JSON, with the arguments of opts->profile
+//! (default: -json -a -s -n -ee3 -U -G3:1 -api requestall=3 -api largefilesupport).
+//! With opts->format EXIF_FORMAT_BINARY the same tags come back as one binary
+//! document instead, and the transform is not applied. resources/exifbin.pl
+//! writes it when the arguments stay within -json -j -s -S -short -a -U -u
+//! -n -b -struct -ee[N] -fast[N] -G[N:N] -config -d -c -lang -x -api and tag
+//! names; otherwise, and for resident stay-open reads, exiftool's JSON is
+//! converted to the same layout.
 //! @param ctx   Context from exif_create.
 //! @param path  Path to the image file.
 //! @param opts  Extra CLI args, config, transform. NULL for defaults.
 EXIF_API exif_result_t exif_read(exif_t *ctx, const char *path,
                                  const exif_options_t *opts);
 
-//! Read metadata from an in-memory buffer. Spills to a temp file internally.
-//! Always returns structured JSON (-json -a -s -n -ee3 -U -G3:1 -api requestall=3 -api largefilesupport).
+//! Read metadata from an in-memory buffer. The buffer is exposed to exiftool
+//! as a virtual file without copying; nothing is written to disk.
+//! With opts->prefilter, JPEG entropy data, PNG IDAT, TIFF/DNG raw strips and
+//! tiles, and (without embedded extraction) ISO-BMFF mdat are found natively
+//! and served as zeros, so those pages of input are never read. Reads that
+//! can hash the image data (ImageDataHash, requestall=3 as in
+//! EXIF_PROFILE_FULL) are not filtered.
+//! Always returns structured JSON, with the arguments of opts->profile
+//! (default: -json -a -s -n -ee3 -U -G3:1 -api requestall=3 -api largefilesupport).
 //! @param ctx    Context from exif_create.
 //! @param input  Source data; filename extension determines format handling.
 //! @param opts   Extra CLI args, config, transform. NULL for defaults.
 EXIF_API exif_result_t exif_read_buf(exif_t *ctx, exif_buf_t input,
                                      const exif_options_t *opts);
 
-//! Read metadata from a file descriptor via /dev/fd.
-//! Always returns structured JSON (-json -a -s -n -ee3 -U -G3:1 -api requestall=3 -api largefilesupport).
+//! Read metadata from a reader. exiftool's reads are served on demand from
+//! the callbacks: with size and pread, only the 64 KiB blocks it touches are
+//! fetched; with size and read, the source is consumed only as far as it
+//! reads. A source of unknown size is read to the end first.
+//! Always returns structured JSON, with the arguments of opts->profile
+//! (default: -json -a -s -n -ee3 -U -G3:1 -api requestall=3 -api largefilesupport).
+//! @param ctx       Context from exif_create.
+//! @param reader    Source callbacks; needs pread or read.
+//! @param filename  Reported name; its extension determines format handling.
+//!                  NULL for "input".
+//! @param opts      Extra CLI args, config, transform. NULL for defaults.
+EXIF_API exif_result_t exif_read_stream(exif_t *ctx, const exif_reader_t *reader,
+                                        const char *filename,
+                                        const exif_options_t *opts);
+
+//! Read metadata from a file descriptor.
+//! Always returns structured JSON, with the arguments of opts->profile
+//! (default: -json -a -s -n -ee3 -U -G3:1 -api requestall=3 -api largefilesupport).
 //! @param ctx       Context from exif_create.
 //! @param fd        Readable file descriptor.
-//! @param filename  Unused, reserved for future use.
+//! @param filename  Reported name; the fd is then read through exif_read_stream.
+//!                  NULL to pass the fd as /dev/fd/<fd>.
 //! @param opts      Extra CLI args, config, transform. NULL for defaults.
 EXIF_API exif_result_t exif_read_fd(exif_t *ctx, int fd, const char *filename,
                                      const exif_options_t *opts);
 
+//! Read metadata from many files in a single exiftool run.
+//! Paths are passed to exiftool together (in chunks of a few hundred) and the
+//! JSON array is split back into one result per path, each shaped like an
+//! exif_read result. A missing or unreadable file only fails its own entry.
+//! @param ctx      Context from exif_create.
+//! @param paths    Image file paths.
+//! @param n        Number of paths.
+//! @param opts     Extra CLI args, config, transform. NULL for defaults.
+//!                 transform is applied to each file's result. With a
+//!                 sink, each file is its own command of the run, so its
+//!                 output streams out as soon as exiftool has written it.
+//! @param results  Array of n results, filled in path order. Free each with
+//!                 exif_result_free.
+//! @return         Number of successful results.
+EXIF_API size_t exif_read_many(exif_t *ctx, const char *const *paths, size_t n,
+                               const exif_options_t *opts,
+                               exif_result_t *results);
+
 //! Write tags to a file.
 //! @param ctx       Context from exif_create.
 //! @param in_path   Source image path.
@@ -125,7 +336,25 @@ EXIF_API exif_result_t exif_write(exif_t *ctx, const char *in_path,
                                   const char *out_path,
                                   const exif_options_t *opts);
 
-//! Write tags to an in-memory buffer.
+//! Write the same tags to many files in a single exiftool run.
+//! Each file is its own -execute command with the tags as -common_args, so
+//! per-file cost is the write itself rather than a full run. A file that
+//! fails only fails its own entry.
+//! @param ctx        Context from exif_create.
+//! @param in_paths   Source image paths.
+//! @param out_paths  Destination paths, or NULL to overwrite every input.
+//!                   A NULL entry overwrites its input.
+//! @param n          Number of files.
+//! @param opts       Must contain tags to write. args and config_path optional.
+//! @param results    Array of n results, filled in path order, each shaped
+//!                   like an exif_write result. Free each with exif_result_free.
+//! @return           Number of successful results.
+EXIF_API size_t exif_write_many(exif_t *ctx, const char *const *in_paths,
+                                const char *const *out_paths, size_t n,
+                                const exif_options_t *opts,
+                                exif_result_t *results);
+
+//! Write tags to an in-memory buffer. Input and output stay in memory.
 //! @param ctx    Context from exif_create.
 //! @param input  Source file data; filename extension determines format.
 //! @param opts   Must contain tags to write. args and config_path optional.
@@ -138,6 +367,216 @@ EXIF_API exif_result_t exif_write_buf(exif_t *ctx, exif_buf_t input,
 //! @param r    Result to free. NULL is a no-op.
 EXIF_API void exif_result_free(exif_t *ctx, exif_result_t *r);
 
+//! Cumulative counters since exif_create. Not synchronized with calls
+//! running on ctx.
+//! @param ctx  Context to query.
+//! @param out  Filled with the counters.
+EXIF_API void exif_counters(const exif_t *ctx, exif_counters_t *out);
+
+//! JSON type of a tag value.
+typedef enum exif_value_type {
+    EXIF_VALUE_NULL,
+    EXIF_VALUE_BOOL,
+    EXIF_VALUE_NUMBER,
+    EXIF_VALUE_STRING,
+    EXIF_VALUE_ARRAY,
+    EXIF_VALUE_OBJECT,
+    EXIF_VALUE_BINARY,  // binary output with -b only: raw bytes
+} exif_value_type_t;
+
+//! One tag of a parsed result. Strings are owned by the table.
+typedef struct exif_tag {
+    const char        *key;       // as emitted, e.g. "Main:IFD0:Orientation"
+    const char        *group;     // key up to its last ':', "" if none
+    const char        *name;      // key after its last ':'
+    exif_value_type_t  type;
+    const char        *text;      // STRING decoded, BINARY raw; others as JSON text
+    size_t             text_len;
+    double             number;    // NUMBER value; BOOL as 0 or 1
+} exif_tag_t;
+
+typedef struct exif_tags exif_tags_t;
+
+//! Parse a read result into a tag table, indexed by tag name.
+//! Uses the first object of the result's JSON array, or the first document
+//! of EXIF_FORMAT_BINARY output.
+//! @param ctx  Context whose allocator owns the table. NULL uses malloc/free.
+//! @param r    Successful read result; it can be freed once parsed.
+//! @return     Table, or NULL if r is not a successful read.
+EXIF_API exif_tags_t *exif_tags_parse(exif_t *ctx, const exif_result_t *r);
+
+//! Look up a tag. "Orientation" matches the first tag of that name in any
+//! group; "IFD0:Orientation" only one whose key ends in those groups.
+//! @return  Tag, or NULL if absent. Valid until exif_tags_free.
+EXIF_API const exif_tag_t *exif_tags_get(const exif_tags_t *t, const char *key);
+
+//! Number of tags, for iteration with exif_tags_at.
+EXIF_API size_t exif_tags_count(const exif_tags_t *t);
+
+//! Tag i in output order, or NULL when out of range.
+EXIF_API const exif_tag_t *exif_tags_at(const exif_tags_t *t, size_t i);
+
+//! Free a table. NULL is a no-op.
+EXIF_API void exif_tags_free(exif_tags_t *t);
+
+//! Kind of an embedded image.
+typedef enum exif_preview_kind {
+    EXIF_PREVIEW_THUMBNAIL,  // EXIF thumbnail, usually 160x120
+    EXIF_PREVIEW_PREVIEW,    // larger preview, JpgFromRaw or MPF image
+} exif_preview_kind_t;
+
+//! A JPEG embedded in a file, as a byte range of that file.
+typedef struct exif_preview {
+    uint64_t             offset;  // from the start of the file or buffer
+    uint64_t             length;
+    exif_preview_kind_t  kind;
+    const char          *name;    // exiftool tag, e.g. "JpgFromRaw"; static. Strip
+                                  // previews are all "PreviewImage"
+    uint32_t             width;   // from the JPEG's frame header, 0 if unknown
+    uint32_t             height;
+} exif_preview_t;
+
+//! Locate embedded previews and thumbnails without extracting them.
+//! JPEG and TIFF-based files (DNG and most raw formats) are walked in C;
+//! other formats, and files where that walk finds nothing, fall back to an
+//! exiftool read of the offset tags.
+//! @param ctx  Context, used for the exiftool fallback.
+//! @param path File to inspect.
+//! @param out  Filled with up to max ranges, in file order of discovery.
+//! @param max  Capacity of out; 0 just counts.
+//! @return     Number of previews found, which may exceed max.
+EXIF_API size_t exif_previews(exif_t *ctx, const char *path,
+                              exif_preview_t *out, size_t max);
+
+//! exif_previews for an in-memory file. Offsets are into input.data, so
+//! input.data + offset can be used directly while input is alive.
+EXIF_API size_t exif_previews_buf(exif_t *ctx, exif_buf_t input,
+                                  exif_preview_t *out, size_t max);
+
+typedef struct exif_pool exif_pool_t;
+
+//! Operation carried by an exif_job_t.
+typedef enum exif_job_kind {
+    EXIF_JOB_READ,       // exif_read(path)
+    EXIF_JOB_READ_BUF,   // exif_read_buf(buf)
+    EXIF_JOB_WRITE,      // exif_write(path, out_path)
+    EXIF_JOB_WRITE_BUF,  // exif_write_buf(buf)
+} exif_job_kind_t;
+
+//! One pool job. Inputs must stay valid until the job completes.
+//! The pool fills result; free it with exif_pool_result_free.
+typedef struct exif_job {
+    exif_job_kind_t        kind;
+    const char            *path;      // READ, WRITE
+    const char            *out_path;  // WRITE; NULL to overwrite path
+    exif_buf_t             buf;       // READ_BUF, WRITE_BUF
+    const exif_options_t  *opts;      // NULL for defaults
+    exif_result_t          result;
+} exif_job_t;
+
+//! Create a pool of worker threads, each owning one context.
+//! Jobs are spread over per-worker deques; idle workers steal queued jobs
+//! from busy ones, so a long job never holds up short ones behind it.
+//! @param cfg       Configuration for every worker context. NULL for defaults.
+//! @param nworkers  Number of workers. <= 0 uses the online CPU count.
+//! @return          Pool, or NULL on failure.
+EXIF_API exif_pool_t *exif_pool_create(const exif_config_t *cfg, int nworkers);
+
+//! Finish queued jobs, stop the workers and destroy their contexts.
+//! @param pool  Pool to destroy. NULL is a no-op.
+EXIF_API void exif_pool_destroy(exif_pool_t *pool);
+
+//! Number of workers (and contexts) in the pool.
+EXIF_API int exif_pool_size(const exif_pool_t *pool);
+
+//! Run jobs on the pool and block until all of them have completed.
+//! Safe to call from several threads at once.
+//! @param pool   Pool from exif_pool_create.
+//! @param jobs   Jobs to run; each job's result is filled in place.
+//! @param njobs  Number of jobs.
+EXIF_API void exif_pool_run(exif_pool_t *pool, exif_job_t *jobs, size_t njobs);
+
+//! Called on the worker thread that ran job, once its result is filled.
+typedef void (*exif_done_fn)(exif_job_t *job, void *user);
+
+//! A finished exif_submit job, reaped with exif_poll or exif_wait.
+typedef struct exif_completion {
+    exif_job_t *job;
+    void       *user;  // as passed to exif_submit
+} exif_completion_t;
+
+//! Queue one job on the pool and return without waiting for it.
+//! With done set, it is called when the job finishes. Otherwise the job
+//! is reported by exif_poll/exif_wait, tagged with user. The job must stay
+//! valid until then. Jobs still queued at exif_pool_destroy are run first.
+//! @return  false if the job could not be queued.
+EXIF_API bool exif_submit(exif_pool_t *pool, exif_job_t *job,
+                          exif_done_fn done, void *user);
+
+//! Reap finished jobs without blocking.
+//! @param out  Receives up to max completions, in completion order.
+//! @return     Number of completions written.
+EXIF_API size_t exif_poll(exif_pool_t *pool, exif_completion_t *out, size_t max);
+
+//! Like exif_poll, but first blocks until a job finishes.
+//! Returns 0 at once when no reaped-by-poll job is outstanding.
+//! @param timeout_ms  Longest wait; -1 waits indefinitely, 0 does not wait.
+EXIF_API size_t exif_wait(exif_pool_t *pool, exif_completion_t *out, size_t max,
+                          int timeout_ms);
+
+//! Descriptor that is readable while completions are waiting to be reaped,
+//! for registering with an event loop (poll, epoll, kqueue). Owned by the
+//! pool. Reaping every completion clears it.
+//! @return  The descriptor, or -1 if none could be created.
+EXIF_API int exif_pool_event_fd(const exif_pool_t *pool);
+
+//! Free data and error strings in a result produced by the pool.
+//! @param pool  Pool whose allocator owns the strings. NULL falls back to free().
+//! @param r     Result to free. NULL is a no-op.
+EXIF_API void exif_pool_result_free(exif_pool_t *pool, exif_result_t *r);
+
+typedef struct exif_forkserver exif_forkserver_t;
+
+//! Create a pool of worker processes forked from one initialized context.
+//! A zygote process builds the context once; every worker is a fork of it
+//! and shares its memory copy-on-write, so a worker costs a fork, not an
+//! exif_create. A worker that crashes or exceeds timeout_ms is killed and
+//! replaced by a fresh fork; only its own job fails. Not available on Windows.
+//! Call before the process starts other threads, contexts with stay_open
+//! or pools: the zygote is forked from the caller and runs exif_create
+//! there, which is only safe when no other thread can hold a lock at fork
+//! time. On Linux and macOS creation fails while other threads run.
+//! @param cfg         Configuration for the zygote context. NULL for defaults.
+//! @param nworkers    Number of worker processes. <= 0 uses the online CPU count.
+//! @param timeout_ms  Per-job limit before a worker is replaced. 0 for none.
+//! @return            Fork server, or NULL on failure or when the process
+//!                    already runs other threads.
+EXIF_API exif_forkserver_t *exif_forkserver_create(const exif_config_t *cfg,
+                                                   int nworkers,
+                                                   uint32_t timeout_ms);
+
+//! Kill the workers, stop the zygote and release all resources.
+//! @param fs  Fork server to destroy. NULL is a no-op.
+EXIF_API void exif_forkserver_destroy(exif_forkserver_t *fs);
+
+//! Number of worker processes.
+EXIF_API int exif_forkserver_size(const exif_forkserver_t *fs);
+
+//! Run jobs on the worker processes and block until all of them have
+//! completed. Inputs are copied to the workers, so buffers and options may
+//! live anywhere in the caller. Transforms run in the calling process.
+//! Calls from several threads are serialized.
+//! @param fs     Fork server from exif_forkserver_create.
+//! @param jobs   Jobs to run; each job's result is filled in place.
+//! @param njobs  Number of jobs.
+EXIF_API void exif_forkserver_run(exif_forkserver_t *fs, exif_job_t *jobs,
+                                  size_t njobs);
+
+//! Free data and error strings in a result produced by the fork server.
+//! @param fs  Fork server whose allocator owns the strings. NULL falls back to free().
+//! @param r   Result to free. NULL is a no-op.
+EXIF_API void exif_forkserver_result_free(exif_forkserver_t *fs, exif_result_t *r);
+
 #ifdef __cplusplus
 }
 #endif
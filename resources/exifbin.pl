@@ -0,0 +1,158 @@
+#!/usr/bin/env perl
+# Binary output for libexif reads (EXIF_FORMAT_BINARY).
+#
+# Takes the read subset of the exiftool command line and writes one document
+# per file instead of JSON:
+#
+#   "EXB1" u32 body_len
+#   body:  u32 nstrings, nstrings x (u32 len, bytes, NUL)
+#          u32 ntags,    ntags x (u32 group, u32 name, u8 type, value)
+#   value: NUMBER         f64, u32 len, text, NUL
+#          STRING, BINARY u32 len, bytes, NUL
+#          ARRAY, OBJECT  u32 len, JSON text, NUL
+#
+# Integers are little-endian. The string table holds the interned group and
+# tag names that records refer to by index; the reader joins them into the
+# "Group:Name" key. Type codes are exif_value_type_t. Files that fail are
+# reported on stderr the way exiftool does.
+#
+# libexif only runs this script when every argument is in the subset parsed
+# below (exif__bin_args_ok); other binary reads go through exiftool's JSON
+# and are converted in C. The error for an unknown option is a safeguard.
+use strict;
+use warnings;
+
+use constant {
+    T_NULL   => 0,
+    T_NUMBER => 2,
+    T_STRING => 3,
+    T_ARRAY  => 4,
+    T_OBJECT => 5,
+    T_BINARY => 6,
+};
+
+my ( @files, @tags, %opt );
+my ( $config, $families, $binary ) = ( undef, undef, 0 );
+$opt{Duplicates} = 0;
+$opt{Charset}    = 'UTF8';
+
+while (@ARGV) {
+    my $a = shift @ARGV;
+    if ( $a eq '-' or $a !~ /^-/ ) { push @files, $a; next }
+    if    ( $a =~ /^-(json|j|s|S|short)$/ ) { }
+    elsif ( $a eq '-config' )  { $config = shift @ARGV }
+    elsif ( $a eq '-a' )       { $opt{Duplicates} = 1 }
+    elsif ( $a eq '-U' )       { $opt{Unknown} = 2 }
+    elsif ( $a eq '-u' )       { $opt{Unknown} = 1 }
+    elsif ( $a eq '-n' )       { $opt{PrintConv} = 0 }
+    elsif ( $a eq '-b' )       { $binary = 1 }
+    elsif ( $a eq '-struct' )  { $opt{Struct} = 1 }
+    elsif ( $a =~ /^-ee(\d?)$/ )   { $opt{ExtractEmbedded} = length $1 ? $1 : 1 }
+    elsif ( $a =~ /^-fast(\d?)$/ ) { $opt{FastScan} = length $1 ? $1 : 1 }
+    elsif ( $a =~ /^-G([\d:]*)$/ ) { $families = length $1 ? $1 : '0' }
+    elsif ( $a eq '-d' )       { $opt{DateFormat} = shift @ARGV }
+    elsif ( $a eq '-c' )       { $opt{CoordFormat} = shift @ARGV }
+    elsif ( $a eq '-lang' )    { $opt{Lang} = shift @ARGV }
+    elsif ( $a eq '-x' )       { push @tags, '-' . shift @ARGV }
+    elsif ( $a eq '-api' ) {
+        my ( $k, $v ) = split /=/, shift(@ARGV) // '', 2;
+        $opt{$k} = defined $v ? $v : 1;
+    }
+    elsif ( $a =~ /^--([-\w:*?]+)#?$/ ) { push @tags, "-$1" }
+    elsif ( $a =~ /^-([-\w:*?]+)#?$/ ) { push @tags, $1 }
+    else {
+        print STDERR "Error: Option $a is not supported with binary output\n";
+        exit 2;
+    }
+}
+
+{
+    no warnings 'once';
+    $Image::ExifTool::configFile = $config if defined $config;
+}
+require Image::ExifTool;
+
+binmode STDOUT;
+
+sub json_text {
+    my $v = shift;
+    if ( ref $v eq 'ARRAY' ) {
+        return '[' . join( ',', map { json_text($_) } @$v ) . ']';
+    }
+    if ( ref $v eq 'HASH' ) {
+        return '{'
+          . join( ',', map { json_text($_) . ':' . json_text( $$v{$_} ) } sort keys %$v )
+          . '}';
+    }
+    $v = '(Binary data ' . length($$v) . ' bytes, use -b option to extract)'
+      if ref $v eq 'SCALAR';
+    utf8::encode($v) if utf8::is_utf8($v);
+    $v =~ s/(["\\])/\\$1/g;
+    $v =~ s/([\x00-\x1f])/sprintf('\\u%.4x', ord $1)/ge;
+    return qq("$v");
+}
+
+sub bytes_of {
+    my $s = shift;
+    utf8::encode($s) if utf8::is_utf8($s);
+    return pack( 'V', length $s ) . $s . "\0";
+}
+
+sub value_of {
+    my $v = shift;
+    if ( ref $v eq 'SCALAR' ) {
+        return pack( 'C', T_BINARY ) . bytes_of($$v) if $binary;
+        my $len = $$v =~ /^Binary data (\d+) bytes$/ ? $1 : length $$v;
+        return pack( 'C', T_STRING )
+          . bytes_of("(Binary data $len bytes, use -b option to extract)");
+    }
+    return pack( 'C', T_ARRAY ) . bytes_of( json_text($v) )  if ref $v eq 'ARRAY';
+    return pack( 'C', T_OBJECT ) . bytes_of( json_text($v) ) if ref $v eq 'HASH';
+    return pack( 'C', T_NULL ) unless defined $v;
+    # The numbers exiftool's JSON writer leaves unquoted
+    if ( $v =~ /^-?(\d|[1-9]\d{1,14})(\.\d{1,16})?(e[-+]?\d{1,3})?$/i ) {
+        return pack( 'C', T_NUMBER ) . pack( 'd<', $v ) . bytes_of($v);
+    }
+    return pack( 'C', T_STRING ) . bytes_of($v);
+}
+
+my $et = Image::ExifTool->new;
+$et->Options( $_ => $opt{$_} ) for sort keys %opt;
+
+my $status = 0;
+for my $file (@files) {
+    my $info = $et->ImageInfo( $file, @tags );
+    if ( $$info{Error} ) {
+        print STDERR "Error: $$info{Error} - $file\n";
+        $status = 1;
+        next;
+    }
+
+    my ( @strings, %interned, $records );
+    my $intern = sub {
+        my $s = shift;
+        return $interned{$s} //= do { push @strings, $s; $#strings };
+    };
+    $records = pack( 'VV', $intern->(''), $intern->('SourceFile') )
+      . pack( 'C', T_STRING ) . bytes_of($file);
+    my $ntags = 1;
+
+    # Same order and group names as the JSON writer
+    my $sort = defined $families ? "Group$families" : 'File';
+    for my $key ( $et->GetTagList( $info, $sort ) ) {
+        my $name  = Image::ExifTool::GetTagName($key);
+        my $group = '';
+        if ( defined $families ) {
+            $group = $et->GetGroup( $key, $families );
+            $group = 'Unknown' if not $group and $families !~ /\b4\b/;
+        }
+        $records .= pack( 'VV', $intern->($group), $intern->($name) )
+          . value_of( $$info{$key} );
+        $ntags++;
+    }
+
+    my $body = pack( 'V', scalar @strings ) . join( '', map { bytes_of($_) } @strings )
+      . pack( 'V', $ntags ) . $records;
+    print 'EXB1', pack( 'V', length $body ), $body;
+}
+exit $status;
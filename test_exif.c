@@ -6,6 +6,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #ifndef SOURCE_DIR
 #error "SOURCE_DIR must be defined at compile time"
@@ -52,6 +55,113 @@ static char *read_file(const char *path, size_t *len)
     return buf;
 }
 
+static int write_file(const char *path, const void *data, size_t len)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) return 0;
+    size_t n = fwrite(data, 1, len, f);
+    return fclose(f) == 0 && n == len;
+}
+
+// test.png with a tEXt Comment of text bytes after IHDR, which exiftool
+// reads whole. The CRC is left zero; exiftool doesn't check it.
+static unsigned char *png_with_comment(uint32_t text, size_t *len)
+{
+    size_t plen;
+    char *png = read_file(TEST_DATA "test.png", &plen);
+    unsigned char *buf = png && plen > 33 ? malloc(plen + 12 + text) : NULL;
+    if (!buf) {
+        free(png);
+        return NULL;
+    }
+    memcpy(buf, png, 33);
+    unsigned char *p = buf + 33;
+    *p++ = text >> 24; *p++ = text >> 16; *p++ = text >> 8; *p++ = text;
+    memcpy(p, "tEXtComment", 12);
+    memset(p + 12, 'a', text - 8);
+    p += 4 + text;
+    memset(p, 0, 4);
+    memcpy(p + 4, png + 33, plen - 33);
+    free(png);
+    *len = plen + 12 + text;
+    return buf;
+}
+
+// JSON after the SourceFile line, which names the file read
+static const char *after_source_file(const char *json)
+{
+    const char *p = strstr(json, "\"SourceFile\"");
+    p = p ? strchr(p, '\n') : NULL;
+    return p ? p : json;
+}
+
+static void put16(unsigned char *p, uint32_t v) { p[0] = v & 0xFF; p[1] = (v >> 8) & 0xFF; }
+static void put32(unsigned char *p, uint32_t v) { put16(p, v & 0xFFFF); put16(p + 2, v >> 16); }
+static void put32be(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24); p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);  p[3] = (unsigned char)v;
+}
+
+// One IFD entry: ASCII values are strings, others one uint32_t per item,
+// two per RATIONAL
+typedef struct tiff_entry {
+    uint16_t    tag, type;
+    uint32_t    count;
+    const void *value;
+} tiff_entry_t;
+
+// Little-endian TIFF into zeroed t: IFD0, then the Exif and GPS IFDs that
+// IFD0 points at. Entries are sorted by tag. Returns the length.
+static size_t build_tiff(unsigned char *t, const tiff_entry_t *const ifd[3], const int n[3])
+{
+    static const int size[] = { 0, 1, 1, 2, 4, 8 };
+    int total[3] = { n[0] + 2, n[1], n[2] };
+    size_t pos[3], at = 8;
+    for (int i = 0; i < 3; i++) {
+        pos[i] = at;
+        at += 2 + 12 * (size_t)total[i] + 4;
+    }
+    memcpy(t, "II*\0", 4);
+    put32(t + 4, 8);
+    for (int i = 0; i < 3; i++) {
+        unsigned char *e = t + pos[i];
+        put16(e, (uint32_t)total[i]);
+        e += 2;
+        for (int k = 0; k < total[i]; k++, e += 12) {
+            if (k >= n[i]) {
+                put16(e, k == n[i] ? 0x8769 : 0x8825);
+                put16(e + 2, 4);
+                put32(e + 4, 1);
+                put32(e + 8, (uint32_t)pos[k - n[i] + 1]);
+                continue;
+            }
+            const tiff_entry_t *x = &ifd[i][k];
+            size_t len = (size_t)size[x->type] * x->count;
+            unsigned char *v = len <= 4 ? e + 8 : t + at;
+            put16(e, x->tag);
+            put16(e + 2, x->type);
+            put32(e + 4, x->count);
+            if (len > 4) {
+                put32(e + 8, (uint32_t)at);
+                at += len + (len & 1);
+            }
+            if (x->type == 2) {
+                memcpy(v, x->value, len);
+                continue;
+            }
+            const uint32_t *u = x->value;
+            for (size_t j = 0; j < len / size[x->type] * (x->type == 5 ? 2 : 1); j++) {
+                if (x->type == 1) v[j] = (unsigned char)u[j];
+                else if (x->type == 3) put16(v + 2 * j, u[j]);
+                else put32(v + 4 * j, u[j]);
+            }
+        }
+        put32(e, 0);
+    }
+    return at;
+}
+
 // Handles both "Key" and "Group:Key" from -G1 output
 static int json_has_key(const char *json, const char *key)
 {
@@ -149,6 +259,270 @@ static void test_read_buf_jpeg(exif_t *exif)
     free(data);
 }
 
+static void test_read_buf_filename(exif_t *exif)
+{
+    size_t len;
+    char *data = read_file(TEST_DATA "test.jpg", &len);
+    ASSERT(data, "failed to read test.jpg");
+
+    exif_buf_t buf = { .data = data, .len = len, .filename = "holiday photo.jpg" };
+    exif_result_t r = exif_read_buf(exif, buf, NULL);
+    free(data);
+    ASSERT_SUCCESS(r);
+    ASSERT(strstr(r.data, "\"holiday photo.jpg\""), "original filename not reported");
+    exif_result_free(exif, &r);
+}
+
+static int line_contains(const char *line, size_t len, const char *needle)
+{
+    size_t n = strlen(needle);
+    for (size_t i = 0; i + n <= len; i++)
+        if (memcmp(line + i, needle, n) == 0) return 1;
+    return 0;
+}
+
+// Compare two JSON outputs line by line, ignoring lines containing skip
+static int json_equal_except(const char *a, const char *b, const char *skip)
+{
+    for (;;) {
+        const char *ea = strchr(a, '\n'), *eb = strchr(b, '\n');
+        size_t la = ea ? (size_t)(ea - a) : strlen(a);
+        size_t lb = eb ? (size_t)(eb - b) : strlen(b);
+        int skip_a = line_contains(a, la, skip);
+        int skip_b = line_contains(b, lb, skip);
+        if (skip_a || skip_b) {
+            if (skip_a) a = ea ? ea + 1 : a + la;
+            if (skip_b) b = eb ? eb + 1 : b + lb;
+            continue;
+        }
+        if (la != lb || memcmp(a, b, la) != 0) return 0;
+        if (!ea || !eb) return !ea && !eb;
+        a = ea + 1;
+        b = eb + 1;
+    }
+}
+
+static void test_read_buf_prefilter(exif_t *exif)
+{
+    size_t len;
+    char *png = read_file(TEST_DATA "test.png", &len);
+    ASSERT(png && len > 20, "failed to read test.png");
+
+    // Put a 256 KiB IDAT in front of IEND; exiftool never looks inside it
+    size_t idat_len = 256 << 10;
+    char *data = malloc(len + 12 + idat_len);
+    size_t iend = len - 12;
+    memcpy(data, png, iend);
+    char *c = data + iend;
+    c[0] = (char)(idat_len >> 24); c[1] = (char)(idat_len >> 16);
+    c[2] = (char)(idat_len >> 8);  c[3] = (char)idat_len;
+    memcpy(c + 4, "IDAT", 4);
+    for (size_t i = 0; i < idat_len; i++) c[8 + i] = (char)(i * 7 + 1);
+    memset(c + 8 + idat_len, 0, 4);
+    memcpy(c + 12 + idat_len, png + iend, 12);
+    free(png);
+
+    exif_buf_t buf = { .data = data, .len = len + 12 + idat_len, .filename = "big.png" };
+    exif_options_t plain = { .profile = EXIF_PROFILE_STANDARD };
+    exif_options_t opts = { .profile = EXIF_PROFILE_STANDARD, .prefilter = true };
+    exif_result_t full = exif_read_buf(exif, buf, &plain);
+    exif_result_t filtered = exif_read_buf(exif, buf, &opts);
+    free(data);
+    int same = full.success && filtered.success
+            && json_equal_except(full.data, filtered.data, "System:");
+    exif_result_free(exif, &full);
+    exif_result_free(exif, &filtered);
+    ASSERT(same, "prefiltered read differs from full read");
+}
+
+// Box header for len bytes of content; returns where the content goes
+static unsigned char *put_box(unsigned char *p, const char *type, size_t len)
+{
+    put32be(p, (uint32_t)(len + 8));
+    memcpy(p + 4, type, 4);
+    return p + 8;
+}
+
+// Read buf with and without the prefilter; the outputs must match
+static int prefilter_same(exif_t *exif, exif_buf_t buf, const exif_options_t *opts,
+                          exif_buf_t filtered_buf)
+{
+    exif_options_t filter = *opts;
+    filter.prefilter = true;
+    exif_result_t full = exif_read_buf(exif, buf, opts);
+    exif_result_t filtered = exif_read_buf(exif, filtered_buf, &filter);
+    int same = full.success && filtered.success
+            && json_equal_except(full.data, filtered.data, "System:");
+    if (!same) printf(" [%s]", filtered.error ? filtered.error : "output differs");
+    exif_result_free(exif, &full);
+    exif_result_free(exif, &filtered);
+    return same;
+}
+
+static void test_read_buf_prefilter_bmff(exif_t *exif)
+{
+    // MP4: ftyp, moov with an mvhd, and 256 KiB of mdat
+    size_t payload = 256 << 10, len = 24 + 116 + 8 + payload;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t maplen = (len + (size_t)page - 1) / (size_t)page * (size_t)page;
+    unsigned char *mp4 = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT(mp4 != MAP_FAILED, "mmap failed");
+    unsigned char *p = put_box(mp4, "ftyp", 16);
+    memcpy(p, "isom\0\0\2\0isommp41", 16);
+    p = put_box(put_box(p + 16, "moov", 108), "mvhd", 100);
+    put32be(p + 12, 1000);        // timescale
+    put32be(p + 16, 5000);        // duration
+    put32be(p + 20, 0x10000);     // rate
+    p[24] = 1;                    // volume
+    put32be(p + 36, 0x10000);     // matrix
+    put32be(p + 52, 0x10000);
+    put32be(p + 68, 0x40000000);
+    put32be(p + 96, 2);           // next track
+    p = put_box(p + 100, "mdat", payload);
+    for (size_t i = 0; i < payload; i++) p[i] = (unsigned char)(i * 7 + 1);
+
+    // A copy whose mdat pages fault: the filtered read must not touch them
+    unsigned char *fenced = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fenced == MAP_FAILED) munmap(mp4, maplen);
+    ASSERT(fenced != MAP_FAILED, "mmap failed");
+    memcpy(fenced, mp4, len);
+    size_t from = ((size_t)(p - mp4) + (size_t)page - 1) / (size_t)page * (size_t)page;
+    size_t to = (size_t)(p - mp4 + payload) / (size_t)page * (size_t)page;
+    int fenced_ok = to > from && mprotect(fenced + from, to - from, PROT_NONE) == 0;
+
+    exif_buf_t buf = { .data = mp4, .len = len, .filename = "clip.mp4" };
+    exif_buf_t fbuf = { .data = fenced, .len = len, .filename = "clip.mp4" };
+    exif_options_t standard = { .profile = EXIF_PROFILE_STANDARD };
+    // requestall=3 can hash the media data, so that read is not filtered
+    const char *all[] = { "-api", "requestall=3" };
+    exif_options_t request_all = { .profile = EXIF_PROFILE_STANDARD, .args = all, .argc = 2 };
+    int pass = fenced_ok && prefilter_same(exif, buf, &standard, fbuf)
+            && prefilter_same(exif, buf, &request_all, buf);
+    munmap(fenced, maplen);
+    munmap(mp4, maplen);
+    ASSERT(pass, "prefiltered MP4 read differs from full read");
+
+    // HEIC: the Exif item lives in mdat, which a top-level meta box keeps
+    unsigned char tiff[256] = {0};
+    const tiff_entry_t ifd0[] = { { 0x010F, 2, 6, "Canon" } };
+    const tiff_entry_t *const ifds[3] = { ifd0, NULL, NULL };
+    size_t tlen = build_tiff(tiff, ifds, (const int[3]){ 1, 0, 0 });
+    size_t exif_len = 10 + tlen;
+    payload = 64 << 10;
+    len = 24 + 110 + 8 + payload;
+    unsigned char *heic = calloc(1, len);
+    ASSERT(heic, "alloc failed");
+    p = put_box(heic, "ftyp", 16);
+    memcpy(p, "heic\0\0\0\0mif1heic", 16);
+    p = put_box(p + 16, "meta", 102) + 4;
+    p = put_box(p, "hdlr", 25);
+    memcpy(p + 8, "pict", 4);
+    p = put_box(p + 25, "iinf", 27);
+    p[5] = 1;                                   // one entry
+    p = put_box(p + 6, "infe", 13);
+    p[0] = 2;                                   // version 2
+    p[5] = 1;                                   // item 1
+    memcpy(p + 8, "Exif", 4);
+    p = put_box(p + 13, "iloc", 22);
+    p[4] = 0x44;                                // 4-byte offsets and lengths
+    p[7] = 1;                                   // one item
+    p[9] = 1;                                   // item 1
+    p[13] = 1;                                  // one extent
+    put32be(p + 14, 24 + 110 + 8);
+    put32be(p + 18, (uint32_t)exif_len);
+    p = put_box(p + 22, "mdat", payload);
+    put32be(p, 6);
+    memcpy(p + 4, "Exif\0\0", 6);
+    memcpy(p + 10, tiff, tlen);
+    for (size_t i = exif_len; i < payload; i++) p[i] = (unsigned char)(i * 7 + 1);
+
+    buf = (exif_buf_t){ .data = heic, .len = len, .filename = "photo.heic" };
+    exif_result_t r = exif_read_buf(exif, buf, &(exif_options_t){
+        .profile = EXIF_PROFILE_STANDARD, .prefilter = true });
+    pass = r.success && json_has_key(r.data, "Make")
+        && prefilter_same(exif, buf, &standard, buf)
+        && prefilter_same(exif, buf, &request_all, buf);
+    exif_result_free(exif, &r);
+    free(heic);
+    ASSERT(pass, "prefiltered HEIC read lost its Exif item");
+}
+
+typedef struct mem_source {
+    const char *data;
+    size_t      len;
+    size_t      pos;
+    size_t      fetched;
+    size_t      calls;
+} mem_source_t;
+
+static int64_t mem_size(void *ctx)
+{
+    return (int64_t)((mem_source_t *)ctx)->len;
+}
+
+static int64_t mem_pread(void *ctx, void *buf, size_t len, uint64_t off)
+{
+    mem_source_t *m = ctx;
+    if (off >= m->len) return 0;
+    if (len > m->len - off) len = m->len - off;
+    memcpy(buf, m->data + off, len);
+    m->fetched += len;
+    m->calls++;
+    return (int64_t)len;
+}
+
+static int64_t mem_read(void *ctx, void *buf, size_t len)
+{
+    mem_source_t *m = ctx;
+    int64_t n = mem_pread(ctx, buf, len, m->pos);
+    m->pos += (size_t)n;
+    return n;
+}
+
+static void test_read_stream(exif_t *exif)
+{
+    size_t len;
+    char *data = read_file(TEST_DATA "test.jpg", &len);
+    ASSERT(data, "failed to read test.jpg");
+
+    mem_source_t seekable = { data, len, 0, 0, 0 };
+    exif_reader_t r1 = { .size = mem_size, .pread = mem_pread, .ctx = &seekable };
+    exif_result_t a = exif_read_stream(exif, &r1, "remote.jpg", NULL);
+
+    // read() only, size unknown: spooled in full first
+    mem_source_t sequential = { data, len, 0, 0, 0 };
+    exif_reader_t r2 = { .read = mem_read, .ctx = &sequential };
+    exif_result_t b = exif_read_stream(exif, &r2, "remote.jpg", NULL);
+
+    int ok = a.success && strstr(a.data, "\"remote.jpg\"")
+          && b.success && strstr(b.data, "\"remote.jpg\"")
+          && json_equal_except(a.data, b.data, "System:")
+          && seekable.fetched > 0 && sequential.fetched == len;
+    exif_result_free(exif, &a);
+    exif_result_free(exif, &b);
+    ASSERT(ok, "stream reads failed or differ");
+
+    // With 4 MiB of padding after the image, a fast read fetches a few
+    // 64 KiB blocks of it at most
+    size_t plen = len + ((size_t)4 << 20);
+    char *padded = calloc(1, plen);
+    ASSERT(padded, "alloc failed");
+    memcpy(padded, data, len);
+    free(data);
+    mem_source_t remote = { padded, plen, 0, 0, 0 };
+    exif_reader_t r3 = { .size = mem_size, .pread = mem_pread, .ctx = &remote };
+    exif_options_t fast = { .profile = EXIF_PROFILE_FAST };
+    exif_result_t c = exif_read_stream(exif, &r3, "remote.jpg", &fast);
+    free(padded);
+    ok = c.success && strstr(c.data, "\"remote.jpg\"");
+    exif_result_free(exif, &c);
+    ASSERT(ok, "padded stream read failed");
+    ASSERT(remote.calls > 0 && remote.calls <= 4, "unexpected number of preads");
+    ASSERT(remote.fetched <= (size_t)4 * 65536, "stream read fetched the padding");
+}
+
 static void test_read_buf_dng(exif_t *exif)
 {
     size_t len;
@@ -217,6 +591,207 @@ static void test_write_buf_roundtrip(exif_t *exif)
     free(data);
 }
 
+static void test_write_buf_patch(exif_t *exif)
+{
+    size_t len;
+    char *data = read_file(TEST_DATA "test.jpg", &len);
+    ASSERT(data, "failed to read test.jpg");
+    exif_counters_t c0, c1;
+
+    // test.jpg has no EXIF, so the first write falls back to exiftool
+    const char *first[] = { "-Artist=short" };
+    exif_options_t fopts = { .tags = first, .ntags = 1, .patch = true };
+    exif_buf_t in = { .data = data, .len = len, .filename = "test.jpg" };
+    exif_counters(exif, &c0);
+    exif_result_t base = exif_write_buf(exif, in, &fopts);
+    exif_counters(exif, &c1);
+    free(data);
+    ASSERT_SUCCESS(base);
+    ASSERT(c1.patched == c0.patched, "write without EXIF was patched");
+
+    // A longer Artist and a new Copyright are patched into its IFD0
+    const char *tags[] = { "-Artist=a much longer artist name", "-EXIF:Copyright=libexif" };
+    exif_options_t wopts = { .tags = tags, .ntags = 2, .patch = true };
+    exif_buf_t exif_in = { .data = base.data, .len = base.data_len, .filename = "base.jpg" };
+    exif_result_t wr = exif_write_buf(exif, exif_in, &wopts);
+    exif_counters(exif, &c0);
+    ASSERT_SUCCESS(wr);
+    ASSERT(c0.patched == c1.patched + 1, "write was not patched");
+
+    // The same write through exiftool reads back identically
+    exif_options_t xopts = { .tags = tags, .ntags = 2 };
+    exif_result_t ref = exif_write_buf(exif, exif_in, &xopts);
+    exif_counters(exif, &c1);
+    ASSERT_SUCCESS(ref);
+    ASSERT(c1.patched == c0.patched, "write without patch was patched");
+
+    const char *cargs[] = { "-G1", "-EXIF:all" };
+    exif_options_t ropts = { .profile = EXIF_PROFILE_CUSTOM, .profile_args = cargs,
+                             .profile_argc = 2 };
+    exif_buf_t modified = { .data = wr.data, .len = wr.data_len, .filename = "out.jpg" };
+    exif_buf_t expected = { .data = ref.data, .len = ref.data_len, .filename = "out.jpg" };
+    exif_result_t rr = exif_read_buf(exif, modified, &ropts);
+    exif_result_t rx = exif_read_buf(exif, expected, &ropts);
+    exif_result_free(exif, &ref);
+    ASSERT_SUCCESS(rr);
+    ASSERT_SUCCESS(rx);
+    ASSERT(strcmp(after_source_file(rr.data), after_source_file(rx.data)) == 0,
+           "patched and exiftool writes read back differently");
+    exif_result_free(exif, &rx);
+    char val[256];
+    ASSERT(json_string_value(rr.data, "Artist", val, sizeof val), "missing Artist");
+    ASSERT(strcmp(val, "a much longer artist name") == 0, "Artist mismatch");
+    ASSERT(json_string_value(rr.data, "Copyright", val, sizeof val), "missing Copyright");
+    ASSERT(strcmp(val, "libexif") == 0, "Copyright mismatch");
+    exif_result_free(exif, &rr);
+
+    // File writes print what exiftool prints: created with an output path,
+    // updated in place, then unchanged once the values are already set
+    const char *src = "/tmp/libexif_patch.jpg", *dst = "/tmp/libexif_patch_out.jpg";
+    const char *xsrc = "/tmp/libexif_patch_x.jpg", *xdst = "/tmp/libexif_patch_x_out.jpg";
+    int wrote = write_file(src, base.data, base.data_len)
+             && write_file(xsrc, base.data, base.data_len);
+    exif_result_free(exif, &base);
+    ASSERT(wrote, "failed to write temp files");
+    unlink(dst);
+    unlink(xdst);
+    const char *outs[][2] = { { dst, xdst }, { NULL, NULL }, { NULL, NULL } };
+    for (int i = 0; i < 3; i++) {
+        exif_counters(exif, &c0);
+        exif_result_t p = exif_write(exif, src, outs[i][0], &wopts);
+        exif_counters(exif, &c1);
+        exif_result_t x = exif_write(exif, xsrc, outs[i][1], &xopts);
+        int same = p.success && x.success && strcmp(p.data, x.data) == 0;
+        exif_result_free(exif, &p);
+        exif_result_free(exif, &x);
+        ASSERT(c1.patched == c0.patched + 1, "file write was not patched");
+        ASSERT(same, "patched write message differs from exiftool");
+    }
+    unlink(src);
+    unlink(dst);
+    unlink(xsrc);
+    unlink(xdst);
+}
+
+static void test_previews(exif_t *exif)
+{
+    // Nothing found in C is double-checked with exiftool
+    exif_preview_t pv[4];
+    exif_counters_t c0, c1;
+    exif_counters(exif, &c0);
+    ASSERT(exif_previews(exif, TEST_DATA "test.jpg", pv, 4) == 0, "test.jpg has no previews");
+    exif_counters(exif, &c1);
+    ASSERT(c1.calls > c0.calls, "empty walk did not ask exiftool");
+
+    size_t len;
+    char *data = read_file(TEST_DATA "test.jpg", &len);
+    ASSERT(data, "failed to read test.jpg");
+
+    // An EXIF APP1 whose IFD1 points at a 160x120 JPEG thumbnail
+    static const unsigned char thumb[] = {
+        0xFF, 0xD8, 0xFF, 0xC0, 0x00, 0x0B, 0x08, 0x00, 0x78, 0x00, 0xA0, 0x01,
+        0x01, 0x11, 0x00, 0xFF, 0xD9,
+    };
+    static const unsigned char tiff[] = {
+        'I', 'I', 0x2A, 0x00, 0x08, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x0E, 0x00, 0x00, 0x00,  // IFD0: no entries, IFD1 at 14
+        0x02, 0x00,
+        0x01, 0x02, 0x04, 0x00, 0x01, 0x00, 0x00, 0x00, 0x2C, 0x00, 0x00, 0x00,
+        0x02, 0x02, 0x04, 0x00, 0x01, 0x00, 0x00, 0x00, sizeof thumb, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+    };
+    size_t app1 = 2 + 6 + sizeof tiff + sizeof thumb;
+    size_t blen = len + 2 + app1;
+    unsigned char *buf = malloc(blen);
+    ASSERT(buf, "alloc failed");
+    unsigned char *p = buf;
+    memcpy(p, data, 2); p += 2;
+    *p++ = 0xFF; *p++ = 0xE1; *p++ = (unsigned char)(app1 >> 8); *p++ = (unsigned char)app1;
+    memcpy(p, "Exif\0\0", 6); p += 6;
+    memcpy(p, tiff, sizeof tiff); p += sizeof tiff;
+    memcpy(p, thumb, sizeof thumb); p += sizeof thumb;
+    memcpy(p, data + 2, len - 2);
+    free(data);
+
+    exif_buf_t in = { .data = buf, .len = blen, .filename = "thumb.jpg" };
+    exif_counters(exif, &c0);
+    size_t n = exif_previews_buf(exif, in, pv, 4);
+    exif_counters(exif, &c1);
+    ASSERT(c1.calls == c0.calls, "native walk asked exiftool");
+    ASSERT(n == 1, "expected one preview");
+    ASSERT(pv[0].kind == EXIF_PREVIEW_THUMBNAIL, "expected a thumbnail");
+    ASSERT(strcmp(pv[0].name, "ThumbnailImage") == 0, "unexpected name");
+    ASSERT(pv[0].offset == 12 + sizeof tiff && pv[0].length == sizeof thumb, "range mismatch");
+    ASSERT(memcmp(buf + pv[0].offset, thumb, sizeof thumb) == 0, "range content mismatch");
+    ASSERT(pv[0].width == 160 && pv[0].height == 120, "dimensions mismatch");
+
+    // exiftool reports the same range
+    // JPEGInterchangeFormat in a SubIFD is JpgFromRaw
+    unsigned char raw[56 + sizeof thumb] = {
+        'I', 'I', 0x2A, 0x00, 0x08, 0x00, 0x00, 0x00,
+        0x01, 0x00,  // IFD0: SubIFDs at 26
+        0x4A, 0x01, 0x04, 0x00, 0x01, 0x00, 0x00, 0x00, 0x1A, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+        0x02, 0x00,  // SubIFD: the JPEG at 56
+        0x01, 0x02, 0x04, 0x00, 0x01, 0x00, 0x00, 0x00, 0x38, 0x00, 0x00, 0x00,
+        0x02, 0x02, 0x04, 0x00, 0x01, 0x00, 0x00, 0x00, sizeof thumb, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+    };
+    memcpy(raw + 56, thumb, sizeof thumb);
+    exif_buf_t rin = { .data = raw, .len = sizeof raw, .filename = "raw.tif" };
+    n = exif_previews_buf(exif, rin, pv, 4);
+    ASSERT(n == 1 && pv[0].offset == 56 && pv[0].kind == EXIF_PREVIEW_PREVIEW
+           && strcmp(pv[0].name, "JpgFromRaw") == 0, "SubIFD JPEG mismatch");
+
+    const char *args[] = { "-n", "-ThumbnailOffset", "-ThumbnailLength" };
+    exif_options_t opts = { .profile = EXIF_PROFILE_CUSTOM, .profile_args = args,
+                            .profile_argc = 3 };
+    exif_result_t r = exif_read_buf(exif, in, &opts);
+    free(buf);
+    ASSERT_SUCCESS(r);
+    exif_tags_t *t = exif_tags_parse(exif, &r);
+    exif_result_free(exif, &r);
+    ASSERT(t, "parse failed");
+    const exif_tag_t *off = exif_tags_get(t, "ThumbnailOffset");
+    const exif_tag_t *tl = exif_tags_get(t, "ThumbnailLength");
+    bool same = off && tl && off->number == (double)pv[0].offset
+             && tl->number == (double)pv[0].length;
+    exif_tags_free(t);
+    ASSERT(same, "exiftool range differs");
+}
+
+static void test_write_buf_prepared(exif_t *exif)
+{
+    size_t len;
+    char *data = read_file(TEST_DATA "test.jpg", &len);
+    ASSERT(data, "failed to read test.jpg");
+
+    const char *tags[] = { "-Artist=prepared" };
+    exif_options_t popts = { .tags = tags, .ntags = 1 };
+    exif_prepared_t *p = exif_prepare(exif, &popts);
+    ASSERT(p, "exif_prepare failed");
+    tags[0] = "-Artist=changed";  // the handle keeps its own copy
+
+    exif_options_t wopts = { .prepared = p };
+    exif_buf_t in = { .data = data, .len = len, .filename = "test.jpg" };
+    for (int i = 0; i < 3; i++) {
+        exif_result_t wr = exif_write_buf(exif, in, &wopts);
+        ASSERT_SUCCESS(wr);
+
+        exif_buf_t modified = { .data = wr.data, .len = wr.data_len, .filename = "out.jpg" };
+        exif_result_t rr = exif_read_buf(exif, modified, NULL);
+        ASSERT_SUCCESS(rr);
+        char val[256];
+        ASSERT(json_string_value(rr.data, "Artist", val, sizeof val), "missing Artist");
+        ASSERT(strcmp(val, "prepared") == 0, "Artist mismatch");
+        exif_result_free(exif, &rr);
+        exif_result_free(exif, &wr);
+    }
+
+    exif_prepared_free(exif, p);
+    free(data);
+}
+
 // --- unicode tests ---
 
 static void test_unicode_korean(exif_t *exif)
@@ -378,6 +953,192 @@ static void test_read_buf_transform(exif_t *exif)
 
 // --- edge cases ---
 
+static void test_read_profiles(exif_t *exif)
+{
+    exif_options_t fast = { .profile = EXIF_PROFILE_FAST };
+    const char *only[] = { "-s", "-G3:1", "-FileName", "-MIMEType" };
+    exif_options_t custom = { .profile = EXIF_PROFILE_CUSTOM,
+                              .profile_args = only, .profile_argc = 4 };
+
+    exif_result_t full = exif_read(exif, TEST_DATA "test.jpg", NULL);
+    exif_result_t f = exif_read(exif, TEST_DATA "test.jpg", &fast);
+    exif_result_t c = exif_read(exif, TEST_DATA "test.jpg", &custom);
+    int ok = full.success && f.success && c.success
+          && json_has_key(f.data, "ImageWidth") && f.data_len <= full.data_len
+          && json_has_key(c.data, "FileName") && json_has_key(c.data, "MIMEType")
+          && !json_has_key(c.data, "ImageWidth");
+    exif_result_free(exif, &full);
+    exif_result_free(exif, &f);
+    exif_result_free(exif, &c);
+    ASSERT(ok, "profile reads returned unexpected tags");
+}
+
+static void test_read_common_native(exif_t *exif)
+{
+    size_t len;
+    char *data = read_file(TEST_DATA "test.jpg", &len);
+    ASSERT(data, "failed to read test.jpg");
+
+    // test.jpg with IFD0, ExifIFD and GPS entries for every common tag
+    static const uint32_t orient[] = { 6 }, iso[] = { 400 }, exposure[] = { 1, 250 },
+        fnumber[] = { 28, 10 }, focal[] = { 50, 1 }, lat[] = { 48, 1, 51, 1, 2964, 100 },
+        lon[] = { 2, 1, 17, 1, 4010, 100 }, altref[] = { 0 }, alt[] = { 3550, 100 };
+    static const tiff_entry_t ifd0[] = {
+        { 0x010F, 2, 6, "Canon" }, { 0x0110, 2, 7, "EOS R5" }, { 0x0112, 3, 1, orient },
+    };
+    static const tiff_entry_t exififd[] = {
+        { 0x829A, 5, 1, exposure }, { 0x829D, 5, 1, fnumber }, { 0x8827, 3, 1, iso },
+        { 0x9003, 2, 20, "2024:05:01 12:34:56" }, { 0x9011, 2, 7, "+02:00" },
+        { 0x920A, 5, 1, focal }, { 0xA433, 2, 6, "Canon" },
+        { 0xA434, 2, 16, "RF50mm F1.8 STM" },
+    };
+    static const tiff_entry_t gps[] = {
+        { 0x0001, 2, 2, "N" }, { 0x0002, 5, 3, lat }, { 0x0003, 2, 2, "E" },
+        { 0x0004, 5, 3, lon }, { 0x0005, 1, 1, altref }, { 0x0006, 5, 1, alt },
+    };
+    const tiff_entry_t *const ifds[3] = { ifd0, exififd, gps };
+    const int nifd[3] = { 3, 8, 6 };
+    unsigned char *tiff = calloc(1, 1024);
+    unsigned char *jpg = malloc(len + 1024);
+    ASSERT(tiff && jpg, "alloc failed");
+    size_t tlen = build_tiff(tiff, ifds, nifd);
+    memcpy(jpg, data, 2);
+    jpg[2] = 0xFF;
+    jpg[3] = 0xE1;
+    jpg[4] = (unsigned char)((2 + 6 + tlen) >> 8);
+    jpg[5] = (unsigned char)((2 + 6 + tlen) & 0xFF);
+    memcpy(jpg + 6, "Exif\0\0", 6);
+    memcpy(jpg + 12, tiff, tlen);
+    memcpy(jpg + 12 + tlen, data + 2, len - 2);
+    size_t jlen = 12 + tlen + len - 2;
+    free(tiff);
+    free(data);
+    const char *fixture = "/tmp/libexif_common.jpg";
+    int wrote = write_file(fixture, jpg, jlen);
+    ASSERT(wrote, "failed to write the fixture");
+
+    // The native reader must print what exiftool prints for the full
+    // argument list of the profile
+    const char *args[] = {
+        "-a", "-s", "-n", "-G3:1", "-fast2", "-api", "largefilesupport",
+        "-File:ImageWidth", "-File:ImageHeight", "-PNG:ImageWidth", "-PNG:ImageHeight",
+        "-IFD0:ImageWidth", "-IFD0:ImageHeight", "-IFD0:Make", "-IFD0:Model", "-IFD0:Orientation",
+        "-ExifIFD:DateTimeOriginal", "-ExifIFD:OffsetTimeOriginal", "-ExifIFD:ExposureTime",
+        "-ExifIFD:FNumber", "-ExifIFD:ISO", "-ExifIFD:FocalLength", "-ExifIFD:LensMake",
+        "-ExifIFD:LensModel", "-GPS:GPSLatitudeRef", "-GPS:GPSLatitude", "-GPS:GPSLongitudeRef",
+        "-GPS:GPSLongitude", "-GPS:GPSAltitudeRef", "-GPS:GPSAltitude",
+    };
+    exif_options_t common = { .profile = EXIF_PROFILE_COMMON };
+    exif_options_t custom = { .profile = EXIF_PROFILE_CUSTOM, .profile_args = args,
+                              .profile_argc = (int)(sizeof args / sizeof *args) };
+    const char *files[] = { TEST_DATA "test.jpg", TEST_DATA "test.png", TEST_DATA "test.tiff",
+                            fixture };
+    exif_counters_t c0, c1;
+    for (int i = 0; i < 4; i++) {
+        exif_counters(exif, &c0);
+        exif_result_t n = exif_read(exif, files[i], &common);
+        exif_counters(exif, &c1);
+        exif_result_t e = exif_read(exif, files[i], &custom);
+        int native = c1.native_reads == c0.native_reads + 1;
+        int same = n.success && e.success && n.data_len == e.data_len
+                   && memcmp(n.data, e.data, n.data_len) == 0;
+        int full = i < 3 || (n.success && strstr(n.data, "\"Main:GPS:GPSAltitude\"")
+                             && strstr(n.data, "\"Main:ExifIFD:LensModel\""));
+        exif_result_free(exif, &n);
+        exif_result_free(exif, &e);
+        ASSERT(native, "common read went to exiftool");
+        ASSERT(same, "native common read differs from exiftool");
+        ASSERT(full, "fixture tags missing from the common read");
+    }
+
+    // Buffers too, apart from the guest path each read mounts them at
+    exif_buf_t in = { .data = jpg, .len = jlen, .filename = "common.jpg" };
+    exif_counters(exif, &c0);
+    exif_result_t n = exif_read_buf(exif, in, &common);
+    exif_counters(exif, &c1);
+    exif_result_t e = exif_read_buf(exif, in, &custom);
+    free(jpg);
+    unlink(fixture);
+    int same = n.success && e.success
+               && strcmp(after_source_file(n.data), after_source_file(e.data)) == 0;
+    exif_result_free(exif, &n);
+    exif_result_free(exif, &e);
+    ASSERT(c1.native_reads == c0.native_reads + 1, "common buffer read went to exiftool");
+    ASSERT(same, "native common buffer read differs from exiftool");
+}
+
+static void test_result_tags(exif_t *exif)
+{
+    exif_result_t r = exif_read(exif, TEST_DATA "test.jpg", NULL);
+    ASSERT_SUCCESS(r);
+    exif_tags_t *t = exif_tags_parse(exif, &r);
+    exif_result_free(exif, &r);
+    ASSERT(t, "exif_tags_parse failed");
+
+    const exif_tag_t *name = exif_tags_get(t, "FileName");
+    const exif_tag_t *grouped = exif_tags_get(t, "System:FileName");
+    const exif_tag_t *size = exif_tags_get(t, "FileSize");
+    int ok = name && name->type == EXIF_VALUE_STRING && strcmp(name->text, "test.jpg") == 0
+          && grouped == name
+          && size && size->type == EXIF_VALUE_NUMBER && size->number > 0
+          && !exif_tags_get(t, "NoSuchTag") && !exif_tags_get(t, "Bogus:FileName")
+          && exif_tags_count(t) > 3 && exif_tags_at(t, exif_tags_count(t)) == NULL;
+    exif_tags_free(t);
+    ASSERT(ok, "unexpected tag table contents");
+}
+
+// Same keys, types and values in two read results
+static int tags_match(exif_t *exif, const exif_result_t *x, const exif_result_t *y)
+{
+    exif_tags_t *a = exif_tags_parse(exif, x), *b = exif_tags_parse(exif, y);
+    int ok = a && b && exif_tags_count(a) == exif_tags_count(b);
+    for (size_t i = 0; ok && i < exif_tags_count(a); i++) {
+        const exif_tag_t *p = exif_tags_at(a, i), *q = exif_tags_at(b, i);
+        ok = strcmp(p->key, q->key) == 0 && p->type == q->type
+          && (p->type != EXIF_VALUE_STRING || strcmp(p->text, q->text) == 0)
+          && (p->type != EXIF_VALUE_NUMBER || p->number == q->number);
+    }
+    exif_tags_free(a);
+    exif_tags_free(b);
+    return ok;
+}
+
+static void test_read_binary(exif_t *exif)
+{
+    exif_options_t opts = { .format = EXIF_FORMAT_BINARY };
+    exif_result_t json = exif_read(exif, TEST_DATA "test.jpg", NULL);
+    exif_result_t bin = exif_read(exif, TEST_DATA "test.jpg", &opts);
+    ASSERT_SUCCESS(json);
+    ASSERT_SUCCESS(bin);
+    ASSERT(bin.data_len > 8 && memcmp(bin.data, "EXB1", 4) == 0, "missing binary header");
+    int ok = tags_match(exif, &json, &bin);
+    exif_result_free(exif, &json);
+    exif_result_free(exif, &bin);
+    ASSERT(ok, "binary tags differ from JSON");
+
+    // Options the emitter does not parse run exiftool and are converted
+    const char *extra[] = { "-charset", "UTF8" };
+    exif_options_t jopts = { .args = extra, .argc = 2 };
+    exif_options_t xopts = { .args = extra, .argc = 2, .format = EXIF_FORMAT_BINARY };
+    json = exif_read(exif, TEST_DATA "test.jpg", &jopts);
+    bin = exif_read(exif, TEST_DATA "test.jpg", &xopts);
+    ASSERT_SUCCESS(json);
+    ASSERT_SUCCESS(bin);
+    ok = bin.data_len > 8 && memcmp(bin.data, "EXB1", 4) == 0 && tags_match(exif, &json, &bin);
+    exif_result_free(exif, &json);
+    exif_result_free(exif, &bin);
+    ASSERT(ok, "converted binary tags differ from JSON");
+
+    const char *paths[] = { TEST_DATA "test.png", "/tmp/does_not_exist_12345.jpg" };
+    exif_result_t results[2];
+    size_t n = exif_read_many(exif, paths, 2, &opts, results);
+    ok = n == 1 && results[0].success && memcmp(results[0].data, "EXB1", 4) == 0
+      && !results[1].success && results[1].error;
+    exif_result_free(exif, &results[0]);
+    exif_result_free(exif, &results[1]);
+    ASSERT(ok, "binary read_many mismatch");
+}
+
 static void test_multiple_reads(exif_t *exif)
 {
     size_t len;
@@ -400,6 +1161,632 @@ static void test_read_nonexistent(exif_t *exif)
     exif_result_free(exif, &r);
 }
 
+static void test_read_nonexistent_error(exif_t *exif)
+{
+    exif_result_t r = exif_read(exif, "/tmp/does_not_exist_12345.jpg", NULL);
+    int pass = !r.success && r.error && strstr(r.error, "not found");
+    exif_result_free(exif, &r);
+    ASSERT(pass, "stderr not reported as error");
+}
+
+static void test_write_many(exif_t *exif)
+{
+    size_t len;
+    char *data = read_file(TEST_DATA "test.jpg", &len);
+    ASSERT(data, "failed to read test.jpg");
+    const char *in[] = { "/tmp/libexif_many_a.jpg", "/tmp/does_not_exist_12345.jpg",
+                         "/tmp/libexif_many_b.jpg" };
+    const char *out[] = { "/tmp/libexif_many_a_out.jpg", NULL, NULL };
+    for (int i = 0; i < 3; i += 2) {
+        FILE *f = fopen(in[i], "wb");
+        fwrite(data, 1, len, f);
+        fclose(f);
+    }
+    free(data);
+    unlink(out[0]);
+
+    const char *tags[] = { "-Artist=many", "-Copyright=libexif" };
+    exif_options_t wopts = { .tags = tags, .ntags = 2 };
+    exif_result_t r[3];
+    size_t ok = exif_write_many(exif, in, out, 3, &wopts, r);
+    int pass = ok == 2 && r[0].success && !r[1].success && r[1].error && r[2].success;
+    for (int i = 0; i < 3; i++) exif_result_free(exif, &r[i]);
+    ASSERT(pass, "batch write results split per file");
+
+    const char *check[] = { out[0], in[2] };
+    for (int i = 0; i < 2; i++) {
+        exif_result_t rr = exif_read(exif, check[i], NULL);
+        ASSERT_SUCCESS(rr);
+        char val[64];
+        ASSERT(json_string_value(rr.data, "Copyright", val, sizeof val), "missing Copyright");
+        ASSERT(strcmp(val, "libexif") == 0, "Copyright mismatch");
+        exif_result_free(exif, &rr);
+    }
+    unlink(in[0]);
+    unlink(in[2]);
+    unlink(out[0]);
+}
+
+static void test_read_many(exif_t *exif)
+{
+    const char *paths[] = {
+        TEST_DATA "test.jpg",
+        "/tmp/does_not_exist_12345.jpg",
+        TEST_DATA "test.png",
+        TEST_DATA "test.jpg",
+    };
+    exif_result_t r[4];
+    size_t ok = exif_read_many(exif, paths, 4, NULL, r);
+
+    int pass = ok == 3 && r[0].success && !r[1].success && r[2].success
+               && r[3].success && r[1].error
+               && json_has_key(r[0].data, "FileName")
+               && json_has_key(r[2].data, "ImageWidth")
+               && strstr(r[2].data, "test.png") && !strstr(r[2].data, "test.jpg");
+    for (int i = 0; i < 4; i++) exif_result_free(exif, &r[i]);
+    ASSERT(pass, "batch results split per file");
+}
+
+typedef struct sink_files {
+    char   *data[3];
+    size_t  len[3];
+    int     ends[3];
+    int     chunks[3];
+    int     late;  // bytes after a file's end
+} sink_files_t;
+
+static void collect_sink(size_t file, const char *data, size_t len, void *ctx)
+{
+    sink_files_t *s = ctx;
+    if (file >= 3) return;
+    if (!data) {
+        s->ends[file]++;
+        return;
+    }
+    if (s->ends[file]) s->late++;
+    s->chunks[file]++;
+    s->data[file] = realloc(s->data[file], s->len[file] + len + 1);
+    memcpy(s->data[file] + s->len[file], data, len);
+    s->len[file] += len;
+    s->data[file][s->len[file]] = '\0';
+}
+
+static void test_read_sink(exif_t *exif)
+{
+    // Tags that don't change between reads, unlike FileAccessDate
+    const char *only[] = { "-s", "-G3:1", "-FileName", "-MIMEType", "-ImageWidth" };
+    exif_options_t popts = { .profile = EXIF_PROFILE_CUSTOM,
+                             .profile_args = only, .profile_argc = 5 };
+    exif_result_t plain = exif_read(exif, TEST_DATA "test.jpg", &popts);
+    ASSERT_SUCCESS(plain);
+
+    // The sink gets exactly what the result would have held
+    sink_files_t one = {0};
+    exif_options_t opts = popts;
+    opts.sink = collect_sink;
+    opts.sink_ctx = &one;
+    exif_result_t r = exif_read(exif, TEST_DATA "test.jpg", &opts);
+    int pass = r.success && !r.data && r.data_len == plain.data_len
+               && one.ends[0] == 1 && !one.late && one.len[0] == plain.data_len
+               && memcmp(one.data[0], plain.data, plain.data_len) == 0;
+    exif_result_free(exif, &r);
+    free(one.data[0]);
+    ASSERT(pass, "single read streamed to the sink");
+
+    // Per-file boundaries; a missing file ends with nothing
+    const char *paths[] = {
+        TEST_DATA "test.jpg", "/tmp/does_not_exist_12345.jpg", TEST_DATA "test.png",
+    };
+    sink_files_t many = {0};
+    exif_options_t mopts = popts;
+    mopts.sink = collect_sink;
+    mopts.sink_ctx = &many;
+    exif_result_t rs[3];
+    size_t ok = exif_read_many(exif, paths, 3, &mopts, rs);
+    pass = ok == 2 && rs[0].success && !rs[1].success && rs[1].error && rs[2].success
+           && many.ends[0] == 1 && many.ends[1] == 1 && many.ends[2] == 1 && !many.late
+           && many.len[0] == plain.data_len && !many.len[1]
+           && memcmp(many.data[0], plain.data, plain.data_len) == 0
+           && rs[2].data_len == many.len[2] && strstr(many.data[2], "test.png");
+    for (int i = 0; i < 3; i++) {
+        exif_result_free(exif, &rs[i]);
+        free(many.data[i]);
+    }
+    exif_result_free(exif, &plain);
+    ASSERT(pass, "batch streamed per file");
+
+    // 96 KiB of output takes several flushes. Output left when the run ends
+    // comes in one piece, so a second chunk means the first one streamed.
+    size_t blen;
+    unsigned char *big = png_with_comment(96u << 10, &blen);
+    ASSERT(big, "failed to build the PNG");
+    const char *big_path = "/tmp/libexif_sink.png";
+    pass = write_file(big_path, big, blen);
+    free(big);
+    ASSERT(pass, "failed to write the PNG");
+    const char *comment[] = { "-s", "-G3:1", "-FileName", "-Comment" };
+    popts.profile_args = comment;
+    popts.profile_argc = 4;
+    plain = exif_read(exif, big_path, &popts);
+    ASSERT_SUCCESS(plain);
+    sink_files_t chunked = {0};
+    mopts = popts;
+    mopts.sink = collect_sink;
+    mopts.sink_ctx = &chunked;
+    const char *big_paths[] = { big_path, TEST_DATA "test.jpg" };
+    ok = exif_read_many(exif, big_paths, 2, &mopts, rs);
+    pass = ok == 2 && plain.data_len > 64u << 10 && chunked.chunks[0] >= 2
+           && chunked.ends[0] == 1 && chunked.ends[1] == 1 && !chunked.late
+           && chunked.len[0] == plain.data_len
+           && memcmp(chunked.data[0], plain.data, plain.data_len) == 0;
+    for (int i = 0; i < 2; i++) {
+        exif_result_free(exif, &rs[i]);
+        free(chunked.data[i]);
+    }
+    exif_result_free(exif, &plain);
+    ASSERT(pass, "large result not streamed");
+}
+
+static void test_shared_runtime(exif_t *exif)
+{
+    exif_t *a = exif_create(NULL);
+    exif_t *b = exif_create(NULL);
+    ASSERT(a && b, "create two contexts");
+
+    // b must keep working on the shared module after a is gone
+    exif_destroy(a);
+    exif_result_t r = exif_read(b, TEST_DATA "test.jpg", NULL);
+    ASSERT(r.success, "read after sibling destroyed");
+    exif_result_free(b, &r);
+    exif_destroy(b);
+
+    r = exif_read(exif, TEST_DATA "test.jpg", NULL);
+    ASSERT(r.success, "original context still reads");
+    exif_result_free(exif, &r);
+}
+
+static void test_snapshot_contexts(exif_t *exif)
+{
+    (void)exif;
+    exif_config_t cfg = { .snapshot = true };
+    exif_t *first = exif_create(&cfg);
+    ASSERT(first, "create first snapshot context");
+
+    // Restored from the first context's snapshot; must behave the same
+    exif_t *second = exif_create(&cfg);
+    ASSERT(second, "create restored context");
+    exif_result_t r = exif_read(second, TEST_DATA "test.jpg", NULL);
+    ASSERT_SUCCESS(r);
+    ASSERT(json_has_key(r.data, "FileName"), "missing FileName");
+    exif_result_free(second, &r);
+
+    r = exif_read(first, TEST_DATA "test.png", NULL);
+    ASSERT_SUCCESS(r);
+    exif_result_free(first, &r);
+
+    exif_destroy(second);
+    exif_destroy(first);
+}
+
+static void count_span(const char *phase, uint64_t start_ns, uint64_t duration_ns,
+                       void *ctx)
+{
+    (void)start_ns; (void)duration_ns;
+    if (strcmp(phase, "call") == 0) (*(int *)ctx)++;
+}
+
+static void test_call_stats(exif_t *exif)
+{
+    (void)exif;
+    int calls = 0;
+    exif_config_t cfg = { .stats = true, .trace = count_span, .trace_ctx = &calls };
+    exif_t *ctx = exif_create(&cfg);
+    ASSERT(ctx, "exif_create failed");
+
+    exif_result_t r = exif_read(ctx, TEST_DATA "test.jpg", NULL);
+    ASSERT_SUCCESS(r);
+    ASSERT(r.stats.run_ns > 0, "run not timed");
+    ASSERT(r.stats.total_ns >= r.stats.run_ns, "total below run");
+    size_t out = r.data_len;
+    exif_result_free(ctx, &r);
+
+    exif_counters_t c;
+    exif_counters(ctx, &c);
+    ASSERT(c.calls == 1 && calls == 1, "one call counted");
+    ASSERT(c.bytes_out == out, "bytes_out mismatch");
+    ASSERT(c.heap_high_water > 0, "heap not sampled");
+    ASSERT(c.traps == 0, "unexpected trap");
+    exif_destroy(ctx);
+}
+
+static void test_memory_recycle(exif_t *exif)
+{
+    (void)exif;
+    // Every instance outgrows one byte, so each call ends with a fresh one
+    exif_config_t cfg = { .recycle_size = 1 };
+    exif_t *ctx = exif_create(&cfg);
+    ASSERT(ctx, "exif_create failed");
+    for (int i = 0; i < 2; i++) {
+        exif_result_t r = exif_read(ctx, TEST_DATA "test.jpg", NULL);
+        ASSERT_SUCCESS(r);
+        ASSERT(json_has_key(r.data, "FileName"), "missing FileName");
+        exif_result_free(ctx, &r);
+    }
+    exif_counters_t c;
+    exif_counters(ctx, &c);
+    ASSERT(c.recycles == 2, "expected a recycle per call");
+    ASSERT(c.resets == 0, "recycles counted as resets");
+    exif_destroy(ctx);
+}
+
+static void test_memory_retry(exif_t *exif)
+{
+    (void)exif;
+    exif_config_t bad = { .memory_limit_max = 1ull << 30 };
+    ASSERT(!exif_create(&bad), "memory_limit_max without memory_limit accepted");
+
+    // Start just above what a small read needs
+    exif_t *probe = exif_create(NULL);
+    ASSERT(probe, "exif_create failed");
+    exif_result_t r = exif_read(probe, TEST_DATA "test.png", NULL);
+    exif_counters_t c;
+    exif_counters(probe, &c);
+    exif_destroy(probe);
+    ASSERT_SUCCESS(r);
+    exif_result_free(NULL, &r);
+
+    // A 32 MiB comment outgrows that
+    size_t blen;
+    unsigned char *buf = png_with_comment(32u << 20, &blen);
+    ASSERT(buf, "failed to build the PNG");
+
+    exif_config_t cfg = {
+        .memory_limit = c.heap_high_water + (4u << 20), .memory_limit_max = 1ull << 30,
+    };
+    exif_t *ctx = exif_create(&cfg);
+    if (!ctx) free(buf);
+    ASSERT(ctx, "exif_create failed");
+    exif_buf_t in = { .data = buf, .len = blen, .filename = "big.png" };
+    r = exif_read_buf(ctx, in, NULL);
+    free(buf);
+    exif_counters(ctx, &c);
+    int ok = r.success && json_has_key(r.data, "Comment");
+    exif_result_free(ctx, &r);
+
+    // Back under the base limit
+    exif_result_t small = exif_read(ctx, TEST_DATA "test.png", NULL);
+    ok = ok && small.success;
+    exif_result_free(ctx, &small);
+    exif_destroy(ctx);
+    ASSERT(ok, "read under a raised memory limit failed");
+    ASSERT(c.memory_retries >= 1, "out-of-memory read was not retried");
+}
+
+static void test_shared_cache(exif_t *exif)
+{
+    (void)exif;
+    exif_cache_t *cache = exif_cache_create(NULL, 0);
+    ASSERT(cache, "exif_cache_create failed");
+    exif_config_t cfg = { .cache = cache };
+    exif_t *a = exif_create(&cfg), *b = exif_create(&cfg);
+    ASSERT(a && b, "create cached contexts");
+
+    size_t len;
+    char *data = read_file(TEST_DATA "test.jpg", &len);
+    ASSERT(data, "failed to read test.jpg");
+    const char *path = "/tmp/libexif_cache_test.jpg";
+    FILE *f = fopen(path, "wb");
+    fwrite(data, 1, len, f);
+    fclose(f);
+
+    exif_result_t first = exif_read(a, path, NULL);
+    exif_result_t hit = exif_read(b, path, NULL);
+    exif_options_t upper = { .transform = uppercase_transform };
+    exif_result_t shaped = exif_read(b, path, &upper);
+    int ok = first.success && hit.success && shaped.success
+          && hit.data_len == first.data_len && memcmp(hit.data, first.data, first.data_len) == 0
+          && json_has_key(shaped.data, "FILENAME");
+    exif_result_free(b, &shaped);
+    exif_result_free(b, &hit);
+
+    // A changed file is a different key
+    f = fopen(path, "ab");
+    fwrite("\0\0\0\0", 1, 4, f);
+    fclose(f);
+    exif_result_t changed = exif_read(b, path, NULL);
+    ok = ok && changed.success && strcmp(changed.data, first.data) != 0;
+    exif_result_free(b, &changed);
+    exif_result_free(a, &first);
+
+    exif_buf_t buf = { .data = data, .len = len, .filename = "cached.jpg" };
+    exif_result_t r1 = exif_read_buf(a, buf, NULL), r2 = exif_read_buf(b, buf, NULL);
+    ok = ok && r1.success && r2.success && strcmp(r1.data, r2.data) == 0;
+    exif_result_free(a, &r1);
+    exif_result_free(b, &r2);
+
+    unlink(path);
+    free(data);
+    exif_destroy(b);
+    exif_destroy(a);
+    exif_cache_destroy(cache);
+    ASSERT(ok, "cached reads differ from uncached ones");
+}
+
+// --- stay-open tests ---
+
+static void test_stay_open_reads(exif_t *exif)
+{
+    (void)exif;
+    exif_config_t cfg = { .stay_open = true };
+    exif_t *resident = exif_create(&cfg);
+    ASSERT(resident, "exif_create with stay_open failed");
+
+    const char *files[] = { TEST_DATA "test.jpg", TEST_DATA "test.png", TEST_DATA "test.jpg" };
+    for (int i = 0; i < 3; i++) {
+        exif_result_t r = exif_read(resident, files[i], NULL);
+        if (!r.success) exif_destroy(resident);
+        ASSERT_SUCCESS(r);
+        ASSERT(json_has_key(r.data, "FileName"), "missing FileName");
+        exif_result_free(resident, &r);
+    }
+
+    exif_result_t missing = exif_read(resident, "/tmp/does_not_exist_12345.jpg", NULL);
+    ASSERT(!missing.success, "read of missing file succeeded");
+    exif_result_free(resident, &missing);
+
+    exif_result_t again = exif_read(resident, TEST_DATA "test.jpg", NULL);
+    exif_destroy(resident);
+    ASSERT(again.success, "read after failed command did not succeed");
+    exif_result_free(NULL, &again);
+}
+
+// Whether Image::ExifTool::Sigma, which reading a PNG never needs, is in
+// the %INC of the interpreter that runs the read
+static int sigma_loaded(exif_t *ctx)
+{
+    const char *probe[] = { "-if", "grep m{Image/ExifTool/Sigma\\.pm}, keys %INC", "-FileName" };
+    exif_options_t opts = { .profile = EXIF_PROFILE_CUSTOM,
+                            .profile_args = probe, .profile_argc = 3 };
+    exif_result_t r = exif_read(ctx, TEST_DATA "test.png", &opts);
+    int loaded = r.success && json_has_key(r.data, "FileName");
+    exif_result_free(ctx, &r);
+    return loaded;
+}
+
+static void test_stay_open_warmup(exif_t *exif)
+{
+    (void)exif;
+    const char *warmup[] = { "JPEG", "PNG", "Sigma", "not a module" };
+    exif_config_t cfg = { .stay_open = true, .warmup = warmup, .nwarmup = 4 };
+    exif_t *resident = exif_create(&cfg);
+    ASSERT(resident, "exif_create with warmup failed");
+
+    exif_result_t r = exif_read(resident, TEST_DATA "test.png", NULL);
+    int loaded = sigma_loaded(resident);
+    exif_destroy(resident);
+    ASSERT_SUCCESS(r);
+    ASSERT(json_has_key(r.data, "FileName"), "missing FileName");
+    exif_result_free(NULL, &r);
+    ASSERT(loaded, "warm-up module not loaded in the stay-open interpreter");
+
+    // A cold stay-open interpreter doesn't have it; without stay_open the
+    // names are ignored
+    exif_config_t cold_cfg = { .stay_open = true };
+    exif_config_t reset_cfg = { .warmup = warmup, .nwarmup = 4 };
+    exif_t *cold = exif_create(&cold_cfg), *reset = exif_create(&reset_cfg);
+    int cold_loaded = cold && sigma_loaded(cold);
+    int reset_loaded = reset && sigma_loaded(reset);
+    exif_destroy(cold);
+    exif_destroy(reset);
+    ASSERT(!cold_loaded && !reset_loaded, "Sigma loaded without warm-up");
+}
+
+static void test_stay_open_write_roundtrip(exif_t *exif)
+{
+    (void)exif;
+    exif_config_t cfg = { .stay_open = true };
+    exif_t *resident = exif_create(&cfg);
+    ASSERT(resident, "exif_create with stay_open failed");
+
+    size_t len;
+    char *data = read_file(TEST_DATA "test.jpg", &len);
+    ASSERT(data, "failed to read test.jpg");
+
+    // A space after '=' would be trimmed from a plain argfile line
+    const char *tags[] = { "-Artist= stay open" };
+    exif_options_t wopts = { .tags = tags, .ntags = 1 };
+    exif_buf_t in = { .data = data, .len = len, .filename = "test.jpg" };
+
+    exif_result_t wr = exif_write_buf(resident, in, &wopts);
+    free(data);
+    if (!wr.success) exif_destroy(resident);
+    ASSERT_SUCCESS(wr);
+
+    exif_buf_t modified = { .data = wr.data, .len = wr.data_len, .filename = "out.jpg" };
+    exif_result_t rr = exif_read_buf(resident, modified, NULL);
+    exif_result_free(resident, &wr);
+    exif_destroy(resident);
+    ASSERT_SUCCESS(rr);
+
+    char val[256];
+    ASSERT(json_string_value(rr.data, "Artist", val, sizeof val), "missing Artist");
+    ASSERT(strcmp(val, " stay open") == 0, "Artist mismatch");
+    exif_result_free(NULL, &rr);
+}
+
+// --- pool tests ---
+
+static void test_pool_mixed_jobs(exif_t *exif)
+{
+    (void)exif;
+    exif_pool_t *pool = exif_pool_create(NULL, 2);
+    ASSERT(pool, "exif_pool_create failed");
+
+    size_t len;
+    char *data = read_file(TEST_DATA "test.jpg", &len);
+    if (!data) exif_pool_destroy(pool);
+    ASSERT(data, "failed to read test.jpg");
+
+    const char *tags[] = { "-Artist=pool" };
+    exif_options_t wopts = { .tags = tags, .ntags = 1 };
+    exif_buf_t buf = { .data = data, .len = len, .filename = "test.jpg" };
+    exif_job_t jobs[] = {
+        { .kind = EXIF_JOB_READ, .path = TEST_DATA "Mo_Edge20_ColourfulStreet.dng" },
+        { .kind = EXIF_JOB_READ, .path = TEST_DATA "test.png" },
+        { .kind = EXIF_JOB_READ_BUF, .buf = buf },
+        { .kind = EXIF_JOB_WRITE_BUF, .buf = buf, .opts = &wopts },
+        { .kind = EXIF_JOB_READ, .path = "/tmp/does_not_exist_12345.jpg" },
+    };
+    size_t njobs = sizeof jobs / sizeof jobs[0];
+    exif_pool_run(pool, jobs, njobs);
+
+    int ok = jobs[0].result.success && json_has_key(jobs[0].result.data, "Make")
+          && jobs[1].result.success && json_has_key(jobs[1].result.data, "ImageWidth")
+          && jobs[2].result.success && json_has_key(jobs[2].result.data, "FileName")
+          && jobs[3].result.success && jobs[3].result.data_len > 0
+          && !jobs[4].result.success;
+    for (size_t i = 0; i < njobs; i++)
+        exif_pool_result_free(pool, &jobs[i].result);
+    exif_pool_destroy(pool);
+    free(data);
+    ASSERT(ok, "unexpected pool job results");
+}
+
+static void count_done(exif_job_t *job, void *user)
+{
+    (void)job;
+    __atomic_add_fetch((int *)user, 1, __ATOMIC_SEQ_CST);
+}
+
+static void test_pool_submit(exif_t *exif)
+{
+    (void)exif;
+    exif_pool_t *pool = exif_pool_create(NULL, 2);
+    ASSERT(pool, "exif_pool_create failed");
+
+    exif_job_t jobs[6];
+    int called = 0;
+    for (int i = 0; i < 6; i++) {
+        jobs[i] = (exif_job_t){ .kind = EXIF_JOB_READ,
+                                .path = i % 2 ? TEST_DATA "test.png" : TEST_DATA "test.jpg" };
+        exif_submit(pool, &jobs[i], i == 5 ? count_done : NULL,
+                    i == 5 ? (void *)&called : (void *)(intptr_t)i);
+    }
+
+    // Five are reaped; the sixth reports through its callback
+    exif_completion_t done[6];
+    int reaped = 0, ok = 1;
+    while (reaped < 5) {
+        size_t n = exif_wait(pool, done, 6, 10000);
+        if (!n) break;
+        for (size_t k = 0; k < n; k++) {
+            int i = (int)(intptr_t)done[k].user;
+            ok = ok && done[k].job == &jobs[i] && jobs[i].result.success;
+            reaped++;
+        }
+    }
+    ok = ok && reaped == 5 && exif_poll(pool, done, 6) == 0;
+    exif_pool_destroy(pool);
+    ok = ok && called == 1 && jobs[5].result.success;
+    for (int i = 0; i < 6; i++)
+        exif_pool_result_free(NULL, &jobs[i].result);
+    ASSERT(ok, "unexpected async completions");
+}
+
+static char *tag_transform(const char *data, size_t len, void *ctx)
+{
+    (void)ctx;
+    char *out = malloc(len + 8);
+    if (out) snprintf(out, len + 8, "parent:%.*s", (int)len, data);
+    return out;
+}
+
+static void test_forkserver_jobs(exif_t *exif)
+{
+    (void)exif;
+    exif_forkserver_t *fs = exif_forkserver_create(NULL, 2, 30000);
+    ASSERT(fs, "exif_forkserver_create failed");
+
+    size_t len;
+    char *data = read_file(TEST_DATA "test.jpg", &len);
+    if (!data) exif_forkserver_destroy(fs);
+    ASSERT(data, "failed to read test.jpg");
+
+    const char *tags[] = { "-Artist=forkserver" };
+    exif_options_t wopts = { .tags = tags, .ntags = 1 };
+    exif_options_t topts = { .transform = tag_transform };
+    exif_buf_t buf = { .data = data, .len = len, .filename = "test.jpg" };
+    int ok = 1;
+
+    // Second round runs on the same, already forked workers
+    for (int round = 0; round < 2 && ok; round++) {
+        exif_job_t jobs[] = {
+            { .kind = EXIF_JOB_READ, .path = TEST_DATA "test.png", .opts = &topts },
+            { .kind = EXIF_JOB_READ_BUF, .buf = buf },
+            { .kind = EXIF_JOB_WRITE_BUF, .buf = buf, .opts = &wopts },
+            { .kind = EXIF_JOB_READ, .path = "/tmp/does_not_exist_12345.jpg" },
+        };
+        size_t njobs = sizeof jobs / sizeof jobs[0];
+        exif_forkserver_run(fs, jobs, njobs);
+
+        ok = jobs[0].result.success && strncmp(jobs[0].result.data, "parent:", 7) == 0
+          && jobs[1].result.success && json_has_key(jobs[1].result.data, "FileName")
+          && jobs[2].result.success && jobs[2].result.data_len > len / 2
+          && !jobs[3].result.success && jobs[3].result.error;
+        for (size_t i = 0; i < njobs; i++)
+            exif_forkserver_result_free(fs, &jobs[i].result);
+    }
+    exif_forkserver_destroy(fs);
+    free(data);
+    ASSERT(ok, "unexpected fork server job results");
+}
+
+static void test_forkserver_patch(exif_t *exif)
+{
+    size_t len;
+    char *data = read_file(TEST_DATA "test.jpg", &len);
+    ASSERT(data, "failed to read test.jpg");
+    const char *first[] = { "-Artist=short" };
+    exif_options_t fopts = { .tags = first, .ntags = 1 };
+    exif_result_t base = exif_write_buf(exif, (exif_buf_t){ data, len, "test.jpg" }, &fopts);
+    free(data);
+    ASSERT_SUCCESS(base);
+
+    // What the patcher makes of it in this process
+    const char *tags[] = { "-Artist=a much longer artist name" };
+    exif_options_t wopts = { .tags = tags, .ntags = 1, .patch = true };
+    exif_buf_t in = { .data = base.data, .len = base.data_len, .filename = "base.jpg" };
+    exif_result_t local = exif_write_buf(exif, in, &wopts);
+    const char *path = "/tmp/libexif_fork_patch.jpg";
+    int wrote = write_file(path, base.data, base.data_len);
+    if (!local.success || !wrote) exif_result_free(exif, &base);
+    ASSERT_SUCCESS(local);
+    ASSERT(wrote, "failed to write temp file");
+
+    exif_forkserver_t *fs = exif_forkserver_create(NULL, 1, 30000);
+    if (!fs) exif_result_free(exif, &base);
+    ASSERT(fs, "exif_forkserver_create failed");
+    exif_job_t jobs[] = {
+        { .kind = EXIF_JOB_WRITE_BUF, .buf = in, .opts = &wopts },
+        { .kind = EXIF_JOB_WRITE, .path = path, .opts = &wopts },
+    };
+    exif_forkserver_run(fs, jobs, 2);
+    size_t flen;
+    char *file = read_file(path, &flen);
+    int ok = jobs[0].result.success && jobs[0].result.data_len == local.data_len
+          && memcmp(jobs[0].result.data, local.data, local.data_len) == 0
+          && jobs[1].result.success
+          && strcmp(jobs[1].result.data, "    1 image files updated\n") == 0
+          && file && flen == local.data_len && memcmp(file, local.data, flen) == 0;
+    for (int i = 0; i < 2; i++) exif_forkserver_result_free(fs, &jobs[i].result);
+    exif_forkserver_destroy(fs);
+    free(file);
+    unlink(path);
+    exif_result_free(exif, &local);
+    exif_result_free(exif, &base);
+    ASSERT(ok, "fork server write was not patched");
+}
+
 // --- main ---
 
 int main(void)
@@ -421,10 +1808,16 @@ int main(void)
     printf("\nBuffer read tests:\n");
     RUN(test_read_buf_jpeg);
     RUN(test_read_buf_dng);
+    RUN(test_read_buf_filename);
+    RUN(test_read_buf_prefilter);
+    RUN(test_read_buf_prefilter_bmff);
+    RUN(test_read_stream);
 
     printf("\nWrite tests:\n");
     RUN(test_write_roundtrip);
     RUN(test_write_buf_roundtrip);
+    RUN(test_write_buf_prepared);
+    RUN(test_write_buf_patch);
 
     printf("\nUnicode tests:\n");
     RUN(test_unicode_korean);
@@ -438,7 +1831,35 @@ int main(void)
 
     printf("\nEdge cases:\n");
     RUN(test_multiple_reads);
+    RUN(test_read_profiles);
+    RUN(test_read_common_native);
+    RUN(test_result_tags);
+    RUN(test_read_binary);
+    RUN(test_previews);
     RUN(test_read_nonexistent);
+    RUN(test_read_nonexistent_error);
+    RUN(test_read_many);
+    RUN(test_read_sink);
+    RUN(test_write_many);
+    RUN(test_shared_runtime);
+    RUN(test_snapshot_contexts);
+    RUN(test_shared_cache);
+    RUN(test_call_stats);
+    RUN(test_memory_recycle);
+    RUN(test_memory_retry);
+
+    printf("\nStay-open tests:\n");
+    RUN(test_stay_open_reads);
+    RUN(test_stay_open_write_roundtrip);
+    RUN(test_stay_open_warmup);
+
+    printf("\nPool tests:\n");
+    RUN(test_pool_mixed_jobs);
+    RUN(test_pool_submit);
+
+    printf("\nFork server tests:\n");
+    RUN(test_forkserver_jobs);
+    RUN(test_forkserver_patch);
 
     printf("\n%d tests, %d failed\n", tests_run, tests_failed);
 
@@ -6,26 +6,26 @@ import Foundation
 
 extension Exif {
     /// Extract metadata from a file on disk as structured JSON.
-    public func read(from url: URL, args: [String] = []) throws(ExifError) -> String {
+    public func read(from url: URL, args: [String] = [], profile: ExifProfile = .full) throws(ExifError) -> String {
         try ctx.withLock { (ptr: inout OpaquePointer) throws(ExifError) -> String in
-            try string(ctx: ptr, from: withOptions(args: args) { exif_read(ptr, url.path, &$0) })
+            try string(ctx: ptr, from: withOptions(args: args, profile: profile) { exif_read(ptr, url.path, &$0) })
         }
     }
 
     /// Extract metadata from a file on disk as structured JSON.
-    public func read(from url: URL, args: [String] = []) async throws(ExifError) -> String {
-        try await runBlocking { try self.read(from: url, args: args) }
+    public func read(from url: URL, args: [String] = [], profile: ExifProfile = .full) async throws(ExifError) -> String {
+        try await runBlocking { try self.read(from: url, args: args, profile: profile) }
     }
 
     /// Extract metadata from an in-memory buffer as structured JSON.
     /// - Parameter url: Used for extension-based format detection (e.g. "photo.dng").
-    public func read(data: Data, url: URL, args: [String] = []) throws(ExifError) -> String {
+    public func read(data: Data, url: URL, args: [String] = [], profile: ExifProfile = .full) throws(ExifError) -> String {
         try ctx.withLock { (ptr: inout OpaquePointer) throws(ExifError) -> String in
             let filename = url.lastPathComponent
             let result = data.withUnsafeBytes { bytes in
                 filename.withCString { fname in
                     let buf = exif_buf_t(data: bytes.baseAddress, len: bytes.count, filename: fname)
-                    return withOptions(args: args) { exif_read_buf(ptr, buf, &$0) }
+                    return withOptions(args: args, profile: profile) { exif_read_buf(ptr, buf, &$0) }
                 }
             }
             return try string(ctx: ptr, from: result)
@@ -34,16 +34,16 @@ extension Exif {
 
     /// Extract metadata from an in-memory buffer as structured JSON.
     /// - Parameter url: Used for extension-based format detection (e.g. "photo.dng").
-    public func read(data: Data, url: URL, args: [String] = []) async throws(ExifError) -> String {
-        try await runBlocking { try self.read(data: data, url: url, args: args) }
+    public func read(data: Data, url: URL, args: [String] = [], profile: ExifProfile = .full) async throws(ExifError) -> String {
+        try await runBlocking { try self.read(data: data, url: url, args: args, profile: profile) }
     }
 
     /// Extract metadata from a file descriptor as structured JSON.
     /// - Parameter filename: Used for extension-based format detection (e.g. "photo.dng").
-    public func read(fd: Int32, filename: String, args: [String] = []) throws(ExifError) -> String {
+    public func read(fd: Int32, filename: String, args: [String] = [], profile: ExifProfile = .full) throws(ExifError) -> String {
         try ctx.withLock { (ptr: inout OpaquePointer) throws(ExifError) -> String in
             let result = filename.withCString { fname in
-                withOptions(args: args) { exif_read_fd(ptr, fd, fname, &$0) }
+                withOptions(args: args, profile: profile) { exif_read_fd(ptr, fd, fname, &$0) }
             }
             return try string(ctx: ptr, from: result)
         }
@@ -51,7 +51,7 @@ extension Exif {
 
     /// Extract metadata from a file descriptor as structured JSON.
     /// - Parameter filename: Used for extension-based format detection (e.g. "photo.dng").
-    public func read(fd: Int32, filename: String, args: [String] = []) async throws(ExifError) -> String {
-        try await runBlocking { try self.read(fd: fd, filename: filename, args: args) }
+    public func read(fd: Int32, filename: String, args: [String] = [], profile: ExifProfile = .full) async throws(ExifError) -> String {
+        try await runBlocking { try self.read(fd: fd, filename: filename, args: args, profile: profile) }
     }
 }
@@ -15,23 +15,34 @@ import Synchronization
 ///     try exif.write(to: photoURL, tags: ["-Artist=Jane"])
 public final class Exif: Sendable {
     let ctx: Mutex<OpaquePointer>
+    nonisolated(unsafe) let cache: OpaquePointer?
 
     /// Load the AOT module and initialize the WASM runtime.
     public init(_ config: ExifConfig = .init()) throws(ExifError) {
-        var cfg = exif_config_t(
-            allocator: nil,
-            wasm_stack_size: config.wasmStackSize,
-            wasm_heap_size: config.wasmHeapSize,
-            exec_stack_size: config.execStackSize
-        )
-        guard let ptr = exif_create(&cfg) else {
+        var cfg = exif_config_t()
+        cfg.wasm_stack_size = config.wasmStackSize
+        cfg.wasm_heap_size = config.wasmHeapSize
+        cfg.exec_stack_size = config.execStackSize
+        cfg.stay_open = config.stayOpen
+        cfg.snapshot = config.snapshot
+        let cache = config.cacheSize > 0 ? exif_cache_create(nil, config.cacheSize) : nil
+        cfg.cache = cache
+        let created = withCStringArray(config.warmup) { warmup in
+            cfg.warmup = warmup
+            cfg.nwarmup = Int32(config.warmup.count)
+            return exif_create(&cfg)
+        }
+        guard let ptr = created else {
+            exif_cache_destroy(cache)
             throw .initializationFailed
         }
         self.ctx = Mutex(ptr)
+        self.cache = cache
     }
 
     deinit {
         ctx.withLock { exif_destroy($0) }
+        exif_cache_destroy(cache)
     }
 
     func string(ctx: OpaquePointer, from result: exif_result_t) throws(ExifError) -> String {
@@ -58,16 +69,23 @@ public final class Exif: Sendable {
     func withOptions(
         args: [String] = [],
         tags: [String] = [],
+        profile: ExifProfile = .full,
         body: (inout exif_options_t) -> exif_result_t
     ) -> exif_result_t {
-        withCStringArray(args) { argsPtr in
+        let profileArgs = profile.customArgs
+        return withCStringArray(args) { argsPtr in
             withCStringArray(tags) { tagsPtr in
-                var opts = exif_options_t()
-                opts.args = argsPtr
-                opts.argc = Int32(args.count)
-                opts.tags = tagsPtr
-                opts.ntags = Int32(tags.count)
-                return body(&opts)
+                withCStringArray(profileArgs) { profilePtr in
+                    var opts = exif_options_t()
+                    opts.args = argsPtr
+                    opts.argc = Int32(args.count)
+                    opts.tags = tagsPtr
+                    opts.ntags = Int32(tags.count)
+                    opts.profile = profile.cValue
+                    opts.profile_args = profilePtr
+                    opts.profile_argc = Int32(profileArgs.count)
+                    return body(&opts)
+                }
             }
         }
     }
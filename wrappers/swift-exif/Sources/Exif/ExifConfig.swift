@@ -6,14 +6,30 @@ public struct ExifConfig: Sendable {
     public var wasmStackSize: UInt32
     public var wasmHeapSize: UInt32
     public var execStackSize: UInt32
+    /// Keep one exiftool interpreter resident across calls.
+    public var stayOpen: Bool
+    /// Start from a shared copy-on-write snapshot of the initialized interpreter.
+    public var snapshot: Bool
+    /// Byte budget of a read result cache owned by the instance. 0 disables it.
+    public var cacheSize: Int
+    /// Formats or ExifTool modules to load at creation, e.g. ["JPEG", "MOV"].
+    public var warmup: [String]
 
     public init(
         wasmStackSize: UInt32 = 8 << 20,
         wasmHeapSize: UInt32 = 32 << 20,
-        execStackSize: UInt32 = 8 << 20
+        execStackSize: UInt32 = 8 << 20,
+        stayOpen: Bool = false,
+        snapshot: Bool = false,
+        cacheSize: Int = 0,
+        warmup: [String] = []
     ) {
         self.wasmStackSize = wasmStackSize
         self.wasmHeapSize = wasmHeapSize
         self.execStackSize = execStackSize
+        self.stayOpen = stayOpen
+        self.snapshot = snapshot
+        self.cacheSize = cacheSize
+        self.warmup = warmup
     }
 }
@@ -0,0 +1,33 @@
+// Copyright (c) 6OVER3 Institute. All rights reserved.
+// SPDX-License-Identifier: AGPL-3.0-only
+
+import CLibExif
+
+/// Default argument set for reads.
+public enum ExifProfile: Sendable {
+    /// Every tag, including embedded streams, unknown and request-only tags.
+    case full
+    /// Regular tags without embedded streams, unknown or request-only tags.
+    case standard
+    /// Leading metadata only (`-fast2`), for thumbnail grids and ingestion.
+    case fast
+    /// Dimensions, camera, exposure and GPS only; parsed natively for JPEG, TIFF, DNG and PNG.
+    case common
+    /// `-json` followed by these arguments.
+    case custom([String])
+
+    var cValue: exif_profile_t {
+        switch self {
+        case .full: EXIF_PROFILE_FULL
+        case .standard: EXIF_PROFILE_STANDARD
+        case .fast: EXIF_PROFILE_FAST
+        case .common: EXIF_PROFILE_COMMON
+        case .custom: EXIF_PROFILE_CUSTOM
+        }
+    }
+
+    var customArgs: [String] {
+        if case .custom(let args) = self { return args }
+        return []
+    }
+}